@@ -2,67 +2,451 @@
 // source is open, feel free to use it as you wish with no restrictions
 // except that this copyright notice must be preserved intact
 #include "adaptiveThreadPool.h"
+#include "probes.h"
+#include "trace.h"
+#include <cerrno>
 #include <pthread.h>
 #include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
+#include <new>
 
-// when we start a pool we start one job
-adaptiveThreadPool::adaptiveThreadPool(void*(task)(void*),const int maxsize):
-    task(task),maxsize(maxsize)
+#ifndef SO_INCOMING_CPU
+#define SO_INCOMING_CPU 49
+#endif
+
+void *sizeController(void *);
+
+__thread adaptiveThreadPool::group *adaptiveThreadPool::current=0;
+
+static unsigned long long
+clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock,&ts);
+    return ts.tv_sec*1000000000ULL+ts.tv_nsec;
+}
+
+// when we start a pool we start as many threads as the policy wants to
+// start with in each group, and something to keep an eye on them
+adaptiveThreadPool::adaptiveThreadPool(void*(task)(void*),const int maxsize,
+	void (*shed)(int),const cpuTopology *topology,const sizingPolicy *policy):
+    topology(topology),next(0),task(task),shed(shed),observer(0),
+    stopping(false),cancelled(false)
+{
+    size_t numgroups=topology?topology->size():1;
+    size_t numcpus=topology?topology->num_cpus():1;
+    size_t total=maxsize>0?static_cast<size_t>(maxsize):0;
+    size_t given=0;
+    pthread_condattr_t condattr;
+    pthread_mutex_init(&stop_lock,NULL);
+    pthread_condattr_init(&condattr);
+    pthread_condattr_setclock(&condattr,CLOCK_MONOTONIC);
+    pthread_cond_init(&stop_cond,&condattr);
+    pthread_condattr_destroy(&condattr);
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if(sched_getaffinity(0,sizeof allowed,&allowed)==-1){
+	CPU_SET(0,&allowed);
+    }
+    for(size_t idx=0;idx<numgroups;idx++){
+	int node=topology?topology->node(idx).id:-1;
+	void *mem=node_alloc(sizeof(group),node);
+	if(mem==0){
+	    throw std::bad_alloc();
+	}
+	group *grp=new(mem) group;
+	grp->pool=this;
+	grp->node=node;
+	grp->idle=0;
+	grp->held=0;
+	CPU_ZERO(&grp->cpus);
+	if(topology){
+	    grp->cpus=topology->node(idx).cpus;
+	    // threads in proportion to CPUs, and every group gets one
+	    size_t share=total*topology->node(idx).cpulist.size()/numcpus;
+	    if(idx==numgroups-1){
+		share=total>given?total-given:0;
+	    }
+	    grp->maxsize=share?share:1;
+	    given+=grp->maxsize;
+	    grp->numcpus=topology->node(idx).cpulist.size();
+	}else{
+	    grp->maxsize=maxsize;
+	    grp->numcpus=CPU_COUNT(&allowed);
+	}
+	sem_init(&grp->tids_sem,0,1);
+	grp->policy=policy?policy->clone():hillClimbingPolicy().clone();
+	grp->target=grp->policy->initial(grp->maxsize,grp->numcpus);
+	grp->completed=0;
+	grp->service_ns=0;
+	grp->cpu_ns=0;
+	grp->sampled=clock_ns(CLOCK_MONOTONIC);
+	groups.push_back(grp);
+	for(size_t ctr=0;ctr<grp->target;ctr++){
+	    queueOne(*grp);
+	}
+    }
+    period_ms=groups[0]->policy->period_ms();
+    // joinable, so the destructor knows it's stopped looking at groups
+    pthread_create(&controller,NULL,sizeController,this);
+}
+
+adaptiveThreadPool::~adaptiveThreadPool()
 {
-    sem_init(&sem,0,0);
-    sem_init(&tids_sem,0,1);
-    queueOne();
-} 
+    if(cancelled){
+	// the threads might have been cancelled holding anything at all, so
+	// there's nothing safe to take apart
+	return;
+    }
+    pthread_mutex_lock(&stop_lock);
+    stopping=true;
+    pthread_cond_signal(&stop_cond);
+    pthread_mutex_unlock(&stop_lock);
+    pthread_join(controller,NULL);
+    // retire() lets everybody go now, once what's queued has been run.
+    // The idle ones hear it from wake(), and the busy ones when they're
+    // done.  It's said again till they're
+    // all gone in case one was between jobs and missed it.
+    for(size_t idx=0;idx<groups.size();idx++){
+	group *grp=groups[idx];
+	struct timespec ts={ 0,1000000L };
+	while(true){
+	    sem_wait(&grp->tids_sem);
+	    bool empty=grp->tids.empty();
+	    sem_post(&grp->tids_sem);
+	    if(empty){
+		break;
+	    }
+	    grp->jq.wake();
+	    nanosleep(&ts,0);
+	}
+	delete grp->policy;
+	sem_destroy(&grp->tids_sem);
+	grp->~group();
+	node_free(grp,sizeof(group));
+    }
+    pthread_cond_destroy(&stop_cond);
+    pthread_mutex_destroy(&stop_lock);
+}
 
 void *
-waitAndRun(void *voidatp)
+waitAndRun(void *voidgrp)
 {
-    adaptiveThreadPool *atp=(adaptiveThreadPool*)voidatp;
+    adaptiveThreadPool::group *grp=(adaptiveThreadPool::group*)voidgrp;
+    adaptiveThreadPool *atp=grp->pool;
+    adaptiveThreadPool::current=grp;
     int sd;
-    sem_post(&atp->sem);	    // we have one more thread
+    bool stale;
+    unsigned cls;
+    unsigned long long queued_at;
+    pool_task job;
     while(true){
 	try{
-	    sd=atp->jq.wait_and_pop();  // get a socket descriptor
-	    if(sd==-1){		    // didn't get one
-		if(errno==EINTR){
-		    // this is how we tell a thread to die
-		    pthread_exit(0);
+	    bool got;
+	    grp->idle++;
+	    try{
+		// we come back empty handed now and then to see if we're
+		// still wanted
+		got=grp->jq.wait_and_pop_for(job,stale,cls,4*atp->period_ms,
+			&queued_at);
+	    }catch(...){
+		grp->idle--;
+		throw;
+	    }
+	    grp->idle--;
+	    if(!got){
+		if(atp->retire(*grp)){
+		    return 0;
+		}
+		continue;
+	    }
+	    // what the sizing policy goes by
+	    unsigned long long started=clock_ns(CLOCK_MONOTONIC);
+	    unsigned long long cpu_started=clock_ns(CLOCK_THREAD_CPUTIME_ID);
+	    PROBE3(job_start,job.is_fd()?job.get_fd():-1,cls,started-queued_at);
+	    if(!job.is_fd()){
+		// something submit()ted, its future gets what it throws
+		try{
+		    job();
+		}catch(std::exception& e){
+		    std::cerr << "waitAndRun: submitted task threw - " << e.what() << '\n';
+		}catch(...){
+		    std::cerr << "waitAndRun: submitted task threw\n";
+		}
+		job=pool_task();    // let go of what it captured now
+		grp->jq.done(cls);
+	    }else{
+		sd=job.get_fd();
+		if(sd==-1){		    // didn't get one
+		    if(errno==EINTR){
+			// this is how we tell a thread to die
+			pthread_exit(0);
+		    }
+		}
+		try{
+		    if(stale && atp->shed){
+			// it sat so long we'd only be answering someone who left
+			atp->shed(sd);
+		    }else{
+			// so a trace of what it does starts with its wait
+			requestTrace::queued(queued_at);
+			atp->task(&sd);
+		    }
+		}catch(...){
+		    grp->jq.done(cls);
+		    throw;
+		}
+		grp->jq.done(cls);
+		if(sd!=-1){		    // -1 if the task kept it
+		    shutdown(sd,SHUT_RDWR);
+		    close(sd);
 		}
 	    }
-	    atp->task(&sd);
-	    shutdown(sd,SHUT_RDWR);
-	    close(sd);
+	    unsigned long long service=clock_ns(CLOCK_MONOTONIC)-started;
+	    grp->service_ns+=service;
+	    grp->cpu_ns+=clock_ns(CLOCK_THREAD_CPUTIME_ID)-cpu_started;
+	    grp->completed++;
+	    // a submit()ted job's been emptied by now, so its fd's -1 too
+	    PROBE3(job_done,job.get_fd(),cls,service);
 	}catch(std::bad_alloc ba){
 	    std::cerr << "waitAndRun caught a bad_alloc() running - " << ba.what() << '\n';
 	}
-	// here's where we can check if more threads are needed
-	try{
-	    int numthreads;
-	    sem_getvalue(&atp->sem,&numthreads);
-	    if((atp->jq.num_jobs() > numthreads) &&
-		    (static_cast<size_t>(numthreads) < atp->maxsize)){
-		atp->queueOne();
+	// if the policy's decided there are too many of us, we can go
+	if(atp->retire(*grp)){
+	    return 0;
+	}
+    }
+}
+
+// Every period, tell each group's policy what its threads did and start
+// or let go of threads to get to what it says.
+void *
+sizeController(void *voidatp)
+{
+    adaptiveThreadPool *atp=(adaptiveThreadPool*)voidatp;
+    pthread_mutex_lock(&atp->stop_lock);
+    while(!atp->stopping){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	ts.tv_sec+=atp->period_ms/1000;
+	ts.tv_nsec+=(atp->period_ms%1000)*1000000L;
+	if(ts.tv_nsec>=1000000000L){
+	    ts.tv_sec++;
+	    ts.tv_nsec-=1000000000L;
+	}
+	int waited=0;
+	while(!atp->stopping && waited!=ETIMEDOUT){
+	    waited=pthread_cond_timedwait(&atp->stop_cond,&atp->stop_lock,&ts);
+	}
+	if(atp->stopping){
+	    break;
+	}
+	pthread_mutex_unlock(&atp->stop_lock);
+	for(size_t idx=0;idx<atp->groups.size();idx++){
+	    atp->resize(idx);
+	}
+	pthread_mutex_lock(&atp->stop_lock);
+    }
+    pthread_mutex_unlock(&atp->stop_lock);
+    return 0;
+}
+
+void
+adaptiveThreadPool::resize(size_t idx)
+{
+    group& grp=*groups[idx];
+    pool_sample sample;
+    unsigned long long now=clock_ns(CLOCK_MONOTONIC),wait_ns;
+    unsigned long long completed=grp.completed.exchange(0);
+    unsigned long long service=grp.service_ns.exchange(0);
+    unsigned long long cpu=grp.cpu_ns.exchange(0);
+    size_t popped;
+    grp.jq.take_wait_stats(wait_ns,popped);
+    sample.period=(now-grp.sampled)/1e9;
+    grp.sampled=now;
+    sample.completed=static_cast<size_t>(completed);
+    sample.throughput=sample.period>0?completed/sample.period:0;
+    sample.mean_service=completed?service/1e9/completed:0;
+    sample.mean_cpu=completed?cpu/1e9/completed:0;
+    sample.mean_wait=popped?wait_ns/1e9/popped:0;
+    sample.queued=grp.jq.size();
+    // threads that are held aren't the policy's to count
+    size_t held=grp.held;
+    sem_wait(&grp.tids_sem);
+    sample.threads=grp.tids.size()>held?grp.tids.size()-held:0;
+    sem_post(&grp.tids_sem);
+    int idle=grp.idle;
+    sample.busy=sample.threads>static_cast<size_t>(idle)?sample.threads-idle:0;
+    sample.maxthreads=grp.maxsize;
+    sample.cpus=grp.numcpus;
+
+    sizing_decision decision=grp.policy->decide(sample);
+    grp.target=decision.target;
+    if(decision.target>sample.threads){
+	for(size_t ctr=sample.threads;ctr<decision.target;ctr++){
+	    if(!queueOne(grp)){
+		break;
 	    }
-	}catch(std::bad_alloc ba){
-	    std::cerr << "waitAndRun caught a bad_alloc() starting a new thread - " << ba.what() << '\n';
 	}
+    }else if(decision.target<sample.threads){
+	// the idle ones notice right away, the busy ones when they finish
+	grp.jq.wake();
+    }
+    sizing_observer watching=observer;
+    if(watching){
+	watching(idx,sample,decision);
+    }
+}
+
+// called by a thread of grp's with nothing to do.  If there are more of
+// us than the policy wants, it's off the list and should go.
+bool
+adaptiveThreadPool::retire(group& grp)
+{
+    bool leaving=false;
+    sem_wait(&grp.tids_sem);
+    if((stopping && grp.jq.size()==0)
+	    || (grp.tids.size()>grp.target+grp.held && grp.tids.size()>1)){
+	pthread_t self=pthread_self();
+	for(size_t ctr=0;ctr<grp.tids.size();ctr++){
+	    if(pthread_equal(grp.tids[ctr],self)){
+		grp.tids.erase(grp.tids.begin()+ctr);
+		leaving=true;
+		break;
+	    }
+	}
+    }
+    sem_post(&grp.tids_sem);
+    return leaving;
+}
+
+// The kernel knows which CPU handled the connection's packets, so hand it
+// to the group on that CPU's node, where its data already is.  If it can't
+// tell us, take turns.
+adaptiveThreadPool::group&
+adaptiveThreadPool::pick(int fd)
+{
+    if(groups.size()==1){
+	return *groups[0];
+    }
+    int cpu=-1,idx;
+    socklen_t len=sizeof(cpu);
+    if(getsockopt(fd,SOL_SOCKET,SO_INCOMING_CPU,&cpu,&len)==0
+	    && (idx=topology->node_of_cpu(cpu))>=0){
+	return *groups[idx];
+    }
+    return *groups[next++%groups.size()];
+}
+
+// If nobody's free to take it, start another thread now rather than
+// wait for one to finish whatever it's doing, which could be a while if
+// it's a slow client.  That's only up to what the sizing policy wants,
+// past that it's the policy's call.
+bool
+adaptiveThreadPool::addjob(int fd,unsigned cls)
+{
+    group& grp=pick(fd);
+    if(grp.idle==0){
+	queueOne(grp);
+    }
+    bool queued=grp.jq.try_push(pool_task::for_fd(fd),cls);
+    PROBE3(job_queued,fd,cls,queued?1:0);
+    return queued;
+}
+
+// somewhere for submit() and submit_then() to put things
+void
+adaptiveThreadPool::post(pool_task&& task)
+{
+    group& grp=*groups[next++%groups.size()];
+    if(grp.idle==0){
+	queueOne(grp);
+    }
+    grp.jq.push(std::move(task),jobQueue<pool_task>::NUM_CLASSES-1);
+}
+
+void
+adaptiveThreadPool::set_limits(size_t maxdepth,unsigned target_ms,unsigned interval_ms)
+{
+    for(size_t idx=0;idx<groups.size();idx++){
+	// the depth is for the whole pool, so each group gets a share
+	size_t depth=maxdepth/groups.size();
+	if(maxdepth && depth==0){
+	    depth=1;
+	}
+	groups[idx]->jq.set_limits(depth,target_ms,interval_ms);
     }
 }
 
 void
-adaptiveThreadPool::queueOne()
+adaptiveThreadPool::set_class_limit(unsigned cls,unsigned maxjobs)
+{
+    size_t total=0;
+    for(size_t idx=0;idx<groups.size();idx++){
+	total+=groups[idx]->maxsize;
+    }
+    for(size_t idx=0;idx<groups.size();idx++){
+	// rounded up, so a limited class can always run somewhere
+	size_t share=(maxjobs*groups[idx]->maxsize+total-1)/total;
+	if(maxjobs && share==0){
+	    share=1;
+	}
+	groups[idx]->jq.set_class_limit(cls,static_cast<unsigned>(share));
+    }
+}
+
+// false if there are already as many threads as the policy wants
+bool
+adaptiveThreadPool::queueOne(group& grp)
 {
     pthread_t tid;
     pthread_attr_t theattr;
-    sem_wait(&tids_sem);
+    sem_wait(&grp.tids_sem);
+    if(stopping || grp.tids.size()>=grp.maxsize
+	    || grp.tids.size()>=grp.target+grp.held){
+	// addjob() and the controller can both decide we need one more
+	sem_post(&grp.tids_sem);
+	return false;
+    }
     pthread_attr_init(&theattr);
     pthread_attr_setdetachstate(&theattr,PTHREAD_CREATE_DETACHED);
+    if(grp.node>=0){
+	// pinned before it starts, so its stack's first touched on the node
+	pthread_attr_setaffinity_np(&theattr,sizeof(grp.cpus),&grp.cpus);
+    }
+
+    if(pthread_create(&tid,&theattr,waitAndRun,&grp)!=0){
+	pthread_attr_destroy(&theattr);
+	sem_post(&grp.tids_sem);
+	return false;
+    }
+    pthread_attr_destroy(&theattr);
+    grp.tids.push_back(tid);
+    PROBE2(thread_spawn,grp.node,grp.tids.size());
+    sem_post(&grp.tids_sem);
+    return true;
+}
 
-    pthread_create(&tid,&theattr,waitAndRun,this);
-    tids.push_back(tid);
-    sem_post(&tids_sem);
-    return;
+void
+adaptiveThreadPool::hold_thread()
+{
+    if(current){
+	current->held++;
+	if(current->idle==0){
+	    current->pool->queueOne(*current);
+	}
+    }
+}
+
+void
+adaptiveThreadPool::release_thread()
+{
+    if(current){
+	// the extra thread goes once it's idle, like any the policy
+	// doesn't want
+	current->held--;
+    }
 }
 
 void
@@ -70,10 +454,12 @@ adaptiveThreadPool::killAll()
 {
     // we'll get it, but not post it because no one else gets to run after
     // this.  The thread system is dead
-    sem_wait(&tids_sem);
-    for(size_t ctr=0;ctr<tids.size();ctr++){
-	pthread_cancel(tids[ctr]);
+    cancelled=true;
+    pthread_cancel(controller);
+    for(size_t idx=0;idx<groups.size();idx++){
+	sem_wait(&groups[idx]->tids_sem);
+	for(size_t ctr=0;ctr<groups[idx]->tids.size();ctr++){
+	    pthread_cancel(groups[idx]->tids[ctr]);
+	}
     }
 }
-
-
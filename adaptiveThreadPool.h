@@ -4,28 +4,163 @@
 #ifndef adaptiveThreadPool_guard
 #define adaptiveThreadPool_guard
 #include "jobQueue.h"
+#include "pooltask.h"
+#include "sizingpolicy.h"
+#include "topology.h"
 #include <pthread.h>
+#include <sched.h>
+#include <atomic>
 #include <vector>
 
 class adaptiveThreadPool
 {
 public:
     friend void* waitAndRun(void *); // method doesn't have right sig for thread
-    adaptiveThreadPool(void*(task)(void*),const int maxsize=20); 
+    friend void* sizeController(void *);
+    // what set_observer() wants, called with each group's sample and what
+    // the policy made of it
+    typedef void (*sizing_observer)(size_t group,const pool_sample& sample,
+	    const sizing_decision& decision);
+    // shed, if given, is called instead of task for a job that waited in
+    // the queue too long to be worth running.  Given a topology the pool
+    // splits into a group per NUMA node, each with its own queue and its
+    // share of maxsize threads, pinned to that node's CPUs.  How many of
+    // those maxsize threads there actually are is up to policy, which
+    // gets a look every period and defaults to a hillClimbingPolicy.
+    // Each group gets its own clone.  task gets a pointer to the
+    // connection's fd and the pool shuts it down and closes it after task
+    // returns, unless task sets it to -1 to say it's kept the connection.
+    adaptiveThreadPool(void*(task)(void*),const int maxsize=20,
+	    void (*shed)(int)=0,const cpuTopology *topology=0,
+	    const sizingPolicy *policy=0);
+    // runs what's already queued, and then the threads all go and the
+    // groups are given back to their nodes
+    ~adaptiveThreadPool();
+    // false if the queue's full or overloaded and didn't take the job,
+    // the caller has to turn it away itself.  cls is the job's priority
+    // class, 0 the most urgent, see jobQueue.
+    bool
+    addjob(int fd,unsigned cls=0);
     void
-    addjob(int fd){ jq.push(fd); /* std::cerr << "aj+\n";*/ };
+    set_limits(size_t maxdepth,unsigned target_ms,unsigned interval_ms);
+    // no more than maxjobs threads at once on jobs of class cls, spread
+    // over the groups like the threads are
+    void
+    set_class_limit(unsigned cls,unsigned maxjobs);
+    // see every decision the sizing policy makes, for tuning it
+    void
+    set_observer(sizing_observer observer){ this->observer=observer; };
+
+    // Run f() on one of the pool's threads.  The future's get() gives
+    // back what it returned, or throws what it threw.  Tasks go in the
+    // least urgent class, behind any waiting connections.
+    template<typename F>
+    pool_future<typename std::result_of<typename std::decay<F>::type()>::type>
+    submit(F&& f)
+    {
+	typedef typename std::decay<F>::type callable;
+	typedef typename std::result_of<callable()>::type result;
+	std::shared_ptr<pool_future_state<result> > state=
+	    std::make_shared<pool_future_state<result> >();
+	post(pool_task(pool_future_runner<callable,result>(std::forward<F>(f),state)));
+	return pool_future<result>(state);
+    }
+    // Run f() and then call done with what it returned (or with nothing
+    // if it returns void), both on the pool's thread.  No future means no
+    // shared state to allocate.  If f throws, done isn't called.
+    template<typename F,typename C>
+    void
+    submit_then(F&& f,C&& done)
+    {
+	typedef typename std::decay<F>::type callable;
+	typedef typename std::decay<C>::type completion;
+	typedef typename std::result_of<callable()>::type result;
+	post(pool_task(pool_then_runner<callable,completion,result>(
+		std::forward<F>(f),std::forward<C>(done))));
+    }
+    // Run every callable from first to last, fire and forget, handed out
+    // to the groups a slice each with one lock per slice.
+    template<typename Iter>
+    void
+    submit_bulk(Iter first,Iter last)
+    {
+	std::vector<pool_task> tasks;
+	for(;first!=last;++first){
+	    tasks.push_back(pool_task(*first));
+	}
+	size_t slice=(tasks.size()+groups.size()-1)/groups.size();
+	for(size_t start=0;start<tasks.size();start+=slice){
+	    size_t end=start+slice<tasks.size()?start+slice:tasks.size();
+	    group& grp=*groups[next++%groups.size()];
+	    if(grp.idle==0){
+		queueOne(grp);
+	    }
+	    grp.jq.push_bulk(tasks.begin()+start,tasks.begin()+end,
+		    jobQueue<pool_task>::NUM_CLASSES-1);
+	}
+    }
     void
     killAll();
+    // A job that's going to keep its thread a long time, like an HTTP/2
+    // connection waiting on its streams, says so from that thread, and
+    // till it lets go its group runs one more thread than the policy
+    // wants, so what's queued behind it isn't left waiting.
+    static void
+    hold_thread();
+    static void
+    release_thread();
 private:
     adaptiveThreadPool();
     adaptiveThreadPool(const adaptiveThreadPool&);
-    void queueOne(void);
     const adaptiveThreadPool& operator=(const adaptiveThreadPool&);
-    class jobQueue<int> jq;
+    // Everything the threads serving one node share.  It lives in memory
+    // from that node, and its threads only run on that node's CPUs, so
+    // their stacks and the buffers on them are local too.
+    struct group
+    {
+	adaptiveThreadPool *pool;
+	class jobQueue<pool_task> jq;
+	int node;		// NUMA node id, -1 if we're not pinning
+	cpu_set_t cpus;
+	std::atomic<int> idle;	// threads waiting for a job
+	std::vector<pthread_t> tids;	// one for each thread we have
+	sem_t tids_sem;
+	size_t maxsize;
+	size_t numcpus;		// CPUs its threads can use
+	std::atomic<size_t> target; // how many threads policy wants
+	std::atomic<size_t> held;   // and how many more, see hold_thread()
+	sizingPolicy *policy;
+	// what the threads measured since the controller last looked
+	std::atomic<unsigned long long> completed;
+	std::atomic<unsigned long long> service_ns;
+	std::atomic<unsigned long long> cpu_ns;
+	unsigned long long sampled;	// when it last looked
+    };
+    // the group of the pool thread we're on, if we're on one
+    static __thread group *current;
+    bool queueOne(group& grp);
+    bool retire(group& grp);
+    void resize(size_t idx);
+    group& pick(int fd);
+    void post(pool_task&& task);
+    std::vector<group*> groups;
+    const cpuTopology *topology;
+    std::atomic<size_t> next;	// round robin when the kernel won't say
     void *(*task)(void *);
-    sem_t sem;			// count threads
-    std::vector<pthread_t> tids;
-    sem_t tids_sem;
-    size_t maxsize;
+    void (*shed)(int);
+    std::atomic<sizing_observer> observer;
+    pthread_t controller;	// runs sizeController()
+    std::atomic<bool> stopping;	// the destructor's waiting on the threads
+    bool cancelled;		// killAll() left them in who knows what state
+    pthread_mutex_t stop_lock;
+    pthread_cond_t stop_cond;	// wakes the controller to stop
+    unsigned period_ms;
+};
+
+// holds the thread it's made on for as long as it's around
+struct thread_hold
+{
+    thread_hold(){ adaptiveThreadPool::hold_thread(); };
+    ~thread_hold(){ adaptiveThreadPool::release_thread(); };
 };
 #endif
@@ -0,0 +1,157 @@
+// copyright Patrick Horgan
+// source is open, feel free to use it as you wish with no restrictions
+// except that this copyright notice must be preserved intact
+#include "arena.h"
+#include <atomic>
+#include <cstdlib>
+
+// the first chunk never grows past this, one huge request shouldn't
+// leave every thread holding on to that much
+const size_t MAX_FIRST_CHUNK=262144;
+
+static __thread requestArena *active=0;
+static pthread_key_t owned_key;
+static pthread_once_t owned_once=PTHREAD_ONCE_INIT;
+
+static std::atomic<size_t> all_high_water(0);
+static std::atomic<unsigned long long> all_requests(0);
+static std::atomic<unsigned long long> all_overflows(0);
+static std::atomic<unsigned long long> all_big(0);
+
+static void
+delete_arena(void *arena)
+{
+    delete static_cast<requestArena*>(arena);
+}
+
+static void
+make_key()
+{
+    pthread_key_create(&owned_key,delete_arena);
+}
+
+requestArena::requestArena(size_t chunk_size):
+    first(0),last(0),ptr(0),end(0),before(0),most(0),
+    chunk_size(chunk_size?chunk_size:DEFAULT_CHUNK),big(0)
+{
+    void *mem=malloc(sizeof(chunk)+this->chunk_size);
+    if(mem==0){
+	throw std::bad_alloc();
+    }
+    first=last=static_cast<chunk*>(mem);
+    first->next=0;
+    first->size=this->chunk_size;
+    ptr=reinterpret_cast<char*>(first+1);
+    end=ptr+first->size;
+}
+
+requestArena::~requestArena()
+{
+    while(first){
+	chunk *next=first->next;
+	free(first);
+	first=next;
+    }
+}
+
+size_t
+requestArena::used() const
+{
+    return before+(ptr-reinterpret_cast<char*>(last+1));
+}
+
+// Out of room in this chunk, so start another big enough for size.  What's
+// left of this one is wasted, but it's only till reset().
+void *
+requestArena::grow(size_t size,size_t align)
+{
+    size_t want=size+align;
+    if(want>chunk_size){
+	big++;
+	all_big++;
+    }
+    size_t csize=want>chunk_size?want:chunk_size;
+    void *mem=malloc(sizeof(chunk)+csize);
+    if(mem==0){
+	throw std::bad_alloc();
+    }
+    chunk *fresh=static_cast<chunk*>(mem);
+    fresh->next=0;
+    fresh->size=csize;
+    before=used();
+    last->next=fresh;
+    last=fresh;
+    ptr=reinterpret_cast<char*>(fresh+1);
+    end=ptr+csize;
+    return allocate(size,align);
+}
+
+void
+requestArena::reset()
+{
+    size_t total=used();
+    if(total>most){
+	most=total;
+    }
+    size_t seen=all_high_water;
+    while(total>seen && !all_high_water.compare_exchange_weak(seen,total));
+    all_requests++;
+    if(first->next){
+	// it didn't fit, so give back the extras and make the first one
+	// big enough next time
+	all_overflows++;
+	while(first->next){
+	    chunk *next=first->next->next;
+	    free(first->next);
+	    first->next=next;
+	}
+	size_t want=total<MAX_FIRST_CHUNK?total:MAX_FIRST_CHUNK;
+	if(want>first->size){
+	    void *mem=realloc(first,sizeof(chunk)+want);
+	    if(mem){
+		first=static_cast<chunk*>(mem);
+		first->size=want;
+	    }
+	}
+    }
+    last=first;
+    before=0;
+    ptr=reinterpret_cast<char*>(first+1);
+    end=ptr+first->size;
+}
+
+requestArena *
+requestArena::current()
+{
+    return active;
+}
+
+arena_stats
+requestArena::stats()
+{
+    arena_stats result;
+    result.high_water=all_high_water;
+    result.requests=all_requests;
+    result.overflows=all_overflows;
+    result.big=all_big;
+    return result;
+}
+
+// Every thread gets its own arena the first time it needs one, and it's
+// deleted when the thread exits, which they do now that the pool shrinks.
+arena_scope::arena_scope()
+{
+    pthread_once(&owned_once,make_key);
+    mine=static_cast<requestArena*>(pthread_getspecific(owned_key));
+    if(mine==0){
+	mine=new requestArena;
+	pthread_setspecific(owned_key,mine);
+    }
+    active=mine;
+}
+
+arena_scope::~arena_scope()
+{
+    active=0;
+    mine->reset();
+}
@@ -0,0 +1,168 @@
+// copyright Patrick Horgan
+// source is open, feel free to use it as you wish with no restrictions
+// except that this copyright notice must be preserved intact
+#ifndef arena_guard
+#define arena_guard
+#include <pthread.h>
+#include <cctype>
+#include <cstddef>
+#include <map>
+#include <new>
+#include <string>
+#include <vector>
+
+// How big the arenas have had to get, over every thread, for sizing
+// requestArena::DEFAULT_CHUNK.
+struct arena_stats
+{
+    size_t high_water;		// most bytes any one request used
+    unsigned long long requests;	// resets, so one a request
+    unsigned long long overflows;	// requests that needed more than one chunk
+    unsigned long long big;	// allocations too big for a chunk
+};
+
+// Memory for things that all die at the same time, the end of a request.
+// Allocating is bumping a pointer, freeing is nothing at all, and reset()
+// gives it all back at once.  It gets its memory a chunk at a time, and
+// keeps the first chunk across resets, so a request that fits in it never
+// calls malloc.  If a request didn't fit, reset() makes the first chunk
+// big enough that the next one like it will.
+//
+// Each worker thread has its own, see arena_scope, so there's no locking.
+class requestArena
+{
+public:
+    static const size_t DEFAULT_CHUNK=16384;
+    requestArena(size_t chunk_size=DEFAULT_CHUNK);
+    ~requestArena();
+    void *
+    allocate(size_t size,size_t align)
+    {
+	size_t pad=(align-reinterpret_cast<size_t>(ptr)%align)%align;
+	if(ptr && pad+size<=static_cast<size_t>(end-ptr)){
+	    void *result=ptr+pad;
+	    ptr+=pad+size;
+	    return result;
+	}
+	return grow(size,align);
+    }
+    void reset();
+    size_t used() const;	// bytes since the last reset
+    size_t high_water() const { return most; };
+    // this thread's arena if it's in the middle of a request, else 0
+    static requestArena *current();
+    static arena_stats stats();
+private:
+    requestArena(const requestArena&);
+    const requestArena& operator=(const requestArena&);
+    struct chunk
+    {
+	chunk *next;
+	size_t size;		// not counting this
+    };
+    void *grow(size_t size,size_t align);
+    chunk *first;
+    chunk *last;		// the one we're allocating from
+    char *ptr;
+    char *end;
+    size_t before;		// used in the chunks before last
+    size_t most;
+    size_t chunk_size;
+    unsigned long long big;
+};
+
+// While one of these is around, containers using arena_allocator on this
+// thread allocate from the thread's arena.  When it goes it resets the
+// arena, so anything from the arena has to be gone by then: make it the
+// first thing in the function.
+class arena_scope
+{
+public:
+    arena_scope();
+    ~arena_scope();
+    requestArena& arena(){ return *mine; };
+private:
+    arena_scope(const arena_scope&);
+    const arena_scope& operator=(const arena_scope&);
+    requestArena *mine;
+};
+
+// A C++11 allocator for the arena.  It takes the thread's arena when it's
+// made, and if there isn't one it's plain operator new, so a container of
+// these made outside a request still works.  Nothing allocated in a
+// request can be kept past it, so never put one of these in a cache.
+template<typename T>
+class arena_allocator
+{
+public:
+    typedef T value_type;
+    template<typename U>
+    struct rebind
+    {
+	typedef arena_allocator<U> other;
+    };
+    arena_allocator():arena(requestArena::current()){};
+    explicit arena_allocator(requestArena *arena):arena(arena){};
+    template<typename U>
+    arena_allocator(const arena_allocator<U>& other):arena(other.arena){};
+    T *
+    allocate(size_t n)
+    {
+	if(arena){
+	    return static_cast<T*>(arena->allocate(n*sizeof(T),alignof(T)));
+	}
+	return static_cast<T*>(::operator new(n*sizeof(T)));
+    }
+    void
+    deallocate(T *p,size_t)
+    {
+	if(!arena){
+	    ::operator delete(p);
+	}
+    }
+    requestArena *arena;
+};
+
+template<typename T,typename U>
+bool
+operator==(const arena_allocator<T>& a,const arena_allocator<U>& b)
+{
+    return a.arena==b.arena;
+}
+
+template<typename T,typename U>
+bool
+operator!=(const arena_allocator<T>& a,const arena_allocator<U>& b)
+{
+    return a.arena!=b.arena;
+}
+
+typedef std::basic_string<char,std::char_traits<char>,arena_allocator<char> > arena_string;
+typedef std::vector<arena_string,arena_allocator<arena_string> > arena_strings;
+// What an arena_map holds is headers, and their names don't care about
+// case, so neither does looking them up.
+struct nocase_less
+{
+    bool operator()(const arena_string& a,const arena_string& b) const
+    {
+	size_t len=a.size()<b.size()?a.size():b.size();
+	for(size_t ctr=0;ctr<len;ctr++){
+	    int ca=tolower(static_cast<unsigned char>(a[ctr]));
+	    int cb=tolower(static_cast<unsigned char>(b[ctr]));
+	    if(ca!=cb){
+		return ca<cb;
+	    }
+	}
+	return a.size()<b.size();
+    }
+};
+typedef std::map<arena_string,arena_string,nocase_less,
+	arena_allocator<std::pair<const arena_string,arena_string> > > arena_map;
+
+// for handing an arena_string to something that wants a std::string
+inline std::string
+to_std(const arena_string& s)
+{
+    return std::string(s.data(),s.size());
+}
+#endif
@@ -0,0 +1,58 @@
+#!/bin/sh
+# copyright Patrick Horgan
+# source is open, feel free to use it as you wish with no restrictions
+# except that this copyright notice must be preserved intact
+#
+# Races helloplugin.so against basiccgi, the same page both ways.  Start
+# the server with
+#
+#     httpserver -r '/hello/*=plugin:./helloplugin.so'
+#
+# and copy basiccgi into DOCUMENT_ROOT/cgi-bin first.  Each one gets n
+# requests, one after another on one kept-alive connection, so what's
+# timed is the server and not connecting.
+#
+#     benchplugin.sh [-n requests] [host:port]
+
+n=1000
+while getopts n: opt; do
+    case $opt in
+	n) n=$OPTARG ;;
+	*) echo "usage: $0 [-n requests] [host:port]" >&2; exit 1 ;;
+    esac
+done
+shift $((OPTIND-1))
+server=${1:-localhost:8080}
+
+# one curl, n requests, the seconds each took
+run()
+{
+    i=0
+    while [ $i -lt $n ]; do
+	echo "url = \"http://$server$1\""
+	echo 'output = "/dev/null"'
+	i=$((i+1))
+    done | curl -s -K - -w '%{http_code} %{time_total}\n'
+}
+
+report()
+{
+    sort -n -k2 | awk -v name="$1" '
+	$1!=200 { bad++ }
+	{ t[NR]=$2; sum+=$2 }
+	END {
+	    if(NR==0){ print name ": no answers"; exit 1 }
+	    p99=int(NR*.99)+1
+	    if(p99>NR){ p99=NR }
+	    printf "%-8s %6d requests %4d not 200  mean %7.3fms  p50 %7.3fms  p99 %7.3fms  %8.0f/s\n",
+		name, NR, bad, sum/NR*1000, t[int(NR*.5)+1]*1000,
+		t[p99]*1000, NR/sum
+	}'
+}
+
+# a few of each first so neither pays for being first
+n_was=$n; n=20
+run /hello/ >/dev/null; run /cgi-bin/basiccgi >/dev/null
+n=$n_was
+run /hello/ | report plugin
+run /cgi-bin/basiccgi | report cgi
@@ -0,0 +1,97 @@
+// copyright Patrick Horgan
+// source is open, feel free to use it as you wish with no restrictions
+// except that this copyright notice must be preserved intact
+#include "bufferpool.h"
+#include <pthread.h>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+// a free block's first bytes point at the next free one
+struct free_block
+{
+    free_block *next;
+};
+
+struct free_list
+{
+    free_block *head;
+    size_t count;
+};
+
+static __thread free_list *mine=0;
+static pthread_key_t list_key;
+static pthread_once_t list_once=PTHREAD_ONCE_INIT;
+static std::atomic<size_t> out(0);
+
+// when a thread goes so do its free blocks
+static void
+free_all(void *voidlist)
+{
+    free_list *list=static_cast<free_list*>(voidlist);
+    while(list->head){
+	free_block *next=list->head->next;
+	free(list->head);
+	list->head=next;
+    }
+    delete list;
+}
+
+static void
+make_key()
+{
+    pthread_key_create(&list_key,free_all);
+}
+
+static free_list *
+my_list()
+{
+    if(mine==0){
+	pthread_once(&list_once,make_key);
+	mine=new free_list;
+	mine->head=0;
+	mine->count=0;
+	pthread_setspecific(list_key,mine);
+    }
+    return mine;
+}
+
+char *
+bufferPool::get()
+{
+    free_list *list=my_list();
+    char *block;
+    if(list->head){
+	block=reinterpret_cast<char*>(list->head);
+	list->head=list->head->next;
+	list->count--;
+    }else if((block=static_cast<char*>(malloc(BLOCK_SIZE)))==0){
+	throw std::bad_alloc();
+    }
+    out++;
+    return block;
+}
+
+void
+bufferPool::put(char *block)
+{
+    if(block==0){
+	return;
+    }
+    out--;
+    free_list *list=my_list();
+    if(list->count>=KEEP){
+	free(block);
+	return;
+    }
+    free_block *fb=reinterpret_cast<free_block*>(block);
+    fb->next=list->head;
+    list->head=fb;
+    list->count++;
+}
+
+size_t
+bufferPool::outstanding()
+{
+    return out;
+}
@@ -0,0 +1,27 @@
+// copyright Patrick Horgan
+// source is open, feel free to use it as you wish with no restrictions
+// except that this copyright notice must be preserved intact
+#ifndef bufferpool_guard
+#define bufferpool_guard
+#include <cstddef>
+
+// Fixed size blocks for connection buffers.  A connection only holds one
+// while it's got data in flight, so there are about as many in use as
+// there are busy threads, not as many as there are connections.  Each
+// thread keeps up to KEEP free ones of its own, so getting one and giving
+// it back never takes a lock, and the rest go back to malloc.  Nothing's
+// ever zeroed, whoever gets a block writes it before reading it.
+class bufferPool
+{
+public:
+    static const size_t BLOCK_SIZE=8*1024;
+    static const size_t KEEP=8;
+    // throws std::bad_alloc if there's no memory
+    static char *get();
+    static void put(char *block);
+    // blocks handed out and not back yet, over every thread
+    static size_t outstanding();
+private:
+    bufferPool();
+};
+#endif
@@ -0,0 +1,161 @@
+// copyright Patrick Horgan
+// source is open, feel free to use it as you wish with no restrictions
+// except that this copyright notice must be preserved intact
+#include "capture.h"
+#include <cstring>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char MAGIC[]="HSCAP001";
+static const size_t RECORD_HEAD=24;	// everything before the request bytes
+
+static void
+put_le(std::string& out,uint64_t value,size_t bytes)
+{
+    for(size_t ctr=0;ctr<bytes;ctr++){
+	out+=static_cast<char>(value>>(8*ctr)&0xff);
+    }
+}
+
+static uint64_t
+get_le(const unsigned char *in,size_t bytes)
+{
+    uint64_t value=0;
+    for(size_t ctr=bytes;ctr>0;ctr--){
+	value=value<<8|in[ctr-1];
+    }
+    return value;
+}
+
+trafficCapture::trafficCapture():file(0),began(0),connections(0)
+{
+    pthread_mutex_init(&lock,0);
+}
+
+trafficCapture::~trafficCapture()
+{
+    if(file){
+	flush();
+	fclose(file);
+    }
+    pthread_mutex_destroy(&lock);
+}
+
+unsigned long long
+trafficCapture::now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec*1000000000ULL+ts.tv_nsec;
+}
+
+bool
+trafficCapture::open(const char *path)
+{
+    int fd=::open(path,O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC,0600);
+    if(fd==-1){
+	return false;
+    }
+    FILE *f=fdopen(fd,"w");
+    if(f==0){
+	close(fd);
+	return false;
+    }
+    // out now, so it's a capture even before there's anything in it
+    if(fwrite(MAGIC,1,8,f)!=8 || fflush(f)!=0){
+	fclose(f);
+	return false;
+    }
+    began=now();
+    file=f;
+    return true;
+}
+
+uint32_t
+trafficCapture::new_connection()
+{
+    return ++connections;
+}
+
+void
+trafficCapture::record(uint32_t connection,unsigned long long start_ns,
+	unsigned long long duration_ns,int status,const std::string& request,
+	bool truncated)
+{
+    if(file==0){
+	return;
+    }
+    // the length has to fit its 4 bytes
+    size_t len=request.size();
+    if(len>MAX_REQUEST){
+	len=MAX_REQUEST;
+	truncated=true;
+    }
+    pthread_mutex_lock(&lock);
+    put_le(pending,start_ns>began?(start_ns-began)/1000:0,8);
+    put_le(pending,connection,4);
+    put_le(pending,status>0 && status<0x10000?status:0,2);
+    put_le(pending,truncated?CAPTURE_TRUNCATED:0,2);
+    put_le(pending,duration_ns/1000>0xffffffffULL?0xffffffffULL:duration_ns/1000,4);
+    put_le(pending,len,4);
+    pending.append(request,0,len);
+    if(pending.size()>=FLUSH_AT){
+	write_out();
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void
+trafficCapture::flush()
+{
+    if(file==0){
+	return;
+    }
+    pthread_mutex_lock(&lock);
+    write_out();
+    fflush(file);
+    pthread_mutex_unlock(&lock);
+}
+
+// with the lock held
+void
+trafficCapture::write_out()
+{
+    if(!pending.empty()){
+	fwrite(pending.data(),1,pending.size(),file);
+	pending.clear();
+    }
+}
+
+FILE *
+open_capture(const char *path)
+{
+    FILE *in=fopen(path,"re");
+    char magic[8];
+    if(in==0){
+	return 0;
+    }
+    if(fread(magic,1,8,in)!=8 || memcmp(magic,MAGIC,8)!=0){
+	fclose(in);
+	return 0;
+    }
+    return in;
+}
+
+bool
+read_capture(FILE *in,capture_record& rec)
+{
+    unsigned char head[RECORD_HEAD];
+    if(fread(head,1,RECORD_HEAD,in)!=RECORD_HEAD){
+	return false;
+    }
+    rec.start_us=get_le(head,8);
+    rec.connection=static_cast<uint32_t>(get_le(head+8,4));
+    rec.status=static_cast<uint16_t>(get_le(head+12,2));
+    rec.flags=static_cast<uint16_t>(get_le(head+14,2));
+    rec.duration_us=static_cast<uint32_t>(get_le(head+16,4));
+    size_t len=static_cast<size_t>(get_le(head+20,4));
+    rec.request.resize(len);
+    return len==0 || fread(&rec.request[0],1,len,in)==len;
+}
@@ -0,0 +1,81 @@
+// copyright Patrick Horgan
+// source is open, feel free to use it as you wish with no restrictions
+// except that this copyright notice must be preserved intact
+#ifndef capture_guard
+#define capture_guard
+#include <cstdio>
+#include <string>
+#include <atomic>
+#include <pthread.h>
+#include <stdint.h>
+
+// A capture file is the magic, then one record for each request:
+//
+//	8 bytes  "HSCAP001"
+//	8 bytes  microseconds from the start of the capture to the request
+//	4 bytes  which connection it came on, numbered as they're accepted
+//	2 bytes  the status we answered with, 0 if we don't know
+//	2 bytes  flags, CAPTURE_TRUNCATED if the request's been cut short
+//	4 bytes  microseconds we took to answer it
+//	4 bytes  how many bytes of request there are
+//	         the request exactly as it came, header and the body as far as
+//	         we read it, up to trafficCapture::MAX_REQUEST bytes of it
+//
+// Numbers are little-endian.  A connection's requests are in the order
+// they were answered, and records are in the order they finished, so
+// they're only roughly in the order they started.
+static const uint16_t CAPTURE_TRUNCATED=1;
+
+struct capture_record
+{
+    uint64_t start_us;
+    uint32_t connection;
+    uint16_t status;
+    uint16_t flags;
+    uint32_t duration_us;
+    std::string request;
+};
+
+// Writes the capture file for the whole server.  Records are put together
+// in memory and written when there's 64K of them or someone calls
+// flush(), so a request only takes the lock long enough to copy itself.
+// The file's made readable by us alone, since it has cookies and all in
+// it.
+class trafficCapture
+{
+public:
+    static const size_t FLUSH_AT=64*1024;
+    // the most of one request that's kept, past that it's marked truncated
+    static const size_t MAX_REQUEST=256*1024;
+    trafficCapture();
+    ~trafficCapture();
+    // false, with errno set, if the file can't be made
+    bool open(const char *path);
+    bool enabled() const { return file!=0; };
+    // number for the next connection accepted
+    uint32_t new_connection();
+    // when it started, by CLOCK_MONOTONIC in ns, and how long it took.
+    // truncated says request isn't all of it, and it's cut to MAX_REQUEST
+    // here if it's longer.
+    void record(uint32_t connection,unsigned long long start_ns,
+	    unsigned long long duration_ns,int status,const std::string& request,
+	    bool truncated=false);
+    void flush();
+    static unsigned long long now();
+private:
+    trafficCapture(const trafficCapture&);
+    const trafficCapture& operator=(const trafficCapture&);
+    void write_out();
+    FILE *file;
+    pthread_mutex_t lock;
+    std::string pending;
+    unsigned long long began;
+    std::atomic<uint32_t> connections;
+};
+
+// Reading one back.  open_capture() checks the magic and returns 0 if it's
+// not there or the file won't open.  read_capture() returns false at the
+// end of the file or if the last record's cut short.
+FILE *open_capture(const char *path);
+bool read_capture(FILE *in,capture_record& rec);
+#endif
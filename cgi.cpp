@@ -0,0 +1,162 @@
+// copyright Patrick Horgan
+// source is open, feel free to use it as you wish with no restrictions
+// except that this copyright notice must be preserved intact
+#include "cgi.h"
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// longest a script can go without writing anything before we give up on it
+const int CGI_TIMEOUT_MS=30000;
+// most we'll read looking for the end of the script's headers
+const size_t CGI_MAX_HEAD=8*1024;
+
+// wait for fd to be ready for events, false on timeout or error
+static bool
+wait_for(int fd,short events,int timeout)
+{
+    struct pollfd pfd;
+    pfd.fd=fd;
+    pfd.events=events;
+    while(1){
+	int retval=poll(&pfd,1,timeout);
+	if(retval==-1 && errno==EINTR){
+	    continue;
+	}
+	return retval>0;
+    }
+}
+
+// Everything the script writes from here on goes to the client through
+// sfd, so its deadlines and minimum rate hold the client to taking it and
+// it's counted in what we sent.  With chunked encoding we have to say how
+// big a chunk is before sending it, so ask the pipe how much it's holding
+// and splice exactly that.  False if the script stalled.
+static bool
+relay_output(sockfdwrapper& sfd,int pipefd,bool chunked)
+{
+    while(1){
+	int avail=0;
+	if(!wait_for(pipefd,POLLIN,CGI_TIMEOUT_MS) || ioctl(pipefd,FIONREAD,&avail)==-1){
+	    return false;
+	}
+	if(avail==0){
+	    // readable with nothing in it means the script closed stdout
+	    if(chunked){
+		cgi_send_body(sfd,0,0,true);
+	    }
+	    return true;
+	}
+	if(chunked){
+	    char sizeline[24];
+	    snprintf(sizeline,sizeof sizeline,"%x\r\n",avail);
+	    sfd << sizeline;
+	}
+	if(sfd.splice_from(pipefd,avail)<static_cast<size_t>(avail)){
+	    return false;
+	}
+	if(chunked){
+	    sfd << "\r\n";
+	}
+    }
+}
+
+void
+run_cgi(sockfdwrapper& sfd,const std::string& script,const cgi_env& env,
+	bool http11,int stdinfd)
+{
+    std::vector<std::string> envstrings;
+    std::vector<char *> envp;
+    int out[2];
+    pid_t pid;
+    int retval;
+
+    for(cgi_env::const_iterator i=env.begin();i!=env.end();i++){
+	envstrings.push_back(i->first+"="+i->second);
+    }
+    for(size_t ctr=0;ctr<envstrings.size();ctr++){
+	envp.push_back(const_cast<char*>(envstrings[ctr].c_str()));
+    }
+    envp.push_back(0);
+    char *argv[]={ const_cast<char*>(script.c_str()),0 };
+
+    if(pipe2(out,O_CLOEXEC)==-1){
+	throw cgi_spawn_fail(errno);
+    }
+    // posix_spawn gets us vfork semantics, the child borrows our address
+    // space until it execs instead of copying the page tables of a big
+    // threaded process.
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if(stdinfd==-1){
+	posix_spawn_file_actions_addopen(&actions,0,"/dev/null",O_RDONLY,0);
+    }else{
+	posix_spawn_file_actions_adddup2(&actions,stdinfd,0);
+    }
+    posix_spawn_file_actions_adddup2(&actions,out[1],1);
+    retval=posix_spawn(&pid,script.c_str(),&actions,NULL,argv,&envp[0]);
+    posix_spawn_file_actions_destroy(&actions);
+    close(out[1]);
+    if(retval!=0){
+	close(out[0]);
+	throw cgi_spawn_fail(retval);
+    }
+
+    // The headers are the only part we look at.  Whatever body came along
+    // in the same reads goes out with a plain send, the rest is spliced.
+    char head[CGI_MAX_HEAD];
+    size_t got=0,bodystart=std::string::npos;
+    bool ok=true,chunked=false;
+    // looked for before the room's checked, a first read can fill it
+    while((bodystart=cgi_header_end(head,got))==std::string::npos && got<CGI_MAX_HEAD){
+	ssize_t nbytes;
+	if(!wait_for(out[0],POLLIN,CGI_TIMEOUT_MS)){
+	    break;
+	}
+	if((nbytes=read(out[0],head+got,CGI_MAX_HEAD-got))==-1 && errno==EINTR){
+	    continue;
+	}
+	if(nbytes<=0){
+	    break;
+	}
+	got+=nbytes;
+    }
+    if(got==0){
+	// it died or hung without saying a thing, nothing's been sent yet so
+	// let our caller tell the client
+	close(out[0]);
+	kill(pid,SIGKILL);
+	waitpid(pid,NULL,0);
+	throw cgi_spawn_fail(EPIPE);
+    }
+    try{
+	if(bodystart==std::string::npos){
+	    // never saw the end of the headers, so it's all we're getting
+	    std::cerr << script << ": no blank line after the cgi headers\n";
+	    bodystart=got;
+	    sfd << cgi_to_http_head(head,got,http11,chunked);
+	}else{
+	    sfd << cgi_to_http_head(head,bodystart,http11,chunked);
+	}
+	if(got>bodystart){
+	    cgi_send_body(sfd,head+bodystart,got-bodystart,chunked);
+	}
+	ok=relay_output(sfd,out[0],chunked);
+    }catch(const socket_insert_fail& sif){
+	std::cerr << sif.what() << '\n';
+	ok=false;
+    }
+    close(out[0]);
+    if(!ok){
+	// stalled script or client gone, either way nobody wants the rest
+	kill(pid,SIGKILL);
+    }
+    waitpid(pid,NULL,0);
+}
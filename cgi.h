@@ -0,0 +1,40 @@
+// copyright Patrick Horgan
+// source is open, feel free to use it as you wish with no restrictions
+// except that this copyright notice must be preserved intact
+#ifndef cgi_guard
+#define cgi_guard
+#include <string>
+#include <exception>
+#include "cgienv.h"
+#include "sockfdwrapper.h"
+
+class
+cgi_spawn_fail: public std::exception
+{
+public:
+    cgi_spawn_fail(int err):err(err){
+	std::stringstream ss;
+	ss << "Couldn't start the cgi script, " << strerror(err);
+	the_str=ss.str();
+    };
+    virtual ~cgi_spawn_fail() throw() {};
+    int
+    error() const { return err; };
+    virtual const char* what() const throw()
+    {
+	return the_str.c_str();
+    };
+private:
+    int err;
+    std::string the_str;
+};
+
+// Run script with env as a CGI/1.1 script and stream what it writes to
+// sfd.  Only the script's headers get read into our memory, the body
+// goes from the script's stdout pipe to the socket with splice(2).  Throws
+// cgi_spawn_fail if it couldn't be started, in which case nothing was sent.
+// The script's stdin is stdinfd if it's not -1, otherwise /dev/null.
+void
+run_cgi(sockfdwrapper& sfd,const std::string& script,const cgi_env& env,
+	bool http11,int stdinfd=-1);
+#endif
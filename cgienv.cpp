@@ -0,0 +1,171 @@
+// copyright Patrick Horgan
+// source is open, feel free to use it as you wish with no restrictions
+// except that this copyright notice must be preserved intact
+#include "cgienv.h"
+#include "sockfdwrapper.h"
+#include <cstdio>
+#include <cstdlib>
+#include <netdb.h>
+#include <sys/socket.h>
+
+// get the numeric host and port for either end of a socket
+static void
+sock_name(int fd,bool peer,std::string& host,std::string& port)
+{
+    struct sockaddr_storage addr;
+    socklen_t len=sizeof(addr);
+    char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
+    int retval;
+
+    if(peer){
+	retval=getpeername(fd,reinterpret_cast<struct sockaddr*>(&addr),&len);
+    }else{
+	retval=getsockname(fd,reinterpret_cast<struct sockaddr*>(&addr),&len);
+    }
+    if(retval==-1 || getnameinfo(reinterpret_cast<struct sockaddr*>(&addr),len,
+		hbuf,sizeof hbuf,sbuf,sizeof sbuf,NI_NUMERICHOST|NI_NUMERICSERV)!=0){
+	host="";
+	port="";
+	return;
+    }
+    host=hbuf;
+    port=sbuf;
+}
+
+void
+cgi_environment(cgi_env& env,int fd,http_request_line& hrl,
+	header_map& hdrs,
+	const std::string& script_name,const std::string& script_filename)
+{
+    std::string host,port;
+    const std::string& path=hrl.get_path();
+    const char *envpath=getenv("PATH");
+
+    env["GATEWAY_INTERFACE"]="CGI/1.1";
+    env["SERVER_SOFTWARE"]="patrick0.7";
+    env["SERVER_PROTOCOL"]="HTTP/"+hrl.get_major_release()+"."+hrl.get_minor_release();
+    env["REQUEST_METHOD"]=hrl.get_method();
+    env["QUERY_STRING"]=hrl.get_query();
+    env["REQUEST_URI"]=path;
+    if(hrl.get_query()!=""){
+	env["REQUEST_URI"]+="?"+hrl.get_query();
+    }
+    env["DOCUMENT_ROOT"]=to_std(hdrs["DOCUMENT_ROOT"]);
+    env["SCRIPT_NAME"]=script_name;
+    env["SCRIPT_FILENAME"]=script_filename;
+    if(path.size()>script_name.size() && path.compare(0,script_name.size(),script_name)==0){
+	env["PATH_INFO"]=path.substr(script_name.size());
+    }
+    env["PATH"]=envpath?envpath:"/usr/local/bin:/usr/bin:/bin";
+    sock_name(fd,true,host,port);
+    env["REMOTE_ADDR"]=host;
+    env["REMOTE_PORT"]=port;
+    sock_name(fd,false,host,port);
+    env["SERVER_ADDR"]=host;
+    env["SERVER_PORT"]=port;
+    env["SERVER_NAME"]=hrl.get_host()!=""?hrl.get_host():host;
+
+    // Every header but the ones we made up ourselves turns into HTTP_*
+    // except for the two the spec gives their own names.  Proxy would be
+    // HTTP_PROXY, which too many things take for the http_proxy setting,
+    // so a client could send their outgoing requests anywhere (httpoxy).
+    for(header_map::iterator i=hdrs.begin();i!=hdrs.end();i++){
+	if(i->first=="DOCUMENT_ROOT"){
+	    continue;
+	}
+	std::string name;
+	for(arena_string::const_iterator c=i->first.begin();c!=i->first.end();c++){
+	    name+=(*c=='-')?'_':static_cast<char>(toupper(*c));
+	}
+	if(name=="PROXY"){
+	    continue;
+	}else if(name=="CONTENT_TYPE" || name=="CONTENT_LENGTH"){
+	    env[name]=to_std(i->second);
+	}else{
+	    env["HTTP_"+name]=to_std(i->second);
+	}
+    }
+}
+
+size_t
+cgi_header_end(const char *buf,size_t len)
+{
+    for(size_t ctr=0;ctr<len;ctr++){
+	if(buf[ctr]!='\n'){
+	    continue;
+	}
+	if(ctr+1<len && buf[ctr+1]=='\n'){
+	    return ctr+2;
+	}
+	if(ctr+2<len && buf[ctr+1]=='\r' && buf[ctr+2]=='\n'){
+	    return ctr+3;
+	}
+    }
+    return std::string::npos;
+}
+
+std::string
+cgi_to_http_head(const char *buf,size_t len,bool http11,bool& chunked)
+{
+    std::string status;
+    std::string headers;
+    bool haslocation=false,haslength=false;
+    const char *ptr=buf,*eol,*end=buf+len;
+
+    while(ptr<end){
+	for(eol=ptr;eol<end && *eol!='\n';eol++);
+	std::string line(ptr,eol);
+	ptr=eol+1;
+	if(line.size() && line[line.size()-1]=='\r'){
+	    line.erase(line.size()-1);
+	}
+	if(line==""){
+	    break;	    // the blank line ending the headers
+	}
+	size_t colon=line.find(':');
+	if(colon==std::string::npos){
+	    continue;	    // not a header, scripts get things wrong
+	}
+	std::string name(line,0,colon);
+	std::string lname(name);
+	size_t vstart=line.find_first_not_of(" \t",colon+1);
+	std::string value=(vstart==std::string::npos)?"":line.substr(vstart);
+	std::transform(lname.begin(),lname.end(),lname.begin(),::tolower);
+	if(lname=="status"){
+	    status=value;
+	    continue;	    // this one's for us, not the client
+	}
+	if(lname=="location"){
+	    haslocation=true;
+	}else if(lname=="content-length"){
+	    haslength=true;
+	}
+	headers+=name+": "+value+"\r\n";
+    }
+    if(status==""){
+	status=haslocation?"302 Found":"200 OK";
+    }
+    chunked=!haslength && http11;
+    if(chunked){
+	headers+="Transfer-Encoding: chunked\r\n";
+    }
+    return "HTTP/1.1 "+status+"\r\n"+headers+"\r\n";
+}
+
+void
+cgi_send_body(sockfdwrapper& sfd,const char *buf,size_t len,bool chunked)
+{
+    if(!chunked){
+	if(len){
+	    sfd.sendall(buf,len);
+	}
+	return;
+    }
+    char sizeline[24];
+    snprintf(sizeline,sizeof sizeline,"%zx\r\n",len);
+    sfd << sizeline;
+    if(len){
+	sfd.sendall(buf,len);
+    }
+    sfd << "\r\n";
+}
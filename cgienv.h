@@ -30,4 +30,38 @@ SERVER_PORT
 SERVER_SIGNATURE
 SERVER_SOFTWARE
 */
+#include <map>
+#include <string>
+#include "http.h"
+
+class sockfdwrapper;
+
+typedef std::map<std::string,std::string> cgi_env;
+
+// Fill env with the meta-variables above for the request that came in on
+// fd.  script_name is the part of the path that names the script, anything
+// after it becomes PATH_INFO.  Every request header turns into HTTP_FOO_BAR,
+// but Proxy, which is left out.
+void
+cgi_environment(cgi_env& env,int fd,http_request_line& hrl,
+	header_map& hdrs,
+	const std::string& script_name,const std::string& script_filename);
+
+// Scripts end their headers with a blank line, either \n\n or \r\n\r\n.
+// Returns the offset of the first body byte, or std::string::npos if the
+// blank line isn't in buf yet.
+size_t
+cgi_header_end(const char *buf,size_t len);
+
+// Turn the header block a script wrote into an HTTP status line and headers.
+// Status: gives the status line, a Location: without a Status: is a 302,
+// anything else is a 200.  If the script didn't say Content-Length and the
+// client speaks HTTP/1.1 we add Transfer-Encoding: chunked and set chunked.
+std::string
+cgi_to_http_head(const char *buf,size_t len,bool http11,bool& chunked);
+
+// Send some of the body, as a chunk if chunked is set.  With chunked set,
+// len==0 sends the last-chunk that ends the body.
+void
+cgi_send_body(sockfdwrapper& sfd,const char *buf,size_t len,bool chunked);
 #endif
@@ -0,0 +1,274 @@
+// copyright Patrick Horgan
+// source is open, feel free to use it as you wish with no restrictions
+// except that this copyright notice must be preserved intact
+#include "dircache.h"
+#include "pathintern.h"
+#include <algorithm>
+#include <dirent.h>
+#include <cerrno>
+#include <cstdio>
+#include <ctime>
+#include <vector>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// what getdents64 hands back, glibc doesn't declare it for us
+struct linux_dirent64
+{
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// bytes of entries we ask the kernel for per getdents64 call
+const size_t DIRENT_BUF_SIZ=32*1024;
+// directories bigger than this get their statx calls split across threads
+const size_t STAT_PER_THREAD=256;
+const size_t MAX_STAT_THREADS=4;
+
+struct dir_entry
+{
+    std::string name;
+    bool isdir;
+    bool statted;
+    unsigned long long size;
+    time_t mtime;
+    bool operator<(const dir_entry& other) const { return name<other.name; };
+};
+
+struct stat_work
+{
+    int dirfd;
+    std::vector<dir_entry>::iterator first,last;
+};
+
+static void *
+stat_entries(void *voidwork)
+{
+    stat_work *work=static_cast<stat_work*>(voidwork);
+    struct statx stx;
+    for(std::vector<dir_entry>::iterator i=work->first;i!=work->last;i++){
+	if(statx(work->dirfd,i->name.c_str(),AT_SYMLINK_NOFOLLOW|AT_STATX_DONT_SYNC,
+		    STATX_TYPE|STATX_SIZE|STATX_MTIME,&stx)==0){
+	    i->statted=true;
+	    i->isdir=S_ISDIR(stx.stx_mode);
+	    i->size=stx.stx_size;
+	    i->mtime=stx.stx_mtime.tv_sec;
+	}
+    }
+    return 0;
+}
+
+static std::string
+html_escape(const std::string& s)
+{
+    std::string retval;
+    for(std::string::const_iterator i=s.begin();i!=s.end();i++){
+	switch(*i){
+	    case '&': retval+="&amp;"; break;
+	    case '<': retval+="&lt;"; break;
+	    case '>': retval+="&gt;"; break;
+	    case '"': retval+="&quot;"; break;
+	    default: retval+=*i;
+	}
+    }
+    return retval;
+}
+
+// what goes in an href for a name in the directory.  A : could be taken
+// for a scheme, so a name with one is ./name.
+static std::string
+href_for(const std::string& name)
+{
+    std::string href=encode_path(name);
+    if(name.find(':')!=std::string::npos){
+	href="./"+href;
+    }
+    return html_escape(href);
+}
+
+dirCache::dirCache(bool withstat,size_t maxentries):
+    withstat(withstat),maxentries(maxentries)
+{
+    pthread_mutex_init(&lock,NULL);
+}
+
+dirCache::~dirCache()
+{
+    pthread_mutex_destroy(&lock);
+}
+
+// read the whole directory a buffer full of entries at a time instead of
+// one readdir call per entry, sort it, and build all the page but the title
+std::shared_ptr<const dirCache::rendered>
+dirCache::render(const std::string& directory)
+{
+    std::vector<dir_entry> entries;
+    std::vector<char> buf(DIRENT_BUF_SIZ);
+    int dirfd;
+    long nread;
+
+    if((dirfd=open(directory.c_str(),O_RDONLY|O_DIRECTORY|O_CLOEXEC))==-1){
+	return std::shared_ptr<const rendered>();
+    }
+    while((nread=syscall(SYS_getdents64,dirfd,&buf[0],buf.size()))>0){
+	for(long pos=0;pos<nread;){
+	    linux_dirent64 *d=reinterpret_cast<linux_dirent64*>(&buf[pos]);
+	    dir_entry e;
+	    e.name=d->d_name;
+	    e.isdir=(d->d_type==DT_DIR);
+	    e.statted=false;
+	    e.size=0;
+	    e.mtime=0;
+	    entries.push_back(e);
+	    pos+=d->d_reclen;
+	}
+    }
+    std::sort(entries.begin(),entries.end());
+
+    if(withstat){
+	size_t nthreads=entries.size()/STAT_PER_THREAD;
+	if(nthreads>MAX_STAT_THREADS){
+	    nthreads=MAX_STAT_THREADS;
+	}
+	std::vector<stat_work> work(nthreads+1);
+	std::vector<pthread_t> tids(nthreads);
+	size_t per=entries.size()/(nthreads+1);
+	for(size_t ctr=0;ctr<=nthreads;ctr++){
+	    work[ctr].dirfd=dirfd;
+	    work[ctr].first=entries.begin()+ctr*per;
+	    work[ctr].last=(ctr==nthreads)?entries.end():entries.begin()+(ctr+1)*per;
+	}
+	// we do the last slice ourselves while the others do theirs
+	for(size_t ctr=0;ctr<nthreads;ctr++){
+	    if(pthread_create(&tids[ctr],NULL,stat_entries,&work[ctr])!=0){
+		stat_entries(&work[ctr]);
+		tids[ctr]=pthread_self();
+	    }
+	}
+	stat_entries(&work[nthreads]);
+	for(size_t ctr=0;ctr<nthreads;ctr++){
+	    if(!pthread_equal(tids[ctr],pthread_self())){
+		pthread_join(tids[ctr],NULL);
+	    }
+	}
+    }
+    close(dirfd);
+
+    rendered *page=new rendered;
+    page->head=
+	"<html>\n"
+	"  <head>\n"
+	"    <style>\n"
+	"      pre {\n"
+	"        border: solid 1px;\n"
+	"        background-color: rgb(270,260,200);\n"
+	"        width: auto;\n"
+	"      }\n"
+	"    </style>\n"
+	"  </head>\n"
+	"  <body>\n"
+	"    <h1>";
+    std::string& body=page->rest;
+    body="</h1>\n"
+	"    <pre>\n";
+    for(std::vector<dir_entry>::iterator i=entries.begin();i!=entries.end();i++){
+	std::string name=html_escape(i->name)+(i->isdir?"/":"");
+	body+="<a href=\""+href_for(i->name+(i->isdir?"/":""))+"\">"+name+"</a>";
+	if(i->statted){
+	    char line[64];
+	    char date[24];
+	    struct tm thetm;
+	    gmtime_r(&i->mtime,&thetm);
+	    strftime(date,sizeof date,"%Y-%m-%d %H:%M",&thetm);
+	    if(name.size()<40){
+		body+=std::string(40-name.size(),' ');
+	    }
+	    snprintf(line,sizeof line," %14llu  %s",i->size,date);
+	    body+=line;
+	}
+	body+='\n';
+    }
+    body+=
+	"    </pre>\n"
+	"  </body>\n"
+	"</html>\n";
+
+    return std::shared_ptr<const rendered>(page);
+}
+
+bool
+dirCache::send(sockfdwrapper& sfd,const std::string& directory,const std::string& path)
+{
+    struct stat sb;
+    std::shared_ptr<const rendered> page;
+
+    if(stat(directory.c_str(),&sb)==-1){
+	return false;
+    }
+    pthread_mutex_lock(&lock);
+    std::map<std::string,listing>::iterator i=listings.find(directory);
+    if(i!=listings.end() && i->second.ino==sb.st_ino
+	    && i->second.mtime.tv_sec==sb.st_mtim.tv_sec
+	    && i->second.mtime.tv_nsec==sb.st_mtim.tv_nsec){
+	page=i->second.page;
+	lru.splice(lru.begin(),lru,i->second.used);
+    }
+    pthread_mutex_unlock(&lock);
+
+    if(!page){
+	// We use the mtime from before we read it, so if it changes while
+	// we're reading, the next request sees a different mtime and rereads.
+	if(!(page=render(directory))){
+	    return false;
+	}
+	pthread_mutex_lock(&lock);
+	if((i=listings.find(directory))==listings.end()){
+	    if(listings.size()>=maxentries){
+		listings.erase(lru.back());
+		lru.pop_back();
+	    }
+	    lru.push_front(directory);
+	    i=listings.insert(std::make_pair(directory,listing())).first;
+	}else{
+	    lru.splice(lru.begin(),lru,i->second.used);
+	}
+	listing& l=i->second;
+	l.mtime=sb.st_mtim;
+	l.ino=sb.st_ino;
+	l.page=page;
+	l.used=lru.begin();
+	pthread_mutex_unlock(&lock);
+    }
+    std::string title=html_escape(path);
+    std::stringstream ss;
+    ss << "HTTP/1.1 200 OK\r\n"
+	"Set-Cookie: server=patrick0.7\r\n"
+	"Content-Type: text/html\r\n"
+	"Content-Length: " << page->head.size()+title.size()+page->rest.size() << "\r\n"
+	<< sfd.framed_response() << "\r\n"
+	<< page->head << title << page->rest;
+    sfd << ss.str();
+    return true;
+}
+
+bool
+dirCache::cached(const std::string& directory)
+{
+    pthread_mutex_lock(&lock);
+    bool there=listings.find(directory)!=listings.end();
+    pthread_mutex_unlock(&lock);
+    return there;
+}
+
+size_t
+dirCache::size()
+{
+    pthread_mutex_lock(&lock);
+    size_t n=listings.size();
+    pthread_mutex_unlock(&lock);
+    return n;
+}
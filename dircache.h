@@ -0,0 +1,58 @@
+// copyright Patrick Horgan
+// source is open, feel free to use it as you wish with no restrictions
+// except that this copyright notice must be preserved intact
+#ifndef dircache_guard
+#define dircache_guard
+#include <list>
+#include <map>
+#include <string>
+#include <memory>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "sockfdwrapper.h"
+
+// Keeps rendered HTTP responses for directory listings, keyed by the
+// directory alone, so a query string or another route to the same place
+// doesn't render it again.  The path it was asked for by goes in the title
+// as it's sent.  An entry's good as long as the directory's mtime (which
+// changes whenever an entry is added, removed or renamed) hasn't moved, so
+// a hit costs one stat and one send.  When it's full the one used longest
+// ago goes.
+class dirCache
+{
+public:
+    // withstat gets sizes and dates for every entry with statx, fanned out
+    // over a few threads for big directories.  Without it only names.
+    dirCache(bool withstat=true,size_t maxentries=256);
+    ~dirCache();
+    // send the listing for directory, titled with the path it was asked
+    // for by, false if it couldn't be read
+    bool
+    send(sockfdwrapper& sfd,const std::string& directory,const std::string& path);
+    bool cached(const std::string& directory);
+    size_t size();
+private:
+    dirCache(const dirCache&);
+    const dirCache& operator=(const dirCache&);
+    // the html before and after the title
+    struct rendered
+    {
+	std::string head;
+	std::string rest;
+    };
+    struct listing
+    {
+	struct timespec mtime;
+	ino_t ino;
+	std::shared_ptr<const rendered> page;
+	std::list<std::string>::iterator used;	// where it is in lru
+    };
+    std::shared_ptr<const rendered>
+    render(const std::string& directory);
+    bool withstat;
+    size_t maxentries;
+    std::map<std::string,listing> listings;
+    std::list<std::string> lru;	    // directories, last used first
+    pthread_mutex_t lock;
+};
+#endif
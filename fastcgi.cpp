@@ -0,0 +1,528 @@
+// copyright Patrick Horgan
+// source is open, feel free to use it as you wish with no restrictions
+// except that this copyright notice must be preserved intact
+#include "fastcgi.h"
+#include "cgienv.h"
+#include <cerrno>
+#include <csignal>
+#include <ctime>
+#include <cstdio>
+#include <spawn.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char **environ;
+
+// how often the health checker wakes up, and how many failed probes in a
+// row before we decide a live process is wedged and kill it
+const unsigned int FCGI_CHECK_SECS=5;
+const size_t FCGI_MAX_FAILURES=3;
+// how long we'll wait on an application for one read or write
+const time_t FCGI_IO_TIMEOUT=30;
+
+// outcome of one attempt at a request on one connection
+enum fcgi_outcome { fcgi_done, fcgi_retry, fcgi_broken };
+
+// a FastCGI record is an 8 byte header then up to 64k of content.  We
+// never pad since the spec only recommends it.
+static void
+fcgi_record(std::string& out,unsigned char type,const char *data,size_t len)
+{
+    do{
+	size_t clen=len>0xffff?0xffff:len;
+	char hdr[8]={ static_cast<char>(FCGI_VERSION_1),static_cast<char>(type),
+	    0,1,	// we only ever have request id 1 on a connection
+	    static_cast<char>((clen>>8)&0xff),static_cast<char>(clen&0xff),0,0};
+	out.append(hdr,8);
+	out.append(data,clen);
+	data+=clen;
+	len-=clen;
+    }while(len);
+}
+
+// lengths under 128 take one byte, the rest four with the high bit set
+static void
+fcgi_length(std::string& out,size_t len)
+{
+    if(len<128){
+	out+=static_cast<char>(len);
+    }else{
+	out+=static_cast<char>(((len>>24)&0x7f)|0x80);
+	out+=static_cast<char>((len>>16)&0xff);
+	out+=static_cast<char>((len>>8)&0xff);
+	out+=static_cast<char>(len&0xff);
+    }
+}
+
+static bool
+sendfull(int fd,const char *buf,size_t len)
+{
+    while(len){
+	ssize_t retval=send(fd,buf,len,MSG_NOSIGNAL);
+	if(retval==-1){
+	    if(errno==EINTR){
+		continue;
+	    }
+	    return false;
+	}
+	buf+=retval;
+	len-=retval;
+    }
+    return true;
+}
+
+static bool
+recvfull(int fd,char *buf,size_t len)
+{
+    while(len){
+	ssize_t retval=recv(fd,buf,len,0);
+	if(retval==-1 && errno==EINTR){
+	    continue;
+	}
+	if(retval<=0){
+	    return false;
+	}
+	buf+=retval;
+	len-=retval;
+    }
+    return true;
+}
+
+// when a wait that starts now should give up
+static struct timespec
+deadline(time_t secs)
+{
+    struct timespec when;
+    clock_gettime(CLOCK_REALTIME,&when);
+    when.tv_sec+=secs;
+    return when;
+}
+
+void *
+fcgi_health(void *voidpool)
+{
+    fcgiPool *pool=static_cast<fcgiPool*>(voidpool);
+    pthread_mutex_lock(&pool->lock);
+    while(pool->running){
+	struct timespec when=deadline(FCGI_CHECK_SECS);
+	pthread_cond_timedwait(&pool->wake,&pool->lock,&when);
+	if(!pool->running){
+	    break;
+	}
+	pthread_mutex_unlock(&pool->lock);
+	pool->health_check();
+	pthread_mutex_lock(&pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+fcgiPool::fcgiPool(const std::string& prefix,const std::string& command,size_t nprocs):
+    prefix(prefix),command(command),next(0),running(true)
+{
+    static int seq=0;
+    pthread_mutex_init(&lock,NULL);
+    pthread_cond_init(&freed,NULL);
+    pthread_cond_init(&wake,NULL);
+    backends.resize(nprocs);
+    for(size_t ctr=0;ctr<nprocs;ctr++){
+	std::stringstream ss;
+	ss << "/tmp/httpserver." << getpid() << '.' << seq++ << ".sock";
+	backends[ctr].pid=-1;
+	backends[ctr].sockpath=ss.str();
+	backends[ctr].conn=-1;
+	backends[ctr].busy=false;
+	backends[ctr].failures=0;
+	if(!spawn(backends[ctr])){
+	    std::cerr << "fcgiPool couldn't start " << command << '\n';
+	}
+    }
+    pthread_create(&checker,NULL,fcgi_health,this);
+}
+
+fcgiPool::~fcgiPool()
+{
+    // the checker finishes whatever check it's in and sees running
+    pthread_mutex_lock(&lock);
+    running=false;
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&lock);
+    pthread_join(checker,NULL);
+    for(size_t ctr=0;ctr<backends.size();ctr++){
+	backend& be=backends[ctr];
+	if(be.conn!=-1){
+	    close(be.conn);
+	}
+	if(be.pid>0){
+	    kill(be.pid,SIGTERM);
+	    waitpid(be.pid,NULL,0);
+	}
+	unlink(be.sockpath.c_str());
+    }
+    pthread_cond_destroy(&wake);
+    pthread_cond_destroy(&freed);
+    pthread_mutex_destroy(&lock);
+}
+
+// make the listening socket, then start the application with it as fd 0.
+// posix_spawn lets the kernel skip copying our page tables, which matters
+// since by the time we respawn we're a big threaded process.
+bool
+fcgiPool::spawn(backend& be)
+{
+    struct sockaddr_un addr;
+    int lfd;
+    pid_t pid;
+
+    if((lfd=socket(AF_UNIX,SOCK_STREAM|SOCK_CLOEXEC,0))==-1){
+	return false;
+    }
+    bzero(&addr,sizeof(addr));
+    addr.sun_family=AF_UNIX;
+    strncpy(addr.sun_path,be.sockpath.c_str(),sizeof(addr.sun_path)-1);
+    unlink(be.sockpath.c_str());
+    if(bind(lfd,reinterpret_cast<struct sockaddr*>(&addr),sizeof(addr))==-1
+	    || listen(lfd,SOMAXCONN)==-1){
+	std::cerr << "fcgiPool::spawn() - " << be.sockpath << ": " << strerror(errno) << '\n';
+	close(lfd);
+	return false;
+    }
+    std::string shellcmd="exec "+command;
+    char *argv[]={ const_cast<char*>("/bin/sh"),const_cast<char*>("-c"),
+	const_cast<char*>(shellcmd.c_str()),0 };
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions,lfd,0);
+    int retval=posix_spawn(&pid,"/bin/sh",&actions,NULL,argv,environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(lfd);
+    if(retval!=0){
+	std::cerr << "fcgiPool::spawn() - " << command << ": " << strerror(retval) << '\n';
+	return false;
+    }
+    be.pid=pid;
+    be.failures=0;
+    return true;
+}
+
+int
+fcgiPool::connect_to(const backend& be)
+{
+    struct sockaddr_un addr;
+    struct timeval tv={ FCGI_IO_TIMEOUT,0 };
+    int fd;
+
+    if((fd=socket(AF_UNIX,SOCK_STREAM|SOCK_CLOEXEC,0))==-1){
+	return -1;
+    }
+    bzero(&addr,sizeof(addr));
+    addr.sun_family=AF_UNIX;
+    strncpy(addr.sun_path,be.sockpath.c_str(),sizeof(addr.sun_path)-1);
+    if(connect(fd,reinterpret_cast<struct sockaddr*>(&addr),sizeof(addr))==-1){
+	close(fd);
+	return -1;
+    }
+    setsockopt(fd,SOL_SOCKET,SO_RCVTIMEO,&tv,sizeof(tv));
+    setsockopt(fd,SOL_SOCKET,SO_SNDTIMEO,&tv,sizeof(tv));
+    return fd;
+}
+
+// Take backend which's connection, or a new one if it doesn't have one
+// yet.  Called with lock held and the backend not busy.  reused tells the
+// caller whether the connection might have gone stale.
+int
+fcgiPool::checkout_one(size_t which,bool& reused)
+{
+    backend& be=backends[which];
+    int fd=be.conn;
+    be.busy=true;
+    be.conn=-1;
+    reused=fd!=-1;
+    if(fd==-1){
+	pthread_mutex_unlock(&lock);
+	fd=connect_to(be);
+	pthread_mutex_lock(&lock);
+	if(fd==-1){
+	    be.busy=false;
+	    pthread_cond_broadcast(&freed);
+	}
+    }
+    return fd;
+}
+
+// Wait for a live application that isn't doing anything, taking turns so
+// they all get used, and hand back its connection.  Gives up after
+// FCGI_IO_TIMEOUT, or right away if none are running.
+int
+fcgiPool::checkout(size_t& which,bool& reused)
+{
+    struct timespec when=deadline(FCGI_IO_TIMEOUT);
+    pthread_mutex_lock(&lock);
+    while(1){
+	bool any=false;
+	which=backends.size();
+	for(size_t ctr=0;ctr<backends.size();ctr++){
+	    size_t idx=(next+ctr)%backends.size();
+	    if(backends[idx].pid>0){
+		any=true;
+		if(!backends[idx].busy){
+		    which=idx;
+		    break;
+		}
+	    }
+	}
+	if(which!=backends.size()){
+	    break;
+	}
+	if(!any || pthread_cond_timedwait(&freed,&lock,&when)==ETIMEDOUT){
+	    pthread_mutex_unlock(&lock);
+	    return -1;
+	}
+    }
+    next=which+1;
+    int fd=checkout_one(which,reused);
+    pthread_mutex_unlock(&lock);
+    return fd;
+}
+
+void
+fcgiPool::checkin(size_t which,int fd,bool reusable)
+{
+    pthread_mutex_lock(&lock);
+    backend& be=backends[which];
+    be.busy=false;
+    if(fd!=-1){
+	if(reusable && be.pid>0){
+	    be.conn=fd;
+	}else{
+	    close(fd);
+	}
+    }
+    pthread_cond_broadcast(&freed);
+    pthread_mutex_unlock(&lock);
+}
+
+// Send the request down fd and relay the response.  If things go wrong
+// before the application said anything we can try again elsewhere.  If
+// it goes away after we've sent the client some of its answer, it's too
+// late for a 500, so their connection's shut down and we say we're done.
+bool
+fcgiPool::one_try(sockfdwrapper& sfd,int fd,const std::string& request,
+	request_body *body,bool http11,bool& reusable)
+{
+    std::vector<char> buf(0xffff+0xff);
+    std::string head;
+    bool headdone=false,chunked=false,heard=false;
+    unsigned char hdr[8];
+
+    reusable=false;
+    if(!sendfull(fd,request.data(),request.size())){
+	return false;
+    }
+    // the body goes as FCGI_STDIN records, a piece at a time from wherever
+    // request_body spilled it, then the empty record that ends stdin
+    if(body){
+	size_t got;
+	off_t offset=0;
+	std::string record;
+	while((got=body->copy_out(&buf[0],0xffff,offset))>0){
+	    record.clear();
+	    fcgi_record(record,FCGI_STDIN,&buf[0],got);
+	    if(!sendfull(fd,record.data(),record.size())){
+		return false;
+	    }
+	    offset+=got;
+	}
+    }
+    std::string endstdin;
+    fcgi_record(endstdin,FCGI_STDIN,0,0);
+    if(!sendfull(fd,endstdin.data(),endstdin.size())){
+	return false;
+    }
+    while(1){
+	bool whole=recvfull(fd,reinterpret_cast<char*>(hdr),8);
+	if(!whole && !heard){
+	    return false;
+	}
+	heard=true;
+	size_t clen=(hdr[4]<<8)|hdr[5];
+	if(!whole || !recvfull(fd,&buf[0],clen+hdr[6])){
+	    if(!headdone){
+		throw fcgi_backend_unavailable();
+	    }
+	    // they've been promised more than they're going to get, and
+	    // closing is the only way left to tell them
+	    std::cerr << "fastcgi " << prefix << ": application went away partway through a response\n";
+	    shutdown(sfd.get_fd(),SHUT_RDWR);
+	    return true;
+	}
+	switch(hdr[1]){
+	    case FCGI_STDOUT:
+		if(clen==0){
+		    break;	    // end of the stdout stream
+		}
+		if(headdone){
+		    cgi_send_body(sfd,&buf[0],clen,chunked);
+		    break;
+		}
+		head.append(&buf[0],clen);
+		{
+		    size_t bodystart=cgi_header_end(head.data(),head.size());
+		    if(bodystart!=std::string::npos){
+			sfd << cgi_to_http_head(head.data(),bodystart,http11,chunked);
+			headdone=true;
+			if(head.size()>bodystart){
+			    cgi_send_body(sfd,head.data()+bodystart,
+				    head.size()-bodystart,chunked);
+			}
+			head.clear();
+		    }
+		}
+		break;
+	    case FCGI_STDERR:
+		std::cerr << "fastcgi " << prefix << ": " << std::string(&buf[0],clen);
+		break;
+	    case FCGI_END_REQUEST:
+		if(!headdone){
+		    // it ended without a blank line, so it's all headers
+		    sfd << cgi_to_http_head(head.data(),head.size(),http11,chunked);
+		}
+		if(chunked){
+		    cgi_send_body(sfd,0,0,true);
+		}
+		reusable=true;
+		return true;
+	    default:
+		// nothing else is supposed to come to a responder
+		break;
+	}
+    }
+}
+
+void
+fcgiPool::run(sockfdwrapper& sfd,const std::map<std::string,std::string>& params,
+	bool http11,request_body *body)
+{
+    std::string request;
+    std::string pairs;
+    const char begin[8]={ 0,FCGI_RESPONDER,FCGI_KEEP_CONN,0,0,0,0,0 };
+
+    fcgi_record(request,FCGI_BEGIN_REQUEST,begin,8);
+    for(std::map<std::string,std::string>::const_iterator i=params.begin();i!=params.end();i++){
+	fcgi_length(pairs,i->first.size());
+	fcgi_length(pairs,i->second.size());
+	pairs+=i->first;
+	pairs+=i->second;
+    }
+    fcgi_record(request,FCGI_PARAMS,pairs.data(),pairs.size());
+    fcgi_record(request,FCGI_PARAMS,0,0);
+
+    // A stale persistent connection (the application restarted under us)
+    // fails before we hear anything, so it's always safe to try once more.
+    for(int tries=0;tries<2;tries++){
+	size_t which;
+	bool reused,reusable;
+	int fd;
+	if((fd=checkout(which,reused))==-1){
+	    break;
+	}
+	try{
+	    if(one_try(sfd,fd,request,body,http11,reusable)){
+		checkin(which,fd,reusable);
+		return;
+	    }
+	}catch(...){
+	    checkin(which,fd,false);
+	    throw;
+	}
+	checkin(which,fd,false);
+	if(!reused){
+	    break;
+	}
+    }
+    throw fcgi_backend_unavailable();
+}
+
+// Ask for FCGI_MPXS_CONNS on the application's own connection, since it
+// may never get around to accepting another.  Anything that answers with
+// a record is alive, even an FCGI_UNKNOWN_TYPE, and one that's in the
+// middle of a request is taken to be alive too.  If it's wedged there
+// the request times out and drops the connection, and then we'll see.
+bool
+fcgiPool::probe(size_t which)
+{
+    std::string request,pairs;
+    struct timeval tv={ 2,0 },iotv={ FCGI_IO_TIMEOUT,0 };
+    unsigned char hdr[8];
+    char content[0xffff+0xff];
+    bool reused;
+    int fd;
+
+    pthread_mutex_lock(&lock);
+    if(backends[which].busy){
+	pthread_mutex_unlock(&lock);
+	return true;
+    }
+    fd=checkout_one(which,reused);
+    pthread_mutex_unlock(&lock);
+    if(fd==-1){
+	return false;
+    }
+    setsockopt(fd,SOL_SOCKET,SO_RCVTIMEO,&tv,sizeof(tv));
+    fcgi_length(pairs,15);
+    fcgi_length(pairs,0);
+    pairs+="FCGI_MPXS_CONNS";
+    fcgi_record(request,FCGI_GET_VALUES,pairs.data(),pairs.size());
+    request[2]=request[3]=0;	// management records use request id 0
+    // read the whole record, so the connection's ready for a request
+    bool alive=sendfull(fd,request.data(),request.size())
+	&& recvfull(fd,reinterpret_cast<char*>(hdr),8)
+	&& recvfull(fd,content,((hdr[4]<<8)|hdr[5])+hdr[6]);
+    setsockopt(fd,SOL_SOCKET,SO_RCVTIMEO,&iotv,sizeof(iotv));
+    checkin(which,fd,alive);
+    return alive;
+}
+
+void
+fcgiPool::health_check()
+{
+    for(size_t ctr=0;ctr<backends.size();ctr++){
+	pthread_mutex_lock(&lock);
+	backend& be=backends[ctr];
+	bool dead=false;
+	if(be.pid<=0 || waitpid(be.pid,NULL,WNOHANG)==be.pid){
+	    dead=true;
+	}
+	pthread_mutex_unlock(&lock);
+	bool alive=!dead && probe(ctr);
+	pthread_mutex_lock(&lock);
+	if(!dead && !alive){
+	    if(++be.failures>=FCGI_MAX_FAILURES){
+		std::cerr << "fcgiPool: " << command << " (" << be.pid << ") isn't answering, killing it\n";
+		kill(be.pid,SIGKILL);
+		waitpid(be.pid,NULL,0);
+		dead=true;
+	    }
+	}else if(!dead){
+	    be.failures=0;
+	}
+	if(dead){
+	    // its connection goes to the old process, so drop it.  One a
+	    // request has now is dropped when it's checked in.
+	    if(be.conn!=-1){
+		close(be.conn);
+		be.conn=-1;
+	    }
+	    be.pid=-1;
+	    if(running){
+		std::cerr << "fcgiPool: restarting " << command << '\n';
+		spawn(be);
+	    }
+	    pthread_cond_broadcast(&freed);
+	}
+	pthread_mutex_unlock(&lock);
+    }
+}
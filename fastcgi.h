@@ -0,0 +1,98 @@
+// copyright Patrick Horgan
+// source is open, feel free to use it as you wish with no restrictions
+// except that this copyright notice must be preserved intact
+#ifndef fastcgi_guard
+#define fastcgi_guard
+#include <map>
+#include <string>
+#include <vector>
+#include <exception>
+#include <pthread.h>
+#include <sys/types.h>
+#include "requestbody.h"
+#include "sockfdwrapper.h"
+
+// FastCGI record types and friends from the FastCGI 1.0 spec
+const unsigned char FCGI_VERSION_1=1;
+const unsigned char FCGI_BEGIN_REQUEST=1;
+const unsigned char FCGI_ABORT_REQUEST=2;
+const unsigned char FCGI_END_REQUEST=3;
+const unsigned char FCGI_PARAMS=4;
+const unsigned char FCGI_STDIN=5;
+const unsigned char FCGI_STDOUT=6;
+const unsigned char FCGI_STDERR=7;
+const unsigned char FCGI_GET_VALUES=9;
+const unsigned char FCGI_GET_VALUES_RESULT=10;
+const unsigned char FCGI_RESPONDER=1;
+const unsigned char FCGI_KEEP_CONN=1;
+
+class
+fcgi_backend_unavailable: public std::exception
+{
+public:
+    fcgi_backend_unavailable(){};
+    virtual ~fcgi_backend_unavailable() throw() {};
+    virtual const char* what() const throw()
+    {
+	return "no FastCGI application could take the request";
+    };
+};
+
+class fcgiPool
+{
+public:
+    // Every request whose path starts with prefix goes to one of nprocs
+    // copies of command.  We start them all here, each listening on its own
+    // unix socket passed in as fd 0 the way FastCGI applications expect.
+    // Most applications serve one connection at a time, so each copy gets
+    // exactly one of ours, and a request waits for a copy that's free.
+    friend void* fcgi_health(void *);
+    fcgiPool(const std::string& prefix,const std::string& command,size_t nprocs);
+    ~fcgiPool();
+    bool
+    handles(const std::string& path) const
+	{ return path.compare(0,prefix.size(),prefix)==0; };
+    const std::string& get_prefix() const { return prefix; };
+    // run one request with the CGI environment in params and stream the
+    // response to sfd.  Throws fcgi_backend_unavailable if nothing was
+    // sent to the client and no application would answer.  If the
+    // application goes away partway through the response, the client's
+    // connection is shut down so they know it's cut short.  If there's a
+    // body it has to have been spill()ed, since a retry sends it again.
+    void
+    run(sockfdwrapper& sfd,const std::map<std::string,std::string>& params,
+	    bool http11,request_body *body=0);
+    // reap and respawn applications that died, probe the live ones
+    void
+    health_check();
+private:
+    fcgiPool();
+    fcgiPool(const fcgiPool&);
+    const fcgiPool& operator=(const fcgiPool&);
+    struct backend
+    {
+	pid_t pid;
+	std::string sockpath;
+	int conn;		    // our persistent connection, -1 till we
+				    // need one
+	bool busy;		    // a request or a probe has conn
+	size_t failures;	    // failed probes in a row
+    };
+    bool spawn(backend&);
+    int connect_to(const backend&);
+    int checkout(size_t&,bool&);
+    int checkout_one(size_t,bool&);
+    void checkin(size_t,int,bool);
+    bool probe(size_t);
+    bool one_try(sockfdwrapper&,int,const std::string&,request_body*,bool,bool&);
+    std::string prefix;
+    std::string command;
+    std::vector<backend> backends;
+    size_t next;		    // where looking for a free one starts
+    pthread_mutex_t lock;	    // backends, next and running
+    pthread_cond_t freed;	    // a backend's free, or changed
+    pthread_cond_t wake;	    // the checker should look at running
+    pthread_t checker;
+    bool running;
+};
+#endif
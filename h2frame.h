@@ -0,0 +1,113 @@
+// copyright Patrick Horgan
+// source is open, feel free to use it as you wish with no restrictions
+// except that this copyright notice must be preserved intact
+#ifndef h2frame_guard
+#define h2frame_guard
+#include <string>
+#include <stdint.h>
+
+// HTTP/2's framing, RFC 7540 section 4 and the numbers that go in the
+// frames.  Every frame starts with the same 9 bytes, a 24 bit length, a
+// type, flags, and a 31 bit stream id.  The server and replay both use
+// these.
+
+const uint8_t H2_DATA=0;
+const uint8_t H2_HEADERS=1;
+const uint8_t H2_PRIORITY=2;
+const uint8_t H2_RST_STREAM=3;
+const uint8_t H2_SETTINGS=4;
+const uint8_t H2_PUSH_PROMISE=5;
+const uint8_t H2_PING=6;
+const uint8_t H2_GOAWAY=7;
+const uint8_t H2_WINDOW_UPDATE=8;
+const uint8_t H2_CONTINUATION=9;
+
+const uint8_t H2_END_STREAM=0x1;
+const uint8_t H2_ACK=0x1;	    // on SETTINGS and PING
+const uint8_t H2_END_HEADERS=0x4;
+const uint8_t H2_PADDED=0x8;
+const uint8_t H2_PRIORITY_FLAG=0x20;
+
+const uint32_t H2_NO_ERROR=0x0;
+const uint32_t H2_PROTOCOL_ERROR=0x1;
+const uint32_t H2_INTERNAL_ERROR=0x2;
+const uint32_t H2_FLOW_CONTROL_ERROR=0x3;
+const uint32_t H2_STREAM_CLOSED=0x5;
+const uint32_t H2_FRAME_SIZE_ERROR=0x6;
+const uint32_t H2_REFUSED_STREAM=0x7;
+const uint32_t H2_CANCEL=0x8;
+const uint32_t H2_COMPRESSION_ERROR=0x9;
+const uint32_t H2_ENHANCE_YOUR_CALM=0xb;
+
+const uint16_t H2_SETTINGS_HEADER_TABLE_SIZE=0x1;
+const uint16_t H2_SETTINGS_ENABLE_PUSH=0x2;
+const uint16_t H2_SETTINGS_MAX_CONCURRENT_STREAMS=0x3;
+const uint16_t H2_SETTINGS_INITIAL_WINDOW_SIZE=0x4;
+const uint16_t H2_SETTINGS_MAX_FRAME_SIZE=0x5;
+const uint16_t H2_SETTINGS_MAX_HEADER_LIST_SIZE=0x6;
+
+const uint32_t H2_DEFAULT_WINDOW=65535;
+const uint32_t H2_MAX_WINDOW=0x7fffffff;
+const uint32_t H2_DEFAULT_FRAME_SIZE=16384;
+const uint32_t H2_MAX_FRAME_SIZE=0xffffff;
+
+// what a client says first, before any frame
+const char H2_PREFACE[]="PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+const size_t H2_PREFACE_LEN=sizeof H2_PREFACE-1;
+const size_t H2_FRAME_HEADER_LEN=9;
+
+struct h2_frame_header
+{
+    uint32_t length;
+    uint8_t type;
+    uint8_t flags;
+    uint32_t stream;
+};
+
+inline uint32_t
+h2_get32(const uint8_t *p)
+{
+    return static_cast<uint32_t>(p[0])<<24|p[1]<<16|p[2]<<8|p[3];
+}
+
+inline void
+h2_put32(std::string& out,uint32_t value)
+{
+    out+=static_cast<char>(value>>24);
+    out+=static_cast<char>(value>>16);
+    out+=static_cast<char>(value>>8);
+    out+=static_cast<char>(value);
+}
+
+// p has to have H2_FRAME_HEADER_LEN bytes
+inline h2_frame_header
+h2_parse_frame_header(const uint8_t *p)
+{
+    h2_frame_header fh;
+    fh.length=p[0]<<16|p[1]<<8|p[2];
+    fh.type=p[3];
+    fh.flags=p[4];
+    fh.stream=h2_get32(p+5)&0x7fffffff;
+    return fh;
+}
+
+// a frame header onto the end of out, the payload's up to the caller
+inline void
+h2_put_frame_header(std::string& out,uint32_t length,uint8_t type,uint8_t flags,uint32_t stream)
+{
+    out+=static_cast<char>(length>>16);
+    out+=static_cast<char>(length>>8);
+    out+=static_cast<char>(length);
+    out+=static_cast<char>(type);
+    out+=static_cast<char>(flags);
+    h2_put32(out,stream&0x7fffffff);
+}
+
+inline void
+h2_put_setting(std::string& out,uint16_t id,uint32_t value)
+{
+    out+=static_cast<char>(id>>8);
+    out+=static_cast<char>(id);
+    h2_put32(out,value);
+}
+#endif
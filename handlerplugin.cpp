@@ -0,0 +1,407 @@
+// copyright Patrick Horgan
+// source is open, feel free to use it as you wish with no restrictions
+// except that this copyright notice must be preserved intact
+#include "handlerplugin.h"
+#include "cgienv.h"
+#include "ssi.h"
+#include "trace.h"
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <dlfcn.h>
+#include <poll.h>
+
+handlerPlugin::handlerPlugin(const std::string& file,const std::string& arg)
+    :handle(0),plugin(0)
+{
+    // RTLD_LOCAL so two plugins can have functions with the same names
+    if((handle=dlopen(file.c_str(),RTLD_NOW|RTLD_LOCAL))==0){
+	throw plugin_load_fail(dlerror());
+    }
+    plugin=static_cast<const hs_plugin*>(dlsym(handle,HS_PLUGIN_SYMBOL));
+    if(plugin==0 || plugin->handle==0){
+	dlclose(handle);
+	throw plugin_load_fail(file+" has no "+HS_PLUGIN_SYMBOL+" with a handle() in it");
+    }
+    if(plugin->abi!=HS_PLUGIN_ABI){
+	std::ostringstream why;
+	why << file << " was built for plugin ABI " << plugin->abi
+	    << " and this is " << HS_PLUGIN_ABI;
+	dlclose(handle);
+	throw plugin_load_fail(why.str());
+    }
+    if(plugin->init && plugin->init(arg.empty()?0:arg.c_str())!=0){
+	dlclose(handle);
+	throw plugin_load_fail(file+"'s init() failed");
+    }
+}
+
+handlerPlugin::~handlerPlugin()
+{
+    if(plugin->fini){
+	plugin->fini();
+    }
+    dlclose(handle);
+}
+
+// Everything about one call of a plugin, where hs_request's and
+// hs_response's server pointers point.  The callbacks can't let an
+// exception out, the plugin's C frames are in the way, so they remember
+// what went wrong and run() throws it once handle()'s back.
+struct plugin_call
+{
+    plugin_call(sockfdwrapper& sfd,http_request_line& hrl,header_map& hdrs,
+	    request_body& body)
+	:sfd(sfd),hrl(hrl),hdrs(hdrs),body(body),have_env(false),code(200),
+	reason("OK"),no_body(false),has_length(false),length(0),written(0),
+	started(false),
+	failed(false),body_bad(false),body_too_large(false),body_why(0),chunks(sfd),
+	wait_fd(-1),wait_events(0),wait_ms(0){};
+    sockfdwrapper& sfd;
+    http_request_line& hrl;
+    header_map& hdrs;
+    request_body& body;
+    std::string query;
+    std::string script_name;
+    std::vector<hs_header> headers;
+    // the CGI variables, once someone asks
+    bool have_env;
+    cgi_env env;
+    std::vector<hs_header> vars;
+    // the response so far
+    int code;
+    std::string reason;
+    std::string head;	    // the plugin's header lines
+    bool no_body;	    // 1xx, 204 and 304 never have one
+    bool has_length;
+    unsigned long long length;	// what their Content-Length said
+    unsigned long long written;	// what they've written, sent or not
+    bool started;	    // the head's gone out
+    bool failed;	    // the client's gone
+    bool body_bad;
+    bool body_too_large;
+    const char *body_why;
+    chunked_sink chunks;
+    std::string held;	    // the body, till the head goes out
+    int wait_fd;
+    short wait_events;
+    int wait_ms;
+};
+
+static hs_str
+view(const char *data,size_t len)
+{
+    hs_str s;
+    s.data=data;
+    s.len=len;
+    return s;
+}
+
+static plugin_call&
+call_of(const hs_request *req)
+{
+    return *static_cast<plugin_call*>(req->server);
+}
+
+static plugin_call&
+call_of(hs_response *resp)
+{
+    return *static_cast<plugin_call*>(resp->server);
+}
+
+static int
+plugin_var(const hs_request *req,size_t idx,hs_str *name,hs_str *value)
+{
+    plugin_call& call=call_of(req);
+    if(!call.have_env){
+	try{
+	    cgi_environment(call.env,call.sfd.get_fd(),call.hrl,call.hdrs,
+		    call.script_name,"");
+	}catch(const std::bad_alloc&){
+	    return 0;
+	}
+	for(cgi_env::iterator i=call.env.begin();i!=call.env.end();i++){
+	    hs_header var;
+	    var.name=view(i->first.data(),i->first.size());
+	    var.value=view(i->second.data(),i->second.size());
+	    call.vars.push_back(var);
+	}
+	call.have_env=true;
+    }
+    if(idx>=call.vars.size()){
+	return 0;
+    }
+    *name=call.vars[idx].name;
+    *value=call.vars[idx].value;
+    return 1;
+}
+
+static ssize_t
+plugin_read_body(const hs_request *req,void *buf,size_t len)
+{
+    plugin_call& call=call_of(req);
+    try{
+	return static_cast<ssize_t>(call.body.read(static_cast<char*>(buf),len));
+    }catch(const request_body_too_large&){
+	call.body_too_large=true;
+    }catch(const request_body_bad& rbb){
+	call.body_bad=true;
+	call.body_why=rbb.what();
+    }catch(const socket_insert_fail&){
+	call.failed=true;
+    }
+    return -1;
+}
+
+// Most answers are small, and we hold on to them till they're done so they
+// go out with a Content-Length in one send.  Otherwise the head and a
+// little chunk and the last-chunk would each be a send, and Nagle and the
+// client's delayed ack cost us 40ms a request.
+static const size_t HOLD_MAX=chunked_sink::CHUNK_SIZ;
+
+// send the head and whatever's held
+static void
+start_response(plugin_call& call)
+{
+    std::ostringstream head;
+    head << "HTTP/1.1 " << call.code << ' ' << call.reason << "\r\n"
+	<< call.head;
+    if(!call.has_length && !call.no_body){
+	head << "Transfer-Encoding: chunked\r\n";
+    }
+    head << call.sfd.framed_response() << "\r\n";
+    call.started=true;
+    if(call.has_length){
+	call.sfd << head.str()+call.held;
+    }else{
+	call.sfd << head.str();
+	call.chunks.write(reinterpret_cast<const uint8_t*>(call.held.data()),call.held.size());
+    }
+    call.held.clear();
+}
+
+static int
+plugin_status(hs_response *resp,int code,const char *reason)
+{
+    plugin_call& call=call_of(resp);
+    if(call.started || call.failed || code<100 || code>999 || reason==0
+	    || strpbrk(reason,"\r\n")){
+	return -1;
+    }
+    call.code=code;
+    call.reason=reason;
+    call.no_body=code<200 || code==204 || code==304;
+    return 0;
+}
+
+static int
+plugin_header(hs_response *resp,const char *name,const char *value)
+{
+    plugin_call& call=call_of(resp);
+    // no sneaking in a header of their own with a \r\n
+    if(call.started || call.failed || name==0 || value==0 || *name=='\0'
+	    || strpbrk(name,"\r\n: ") || strpbrk(value,"\r\n")){
+	return -1;
+    }
+    // we do the chunking, and a length has to be one plain number
+    if(strcasecmp(name,"Transfer-Encoding")==0){
+	return -1;
+    }
+    if(strcasecmp(name,"Content-Length")==0){
+	char *end;
+	if(call.has_length || !isdigit(static_cast<unsigned char>(*value))){
+	    return -1;
+	}
+	errno=0;
+	unsigned long long length=strtoull(value,&end,10);
+	if(*end || errno==ERANGE){
+	    return -1;
+	}
+	call.has_length=true;
+	call.length=length;
+	if(call.held.size()>length){
+	    call.held.resize(length);
+	}
+    }
+    call.head+=name;
+    call.head+=": ";
+    call.head+=value;
+    call.head+="\r\n";
+    return 0;
+}
+
+static int
+plugin_write(hs_response *resp,const void *data,size_t len)
+{
+    plugin_call& call=call_of(resp);
+    if(call.failed){
+	return -1;
+    }
+    if(len==0 || call.no_body){
+	return 0;
+    }
+    unsigned long long before=call.written;
+    call.written+=len;
+    if(call.has_length){
+	// past the length they gave would look like the next response
+	if(before>=call.length){
+	    return 0;
+	}
+	if(len>call.length-before){
+	    len=static_cast<size_t>(call.length-before);
+	}
+    }
+    try{
+	if(!call.started){
+	    call.held.append(static_cast<const char*>(data),len);
+	    // and 1.0 can't take chunks, so without a length we have to
+	    // count it all first
+	    if(call.held.size()>=HOLD_MAX
+		    && (call.hrl.is_http11() || call.has_length)){
+		start_response(call);
+	    }
+	}else if(call.has_length){
+	    call.sfd.sendall(static_cast<const char*>(data),len);
+	}else{
+	    call.chunks.write(static_cast<const uint8_t*>(data),len);
+	}
+    }catch(const socket_insert_fail&){
+	call.failed=true;
+	return -1;
+    }catch(const std::bad_alloc&){
+	call.failed=true;
+	return -1;
+    }
+    return 0;
+}
+
+static int
+plugin_wait(hs_response *resp,int fd,short events,int timeout_ms)
+{
+    plugin_call& call=call_of(resp);
+    if(call.failed || fd<0){
+	return -1;
+    }
+    call.wait_fd=fd;
+    call.wait_events=events;
+    call.wait_ms=timeout_ms;
+    return 0;
+}
+
+void
+handlerPlugin::run(sockfdwrapper& sfd,http_request_line& hrl,header_map& hdrs,
+	request_body& body,const std::string& prefix)
+{
+    trace_span span("plugin",hrl.get_path().c_str());
+    plugin_call call(sfd,hrl,hdrs,body);
+    const std::string& path=hrl.get_path();
+    call.query=hrl.get_query();
+    call.script_name=prefix.size()>1 && prefix[prefix.size()-1]=='/'?
+	prefix.substr(0,prefix.size()-1):prefix;
+    for(header_map::iterator i=hdrs.begin();i!=hdrs.end();i++){
+	if(i->first=="DOCUMENT_ROOT"){
+	    continue;	    // ours, not theirs
+	}
+	hs_header h;
+	h.name=view(i->first.data(),i->first.size());
+	h.value=view(i->second.data(),i->second.size());
+	call.headers.push_back(h);
+    }
+
+    hs_request req;
+    req.method=view(hrl.get_method().data(),hrl.get_method().size());
+    req.path=view(path.data(),path.size());
+    req.query=view(call.query.data(),call.query.size());
+    size_t past=call.script_name.size()<path.size()?call.script_name.size():path.size();
+    req.path_info=view(path.data()+past,path.size()-past);
+    req.http11=hrl.is_http11()?1:0;
+    req.nheaders=call.headers.size();
+    req.headers=call.headers.empty()?0:&call.headers[0];
+    req.var=plugin_var;
+    req.read_body=plugin_read_body;
+    req.server=&call;
+
+    hs_response resp;
+    resp.status=plugin_status;
+    resp.header=plugin_header;
+    resp.write=plugin_write;
+    resp.wait=plugin_wait;
+    resp.ready=0;
+    resp.state=0;
+    resp.server=&call;
+
+    int result;
+    while((result=plugin->handle(&req,&resp))==HS_SUSPEND){
+	if(call.wait_fd<0 || call.failed){
+	    result=HS_ERROR;
+	    break;
+	}
+	// Let them see what's done so far while it waits.  The worker just
+	// waits here, which the pool's sizing sees as a thread that isn't
+	// using its CPU, and adds threads for.
+	try{
+	    if(!call.started && !call.held.empty()
+		    && (call.hrl.is_http11() || call.has_length)){
+		start_response(call);
+	    }
+	    if(call.started && !call.has_length){
+		call.chunks.flush();
+	    }
+	}catch(const socket_insert_fail&){
+	    call.failed=true;
+	}
+	trace_span waiting("plugin wait");
+	struct pollfd pfd;
+	pfd.fd=call.wait_fd;
+	pfd.events=call.wait_events;
+	pfd.revents=0;
+	int n;
+	while((n=poll(&pfd,1,call.wait_ms))==-1 && errno==EINTR){
+	}
+	resp.ready=n>0?pfd.revents:0;
+	call.wait_fd=-1;
+    }
+    if(call.body_too_large && !call.started){
+	throw request_body_too_large();
+    }
+    if(call.body_bad && !call.started){
+	throw request_body_bad(call.body_why);
+    }
+    if(call.failed){
+	return;
+    }
+    if(result!=HS_DONE && !call.started){
+	throw plugin_handler_fail();
+    }
+    if(result!=HS_DONE){
+	// partway through, all we can do is not finish it, and then the
+	// client can only tell it's short if we hang up
+	sfd.set_keep_alive(false,hrl.is_http11());
+	return;
+    }
+    if(call.has_length && !call.no_body && call.written!=call.length){
+	// their Content-Length was wrong, and only hanging up afterwards
+	// tells the client where this one ends
+	std::cerr << hrl.get_path() << ": plugin said Content-Length "
+	    << call.length << " and wrote " << call.written << '\n';
+	sfd.set_keep_alive(false,hrl.is_http11());
+    }
+    if(!call.started){
+	// it's all here, so we know how long it is
+	if(!call.has_length && !call.no_body){
+	    std::ostringstream length;
+	    length << call.held.size();
+	    call.head+="Content-Length: "+length.str()+"\r\n";
+	    call.has_length=true;
+	}
+	start_response(call);
+	return;
+    }
+    if(!call.has_length && !call.no_body){
+	call.chunks.finish();
+    }
+}
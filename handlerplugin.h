@@ -0,0 +1,65 @@
+// copyright Patrick Horgan
+// source is open, feel free to use it as you wish with no restrictions
+// except that this copyright notice must be preserved intact
+#ifndef handlerplugin_guard
+#define handlerplugin_guard
+#include <string>
+#include <exception>
+#include "http.h"
+#include "plugin.h"
+#include "requestbody.h"
+#include "sockfdwrapper.h"
+
+class
+plugin_load_fail: public std::exception
+{
+public:
+    plugin_load_fail(const std::string& why):why(why){};
+    virtual ~plugin_load_fail() throw() {};
+    virtual const char* what() const throw()
+    {
+	return why.c_str();
+    };
+private:
+    std::string why;
+};
+
+class
+plugin_handler_fail: public std::exception
+{
+public:
+    plugin_handler_fail(){};
+    virtual ~plugin_handler_fail() throw() {};
+    virtual const char* what() const throw()
+    {
+	return "the plugin gave up before it sent anything";
+    };
+};
+
+// A handler plugin, a .so with an hs_plugin in it (see plugin.h), loaded
+// once and run right on the worker thread, so a request costs a function
+// call instead of the trip to a CGI or FastCGI process and back.
+class handlerPlugin
+{
+public:
+    // dlopen()s file and runs its init(arg).  Throws plugin_load_fail
+    // saying why if it isn't there, isn't a plugin, is for another ABI or
+    // its init() says no.
+    handlerPlugin(const std::string& file,const std::string& arg);
+    ~handlerPlugin();
+    // Answer one request.  prefix is the route's, what's past it is the
+    // plugin's PATH_INFO.  If the plugin fails before it sends anything
+    // this throws plugin_handler_fail, or what body threw if it read a
+    // bad one, so the caller can answer for it.
+    void
+    run(sockfdwrapper& sfd,http_request_line& hrl,header_map& hdrs,
+	    request_body& body,const std::string& prefix);
+    const char *name() const { return plugin->name; };
+private:
+    handlerPlugin();
+    handlerPlugin(const handlerPlugin&);
+    const handlerPlugin& operator=(const handlerPlugin&);
+    void *handle;
+    const hs_plugin *plugin;
+};
+#endif
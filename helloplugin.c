@@ -0,0 +1,88 @@
+// copyright Patrick Horgan
+// source is open, feel free to use it as you wish with no restrictions
+// except that this copyright notice must be preserved intact
+
+// basiccgi as a handler plugin, so the two can be raced.  It prints the
+// same page, with the CGI variables where basiccgi prints its environment.
+// ?wait=ms holds the response back that long by suspending on a timerfd,
+// to show how a plugin waits for something without a loop of its own.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include "plugin.h"
+
+static int
+put(hs_response *resp,const char *s)
+{
+    return resp->write(resp,s,strlen(s));
+}
+
+// how long ?wait= says, 0 if it doesn't
+static long
+wait_ms(const hs_request *req)
+{
+    char query[64];
+    size_t len=req->query.len<sizeof query-1?req->query.len:sizeof query-1;
+    memcpy(query,req->query.data,len);
+    query[len]='\0';
+    char *w=strstr(query,"wait=");
+    return w?strtol(w+5,0,10):0;
+}
+
+static int
+hello(const hs_request *req,hs_response *resp)
+{
+    hs_str name,value;
+    size_t idx;
+    long ms;
+    if(resp->state==0 && (ms=wait_ms(req))>0){
+	// come back when the timer goes off
+	int tfd=timerfd_create(CLOCK_MONOTONIC,TFD_CLOEXEC);
+	struct itimerspec when;
+	memset(&when,0,sizeof when);
+	when.it_value.tv_sec=ms/1000;
+	when.it_value.tv_nsec=(ms%1000)*1000000;
+	if(tfd==-1 || timerfd_settime(tfd,0,&when,0)==-1){
+	    return HS_ERROR;
+	}
+	resp->state=(void*)(long)(tfd+1);
+	if(resp->wait(resp,tfd,POLLIN,(int)ms+1000)==-1){
+	    close(tfd);
+	    return HS_ERROR;
+	}
+	return HS_SUSPEND;
+    }
+    if(resp->state){
+	close((int)(long)resp->state-1);
+    }
+    resp->status(resp,200,"OK");
+    resp->header(resp,"Content-Type","text/html");
+    put(resp,"<html><title>Hello</title><body>\n");
+    put(resp,"Goodbye Cruel World\n");
+    put(resp,"<pre>\n");
+    put(resp,"envs\n");
+    for(idx=0;req->var(req,idx,&name,&value);idx++){
+	put(resp,"    ");
+	resp->write(resp,name.data,name.len);
+	put(resp,"=");
+	resp->write(resp,value.data,value.len);
+	put(resp,"\n");
+    }
+    put(resp,"End of envs\n");
+    put(resp,"</pre>\n");
+    if(put(resp,"</body></html>\n")==-1){
+	return HS_ERROR;
+    }
+    return HS_DONE;
+}
+
+const hs_plugin hs_plugin_v1={
+    HS_PLUGIN_ABI,
+    "hello",
+    NULL,
+    hello,
+    NULL
+};
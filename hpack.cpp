@@ -0,0 +1,498 @@
+// copyright Patrick Horgan
+// source is open, feel free to use it as you wish with no restrictions
+// except that this copyright notice must be preserved intact
+#include "hpack.h"
+#include <cstring>
+
+struct hpack_static_entry
+{
+    const char *name;
+    const char *value;
+};
+
+// RFC 7541 appendix A, index 1 is the first
+static const hpack_static_entry static_table[]={
+    {":authority",""},
+    {":method","GET"},
+    {":method","POST"},
+    {":path","/"},
+    {":path","/index.html"},
+    {":scheme","http"},
+    {":scheme","https"},
+    {":status","200"},
+    {":status","204"},
+    {":status","206"},
+    {":status","304"},
+    {":status","400"},
+    {":status","404"},
+    {":status","500"},
+    {"accept-charset",""},
+    {"accept-encoding","gzip, deflate"},
+    {"accept-language",""},
+    {"accept-ranges",""},
+    {"accept",""},
+    {"access-control-allow-origin",""},
+    {"age",""},
+    {"allow",""},
+    {"authorization",""},
+    {"cache-control",""},
+    {"content-disposition",""},
+    {"content-encoding",""},
+    {"content-language",""},
+    {"content-length",""},
+    {"content-location",""},
+    {"content-range",""},
+    {"content-type",""},
+    {"cookie",""},
+    {"date",""},
+    {"etag",""},
+    {"expect",""},
+    {"expires",""},
+    {"from",""},
+    {"host",""},
+    {"if-match",""},
+    {"if-modified-since",""},
+    {"if-none-match",""},
+    {"if-range",""},
+    {"if-unmodified-since",""},
+    {"last-modified",""},
+    {"link",""},
+    {"location",""},
+    {"max-forwards",""},
+    {"proxy-authenticate",""},
+    {"proxy-authorization",""},
+    {"range",""},
+    {"referer",""},
+    {"refresh",""},
+    {"retry-after",""},
+    {"server",""},
+    {"set-cookie",""},
+    {"strict-transport-security",""},
+    {"transfer-encoding",""},
+    {"user-agent",""},
+    {"vary",""},
+    {"via",""},
+    {"www-authenticate",""},
+};
+
+// RFC 7541 appendix B, the code for each byte and how many bits of it
+static const uint32_t huffman_codes[256]={
+    0x1ff8,0x7fffd8,0xfffffe2,0xfffffe3,0xfffffe4,0xfffffe5,
+    0xfffffe6,0xfffffe7,0xfffffe8,0xffffea,0x3ffffffc,0xfffffe9,
+    0xfffffea,0x3ffffffd,0xfffffeb,0xfffffec,0xfffffed,0xfffffee,
+    0xfffffef,0xffffff0,0xffffff1,0xffffff2,0x3ffffffe,0xffffff3,
+    0xffffff4,0xffffff5,0xffffff6,0xffffff7,0xffffff8,0xffffff9,
+    0xffffffa,0xffffffb,0x14,0x3f8,0x3f9,0xffa,
+    0x1ff9,0x15,0xf8,0x7fa,0x3fa,0x3fb,
+    0xf9,0x7fb,0xfa,0x16,0x17,0x18,
+    0x0,0x1,0x2,0x19,0x1a,0x1b,
+    0x1c,0x1d,0x1e,0x1f,0x5c,0xfb,
+    0x7ffc,0x20,0xffb,0x3fc,0x1ffa,0x21,
+    0x5d,0x5e,0x5f,0x60,0x61,0x62,
+    0x63,0x64,0x65,0x66,0x67,0x68,
+    0x69,0x6a,0x6b,0x6c,0x6d,0x6e,
+    0x6f,0x70,0x71,0x72,0xfc,0x73,
+    0xfd,0x1ffb,0x7fff0,0x1ffc,0x3ffc,0x22,
+    0x7ffd,0x3,0x23,0x4,0x24,0x5,
+    0x25,0x26,0x27,0x6,0x74,0x75,
+    0x28,0x29,0x2a,0x7,0x2b,0x76,
+    0x2c,0x8,0x9,0x2d,0x77,0x78,
+    0x79,0x7a,0x7b,0x7ffe,0x7fc,0x3ffd,
+    0x1ffd,0xffffffc,0xfffe6,0x3fffd2,0xfffe7,0xfffe8,
+    0x3fffd3,0x3fffd4,0x3fffd5,0x7fffd9,0x3fffd6,0x7fffda,
+    0x7fffdb,0x7fffdc,0x7fffdd,0x7fffde,0xffffeb,0x7fffdf,
+    0xffffec,0xffffed,0x3fffd7,0x7fffe0,0xffffee,0x7fffe1,
+    0x7fffe2,0x7fffe3,0x7fffe4,0x1fffdc,0x3fffd8,0x7fffe5,
+    0x3fffd9,0x7fffe6,0x7fffe7,0xffffef,0x3fffda,0x1fffdd,
+    0xfffe9,0x3fffdb,0x3fffdc,0x7fffe8,0x7fffe9,0x1fffde,
+    0x7fffea,0x3fffdd,0x3fffde,0xfffff0,0x1fffdf,0x3fffdf,
+    0x7fffeb,0x7fffec,0x1fffe0,0x1fffe1,0x3fffe0,0x1fffe2,
+    0x7fffed,0x3fffe1,0x7fffee,0x7fffef,0xfffea,0x3fffe2,
+    0x3fffe3,0x3fffe4,0x7ffff0,0x3fffe5,0x3fffe6,0x7ffff1,
+    0x3ffffe0,0x3ffffe1,0xfffeb,0x7fff1,0x3fffe7,0x7ffff2,
+    0x3fffe8,0x1ffffec,0x3ffffe2,0x3ffffe3,0x3ffffe4,0x7ffffde,
+    0x7ffffdf,0x3ffffe5,0xfffff1,0x1ffffed,0x7fff2,0x1fffe3,
+    0x3ffffe6,0x7ffffe0,0x7ffffe1,0x3ffffe7,0x7ffffe2,0xfffff2,
+    0x1fffe4,0x1fffe5,0x3ffffe8,0x3ffffe9,0xffffffd,0x7ffffe3,
+    0x7ffffe4,0x7ffffe5,0xfffec,0xfffff3,0xfffed,0x1fffe6,
+    0x3fffe9,0x1fffe7,0x1fffe8,0x7ffff3,0x3fffea,0x3fffeb,
+    0x1ffffee,0x1ffffef,0xfffff4,0xfffff5,0x3ffffea,0x7ffff4,
+    0x3ffffeb,0x7ffffe6,0x3ffffec,0x3ffffed,0x7ffffe7,0x7ffffe8,
+    0x7ffffe9,0x7ffffea,0x7ffffeb,0xffffffe,0x7ffffec,0x7ffffed,
+    0x7ffffee,0x7ffffef,0x7fffff0,0x3ffffee,
+};
+static const uint8_t huffman_bits[256]={
+    13,23,28,28,28,28,28,28,28,24,30,28,28,30,28,28,
+    28,28,28,28,28,28,30,28,28,28,28,28,28,28,28,28,
+    6,10,10,12,13,6,8,11,10,10,8,11,8,6,6,6,
+    5,5,5,6,6,6,6,6,6,6,7,8,15,6,12,10,
+    13,6,7,7,7,7,7,7,7,7,7,7,7,7,7,7,
+    7,7,7,7,7,7,7,7,8,7,8,13,19,13,14,6,
+    15,5,6,5,6,5,6,6,6,5,7,7,6,6,6,5,
+    6,7,6,5,5,6,7,7,7,7,7,15,11,14,13,28,
+    20,22,20,20,22,22,22,23,22,23,23,23,23,23,24,23,
+    24,24,22,23,24,23,23,23,23,21,22,23,22,23,23,24,
+    22,21,20,22,22,23,23,21,23,22,22,24,21,22,23,23,
+    21,21,22,21,23,22,23,23,20,22,22,22,23,22,22,23,
+    26,26,20,19,22,23,22,25,26,26,26,27,27,26,24,25,
+    19,21,26,27,27,26,27,24,21,21,26,26,28,27,27,27,
+    20,24,20,21,22,21,21,23,22,22,25,25,24,24,26,23,
+    26,27,26,26,27,27,27,27,27,28,27,27,27,27,27,26,
+};
+
+static const size_t STATIC_COUNT=sizeof static_table/sizeof static_table[0];
+static const int EOS=256;
+
+// what a field costs in a table, RFC 7541 4.1
+static size_t
+entry_size(const header_field& f)
+{
+    return f.name.size()+f.value.size()+32;
+}
+
+void
+hpackTable::evict(size_t room)
+{
+    while(!fields.empty() && size+room>max_size){
+	size-=entry_size(fields.back());
+	fields.pop_back();
+    }
+}
+
+void
+hpackTable::add(const header_field& f)
+{
+    size_t need=entry_size(f);
+    // one too big for the table just empties it
+    evict(need);
+    if(need<=max_size){
+	fields.push_front(f);
+	size+=need;
+    }
+}
+
+void
+hpackTable::set_max_size(size_t max)
+{
+    max_size=max;
+    evict(0);
+}
+
+// The Huffman code as a binary tree, made the first time it's needed.
+// Each node's children are indexes into nodes, and a leaf has its byte.
+struct huffman_tree
+{
+    struct node
+    {
+	node(){ child[0]=child[1]=0; sym=-1; };
+	int child[2];
+	int sym;
+    };
+    huffman_tree()
+    {
+	nodes.push_back(node());
+	for(int sym=0;sym<=EOS;sym++){
+	    uint32_t code=sym==EOS?0x3fffffff:huffman_codes[sym];
+	    int bits=sym==EOS?30:huffman_bits[sym];
+	    int at=0;
+	    for(int bit=bits-1;bit>=0;bit--){
+		int which=(code>>bit)&1;
+		if(nodes[at].child[which]==0){
+		    nodes[at].child[which]=static_cast<int>(nodes.size());
+		    nodes.push_back(node());
+		}
+		at=nodes[at].child[which];
+	    }
+	    nodes[at].sym=sym;
+	}
+    };
+    std::vector<node> nodes;
+};
+
+bool
+huffman_decode(const uint8_t *data,size_t len,std::string& out)
+{
+    static const huffman_tree tree;
+    int at=0;
+    int since=0;	    // bits since the last whole symbol
+    bool ones=true;	    // and if they were all 1s
+    for(size_t idx=0;idx<len;idx++){
+	for(int bit=7;bit>=0;bit--){
+	    int which=(data[idx]>>bit)&1;
+	    at=tree.nodes[at].child[which];
+	    if(at==0){
+		return false;
+	    }
+	    since++;
+	    ones=ones && which;
+	    int sym=tree.nodes[at].sym;
+	    if(sym>=0){
+		if(sym==EOS){
+		    return false;
+		}
+		out+=static_cast<char>(sym);
+		at=0;
+		since=0;
+		ones=true;
+	    }
+	}
+    }
+    // what's left has to be padding, the start of EOS, under a byte of it
+    return since<8 && ones;
+}
+
+size_t
+huffman_length(const std::string& in)
+{
+    size_t bits=0;
+    for(size_t idx=0;idx<in.size();idx++){
+	bits+=huffman_bits[static_cast<uint8_t>(in[idx])];
+    }
+    return (bits+7)/8;
+}
+
+void
+huffman_encode(const std::string& in,std::string& out)
+{
+    uint64_t acc=0;
+    int held=0;
+    for(size_t idx=0;idx<in.size();idx++){
+	uint8_t c=static_cast<uint8_t>(in[idx]);
+	acc=acc<<huffman_bits[c]|huffman_codes[c];
+	held+=huffman_bits[c];
+	while(held>=8){
+	    held-=8;
+	    out+=static_cast<char>(acc>>held);
+	}
+    }
+    if(held){
+	// padded out with the first bits of EOS, all 1s
+	out+=static_cast<char>(acc<<(8-held)|(0xff>>held));
+    }
+}
+
+// An integer with an n bit prefix, RFC 7541 5.1.  False if it runs off
+// the end or is bigger than anything sensible.
+static bool
+decode_int(const uint8_t *&p,const uint8_t *end,int n,uint64_t& value)
+{
+    if(p==end){
+	return false;
+    }
+    uint64_t max=(1u<<n)-1;
+    value=*p++&max;
+    if(value<max){
+	return true;
+    }
+    for(int shift=0;;shift+=7){
+	if(p==end || shift>28){
+	    return false;
+	}
+	uint8_t b=*p++;
+	value+=static_cast<uint64_t>(b&0x7f)<<shift;
+	if((b&0x80)==0){
+	    return true;
+	}
+    }
+}
+
+static void
+encode_int(std::string& out,uint8_t first,int n,uint64_t value)
+{
+    uint64_t max=(1u<<n)-1;
+    if(value<max){
+	out+=static_cast<char>(first|value);
+	return;
+    }
+    out+=static_cast<char>(first|max);
+    value-=max;
+    while(value>=0x80){
+	out+=static_cast<char>((value&0x7f)|0x80);
+	value>>=7;
+    }
+    out+=static_cast<char>(value);
+}
+
+static bool
+decode_string(const uint8_t *&p,const uint8_t *end,std::string& s)
+{
+    if(p==end){
+	return false;
+    }
+    bool huffman=(*p&0x80)!=0;
+    uint64_t len;
+    if(!decode_int(p,end,7,len) || len>static_cast<uint64_t>(end-p)){
+	return false;
+    }
+    s.clear();
+    if(huffman){
+	if(!huffman_decode(p,static_cast<size_t>(len),s)){
+	    return false;
+	}
+    }else{
+	s.assign(reinterpret_cast<const char*>(p),static_cast<size_t>(len));
+    }
+    p+=len;
+    return true;
+}
+
+static void
+encode_string(std::string& out,const std::string& s)
+{
+    size_t hlen=huffman_length(s);
+    if(hlen<s.size()){
+	encode_int(out,0x80,7,hlen);
+	huffman_encode(s,out);
+    }else{
+	encode_int(out,0,7,s.size());
+	out+=s;
+    }
+}
+
+bool
+hpackDecoder::field_at(uint64_t idx,header_field& f) const
+{
+    if(idx==0){
+	return false;
+    }
+    if(idx<=STATIC_COUNT){
+	f.name=static_table[idx-1].name;
+	f.value=static_table[idx-1].value;
+	return true;
+    }
+    idx-=STATIC_COUNT+1;
+    if(idx>=table.count()){
+	return false;
+    }
+    f=table.at(static_cast<size_t>(idx));
+    return true;
+}
+
+bool
+hpackDecoder::decode(const uint8_t *block,size_t len,header_list& fields)
+{
+    const uint8_t *p=block,*end=block+len;
+    bool any=false;	    // size updates only come before the first field
+    size_t total=0;
+    while(p<end){
+	uint8_t b=*p;
+	uint64_t idx;
+	header_field f;
+	if(b&0x80){
+	    // indexed
+	    if(!decode_int(p,end,7,idx) || !field_at(idx,f)){
+		return false;
+	    }
+	}else if((b&0xe0)==0x20){
+	    uint64_t size;
+	    if(any || !decode_int(p,end,5,size) || size>limit){
+		return false;
+	    }
+	    table.set_max_size(static_cast<size_t>(size));
+	    continue;
+	}else{
+	    // a literal, with incremental indexing, without, or never
+	    bool indexing=(b&0xc0)==0x40;
+	    if(!decode_int(p,end,indexing?6:4,idx)){
+		return false;
+	    }
+	    if(idx==0){
+		if(!decode_string(p,end,f.name)){
+		    return false;
+		}
+	    }else if(!field_at(idx,f)){
+		return false;
+	    }
+	    if(!decode_string(p,end,f.value)){
+		return false;
+	    }
+	    if(indexing){
+		table.add(f);
+	    }
+	}
+	any=true;
+	if(list_limit && (total+=entry_size(f))>list_limit){
+	    return false;
+	}
+	fields.push_back(f);
+    }
+    return true;
+}
+
+void
+hpackEncoder::set_max_size(size_t max)
+{
+    if(max<table.get_max_size()){
+	table.set_max_size(max);
+	pending_size=true;
+    }
+}
+
+// different every time, so not worth a place in the table
+static bool
+is_volatile(const std::string& name)
+{
+    return name=="date" || name=="content-length" || name=="etag"
+	|| name=="last-modified" || name=="content-range" || name==":path"
+	|| name=="expires" || name=="age";
+}
+
+// never to be indexed by anyone along the way, RFC 7541 7.1.3
+static bool
+is_secret(const std::string& name)
+{
+    return name=="authorization" || name=="proxy-authorization"
+	|| name=="set-cookie" || name=="cookie";
+}
+
+void
+hpackEncoder::encode(const header_list& fields,std::string& out)
+{
+    if(pending_size){
+	encode_int(out,0x20,5,table.get_max_size());
+	pending_size=false;
+    }
+    for(size_t ctr=0;ctr<fields.size();ctr++){
+	const header_field& f=fields[ctr];
+	size_t name_idx=0,full_idx=0;
+	for(size_t idx=0;idx<STATIC_COUNT && full_idx==0;idx++){
+	    if(f.name==static_table[idx].name){
+		if(name_idx==0){
+		    name_idx=idx+1;
+		}
+		if(f.value==static_table[idx].value){
+		    full_idx=idx+1;
+		}
+	    }
+	}
+	for(size_t idx=0;idx<table.count() && full_idx==0;idx++){
+	    const header_field& t=table.at(idx);
+	    if(f.name==t.name){
+		if(name_idx==0){
+		    name_idx=STATIC_COUNT+1+idx;
+		}
+		if(f.value==t.value){
+		    full_idx=STATIC_COUNT+1+idx;
+		}
+	    }
+	}
+	if(full_idx){
+	    encode_int(out,0x80,7,full_idx);
+	    continue;
+	}
+	bool secret=is_secret(f.name);
+	bool indexing=!secret && !is_volatile(f.name);
+	if(indexing){
+	    encode_int(out,0x40,6,name_idx);
+	}else{
+	    encode_int(out,secret?0x10:0,4,name_idx);
+	}
+	if(name_idx==0){
+	    encode_string(out,f.name);
+	}
+	encode_string(out,f.value);
+	if(indexing){
+	    table.add(f);
+	}
+    }
+}
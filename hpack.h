@@ -0,0 +1,89 @@
+// copyright Patrick Horgan
+// source is open, feel free to use it as you wish with no restrictions
+// except that this copyright notice must be preserved intact
+#ifndef hpack_guard
+#define hpack_guard
+#include <deque>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// HPACK, RFC 7541, the header compression HTTP/2 uses.  Each side of a
+// connection has a decoder for what comes in and an encoder for what
+// goes out, and each keeps a dynamic table of fields it's seen that the
+// other end's matching half keeps in step with.
+
+struct header_field
+{
+    header_field(){};
+    header_field(const std::string& name,const std::string& value)
+	:name(name),value(value){};
+    std::string name;
+    std::string value;
+};
+typedef std::vector<header_field> header_list;
+
+// The fields a side has added, newest first, and no more of them than fit
+// in max_size the way RFC 7541 counts it, 32 more than name and value.
+class hpackTable
+{
+public:
+    static const size_t DEFAULT_SIZE=4096;
+    hpackTable():size(0),max_size(DEFAULT_SIZE){};
+    void add(const header_field& f);
+    void set_max_size(size_t max);
+    size_t get_max_size() const { return max_size; };
+    size_t count() const { return fields.size(); };
+    // 0 is the newest
+    const header_field& at(size_t idx) const { return fields[idx]; };
+private:
+    void evict(size_t room);
+    std::deque<header_field> fields;
+    size_t size;
+    size_t max_size;
+};
+
+class hpackDecoder
+{
+public:
+    // limit is the most the encoder at the other end can make our table,
+    // what we said in SETTINGS_HEADER_TABLE_SIZE.  A few bytes of block
+    // can index a big field over and over, so we give up on a block that
+    // decodes to more than list_limit, counted like the table does, if
+    // there is one.
+    hpackDecoder(size_t limit=hpackTable::DEFAULT_SIZE,size_t list_limit=0)
+	:limit(limit),list_limit(list_limit){};
+    // Decodes a whole header block onto the end of fields.  False if it's
+    // broken in any way, which for HTTP/2 is a COMPRESSION_ERROR that ends
+    // the connection, since the tables can't be trusted after.
+    bool decode(const uint8_t *block,size_t len,header_list& fields);
+private:
+    bool field_at(uint64_t idx,header_field& f) const;
+    hpackTable table;
+    size_t limit;
+    size_t list_limit;
+};
+
+class hpackEncoder
+{
+public:
+    hpackEncoder():pending_size(false){};
+    // the other end's SETTINGS_HEADER_TABLE_SIZE.  We never use more than
+    // the default, but if they allow less we have to say so.
+    void set_max_size(size_t max);
+    // Appends fields as one header block to out.  A field that's all in a
+    // table goes as its index.  Others are added to our table so the next
+    // one's an index, unless they're the kind that are different every
+    // time, or secrets, which go as literals that aren't indexed.
+    void encode(const header_list& fields,std::string& out);
+private:
+    hpackTable table;
+    bool pending_size;	    // a size update has to start the next block
+};
+
+// Huffman coding with RFC 7541's static code.  huffman_decode gives false
+// for anything a conforming encoder couldn't have made.
+bool huffman_decode(const uint8_t *data,size_t len,std::string& out);
+void huffman_encode(const std::string& in,std::string& out);
+size_t huffman_length(const std::string& in);
+#endif
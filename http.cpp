@@ -2,7 +2,9 @@
 // source is open, feel free to use it as you wish with no restrictions
 // except that this copyright notice must be preserved intact
 #include "http.h"
+#include "pathintern.h"
 #include <cstring>
+#include <strings.h>
 #include <iostream>
 #include <sstream>
 #include <vector>
@@ -77,14 +79,245 @@
 
 */
 
-/*
-    std::stringstream ss;
+std::string
+http_date(time_t t)
+{
     char timebuffer[30];
     struct tm thetm;
-    time_t thetime_t=time(NULL);
-    gmtime_r(&thetime_t,&thetm);
+    gmtime_r(&t,&thetm);
     strftime(timebuffer,30,"%a, %d %b %Y %T GMT",&thetm);
-    */
+    return timebuffer;
+}
+
+time_t
+parse_http_date(const std::string& s)
+{
+    return parse_http_date(s.c_str());
+}
+
+time_t
+parse_http_date(const arena_string& s)
+{
+    return parse_http_date(s.c_str());
+}
+
+time_t
+parse_http_date(const char *s)
+{
+    // RFC 1123, RFC 850, and asctime() in that order of likelihood
+    const char *formats[]={ "%a, %d %b %Y %T GMT","%A, %d-%b-%y %T GMT","%a %b %e %T %Y" };
+    struct tm thetm;
+    for(size_t ctr=0;ctr<sizeof(formats)/sizeof(formats[0]);ctr++){
+	bzero(&thetm,sizeof(thetm));
+	const char *end=strptime(s,formats[ctr],&thetm);
+	if(end!=NULL && *end=='\0'){
+	    return timegm(&thetm);
+	}
+    }
+    return -1;
+}
+
+// the header values come in std::strings or in a request's arena_strings,
+// so the list parsing is written for either
+template<typename S>
+static bool
+etag_list_matches(const S& list,const std::string& etag,bool weak)
+{
+    bool etagweak=etag.compare(0,2,"W/")==0;
+    std::string opaque=etagweak?etag.substr(2):etag;
+    size_t pos=0;
+
+    if(!weak && etagweak){
+	return false;
+    }
+    while(pos<list.size()){
+	while(pos<list.size() && (list[pos]==' ' || list[pos]=='\t' || list[pos]==',')) pos++;
+	if(pos==list.size()){
+	    break;
+	}
+	if(list[pos]=='*'){
+	    return true;
+	}
+	bool isweak=list.compare(pos,2,"W/")==0;
+	if(isweak){
+	    pos+=2;
+	}
+	if(pos==list.size() || list[pos]!='"'){
+	    return false;	// not an entity-tag, give up on the whole list
+	}
+	size_t close=list.find('"',pos+1);
+	if(close==S::npos){
+	    return false;
+	}
+	if((weak || !isweak)
+		&& list.compare(pos,close-pos+1,opaque.data(),opaque.size())==0){
+	    return true;
+	}
+	pos=close+1;
+    }
+    return false;
+}
+
+bool
+etag_matches(const std::string& list,const std::string& etag,bool weak)
+{
+    return etag_list_matches(list,etag,weak);
+}
+
+bool
+etag_matches(const arena_string& list,const std::string& etag,bool weak)
+{
+    return etag_list_matches(list,etag,weak);
+}
+
+bool
+etag_matches(const char *list,const std::string& etag,bool weak)
+{
+    return etag_list_matches(std::string(list),etag,weak);
+}
+
+bool
+add_header(header_map& hdrs,const arena_string& line)
+{
+    size_t colon=line.find(':');
+    if(colon==arena_string::npos || colon==0){
+	return false;
+    }
+    arena_string name(line,0,colon);
+    if(strcasecmp(name.c_str(),"DOCUMENT_ROOT")==0){
+	return false;
+    }
+    size_t start=line.find_first_not_of(" \t",colon+1);
+    arena_string value=start==arena_string::npos?arena_string():arena_string(line,start);
+    header_map::iterator there=hdrs.find(name);
+    if(there!=hdrs.end()){
+	there->second+=", ";
+	there->second+=value;
+    }else{
+	hdrs[name]=value;
+    }
+    return true;
+}
+
+bool
+not_modified(header_map& hdrs,const std::string& etag,time_t lastmod)
+{
+    header_map::iterator inm=hdrs.find("If-None-Match");
+    if(inm!=hdrs.end()){
+	return etag_matches(inm->second,etag,true);
+    }
+    header_map::iterator ims=hdrs.find("If-Modified-Since");
+    if(ims!=hdrs.end()){
+	time_t since=parse_http_date(ims->second);
+	return since!=-1 && lastmod<=since;
+    }
+    return false;
+}
+
+// reads a run of digits, false if there weren't any or it's absurdly long
+template<typename S>
+static bool
+range_number(const S& s,size_t& pos,off_t& n)
+{
+    size_t start=pos;
+    n=0;
+    while(pos<s.size() && isdigit(s[pos])){
+	if(pos-start>=18){
+	    return false;
+	}
+	n=n*10+(s[pos++]-'0');
+    }
+    return pos!=start;
+}
+
+template<typename S>
+static range_result
+parse_range_spec(const S& spec,off_t size,std::vector<byte_range>& ranges,
+	size_t max_ranges)
+{
+    // byte-ranges-specifier = "bytes=" byte-range-set
+    // byte-range-set  = 1#( byte-range-spec / suffix-byte-range-spec )
+    // byte-range-spec = first-byte-pos "-" [ last-byte-pos ]
+    // suffix-byte-range-spec = "-" suffix-length
+    size_t pos=6,nspecs=0;
+    ranges.clear();
+    if(spec.compare(0,6,"bytes=")!=0){
+	return range_none;
+    }
+    while(pos<spec.size()){
+	byte_range r;
+	off_t first,last;
+	while(pos<spec.size() && (spec[pos]==' ' || spec[pos]=='\t')) pos++;
+	if(pos<spec.size() && spec[pos]==','){
+	    pos++;		// the RFC lets empty elements in the list
+	    continue;
+	}
+	if(pos==spec.size()){
+	    break;
+	}
+	if(spec[pos]=='-'){
+	    pos++;
+	    if(!range_number(spec,pos,last)){
+		return range_none;
+	    }
+	    // the last so many bytes, a suffix of 0 can't be satisfied
+	    if(last==0){
+		r.first=size;
+	    }else{
+		r.first=last>size?0:size-last;
+	    }
+	    r.last=size-1;
+	}else{
+	    if(!range_number(spec,pos,first) || pos==spec.size() || spec[pos++]!='-'){
+		return range_none;
+	    }
+	    if(pos<spec.size() && isdigit(spec[pos])){
+		if(!range_number(spec,pos,last) || last<first){
+		    return range_none;
+		}
+	    }else{
+		last=size-1;
+	    }
+	    r.first=first;
+	    r.last=last>=size?size-1:last;
+	}
+	while(pos<spec.size() && (spec[pos]==' ' || spec[pos]=='\t')) pos++;
+	if(pos<spec.size() && spec[pos++]!=','){
+	    return range_none;
+	}
+	if(++nspecs>max_ranges){
+	    return range_none;
+	}
+	if(r.first<size){
+	    ranges.push_back(r);
+	}
+    }
+    if(nspecs==0){
+	return range_none;
+    }
+    return ranges.empty()?range_unsatisfiable:range_ok;
+}
+
+range_result
+parse_range(const std::string& spec,off_t size,std::vector<byte_range>& ranges,
+	size_t max_ranges)
+{
+    return parse_range_spec(spec,size,ranges,max_ranges);
+}
+
+range_result
+parse_range(const arena_string& spec,off_t size,std::vector<byte_range>& ranges,
+	size_t max_ranges)
+{
+    return parse_range_spec(spec,size,ranges,max_ranges);
+}
+
+range_result
+parse_range(const char *spec,off_t size,std::vector<byte_range>& ranges,
+	size_t max_ranges)
+{
+    return parse_range_spec(std::string(spec),size,ranges,max_ranges);
+}
 
 std::string
 file2string(std::string filename)
@@ -218,7 +451,7 @@ authority::to_string() const
 
 // main constructor for http_request_line
 http_request_line::http_request_line(const char *inrequest,
-	std::map<std::string,std::string>& headers)
+	header_map& headers)
 {
     // we expect the line to have any trailing \r or \n removed
     const char *ctr=inrequest,*savectr;
@@ -247,11 +480,15 @@ http_request_line::http_request_line(const char *inrequest,
 	major_release=0;
 	minor_release=9;
 	// here's the problem
-	theuri=uri(savectr,headers["Host"]);
-	valid=true;
+	theuri=uri(savectr,to_std(headers["Host"]));
+	valid=theuri.is_valid();
+	return;
+    }
+    theuri=uri(std::string(savectr,ctr),to_std(headers["Host"]));
+    if(!theuri.is_valid()){
+	// a path we won't look up, like one with ..s that go above /
 	return;
     }
-    theuri=uri(std::string(savectr,ctr),headers["Host"]);
     // either pointing at HTTP/1.x or space
     while(*ctr==' '&&*ctr) ctr++;
     if(*ctr=='\0'){
@@ -346,7 +583,8 @@ uri::to_string() const
     if(auth.is_valid()){
 	rets+=auth.to_string();
     }
-    rets+=path;
+    // path's decoded, so it goes back out encoded
+    rets+=encode_path(path);
     if(query!=""){
 	rets+="?"+query;
     }
@@ -394,18 +632,19 @@ uri::uri(std::string r,std::string h)
     //std::cerr << "uri(" << r << ',' << h << ")\n";
     auth=authority(h);
 
+    std::string raw;
+    if((pos2=r.find('#',begin))!=std::string::npos){
+	fragment=r.substr(pos2+1);
+	r.erase(pos2);
+    }
     if((pos=r.find('?',begin))!=std::string::npos){
-	if((pos2=r.find('#',begin))!=std::string::npos){
-	    path=r.substr(begin,pos);
-	    query=r.substr(pos+1,pos2);
-	    fragment=r.substr(pos2+1);
-	}else{
-	    path=r.substr(begin,pos);
-	    query=r.substr(pos+1);
-	}
+	raw=r.substr(begin,pos-begin);
+	query=r.substr(pos+1);
     }else{
-	path=r.substr(begin);
+	raw=r.substr(begin);
     }
+    // so /a//b.css, /a/./b.css and /%61/b.css are all the one file
+    valid=normalize_path(raw,path)==path_ok;
 }
 
 // Will make sure the scheme matches the syntax of scheme
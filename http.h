@@ -6,6 +6,10 @@
 #include <string>
 #include <algorithm>
 #include <map>
+#include <vector>
+#include <ctime>
+#include <sys/types.h>
+#include "arena.h"
 
 /*
          foo://example.com:8042/over/there?name=ferret#nose
@@ -21,6 +25,43 @@ URI scheme from RFC 2396 - Uniform Resource Identifier (URI): General Syntax
 
 std::string file2string(std::string filename);
 
+// dates the way HTTP wants them, "Sun, 06 Nov 1994 08:49:37 GMT"
+std::string http_date(time_t t);
+// parses any of the three formats RFC 2616 allows, returns -1 if it can't
+time_t parse_http_date(const std::string& s);
+time_t parse_http_date(const arena_string& s);
+time_t parse_http_date(const char *s);
+
+// true if etag is in an If-None-Match: or If-Match: style list, "*"
+// matches anything.  The weak comparison ignores W/ on either side, the
+// strong one never lets a weak tag match.
+bool etag_matches(const std::string& list,const std::string& etag,bool weak);
+bool etag_matches(const arena_string& list,const std::string& etag,bool weak);
+bool etag_matches(const char *list,const std::string& etag,bool weak);
+
+// one range from a Range: header, first and last are inclusive and have
+// already been clipped to the size of the thing
+struct byte_range
+{
+    off_t first;
+    off_t last;
+};
+enum range_result
+{
+    range_none,		    // no usable Range: header, send everything
+    range_ok,		    // ranges has what they asked for
+    range_unsatisfiable	    // none of it's in the file, that's a 416
+};
+// turn a Range: value like "bytes=0-99,-500" into byte_ranges for a thing
+// size bytes long.  Bad syntax, or more than max_ranges ranges, and we act
+// like the header wasn't there, which the RFC allows.
+range_result parse_range(const std::string& spec,off_t size,
+	std::vector<byte_range>& ranges,size_t max_ranges=16);
+range_result parse_range(const arena_string& spec,off_t size,
+	std::vector<byte_range>& ranges,size_t max_ranges=16);
+range_result parse_range(const char *spec,off_t size,
+	std::vector<byte_range>& ranges,size_t max_ranges=16);
+
 // check ranges from RFC 2616 (http)
 inline bool isalpha(const char& c)
 {
@@ -95,10 +136,12 @@ private:
 class uri
 {
 public:
+    // request_uri's path is normalized, see normalize_path(), and if it
+    // can't be the uri isn't valid
     uri(std::string request_uri,std::string host);
-    uri(){};
+    uri():valid(false){};
     uri& operator=(const uri&);
-    uri(const uri&){};
+    uri(const uri& u){ *this=u; };
 
     std::string to_string() const;
     std::string get_ext();
@@ -106,6 +149,7 @@ public:
     const std::string& get_host() const { return auth.get_host(); };
     const std::string& get_port() const { return auth.get_port(); };
     const std::string& get_query() const { return query; };
+    bool is_valid() const { return valid; };
 private:
     std::string scheme;
     authority auth;
@@ -116,10 +160,27 @@ private:
     bool valid;
 };
 
+// A request's headers, name to value, plus the DOCUMENT_ROOT we make up.
+// They only live as long as the request, so they're in its arena.
+typedef arena_map header_map;
+
+// Puts a "Name: value" header line from the client into hdrs.  A name
+// that's already there gets this value added on after a comma, the way
+// RFC 7230 says repeats are to be read, so two Content-Lengths don't
+// quietly become one.  One named DOCUMENT_ROOT is left out, since it'd
+// take the place of the one we make up and say where files and scripts
+// come from.  Returns false if the line's left out or isn't a header.
+bool add_header(header_map& hdrs,const arena_string& line);
+
+// true if the client's copy of something with this etag and Last-Modified
+// is still good.  RFC 7232 says If-None-Match wins if it's there,
+// otherwise we look at If-Modified-Since.
+bool not_modified(header_map& hdrs,const std::string& etag,time_t lastmod);
+
 class http_request_line
 {
 public:
-    http_request_line(const char *inrequest,std::map<std::string,std::string>&);
+    http_request_line(const char *inrequest,header_map&);
     std::string to_string() const;
     bool is_valid(){ return valid; };
     std::string get_ext(){ return theuri.get_ext(); };
@@ -129,6 +190,8 @@ public:
     const std::string& get_method(){ return method; }
     std::string get_major_release();
     std::string get_minor_release();
+    bool is_http11() const
+	{ return major_release>1 || (major_release==1 && minor_release>=1); };
     const std::string& get_host(){ return theuri.get_host(); };
     const std::string& get_port(){ return theuri.get_port(); };
 private:
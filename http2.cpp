@@ -0,0 +1,1242 @@
+// copyright Patrick Horgan
+// source is open, feel free to use it as you wish with no restrictions
+// except that this copyright notice must be preserved intact
+#include "http2.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+unsigned h2Connection::max_connections=0;
+std::atomic<unsigned> h2Connection::connections(0);
+unsigned h2Connection::stream_limit=0;
+std::atomic<unsigned> h2Connection::streams_open(0);
+
+// What we tell them in our SETTINGS.  Each stream is a worker, so a few
+// clients could have the whole pool otherwise.  A stream's window is how
+// much of a request body we'll hold for a backend that hasn't read it yet.
+const uint32_t MAX_STREAMS=32;
+const uint32_t STREAM_WINDOW=256*1024;
+const uint32_t CONN_WINDOW=1024*1024;
+// biggest header block we'll put together, and what it can decode to
+const size_t MAX_BLOCK=64*1024;
+const size_t MAX_HEADER_LIST=256*1024;
+// We stop reading a backend's response when this much is waiting on flow
+// control, so a client that's slow to take it doesn't make us hold all of
+// it, and stop making frames when this much is waiting for the socket.
+const size_t OUT_HIGH=256*1024;
+const size_t WBUF_HIGH=64*1024;
+const unsigned DEFAULT_WEIGHT=16;
+
+static unsigned long long
+monotonic_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec*1000ULL+ts.tv_nsec/1000000;
+}
+
+// HTTP2-Settings is base64url without the padding
+static bool
+base64url_decode(const std::string& in,std::string& out)
+{
+    uint32_t acc=0;
+    int bits=0;
+    for(size_t idx=0;idx<in.size();idx++){
+	char c=in[idx];
+	int v;
+	if(c>='A' && c<='Z'){
+	    v=c-'A';
+	}else if(c>='a' && c<='z'){
+	    v=c-'a'+26;
+	}else if(c>='0' && c<='9'){
+	    v=c-'0'+52;
+	}else if(c=='-'){
+	    v=62;
+	}else if(c=='_'){
+	    v=63;
+	}else if(c=='='){
+	    break;
+	}else{
+	    return false;
+	}
+	acc=acc<<6|v;
+	if((bits+=6)>=8){
+	    bits-=8;
+	    out+=static_cast<char>(acc>>bits);
+	}
+    }
+    return true;
+}
+
+// content-type to Content-Type, the way the rest of the server looks
+// headers up
+static std::string
+title_case(const std::string& name)
+{
+    std::string out(name);
+    bool start=true;
+    for(size_t idx=0;idx<out.size();idx++){
+	if(start){
+	    out[idx]=static_cast<char>(toupper(out[idx]));
+	}
+	start=out[idx]=='-';
+    }
+    return out;
+}
+
+// only meant for one hop, so they don't go from one protocol to the other
+static bool
+hop_by_hop(const std::string& name)
+{
+    return name=="connection" || name=="keep-alive" || name=="proxy-connection"
+	|| name=="transfer-encoding" || name=="upgrade";
+}
+
+// nothing that would let a field end a line of the HTTP/1.1 request
+static bool
+clean(const std::string& s)
+{
+    return s.find_first_of(std::string("\r\n\0",3))==std::string::npos;
+}
+
+h2_stream::h2_stream(uint32_t id,uint32_t window):id(id),fd(-1),chunked(false),
+    request_done(false),has_length(false),expected(0),received(0),held(0),credit(0),recv_window(STREAM_WINDOW),
+    parse(head),remaining(0),out_end(false),sent_end(false),send_window(window),parent(0),
+    weight(DEFAULT_WEIGHT),pass(0),idle(true)
+{
+}
+
+bool
+h2Connection::reserve()
+{
+    unsigned now=connections.load();
+    while(now<max_connections){
+	if(connections.compare_exchange_weak(now,now+1)){
+	    return true;
+	}
+    }
+    return false;
+}
+
+// a worker for one more stream, if they're not all taken
+bool
+h2Connection::reserve_stream()
+{
+    unsigned now=streams_open.load();
+    while(stream_limit==0 || now<stream_limit){
+	if(streams_open.compare_exchange_weak(now,now+1)){
+	    return true;
+	}
+    }
+    return false;
+}
+
+h2Connection::h2Connection(sockfdwrapper& sfd,dispatcher dispatch,unsigned idle_ms):
+    sfd(sfd),fd(sfd.get_fd()),dispatch(dispatch),idle_ms(idle_ms),
+    decoder(hpackTable::DEFAULT_SIZE,MAX_HEADER_LIST),continuing(0),
+    continuing_flags(0),prio_set(false),last_stream(0),going_away(false),
+    broken(false),peer_window(H2_DEFAULT_WINDOW),
+    peer_frame_size(H2_DEFAULT_FRAME_SIZE),conn_send_window(H2_DEFAULT_WINDOW),
+    conn_recv_window(CONN_WINDOW),conn_credit(0)
+{
+    // we never wait in a send or recv, poll() says when
+    fcntl(fd,F_SETFL,fcntl(fd,F_GETFL)|O_NONBLOCK);
+    // Frames are put together in wbuf and go out as soon as they can.  A
+    // response's HEADERS and DATA often go in separate sends, and waiting
+    // for the ACK of one before sending the other would be 40ms each time.
+    int on=1;
+    setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&on,sizeof on);
+    // our SETTINGS are the first thing we say, and the connection's window
+    // is opened up to match the streams'
+    h2_put_frame_header(wbuf,12,H2_SETTINGS,0,0);
+    h2_put_setting(wbuf,H2_SETTINGS_MAX_CONCURRENT_STREAMS,MAX_STREAMS);
+    h2_put_setting(wbuf,H2_SETTINGS_INITIAL_WINDOW_SIZE,STREAM_WINDOW);
+    h2_put_frame_header(wbuf,4,H2_WINDOW_UPDATE,0,0);
+    h2_put32(wbuf,CONN_WINDOW-H2_DEFAULT_WINDOW);
+}
+
+h2Connection::~h2Connection()
+{
+    while(!streams.empty()){
+	close_stream(streams.begin()->second);
+    }
+    connections--;
+}
+
+void
+h2Connection::refuse(sockfdwrapper& sfd)
+{
+    std::string frames;
+    h2_put_frame_header(frames,0,H2_SETTINGS,0,0);
+    h2_put_frame_header(frames,8,H2_GOAWAY,0,0);
+    h2_put32(frames,0);
+    h2_put32(frames,H2_REFUSED_STREAM);
+    sfd.sendall(frames.data(),frames.size());
+}
+
+bool
+h2Connection::upgraded(const std::string& settings64,const std::string& request,
+	const std::string& method)
+{
+    std::string raw;
+    if(!base64url_decode(settings64,raw) || raw.size()%6
+	    || settings(reinterpret_cast<const uint8_t*>(raw.data()),raw.size())!=H2_NO_ERROR){
+	return false;
+    }
+    // the request's all here, there's no body, so stream 1 is half closed
+    // from their side already
+    last_stream=1;
+    return open_stream(1,request,method,true)!=0;
+}
+
+h2_stream *
+h2Connection::find(uint32_t id)
+{
+    std::map<uint32_t,h2_stream*>::iterator it=streams.find(id);
+    return it==streams.end()?0:it->second;
+}
+
+void
+h2Connection::run(const char *expect)
+{
+    this->expect=expect;
+    // whatever sfd had read past the request line is ours
+    char buf[16384];
+    while(sfd.buffered()){
+	size_t n=sfd.read(buf,std::min(sizeof buf,sfd.buffered()));
+	in.append(buf,n);
+    }
+    process();
+    unsigned long long last=monotonic_ms();
+    std::vector<struct pollfd> pfds;
+    std::vector<uint32_t> ids;
+    while(true){
+	// as long as the socket takes all we make, make more
+	bool more;
+	do{
+	    more=schedule();
+	    if(!flush()){
+		// they're gone
+		return;
+	    }
+	}while(more && wbuf.empty());
+	if((broken || going_away) && (streams.empty() || broken)){
+	    break;
+	}
+	pfds.clear();
+	ids.clear();
+	struct pollfd pfd;
+	pfd.fd=fd;
+	pfd.events=(wbuf.size()<4*WBUF_HIGH?POLLIN:0)|(wbuf.empty()?0:POLLOUT);
+	pfds.push_back(pfd);
+	ids.push_back(0);
+	for(std::map<uint32_t,h2_stream*>::iterator it=streams.begin();it!=streams.end();it++){
+	    h2_stream *s=it->second;
+	    if(s->fd<0){
+		continue;
+	    }
+	    pfd.fd=s->fd;
+	    pfd.events=(s->to_server.empty()?0:POLLOUT)|(s->out.size()<OUT_HIGH?POLLIN:0);
+	    pfds.push_back(pfd);
+	    ids.push_back(s->id);
+	}
+	unsigned long long now=monotonic_ms();
+	int wait=now-last>=idle_ms?0:static_cast<int>(idle_ms-(now-last));
+	int ready=poll(&pfds[0],pfds.size(),wait);
+	if(ready==-1 && errno!=EINTR){
+	    return;
+	}
+	if(ready==0){
+	    if(monotonic_ms()-last>=idle_ms){
+		// nothing's moved either way for as long as we'd keep an
+		// idle connection
+		goaway(H2_NO_ERROR);
+		flush();
+		return;
+	    }
+	    continue;
+	}
+	last=monotonic_ms();
+	for(size_t idx=1;idx<pfds.size();idx++){
+	    h2_stream *s;
+	    if(pfds[idx].revents==0 || (s=find(ids[idx]))==0){
+		continue;
+	    }
+	    if(pfds[idx].revents&POLLOUT){
+		write_server(s);
+	    }
+	    if(pfds[idx].revents&(POLLIN|POLLHUP|POLLERR)){
+		read_server(s);
+	    }
+	}
+	if(pfds[0].revents&(POLLIN|POLLHUP|POLLERR)){
+	    if(!read_client()){
+		return;
+	    }
+	}
+    }
+    // a GOAWAY for an error is no good if closing with their frames
+    // unread resets the connection before they see it, so we give them a
+    // little while to take it
+    if(broken){
+	flush();
+	shutdown(fd,SHUT_WR);
+	struct pollfd pfd;
+	pfd.fd=fd;
+	pfd.events=POLLIN;
+	unsigned long long until=monotonic_ms()+1000;
+	while(monotonic_ms()<until && poll(&pfd,1,100)>=0){
+	    if(pfd.revents && recv(fd,buf,sizeof buf,MSG_DONTWAIT)==0){
+		break;
+	    }
+	}
+    }
+}
+
+bool
+h2Connection::flush()
+{
+    size_t sent=0;
+    while(sent<wbuf.size()){
+	ssize_t n=send(fd,wbuf.data()+sent,wbuf.size()-sent,MSG_NOSIGNAL|MSG_DONTWAIT);
+	if(n>0){
+	    sent+=n;
+	}else if(errno==EINTR){
+	    continue;
+	}else if(errno==EAGAIN || errno==EWOULDBLOCK){
+	    break;
+	}else{
+	    return false;
+	}
+    }
+    wbuf.erase(0,sent);
+    return true;
+}
+
+// False if they've closed or the connection's broken.
+bool
+h2Connection::read_client()
+{
+    char buf[16384];
+    while(true){
+	ssize_t n=recv(fd,buf,sizeof buf,MSG_DONTWAIT);
+	if(n>0){
+	    in.append(buf,n);
+	    if(in.size()<H2_FRAME_HEADER_LEN+MAX_BLOCK){
+		continue;
+	    }
+	}else if(n==0){
+	    return false;
+	}else if(errno==EINTR){
+	    continue;
+	}else if(errno!=EAGAIN && errno!=EWOULDBLOCK){
+	    return false;
+	}
+	break;
+    }
+    process();
+    return true;
+}
+
+// every whole frame in what they've sent
+void
+h2Connection::process()
+{
+    size_t used=0;
+    if(!expect.empty()){
+	size_t n=std::min(expect.size(),in.size());
+	if(in.compare(0,n,expect,0,n)!=0){
+	    goaway(H2_PROTOCOL_ERROR);
+	    in.clear();
+	    return;
+	}
+	expect.erase(0,n);
+	used=n;
+    }
+    while(!broken && in.size()-used>=H2_FRAME_HEADER_LEN){
+	const uint8_t *p=reinterpret_cast<const uint8_t*>(in.data()+used);
+	h2_frame_header fh=h2_parse_frame_header(p);
+	if(fh.length>H2_DEFAULT_FRAME_SIZE){
+	    // we never said they could send bigger
+	    goaway(H2_FRAME_SIZE_ERROR);
+	    break;
+	}
+	if(in.size()-used<H2_FRAME_HEADER_LEN+fh.length){
+	    break;
+	}
+	used+=H2_FRAME_HEADER_LEN+fh.length;
+	if(!frame(fh,p+H2_FRAME_HEADER_LEN)){
+	    break;
+	}
+    }
+    in.erase(0,used);
+}
+
+// One frame from them.  False if it was a connection error, and then
+// we've already sent the GOAWAY.
+bool
+h2Connection::frame(const h2_frame_header& fh,const uint8_t *payload)
+{
+    uint32_t error=H2_NO_ERROR;
+    if(continuing && (fh.type!=H2_CONTINUATION || fh.stream!=continuing)){
+	// nothing can come between a header block's frames
+	goaway(H2_PROTOCOL_ERROR);
+	return false;
+    }
+    switch(fh.type){
+	case H2_DATA:
+	    return data(fh,payload);
+	case H2_HEADERS:{
+	    size_t off=0,pad=0;
+	    if(fh.stream==0 || (fh.stream&1)==0){
+		error=H2_PROTOCOL_ERROR;
+		break;
+	    }
+	    if(fh.flags&H2_PADDED){
+		if(fh.length<1){
+		    error=H2_FRAME_SIZE_ERROR;
+		    break;
+		}
+		pad=payload[0];
+		off=1;
+	    }
+	    prio_set=(fh.flags&H2_PRIORITY_FLAG)!=0;
+	    if(prio_set){
+		if(fh.length<off+5){
+		    error=H2_FRAME_SIZE_ERROR;
+		    break;
+		}
+		memcpy(prio,payload+off,5);
+		off+=5;
+	    }
+	    if(off+pad>fh.length){
+		error=H2_PROTOCOL_ERROR;
+		break;
+	    }
+	    block.assign(reinterpret_cast<const char*>(payload+off),fh.length-off-pad);
+	    if(fh.flags&H2_END_HEADERS){
+		return header_block(fh.stream,fh.flags);
+	    }
+	    continuing=fh.stream;
+	    continuing_flags=fh.flags;
+	    return true;
+	}
+	case H2_CONTINUATION:
+	    if(!continuing){
+		error=H2_PROTOCOL_ERROR;
+		break;
+	    }
+	    block.append(reinterpret_cast<const char*>(payload),fh.length);
+	    if(block.size()>MAX_BLOCK){
+		error=H2_ENHANCE_YOUR_CALM;
+		break;
+	    }
+	    if(fh.flags&H2_END_HEADERS){
+		continuing=0;
+		return header_block(fh.stream,continuing_flags);
+	    }
+	    return true;
+	case H2_PRIORITY:
+	    if(fh.stream==0){
+		error=H2_PROTOCOL_ERROR;
+	    }else if(fh.length!=5){
+		reset(fh.stream,H2_FRAME_SIZE_ERROR);
+	    }else{
+		priority(fh.stream,payload);
+	    }
+	    break;
+	case H2_RST_STREAM:
+	    if(fh.length!=4){
+		error=H2_FRAME_SIZE_ERROR;
+	    }else if(fh.stream==0 || fh.stream>last_stream){
+		error=H2_PROTOCOL_ERROR;
+	    }else if(h2_stream *s=find(fh.stream)){
+		conn_credit+=s->held;
+		close_stream(s);
+	    }
+	    break;
+	case H2_SETTINGS:
+	    if(fh.stream!=0){
+		error=H2_PROTOCOL_ERROR;
+	    }else if(fh.flags&H2_ACK){
+		error=fh.length?H2_FRAME_SIZE_ERROR:H2_NO_ERROR;
+	    }else if(fh.length%6){
+		error=H2_FRAME_SIZE_ERROR;
+	    }else if((error=settings(payload,fh.length))==H2_NO_ERROR){
+		h2_put_frame_header(wbuf,0,H2_SETTINGS,H2_ACK,0);
+	    }
+	    break;
+	case H2_PUSH_PROMISE:
+	    // only servers push
+	    error=H2_PROTOCOL_ERROR;
+	    break;
+	case H2_PING:
+	    if(fh.stream!=0){
+		error=H2_PROTOCOL_ERROR;
+	    }else if(fh.length!=8){
+		error=H2_FRAME_SIZE_ERROR;
+	    }else if(!(fh.flags&H2_ACK)){
+		h2_put_frame_header(wbuf,8,H2_PING,H2_ACK,0);
+		wbuf.append(reinterpret_cast<const char*>(payload),8);
+	    }
+	    break;
+	case H2_GOAWAY:
+	    if(fh.stream!=0){
+		error=H2_PROTOCOL_ERROR;
+	    }else{
+		// they'll start no more, we finish what they have
+		going_away=true;
+	    }
+	    break;
+	case H2_WINDOW_UPDATE:{
+	    if(fh.length!=4){
+		error=H2_FRAME_SIZE_ERROR;
+		break;
+	    }
+	    uint32_t more=h2_get32(payload)&0x7fffffff;
+	    if(fh.stream==0){
+		if(more==0){
+		    error=H2_PROTOCOL_ERROR;
+		}else if((conn_send_window+=more)>H2_MAX_WINDOW){
+		    error=H2_FLOW_CONTROL_ERROR;
+		}
+	    }else if(more==0){
+		reset(fh.stream,H2_PROTOCOL_ERROR);
+	    }else if(h2_stream *s=find(fh.stream)){
+		if((s->send_window+=more)>H2_MAX_WINDOW){
+		    reset(fh.stream,H2_FLOW_CONTROL_ERROR);
+		}
+	    }
+	    break;
+	}
+	default:
+	    // frames we don't know are ignored
+	    break;
+    }
+    if(error!=H2_NO_ERROR){
+	goaway(error);
+	return false;
+    }
+    return true;
+}
+
+// SETTINGS from them, or from HTTP2-Settings
+uint32_t
+h2Connection::settings(const uint8_t *p,size_t len)
+{
+    for(size_t off=0;off+6<=len;off+=6){
+	uint16_t id=static_cast<uint16_t>(p[off]<<8|p[off+1]);
+	uint32_t value=h2_get32(p+off+2);
+	switch(id){
+	    case H2_SETTINGS_HEADER_TABLE_SIZE:
+		encoder.set_max_size(value);
+		break;
+	    case H2_SETTINGS_ENABLE_PUSH:
+		if(value>1){
+		    return H2_PROTOCOL_ERROR;
+		}
+		break;
+	    case H2_SETTINGS_INITIAL_WINDOW_SIZE:{
+		if(value>H2_MAX_WINDOW){
+		    return H2_FLOW_CONTROL_ERROR;
+		}
+		// every stream's window moves by the difference
+		int64_t change=static_cast<int64_t>(value)-peer_window;
+		for(std::map<uint32_t,h2_stream*>::iterator it=streams.begin();it!=streams.end();it++){
+		    if((it->second->send_window+=change)>H2_MAX_WINDOW){
+			return H2_FLOW_CONTROL_ERROR;
+		    }
+		}
+		peer_window=value;
+		break;
+	    }
+	    case H2_SETTINGS_MAX_FRAME_SIZE:
+		if(value<H2_DEFAULT_FRAME_SIZE || value>H2_MAX_FRAME_SIZE){
+		    return H2_PROTOCOL_ERROR;
+		}
+		peer_frame_size=value;
+		break;
+	    default:
+		// nothing else changes what we do
+		break;
+	}
+    }
+    return H2_NO_ERROR;
+}
+
+// A whole header block is in block.  It's a new request or the trailers
+// of one.
+bool
+h2Connection::header_block(uint32_t id,uint8_t flags)
+{
+    header_list fields;
+    if(!decoder.decode(reinterpret_cast<const uint8_t*>(block.data()),block.size(),fields)){
+	// our table can't be trusted now, so nothing after can be
+	goaway(H2_COMPRESSION_ERROR);
+	return false;
+    }
+    block.clear();
+    bool end=(flags&H2_END_STREAM)!=0;
+    if(h2_stream *s=find(id)){
+	// trailers, which the backends wouldn't know what to do with
+	if(s->request_done || !end || (s->has_length && s->received!=s->expected)){
+	    reset(id,s->request_done?H2_STREAM_CLOSED:H2_PROTOCOL_ERROR);
+	    return true;
+	}
+	s->request_done=true;
+	if(s->chunked){
+	    s->to_server+="0\r\n\r\n";
+	}
+	write_server(s);
+	return true;
+    }
+    if(id<=last_stream){
+	// a stream that's been and gone
+	goaway(H2_STREAM_CLOSED);
+	return false;
+    }
+    last_stream=id;
+    if(going_away || streams.size()>=MAX_STREAMS){
+	reset(id,H2_REFUSED_STREAM);
+	return true;
+    }
+    // pseudo-headers first, all lower case, nothing that only means
+    // something for one hop
+    std::string method,path,scheme,authority,head,cookies;
+    bool regular=false,bad=false,has_length=false;
+    uint64_t length=0;
+    for(size_t idx=0;idx<fields.size() && !bad;idx++){
+	const std::string& name=fields[idx].name;
+	const std::string& value=fields[idx].value;
+	if(name.empty() || !clean(name) || !clean(value)
+		|| name.find_first_of(" :ABCDEFGHIJKLMNOPQRSTUVWXYZ",1)!=std::string::npos){
+	    bad=true;
+	}else if(name[0]==':'){
+	    std::string *which=name==":method"?&method:name==":path"?&path
+		:name==":scheme"?&scheme:name==":authority"?&authority:0;
+	    bad=regular || which==0 || !which->empty() || value.empty();
+	    if(!bad){
+		*which=value;
+	    }
+	}else{
+	    regular=true;
+	    if(hop_by_hop(name) || (name=="te" && value!="trailers")){
+		bad=true;
+	    }else if(name=="cookie"){
+		// they can be split up to compress better, 8.1.2.5
+		cookies+=(cookies.empty()?"":"; ")+value;
+	    }else if(name=="host"){
+		if(authority.empty()){
+		    authority=value;
+		}
+	    }else if(name=="content-length"){
+		// digits, and if it's there twice the same digits, which
+		// only go to the backend once
+		uint64_t n=0;
+		bad=value.find_first_not_of("0123456789")!=std::string::npos;
+		for(size_t at=0;at<value.size() && !bad;at++){
+		    bad=n>(UINT64_MAX-(value[at]-'0'))/10;
+		    n=n*10+(value[at]-'0');
+		}
+		bad=bad || (has_length && n!=length);
+		if(!bad && !has_length){
+		    head+="Content-Length: "+value+"\r\n";
+		}
+		has_length=true;
+		length=n;
+	    }else if(name!="te"){
+		head+=title_case(name)+": "+value+"\r\n";
+	    }
+	}
+    }
+    if(bad || method.empty() || path.empty() || scheme.empty() || method=="CONNECT"
+	    || (end && length!=0)
+	    || path.find(' ')!=std::string::npos || method.find(' ')!=std::string::npos){
+	reset(id,H2_PROTOCOL_ERROR);
+	return true;
+    }
+    std::string request=method+' '+path+" HTTP/1.1\r\n";
+    if(!authority.empty()){
+	request+="Host: "+authority+"\r\n";
+    }
+    request+=head;
+    if(!cookies.empty()){
+	request+="Cookie: "+cookies+"\r\n";
+    }
+    bool chunked=!end && !has_length;
+    if(chunked){
+	// a body with no length, so it's chunked as it comes
+	request+="Transfer-Encoding: chunked\r\n";
+    }
+    request+="Connection: close\r\n\r\n";
+    h2_stream *s=open_stream(id,request,method,end);
+    if(s){
+	s->chunked=chunked;
+	s->has_length=has_length;
+	s->expected=length;
+	if(prio_set){
+	    priority(id,prio);
+	}
+    }
+    return true;
+}
+
+// Sends request off to a worker down a new socketpair.  0 if it can't,
+// and then the stream's been refused.
+h2_stream *
+h2Connection::open_stream(uint32_t id,const std::string& request,
+	const std::string& method,bool done)
+{
+    int fds[2];
+    if(!reserve_stream()){
+	reset(id,H2_REFUSED_STREAM);
+	return 0;
+    }
+    if(socketpair(AF_UNIX,SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC,0,fds)==-1){
+	streams_open--;
+	reset(id,H2_REFUSED_STREAM);
+	return 0;
+    }
+    // every stream in streams has one of streams_open, close_stream()
+    // gives it back
+    h2_stream *s=new h2_stream(id,peer_window);
+    s->fd=fds[0];
+    s->method=method;
+    s->to_server=request;
+    s->request_done=done;
+    streams[id]=s;
+    // the request line's there before a worker, or classify(), looks
+    write_server(s);
+    if(!dispatch(fds[1])){
+	close(fds[1]);
+	reset(id,H2_REFUSED_STREAM);
+	return 0;
+    }
+    return s;
+}
+
+bool
+h2Connection::data(const h2_frame_header& fh,const uint8_t *payload)
+{
+    if(fh.stream==0){
+	goaway(H2_PROTOCOL_ERROR);
+	return false;
+    }
+    size_t off=0,pad=0;
+    if(fh.flags&H2_PADDED){
+	if(fh.length<1 || payload[0]>=fh.length){
+	    goaway(H2_PROTOCOL_ERROR);
+	    return false;
+	}
+	pad=payload[0];
+	off=1;
+    }
+    if((conn_recv_window-=fh.length)<0){
+	goaway(H2_FLOW_CONTROL_ERROR);
+	return false;
+    }
+    h2_stream *s=find(fh.stream);
+    if(s==0 || s->request_done){
+	// it counts against the connection all the same
+	conn_credit+=fh.length;
+	if(fh.stream>last_stream){
+	    goaway(H2_PROTOCOL_ERROR);
+	    return false;
+	}
+	reset(fh.stream,H2_STREAM_CLOSED);
+	return true;
+    }
+    if((s->recv_window-=fh.length)<0){
+	conn_credit+=fh.length;
+	reset(fh.stream,H2_FLOW_CONTROL_ERROR);
+	return true;
+    }
+    size_t len=fh.length-off-pad;
+    s->received+=len;
+    if(s->has_length && (s->received>s->expected
+	    || ((fh.flags&H2_END_STREAM) && s->received!=s->expected))){
+	// the backend's been told a length this body isn't
+	conn_credit+=fh.length;
+	reset(fh.stream,H2_PROTOCOL_ERROR);
+	return true;
+    }
+    // padding's given back now, the rest once the backend's taken it
+    credit(s,fh.length-len);
+    if(len){
+	if(s->chunked){
+	    char size[20];
+	    snprintf(size,sizeof size,"%zx\r\n",len);
+	    s->to_server+=size;
+	}
+	s->to_server.append(reinterpret_cast<const char*>(payload+off),len);
+	if(s->chunked){
+	    s->to_server+="\r\n";
+	}
+	s->held+=len;
+    }
+    if(fh.flags&H2_END_STREAM){
+	s->request_done=true;
+	if(s->chunked){
+	    s->to_server+="0\r\n\r\n";
+	}
+    }
+    write_server(s);
+    return true;
+}
+
+// what a stream depends on and how much it gets next to its siblings
+void
+h2Connection::priority(uint32_t id,const uint8_t *p)
+{
+    uint32_t dep=h2_get32(p)&0x7fffffff;
+    bool exclusive=(p[0]&0x80)!=0;
+    unsigned weight=p[4]+1u;
+    if(dep==id){
+	reset(id,H2_PROTOCOL_ERROR);
+	return;
+    }
+    h2_stream *s=find(id);
+    if(s==0){
+	// one that's closed, or not open yet, and we don't keep either
+	return;
+    }
+    h2_stream *d=find(dep);
+    if(d==0){
+	dep=0;
+    }else{
+	// if it's to depend on one of its own, that one moves up to
+	// where it was first, 5.3.3
+	h2_stream *up=d;
+	for(size_t hops=0;up && hops<=streams.size();hops++){
+	    if(up->id==id){
+		d->parent=s->parent;
+		break;
+	    }
+	    up=find(up->parent);
+	}
+    }
+    if(exclusive){
+	for(std::map<uint32_t,h2_stream*>::iterator it=streams.begin();it!=streams.end();it++){
+	    if(it->second->parent==dep && it->second!=s){
+		it->second->parent=id;
+	    }
+	}
+    }
+    s->parent=dep;
+    s->weight=weight;
+}
+
+void
+h2Connection::reset(uint32_t id,uint32_t code)
+{
+    h2_put_frame_header(wbuf,4,H2_RST_STREAM,0,id);
+    h2_put32(wbuf,code);
+    if(h2_stream *s=find(id)){
+	conn_credit+=s->held;
+	close_stream(s);
+    }
+}
+
+void
+h2Connection::goaway(uint32_t code)
+{
+    h2_put_frame_header(wbuf,8,H2_GOAWAY,0,0);
+    h2_put32(wbuf,last_stream);
+    h2_put32(wbuf,code);
+    going_away=true;
+    broken=broken || code!=H2_NO_ERROR;
+}
+
+// Forget a stream.  Closing our end of the socketpair tells the backend,
+// if it's still going, that nobody's listening.
+void
+h2Connection::close_stream(h2_stream *s)
+{
+    if(s->fd>=0){
+	close(s->fd);
+    }
+    for(std::map<uint32_t,h2_stream*>::iterator it=streams.begin();it!=streams.end();it++){
+	if(it->second->parent==s->id){
+	    it->second->parent=s->parent;
+	}
+    }
+    streams.erase(s->id);
+    delete s;
+    streams_open--;
+}
+
+// Our side of the stream's done.  If theirs isn't they can stop sending.
+void
+h2Connection::finish(h2_stream *s)
+{
+    if(!s->request_done){
+	h2_put_frame_header(wbuf,4,H2_RST_STREAM,0,s->id);
+	h2_put32(wbuf,H2_NO_ERROR);
+	conn_credit+=s->held;
+    }
+    close_stream(s);
+}
+
+// n bytes of the body they can send again
+void
+h2Connection::credit(h2_stream *s,size_t n)
+{
+    conn_credit+=n;
+    s->credit+=n;
+    if(!s->request_done && s->credit>=STREAM_WINDOW/2){
+	h2_put_frame_header(wbuf,4,H2_WINDOW_UPDATE,0,s->id);
+	h2_put32(wbuf,static_cast<uint32_t>(s->credit));
+	s->recv_window+=s->credit;
+	s->credit=0;
+    }
+}
+
+// as much of the request as the backend will take right now
+void
+h2Connection::write_server(h2_stream *s)
+{
+    while(!s->to_server.empty()){
+	ssize_t n=s->fd<0?-1:send(s->fd,s->to_server.data(),s->to_server.size(),
+		MSG_NOSIGNAL|MSG_DONTWAIT);
+	if(n>0){
+	    // the framing's counted as body, which only ever gives back a
+	    // little early
+	    size_t body=std::min(static_cast<size_t>(n),s->held);
+	    s->held-=body;
+	    s->to_server.erase(0,n);
+	    credit(s,body);
+	}else if(n==-1 && errno==EINTR){
+	    continue;
+	}else if(n==-1 && (errno==EAGAIN || errno==EWOULDBLOCK)){
+	    return;
+	}else{
+	    // the backend's answered without reading it all, or gone
+	    conn_credit+=s->held;
+	    s->held=0;
+	    s->to_server.clear();
+	}
+    }
+}
+
+// what the backend's said, till there's enough waiting to go out
+void
+h2Connection::read_server(h2_stream *s)
+{
+    char buf[16384];
+    bool eof=false;
+    while(s->out.size()<OUT_HIGH){
+	ssize_t n=recv(s->fd,buf,sizeof buf,MSG_DONTWAIT);
+	if(n>0){
+	    s->from_server.append(buf,n);
+	    if(!parse_response(s,false)){
+		reset(s->id,H2_INTERNAL_ERROR);
+		return;
+	    }
+	    if(s->sent_end){
+		// no body, it all went in the HEADERS
+		finish(s);
+		return;
+	    }
+	    if(s->parse==h2_stream::done){
+		break;
+	    }
+	}else if(n==-1 && errno==EINTR){
+	    continue;
+	}else if(n==-1 && (errno==EAGAIN || errno==EWOULDBLOCK)){
+	    break;
+	}else{
+	    eof=true;
+	    break;
+	}
+    }
+    if(s->parse==h2_stream::done){
+	return;
+    }
+    if(eof){
+	if(!parse_response(s,true)){
+	    // it stopped partway, and all we can do is say so
+	    reset(s->id,H2_INTERNAL_ERROR);
+	}else if(s->sent_end){
+	    finish(s);
+	}
+    }
+}
+
+// Turns the HTTP/1.1 response in from_server into HEADERS and a body for
+// DATA frames, as far as it goes.  False if it's not a response we can
+// make sense of, or eof came before it was finished.
+bool
+h2Connection::parse_response(h2_stream *s,bool eof)
+{
+    bool had_out=!s->out.empty();
+    while(s->parse==h2_stream::head){
+	header_list fields;
+	fields.push_back(header_field(":status",""));
+	size_t pos=0,length=0;
+	bool has_length=false,chunked=false;
+	while(true){
+	    size_t nl=s->from_server.find('\n',pos);
+	    if(nl==std::string::npos){
+		// the send400()s end lines with just \n, so we take either
+		return !eof && s->from_server.size()<MAX_BLOCK;
+	    }
+	    std::string line=s->from_server.substr(pos,nl-pos);
+	    if(!line.empty() && line[line.size()-1]=='\r'){
+		line.erase(line.size()-1);
+	    }
+	    pos=nl+1;
+	    if(fields[0].value.empty()){
+		if(line.size()<12 || line.compare(0,7,"HTTP/1.")!=0){
+		    return false;
+		}
+		fields[0].value=line.substr(9,3);
+		continue;
+	    }
+	    if(line.empty()){
+		break;
+	    }
+	    size_t colon=line.find(':');
+	    if(colon==std::string::npos || colon==0){
+		continue;
+	    }
+	    std::string name=line.substr(0,colon);
+	    std::transform(name.begin(),name.end(),name.begin(),::tolower);
+	    size_t start=line.find_first_not_of(" \t",colon+1);
+	    std::string value=start==std::string::npos?"":line.substr(start);
+	    if(name=="transfer-encoding"){
+		chunked=value.find("chunked")!=std::string::npos;
+	    }
+	    if(hop_by_hop(name)){
+		continue;
+	    }
+	    if(name=="content-length"){
+		has_length=true;
+		length=strtoul(value.c_str(),0,10);
+	    }
+	    fields.push_back(header_field(name,value));
+	}
+	s->from_server.erase(0,pos);
+	int status=atoi(fields[0].value.c_str());
+	if(status/100==1){
+	    // a 100 Continue for a body that's already on its way, we
+	    // don't pass them on and the real answer comes after
+	    continue;
+	}
+	if(s->method=="HEAD" || status==204 || status==304){
+	    s->parse=h2_stream::done;
+	}else if(chunked){
+	    s->parse=h2_stream::chunk_size;
+	}else if(has_length){
+	    s->parse=length?h2_stream::length:h2_stream::done;
+	    s->remaining=length;
+	}else{
+	    s->parse=h2_stream::to_eof;
+	}
+	send_headers(s,fields,s->parse==h2_stream::done);
+	s->sent_end=s->parse==h2_stream::done;
+    }
+    std::string& in=s->from_server;
+    size_t pos=0;
+    bool more=true;
+    while(more && s->parse!=h2_stream::done){
+	switch(s->parse){
+	    case h2_stream::length:
+	    case h2_stream::chunk_data:{
+		size_t take=static_cast<size_t>(std::min<uint64_t>(s->remaining,in.size()-pos));
+		s->out.append(in,pos,take);
+		pos+=take;
+		if((s->remaining-=take)==0){
+		    s->parse=s->parse==h2_stream::length?h2_stream::done:h2_stream::chunk_end;
+		}else{
+		    more=false;
+		}
+		break;
+	    }
+	    case h2_stream::to_eof:
+		s->out.append(in,pos,std::string::npos);
+		pos=in.size();
+		if(eof){
+		    s->parse=h2_stream::done;
+		}
+		more=false;
+		break;
+	    default:{
+		// the lines around chunks
+		size_t nl=in.find('\n',pos);
+		if(nl==std::string::npos){
+		    more=false;
+		    break;
+		}
+		std::string line=in.substr(pos,nl-pos);
+		pos=nl+1;
+		if(s->parse==h2_stream::chunk_size){
+		    char *end;
+		    s->remaining=strtoull(line.c_str(),&end,16);
+		    if(end==line.c_str()){
+			return false;
+		    }
+		    s->parse=s->remaining?h2_stream::chunk_data:h2_stream::trailer;
+		}else if(s->parse==h2_stream::chunk_end){
+		    s->parse=h2_stream::chunk_size;
+		}else if(line.empty() || line=="\r"){
+		    // the end of the trailers, which we drop
+		    s->parse=h2_stream::done;
+		}
+	    }
+	}
+    }
+    in.erase(0,pos);
+    if(!had_out && !s->out.empty()){
+	s->idle=true;
+    }
+    if(s->parse==h2_stream::done){
+	s->out_end=true;
+	// the backend's said all it's going to
+	close(s->fd);
+	s->fd=-1;
+	conn_credit+=s->held;
+	s->held=0;
+	s->to_server.clear();
+	return true;
+    }
+    return !eof;
+}
+
+// HEADERS, and CONTINUATIONs if it doesn't fit in one frame
+void
+h2Connection::send_headers(h2_stream *s,const header_list& fields,bool end)
+{
+    std::string hb;
+    encoder.encode(fields,hb);
+    size_t pos=0;
+    do{
+	size_t len=std::min(hb.size()-pos,static_cast<size_t>(peer_frame_size));
+	uint8_t flags=pos+len==hb.size()?H2_END_HEADERS:0;
+	if(pos==0){
+	    h2_put_frame_header(wbuf,len,H2_HEADERS,flags|(end?H2_END_STREAM:0),s->id);
+	}else{
+	    h2_put_frame_header(wbuf,len,H2_CONTINUATION,flags,s->id);
+	}
+	wbuf.append(hb,pos,len);
+	pos+=len;
+    }while(pos<hb.size());
+}
+
+// can it send a DATA frame right now
+static bool
+sendable(const h2_stream *s,int64_t conn_window)
+{
+    if(s->out.empty()){
+	return s->out_end;
+    }
+    return s->send_window>0 && conn_window>0;
+}
+
+// The stream that gets to send next, RFC 7540 5.3.  One that can send
+// goes before anything that depends on it.  Otherwise, of the streams
+// with the same parent that can send or have one under them that can,
+// the one that's had the least for its weight goes.  0 if none can.
+h2_stream *
+h2Connection::pick()
+{
+    // which streams have something to send at or under them
+    std::map<uint32_t,bool> active;
+    for(std::map<uint32_t,h2_stream*>::iterator it=streams.begin();it!=streams.end();it++){
+	if(!sendable(it->second,conn_send_window)){
+	    continue;
+	}
+	h2_stream *up=it->second;
+	for(size_t hops=0;up && hops<=streams.size() && !active[up->id];hops++){
+	    active[up->id]=true;
+	    up=find(up->parent);
+	}
+    }
+    uint32_t parent=0;
+    while(true){
+	h2_stream *best=0;
+	uint64_t least=UINT64_MAX;
+	std::vector<h2_stream*> woken;
+	for(std::map<uint32_t,bool>::iterator it=active.begin();it!=active.end();it++){
+	    h2_stream *s=find(it->first);
+	    if(!it->second || s->parent!=parent){
+		continue;
+	    }
+	    if(s->idle){
+		woken.push_back(s);
+	    }else if(s->pass<least){
+		least=s->pass;
+	    }
+	}
+	// One that's had nothing to send for a while doesn't get to make
+	// up for lost time, it starts even with the rest
+	for(size_t idx=0;idx<woken.size();idx++){
+	    if(least!=UINT64_MAX && woken[idx]->pass<least){
+		woken[idx]->pass=least;
+	    }
+	    woken[idx]->idle=false;
+	}
+	for(std::map<uint32_t,bool>::iterator it=active.begin();it!=active.end();it++){
+	    h2_stream *s=find(it->first);
+	    if(it->second && s->parent==parent && (best==0 || s->pass<best->pass)){
+		best=s;
+	    }
+	}
+	if(best==0 || sendable(best,conn_send_window)){
+	    return best;
+	}
+	parent=best->id;
+    }
+}
+
+// DATA frames for whatever's waiting, in priority order, as far as flow
+// control lets us.  True if it stopped because there was enough to be
+// going on with and there's more.
+bool
+h2Connection::schedule()
+{
+    bool full=false;
+    while(!full){
+	h2_stream *s=pick();
+	if(s==0){
+	    break;
+	}
+	size_t len=std::min(s->out.size(),static_cast<size_t>(peer_frame_size));
+	if(len){
+	    len=static_cast<size_t>(std::min<int64_t>(len,std::min(s->send_window,conn_send_window)));
+	}
+	bool end=len==s->out.size() && s->out_end;
+	h2_put_frame_header(wbuf,len,H2_DATA,end?H2_END_STREAM:0,s->id);
+	wbuf.append(s->out,0,len);
+	s->out.erase(0,len);
+	s->send_window-=len;
+	conn_send_window-=len;
+	// everything from here up to the root had this much of its share
+	h2_stream *up=s;
+	for(size_t hops=0;up && hops<=streams.size();hops++){
+	    up->pass+=(len+H2_FRAME_HEADER_LEN)*256/up->weight;
+	    up=find(up->parent);
+	}
+	if(end){
+	    finish(s);
+	}else if(s->out.empty()){
+	    s->idle=true;
+	}
+	full=wbuf.size()>=WBUF_HIGH;
+    }
+    if(conn_credit>=CONN_WINDOW/4 || (conn_credit && streams.empty())){
+	h2_put_frame_header(wbuf,4,H2_WINDOW_UPDATE,0,0);
+	h2_put32(wbuf,static_cast<uint32_t>(conn_credit));
+	conn_recv_window+=conn_credit;
+	conn_credit=0;
+    }
+    return full;
+}
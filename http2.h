@@ -0,0 +1,137 @@
+// copyright Patrick Horgan
+// source is open, feel free to use it as you wish with no restrictions
+// except that this copyright notice must be preserved intact
+#ifndef http2_guard
+#define http2_guard
+#include <atomic>
+#include <map>
+#include <string>
+#include <vector>
+#include "h2frame.h"
+#include "hpack.h"
+#include "sockfdwrapper.h"
+
+// One stream of an HTTP/2 connection.  Its request goes to the rest of
+// the server as an HTTP/1.1 request down one end of a socketpair, and the
+// other end is queued for a worker like any connection, so every backend
+// answers h2 requests without knowing.  What comes back is turned into
+// HEADERS and DATA frames.
+struct h2_stream
+{
+    h2_stream(uint32_t id,uint32_t window);
+    uint32_t id;
+    int fd;			// our end of the socketpair, -1 once it's closed
+    std::string method;
+    // the request, what's still to go down fd
+    std::string to_server;
+    bool chunked;		// we're chunking the body, it had no length
+    bool request_done;		// they've sent END_STREAM
+    // A Content-Length they gave has to be what the DATA frames add up
+    // to, 8.1.1, or the backend waits for more or takes the rest as
+    // another request.
+    bool has_length;
+    uint64_t expected;
+    uint64_t received;
+    size_t held;		// body bytes in to_server
+    size_t credit;		// written down fd, not given back yet
+    int64_t recv_window;	// what they can still send us
+    // the response, as it comes back up fd
+    enum { head, length, chunk_size, chunk_data, chunk_end, trailer, to_eof, done } parse;
+    std::string from_server;	// read but not parsed
+    uint64_t remaining;		// of a Content-Length or chunk
+    std::string out;		// body waiting for DATA frames
+    bool out_end;		// END_STREAM goes out once out's gone
+    bool sent_end;		// it went out with the HEADERS
+    int64_t send_window;
+    // priority, RFC 7540 5.3
+    uint32_t parent;
+    unsigned weight;		// 1 to 256
+    uint64_t pass;		// how much it's been given, over its weight
+    bool idle;			// had nothing to send last time we looked
+};
+
+class h2Connection
+{
+public:
+    // gives one end of a socketpair to a worker, false if it can't
+    typedef bool (*dispatcher)(int fd);
+    // Every h2 connection holds a worker for as long as it's open and
+    // needs others for its streams, so there can only be so many.  The
+    // constructor's only for connections reserve() said yes to.  Streams
+    // past max_streams, across all the connections, are refused, 0 means
+    // there's no limit but each connection's own.
+    static void set_limit(unsigned max,unsigned max_streams=0)
+	{ max_connections=max; stream_limit=max_streams; };
+    static bool reserve();
+    h2Connection(sockfdwrapper& sfd,dispatcher dispatch,unsigned idle_ms);
+    ~h2Connection();
+    // After an HTTP/1.1 request with Upgrade: h2c and we've sent the 101.
+    // settings is the HTTP2-Settings header and request is the request
+    // itself, ready to go to a backend, which becomes stream 1.  False if
+    // the settings are no good.
+    bool upgraded(const std::string& settings,const std::string& request,
+	    const std::string& method);
+    // Talks HTTP/2 until one of us is done.  expect is what's still to
+    // come of the client's preface.
+    void run(const char *expect);
+    // too many connections already, so tell them without talking
+    static void refuse(sockfdwrapper& sfd);
+private:
+    h2Connection(const h2Connection&);
+    const h2Connection& operator=(const h2Connection&);
+    bool read_client();
+    void process();
+    bool frame(const h2_frame_header& fh,const uint8_t *payload);
+    uint32_t settings(const uint8_t *payload,size_t len);
+    bool header_block(uint32_t id,uint8_t flags);
+    bool data(const h2_frame_header& fh,const uint8_t *payload);
+    void priority(uint32_t id,const uint8_t *p);
+    h2_stream *open_stream(uint32_t id,const std::string& request,
+	    const std::string& method,bool done);
+    void reset(uint32_t id,uint32_t code);
+    void goaway(uint32_t code);
+    void close_stream(h2_stream *s);
+    void finish(h2_stream *s);
+    void write_server(h2_stream *s);
+    void read_server(h2_stream *s);
+    bool parse_response(h2_stream *s,bool eof);
+    void send_headers(h2_stream *s,const header_list& fields,bool end);
+    h2_stream *pick();
+    bool schedule();
+    void credit(h2_stream *s,size_t n);
+    bool flush();
+    h2_stream *find(uint32_t id);
+
+    sockfdwrapper& sfd;
+    int fd;
+    dispatcher dispatch;
+    unsigned idle_ms;
+    hpackDecoder decoder;
+    hpackEncoder encoder;
+    std::map<uint32_t,h2_stream*> streams;
+    std::string in;		// what they've sent we haven't used
+    std::string wbuf;		// frames waiting to go to them
+    std::string expect;		// of the preface, still
+    // a HEADERS without END_HEADERS, till its CONTINUATIONs are all here
+    uint32_t continuing;
+    uint8_t continuing_flags;
+    std::string block;
+    bool prio_set;		// and the HEADERS had a priority, this one
+    uint8_t prio[5];
+    uint32_t last_stream;	// the highest they've opened
+    bool going_away;		// no more streams, finish what there is
+    bool broken;		// we sent a GOAWAY for an error, just flush
+    // what they said in SETTINGS
+    uint32_t peer_window;
+    uint32_t peer_frame_size;
+    int64_t conn_send_window;
+    int64_t conn_recv_window;
+    size_t conn_credit;
+
+    static unsigned max_connections;
+    static std::atomic<unsigned> connections;
+    static unsigned stream_limit;
+    static std::atomic<unsigned> streams_open;
+    static bool reserve_stream();
+};
+#endif
@@ -3,18 +3,78 @@
 // except that this copyright notice must be preserved intact
 #include <map>
 #include <netdb.h>
+#include <csignal>
 #include <fcntl.h>	    // only for O_NONBLOCK
 #include "adaptiveThreadPool.h"
+#include "capture.h"
+#include "cgi.h"
+#include "cgienv.h"
+#include "dircache.h"
+#include "fastcgi.h"
+#include "handlerplugin.h"
 #include "http.h"
+#include "http2.h"
+#include "pathcache.h"
+#include "pathintern.h"
+#include "probes.h"
+#include "proxy.h"
+#include "requestbody.h"
+#include "router.h"
 #include "sockfdwrapper.h"
+#include "ssi.h"
+#include "trace.h"
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
-#include <dirent.h>
 #include <fstream>
 #include <algorithm>
 #include "time.h"
 #include <strings.h>
 #include <unistd.h>
 
+// what each path gets, from the defaults, -r, -f and -p
+requestRouter router;
+// if no route has a class of its own, classify() needn't peek
+bool classed_routes=false;
+// for the status route
+time_t started_at;
+std::atomic<unsigned long> requests_served(0);
+// rendered listings for directories without an index.html
+dirCache dir_cache;
+// what request paths turned out to be on disk
+pathCache path_cache;
+// every request path we've looked up, as a number for path_cache
+pathIntern path_ids;
+// biggest request body we'll take, -b on the command line
+size_t max_body_size=16*1024*1024;
+// Connections turned away from the accept loop, and when we give up on
+// them closing first.  Capped so a flood can't make us hold them all.
+std::map<int,time_t> lingering;
+const size_t MAX_LINGERING=1024;
+const time_t LINGER_SECS=2;
+// every connection's deadlines, on one wheel with one thread to turn it
+timerWheel conn_wheel;
+conn_timeouts timeouts;
+// what the accept loop waits on, parked connections go in it too
+int accept_epoll=-1;
+
+// A kept-alive connection waiting on its next request takes no thread and
+// no buffer, just one of these, indexed by its fd, and what the kernel
+// keeps for the socket.  The table's mmapped one for every fd we could
+// have, so only the pages fds are actually parked in ever get touched,
+// and all zeroes is a good disarmed timer.
+struct parked_conn
+{
+    wheel_timer timer;
+    std::atomic<int> expired;	    // set from the wheel's thread
+    uint32_t connection;	    // its number in the capture, if there is one
+};
+parked_conn *parked;
+size_t max_parked;
+// -c writes every request here, for replay to send again later
+trafficCapture capture;
+
 void
 error_exit(const char *msg, int status=1)
 {
@@ -53,7 +113,7 @@ createBindAndListenNonBlockingSocket(const char *service)
     // returned 1 or more interfaces that we can use
     for(rp=result;rp!=NULL;rp=rp->ai_next){
 	// adding SOCK_NONBLOCK only works since Linux 2.6.27
-	if((sfd=socket(rp->ai_family,rp->ai_socktype|SOCK_NONBLOCK,rp->ai_protocol))==-1){
+	if((sfd=socket(rp->ai_family,rp->ai_socktype|SOCK_NONBLOCK|SOCK_CLOEXEC,rp->ai_protocol))==-1){
 	    // couldn't create a socket
 	    continue;
 	}else if(setsockopt(sfd,SOL_SOCKET,SO_REUSEADDR,&yes,yes_sz)==-1){
@@ -118,7 +178,8 @@ send301(sockfdwrapper& sfd,const std::string to,const std::string host, const st
 	    << "Date: " << timebuffer << "\r\n"
 	    << "Location: " << to << "\r\n"
 	    << "Content-Length: " << ss.str() << "\r\n"
-	    << "Content-Type: text/html; charset=iso-8859-1\r\n\r\n"
+	    << "Content-Type: text/html; charset=iso-8859-1\r\n"
+	    << sfd.framed_response() << "\r\n"
 	    << data;
     }catch(const socket_insert_fail& sif){
 	std::cerr << sif.what() << '\n';
@@ -217,6 +278,94 @@ send400(sockfdwrapper& sfd)
     return;
 }
 
+void
+send405(sockfdwrapper& sfd,const std::string& allow)
+{
+    try{
+    sfd<<
+	"HTTP/1.1 405 Method Not Allowed\r\n"
+	"Allow: " << allow << "\r\n\r\n"
+	"<!DOCTYPE html >"
+	"<html><head>"
+	"<title>405 Method Not Allowed</title>"
+	"</head><body>"
+	"<h1>Method Not Allowed</h1>"
+	"<p>You can only " << allow << " things here.<br />"
+	"</p>"
+	"<hr>"
+	"</body></html>";
+    }catch(const socket_insert_fail& sif){
+	std::cerr << sif.what() << '\n';
+    }
+    return;
+}
+
+void
+send408(sockfdwrapper& sfd)
+{
+    try{
+    sfd<<
+	"HTTP/1.1 408 Request Timeout\r\n"
+	"Connection: close\r\n\r\n"
+	"<!DOCTYPE html >"
+	"<html><head>"
+	"<title>408 Request Timeout</title>"
+	"</head><body>"
+	"<h1>Request Timeout</h1>"
+	"<p>Your browser took too long sending its request.<br />"
+	"</p>"
+	"<hr>"
+	"</body></html>";
+    }catch(const socket_insert_fail& sif){
+	std::cerr << sif.what() << '\n';
+    }
+    return;
+}
+
+void
+send431(sockfdwrapper& sfd)
+{
+    try{
+    sfd<<
+	"HTTP/1.1 431 Request Header Fields Too Large\r\n"
+	"Connection: close\r\n\r\n"
+	"<!DOCTYPE html >"
+	"<html><head>"
+	"<title>431 Request Header Fields Too Large</title>"
+	"</head><body>"
+	"<h1>Request Header Fields Too Large</h1>"
+	"<p>Your browser sent a bigger header than this server will hold.<br />"
+	"</p>"
+	"<hr>"
+	"</body></html>";
+    }catch(const socket_insert_fail& sif){
+	std::cerr << sif.what() << '\n';
+    }
+    return;
+}
+
+void
+send413(sockfdwrapper& sfd)
+{
+    try{
+    sfd<<
+	"HTTP/1.1 413 Request Entity Too Large\r\n"
+	"Connection: close\r\n\r\n"
+	"<!DOCTYPE html >"
+	"<html><head>"
+	"<title>413 Request Entity Too Large</title>"
+	"</head><body>"
+	"<h1>Request Entity Too Large</h1>"
+	"<p>Your browser sent more than this server is willing to take.<br />"
+	"</p>"
+	"<hr>"
+	"</body></html>";
+    }catch(const socket_insert_fail& sif){
+	std::cerr << sif.what() << '\n';
+    }
+    return;
+}
+
 void
 send500(sockfdwrapper& sfd)
 {
@@ -237,205 +386,320 @@ send500(sockfdwrapper& sfd)
     }
     return;
 }
+
 void
-send_directory(sockfdwrapper& sfd,std::string& directory,std::string uri)
+send502(sockfdwrapper& sfd)
 {
-    struct dirent entry;
-    struct dirent *retval;
-    DIR *dir=opendir(directory.c_str());;
+    try{
+    sfd<<
+	"HTTP/1.1 502 Bad Gateway\r\n"
+	"Connection: close\r\n\r\n"
+	"<!DOCTYPE html >"
+	"<html><head>"
+	"<title>502 Bad Gateway</title>"
+	"</head><body>"
+	"<h1>Bad Gateway</h1>"
+	"<p>The server this goes to didn't answer.<br />"
+	"</p>"
+	"<hr>"
+	"</body></html>";
+    }catch(const socket_insert_fail& sif){
+	std::cerr << sif.what() << '\n';
+    }
+    return;
+}
 
+// Built ahead of time so turning a connection away is one send from
+// whatever thread does it, usually the one doing the accepting.
+const char shed_response[]=
+    "HTTP/1.1 503 Service Unavailable\r\n"
+    "Retry-After: 1\r\n"
+    "Content-Type: text/html\r\n"
+    "Content-Length: 170\r\n"
+    "Connection: close\r\n\r\n"
+    "<!DOCTYPE html >"
+    "<html><head>"
+    "<title>503 Service Unavailable</title>"
+    "</head><body>"
+    "<h1>Service Unavailable</h1>"
+    "<p>Too busy right now, try again in a second.</p>"
+    "</body></html>";
 
+// Tell them we're too busy, then read whatever request they've sent so
+// that closing doesn't reset the connection before they see the 503.
+// Never blocks.
+void
+shed_connection(int fd)
+{
+    char buf[4096];
+    send(fd,shed_response,sizeof shed_response-1,MSG_NOSIGNAL|MSG_DONTWAIT);
+    while(recv(fd,buf,sizeof buf,MSG_DONTWAIT)>0);
+}
+
+void
+send_directory(sockfdwrapper& sfd,std::string& directory,const std::string& path)
+{
     try{
-	sfd <<
-	    "HTTP/1.1 200 OK\n"
-	    "Set-Cookie: server=patrick0.7\n\n"
-	    "<html>\n"
-	    "  <head>\n"
-	    "    <style>\n"
-	    "      pre {\n"
-	    "        border: solid 1px;\n"
-	    "        background-color: rgb(270,260,200);\n"
-	    "        width: auto;\n"
-	    "      }\n"
-	    "    </style>\n"
-	    "  </head>\n"
-	    "  <body>\n"
-	    "    <h1>" << uri << "</h1>\n"
-	    "    <pre>\n";
-	while(!readdir_r(dir,&entry,&retval)&&retval!=NULL){
-	    sfd << entry.d_name << '\n';
-	}
-	sfd << 
-	    "    </pre>\n"
-	    "  </body>\n"
-	    "</html>\n";
+	if(!dir_cache.send(sfd,directory,path)){
+	    std::cerr << directory << ": " << strerror(errno) << '\n';
+	    send404(sfd);
+	}
     }catch(const socket_insert_fail& sif){
 	std::cerr << sif.what() << '\n';
     }
+}
 
-    closedir(dir);
+// A strong validator for a plain file.  Any change that would change the
+// bytes changes the inode, the size or the mtime.
+std::string
+file_etag(const struct stat& sb)
+{
+    char buf[64];
+    snprintf(buf,sizeof buf,"\"%lx-%llx-%llx.%lx\"",
+	    static_cast<unsigned long>(sb.st_ino),
+	    static_cast<unsigned long long>(sb.st_size),
+	    static_cast<unsigned long long>(sb.st_mtim.tv_sec),
+	    static_cast<unsigned long>(sb.st_mtim.tv_nsec));
+    return buf;
+}
 
+// fnv-1a, just to squash a page and everything it includes into one tag
+static void
+fnv_mix(uint64_t& hash,const void *data,size_t len)
+{
+    const unsigned char *ptr=static_cast<const unsigned char*>(data);
+    for(size_t ctr=0;ctr<len;ctr++){
+	hash^=ptr[ctr];
+	hash*=1099511628211ULL;
+    }
 }
 
-std::string&
-expand_includes(fileblob& b,std::string& data)
+static void
+fnv_mix_stat(uint64_t& hash,const struct stat& sb)
 {
-    // We have to check for included files
-    // format is something like:
-    // <!--#include virtual="/cgi-bin/counter.pl" -->
-    // There's also file= but we don't support it, nor do we support
-    // any other SSI.
-    //std::cerr << "expand_includes for " << b.path << "\n";
-    //std::cerr << "on input, data is\n";
-    //std::cerr << data << "\n";
+    fnv_mix(hash,&sb.st_ino,sizeof(sb.st_ino));
+    fnv_mix(hash,&sb.st_size,sizeof(sb.st_size));
+    fnv_mix(hash,&sb.st_mtim,sizeof(sb.st_mtim));
+}
 
-    const char* searchSSIinclude="<!--#include";
-    const char* searchVirtual="virtual";
-    const char* searchSSIEnd="-->";
-    fileblob::iterator start,foundit,last=b.begin();
+// An SSI page changes when anything it includes does, so its validators
+// come from the whole set.  The tag's weak since we only promise the
+// inputs are the same.  Every included file, and its directory, gets
+// watched.
+static void
+ssi_validators(const std::string& filename,const struct stat& sb,
+	path_resolution& res,std::vector<std::string>& watchdirs,
+	std::vector<std::string>& watchfiles)
+{
+    fileblob b(filename);
+    null_sink scratch;
+    std::vector<std::string> deps;
+    uint64_t hash=14695981039346656037ULL;
+    struct stat depsb;
+    char buf[24];
 
-    while(last!=b.end() && (foundit=std::search(last,b.end(),searchSSIinclude,searchSSIinclude+12))!=b.end()){
-	start=foundit; // remember beginning in case we can't use it
-	// data gets from beginning to the include
-	data+=std::string(last,foundit);
-	// search for virtual
-	if((foundit=std::search(foundit+13,b.end(),searchVirtual,searchVirtual+7))==b.end()){
-	    // didn't find virtual, so look for end of SSI tag
-	    foundit=std::search(start,b.end(),searchSSIEnd,searchSSIEnd+3);
-	    if(foundit!=b.end()){
-		// if we found the ending -->, add to output and skip
-		data+=std::string(start,foundit+3);
-		last=foundit+3;
-		continue;
-	    }else{
-		// no end of tag in the whole thing!!! skip to end
-		data=std::string(start,b.end());
-		last=b.end();
-		continue;
-	    }
-	}else{
-	    // Found the word virtual and foundit points at it
-	    foundit+=7;	// get past "virtual" then find the = sign
-	    while(*foundit!='=') foundit++;
-	    foundit++;	// skip the equal sign
-	    // now skip ws
-	    while(*foundit==' ' || *foundit=='\t' || *foundit=='\r' || *foundit=='\n') foundit++;
-	    // after white space expect 'filename' or "filename"
-	    if(*foundit=='\'' || *foundit=='"'){
-		fileblob::iterator idx;
-		char sep=*foundit++;	// remember ' or "
-		idx=foundit;
-		while(*idx!=sep && idx!=b.end()) idx++;
-		if(idx==b.end()){
-		    // malformed file with 'filename.... and never a '
-		    data+=std::string(start,b.end());
-		    last=b.end();
-		    continue;
-		}
-		// found a name between quotes, look for such a file
-		std::string thefile=b.curdir()+"/"+std::string(foundit,idx);
-		fileblob tfb(thefile);
-		if(tfb.blob_size!=0){
-		    data+=expand_includes(tfb,data);
-		}else{
-		    // what do we do if the file doesn't open
-		}
-		// now skip to end of the SSI tag and skip it.
-		foundit=std::search(++idx,b.end(),searchSSIEnd,searchSSIEnd+3);
-		if(foundit!=b.end()){
-		    // if we found the ending --> just skip past it.
-		    last=foundit+3;
-		    continue;
-		}else{
-		    // otherwise, add the data past the idx to the end to the
-		    // string  The would let something like
-		    // <--#include virtual="some.file"
-		    // work incorrectly but what else do we do?
-		    last=b.end();
-		    data+=std::string(++idx,b.end());
-		    continue;
-		}
-	    }else{
-		// found virtual= but then no ' or "
-		// skip to end of ssi element if found
-		foundit=std::search(start,b.end(),searchSSIEnd,searchSSIEnd+3);
-		if(foundit!=b.end()){
-		    data+=std::string(start,foundit+3);
-		    last=foundit+3;
-		    continue;
-		}else{
-		    data+=std::string(start,b.end());
-		    last=b.end();
-		    continue;
-		}
-	    }
+    expand_includes(b,scratch,&deps);
+    fnv_mix_stat(hash,sb);
+    res.lastmod=sb.st_mtime;
+    for(size_t ctr=0;ctr<deps.size();ctr++){
+	watchdirs.push_back(deps[ctr].substr(0,deps[ctr].rfind('/')));
+	watchfiles.push_back(deps[ctr]);
+	if(stat(deps[ctr].c_str(),&depsb)==-1){
+	    fnv_mix(hash,"missing",7);	// its showing up is a change too
+	    continue;
+	}
+	fnv_mix_stat(hash,depsb);
+	if(depsb.st_mtime>res.lastmod){
+	    res.lastmod=depsb.st_mtime;
 	}
     }
-    // If we never found an include last is still pointing at the start.  
-    // Otherwise, it's pointing past the -->, or if not found at end()
-    data+=std::string(last,b.end());   // Add rest to data
-    return data;
+    snprintf(buf,sizeof buf,"%016llx",static_cast<unsigned long long>(hash));
+    res.etag=std::string("W/\"")+buf+"\"";
+}
+
+void
+send304(sockfdwrapper& sfd,const path_resolution& res,const std::string& cache_control)
+{
+    try{
+	sfd << "HTTP/1.1 304 Not Modified\r\n"
+	    "Date: " << http_date(time(NULL)) << "\r\n"
+	    "ETag: " << res.etag << "\r\n"
+	    "Last-Modified: " << http_date(res.lastmod) << "\r\n"
+	    << cache_control << sfd.framed_response() << "\r\n";
+    }catch(const socket_insert_fail& sif){
+	std::cerr << sif.what() << '\n';
+    }
 }
 
+std::string
+content_type(const std::string& ext)
+{
+    if(ext=="ico" or ext=="jpeg" or ext=="jpg"
+	    or ext=="png" or ext=="gif" or ext=="bmp"){
+	return "image/"+ext;
+    }else if(ext=="js"){
+	return "application/javascript";
+    }else if(ext=="bz2"){
+	return "application/x-bzip2";
+    }else if(ext=="ogg"){
+	return "audio/ogg";
+    }else if(ext=="css"){
+	return "text/css";
+    }else if(ext=="html" || ext=="htm"){
+	return "text/html";
+    }
+    return "application/octet-stream";
+}
+
+// Anything that isn't SSI goes straight from the page cache to the socket
+// with sendfile, so we never hold the file in memory.  Honors Range: (and
+// If-Range:) with a 206, as multipart/byteranges if they asked for more
+// than one piece, or a 416 if none of it's in the file.  cache_control is
+// the route's Cache-Control: line, if it has one.
 void
-send_file(sockfdwrapper& sfd,http_request_line& hrl, std::map<std::string,std::string>&hdrs)
+send_static(sockfdwrapper& sfd,const std::string& filename,const std::string& ext,
+	header_map& hdrs,const std::string& cache_control)
 {
+    trace_span span("send_static",filename.c_str());
     struct stat sb;
-    int statrtn;
-    std::string refdir;
-    std::string ext=hrl.get_ext();
+    int filefd;
+    std::vector<byte_range> ranges;
+    range_result rr=range_none;
+
+    if((filefd=open(filename.c_str(),O_RDONLY|O_CLOEXEC))==-1){
+	send404(sfd);
+	return;
+    }
+    if(fstat(filefd,&sb)==-1){
+	close(filefd);
+	send500(sfd);
+	return;
+    }
+    std::string type=content_type(ext);
+    std::string lastmod=http_date(sb.st_mtime);
+    std::string etag=file_etag(sb);
+    header_map::iterator range=hdrs.find("Range");
+    header_map::iterator ifrange=hdrs.find("If-Range");
+    // If-Range says only give them the range if it hasn't changed since
+    // they got the rest, otherwise they want the whole thing.  It has to
+    // be a strong match, so exactly our etag or exactly our date.
+    if(range!=hdrs.end() && (ifrange==hdrs.end() || ifrange->second==lastmod.c_str()
+		|| etag_matches(ifrange->second,etag,false))){
+	rr=parse_range(range->second,sb.st_size,ranges);
+    }
+
+    std::stringstream head;
+    const char *boundary="patrick0.7-byteranges-boundary";
+    try{
+	if(rr==range_unsatisfiable){
+	    head << "HTTP/1.1 416 Requested Range Not Satisfiable\r\n"
+		"Set-Cookie: server=patrick0.7\r\n"
+		"Content-Range: bytes */" << sb.st_size << "\r\n"
+		"Content-Length: 0\r\n" << sfd.framed_response() << "\r\n";
+	    sfd << head.str();
+	}else if(rr==range_none){
+	    head << "HTTP/1.1 200 OK\r\n"
+		"Set-Cookie: server=patrick0.7\r\n"
+		"Content-Type: " << type << "\r\n"
+		"Content-Length: " << sb.st_size << "\r\n"
+		"Last-Modified: " << lastmod << "\r\n"
+		"ETag: " << etag << "\r\n"
+		"Accept-Ranges: bytes\r\n" << cache_control
+		<< sfd.framed_response() << "\r\n";
+	    sfd << head.str();
+	    sfd.sendfile(filefd,0,sb.st_size);
+	}else if(ranges.size()==1){
+	    head << "HTTP/1.1 206 Partial Content\r\n"
+		"Set-Cookie: server=patrick0.7\r\n"
+		"Content-Type: " << type << "\r\n"
+		"Content-Range: bytes " << ranges[0].first << '-' << ranges[0].last
+		    << '/' << sb.st_size << "\r\n"
+		"Content-Length: " << ranges[0].last-ranges[0].first+1 << "\r\n"
+		"Last-Modified: " << lastmod << "\r\n"
+		"ETag: " << etag << "\r\n"
+		"Accept-Ranges: bytes\r\n" << cache_control
+		<< sfd.framed_response() << "\r\n";
+	    sfd << head.str();
+	    sfd.sendfile(filefd,ranges[0].first,ranges[0].last-ranges[0].first+1);
+	}else{
+	    // work out every part's header first so we can say how long the
+	    // whole thing is
+	    std::vector<std::string> partheads;
+	    off_t length=0;
+	    for(size_t ctr=0;ctr<ranges.size();ctr++){
+		std::stringstream ph;
+		ph << "\r\n--" << boundary << "\r\n"
+		    "Content-Type: " << type << "\r\n"
+		    "Content-Range: bytes " << ranges[ctr].first << '-' << ranges[ctr].last
+			<< '/' << sb.st_size << "\r\n\r\n";
+		partheads.push_back(ph.str());
+		length+=partheads[ctr].size()+ranges[ctr].last-ranges[ctr].first+1;
+	    }
+	    std::string trailer=std::string("\r\n--")+boundary+"--\r\n";
+	    length+=trailer.size();
+	    head << "HTTP/1.1 206 Partial Content\r\n"
+		"Set-Cookie: server=patrick0.7\r\n"
+		"Content-Type: multipart/byteranges; boundary=" << boundary << "\r\n"
+		"Content-Length: " << length << "\r\n"
+		"Last-Modified: " << lastmod << "\r\n"
+		"ETag: " << etag << "\r\n"
+		"Accept-Ranges: bytes\r\n" << cache_control
+		<< sfd.framed_response() << "\r\n";
+	    sfd << head.str();
+	    for(size_t ctr=0;ctr<ranges.size();ctr++){
+		sfd << partheads[ctr];
+		sfd.sendfile(filefd,ranges[ctr].first,ranges[ctr].last-ranges[ctr].first+1);
+	    }
+	    sfd << trailer;
+	}
+    }catch(const socket_insert_fail& sif){
+	std::cerr << sif.what() << '\n';
+    }
+    close(filefd);
+}
 
+// Run the stat chain to work out what the request means on disk.  This is
+// only done when pathcache doesn't already know.  watchdirs gets the
+// directories whose entries changing would change the answer, and
+// watchfiles the files whose contents would.  Returns false on a stat
+// failure we can't explain, which isn't worth caching.
+static bool
+resolve_path(const std::string& path,const std::string& refpath,
+	header_map& hdrs,path_resolution& res,
+	std::vector<std::string>& watchdirs,std::vector<std::string>& watchfiles)
+{
+    struct stat sb;
     // technically should check for existence:
     // if(hdrs.find("DOCUMENT_ROOT")!=hdrs.end()) but I always put this one in.
-    std::string filename=hdrs["DOCUMENT_ROOT"];
+    std::string filename=to_std(hdrs["DOCUMENT_ROOT"]);
     // Now we point to the document root, add the string from the request
-    filename+=hrl.get_path();
+    filename+=path;
+    res.kind=res_not_found;
     // Now we've got the filename, check to see if it exists
-    if((statrtn=stat(filename.c_str(),&sb))==-1){
+    if(stat(filename.c_str(),&sb)==-1){
 	// the stat failed, see why
-	if(errno==ENOENT){
-	    std::cerr << filename.c_str() << " does not exist\n";
-	    // The file does not exist with that name, try building it again
-	    // as a relative reference using the referer
-	    std::string refval=hdrs["Referer"];
-	    if(refval!=""){
-		int offset=refval.find('/',7);
-		std::string referer=std::string(hdrs["Referer"],offset);
-		std::string dirname=hdrs["DOCUMENT_ROOT"]+referer;
-		// Now we might have the directory the file is in, check
-		// to see if it exists
-		if(stat(dirname.c_str(),&sb)==-1){
-		    // Nope, doesn't exist, out of luck
-		    send404(sfd);
-		    return;
-		}else{
-		    // exists, check if it's a directory
-		    if((sb.st_mode&S_IFMT)==S_IFDIR){
-			// yep, try adding our filename to it
-			std::cerr << "~~~~~building from DOCUMENT_ROOT: " 
-			    << hdrs["DOCUMENT_ROOT"]
-			    << ", Referer: " << referer
-			    << " and the request: "
-			    << hrl.get_path()
-			    << '\n';
-			filename=dirname+hrl.get_path();
-			if(stat(filename.c_str(),&sb)==-1){
-			    // doesn't exist
-			    send404(sfd);
-			    return;
-			}
-		    }else{
-			// Not a directory so won't find our file in there
-			send404(sfd);
-			return;
-		    }
-		}
-	    }
-	}else{ // stat failed on file and wasn't enoent so log an error
+	if(errno!=ENOENT && errno!=ENOTDIR){
+	    // stat failed on file and wasn't enoent so log an error
 	    std::cerr << "Unknown error: " << strerror(errno) << '\n';
-	    // and send a 500 unexpected server error ??? What else?
-	    send500(sfd);
-	    return;
+	    return false;
+	}
+	if(refpath==""){
+	    return true;
+	}
+	// The file does not exist with that name, try building it again
+	// as a relative reference using the referer
+	std::string dirname=to_std(hdrs["DOCUMENT_ROOT"])+refpath;
+	// Now we might have the directory the file is in, check
+	// to see if it exists and that it's a directory
+	if(stat(dirname.c_str(),&sb)==-1 || (sb.st_mode&S_IFMT)!=S_IFDIR){
+	    // Nope, out of luck
+	    return true;
+	}
+	// yep, try adding our filename to it
+	filename=dirname+path;
+	if(stat(filename.c_str(),&sb)==-1){
+	    // doesn't exist
+	    return true;
 	}
     }
     // Here we have found something in the filesystem, either a directory
@@ -446,29 +710,150 @@ send_file(sockfdwrapper& sfd,http_request_line& hrl, std::map<std::string,std::s
 	// do this, because otherwise things get too hard with relative
 	// requests
 	if(filename[filename.size()-1]!='/'){
-	    send301(sfd,
-		static_cast<std::string>(hrl.get_uri())+="/",hrl.get_host(),hrl.get_port());
-	    return;
+	    res.kind=res_redirect;
+	    watchdirs.push_back(filename.substr(0,filename.rfind('/')));
+	    return true;
 	}
 	// Well it's a directory, see if it has an index.html in it.
 	// I've arbitrarily decided not to check for index.htm or index.php etc
 	// for now.
 	// If not, send the directory
 	// todo: needs checking that still under Document-Root
+	watchdirs.push_back(filename.substr(0,filename.size()-1));
 	std::string index=filename+"index.html";
-	if(stat(index.c_str(),&sb)!=-1){
-	    filename=index;
-	}else{
-	    // Send the directory contents
-	    send_directory(sfd,filename,hrl.get_uri());
+	if(stat(index.c_str(),&sb)==-1){
+	    res.kind=res_listing;
+	    res.target=filename;
+	    return true;
+	}
+	res.kind=res_index;
+	res.target=index;
+    }else{
+	res.kind=res_file;
+	res.target=filename;
+	watchdirs.push_back(filename.substr(0,filename.rfind('/')));
+    }
+    // work out the validators now so that revalidating is just a lookup
+    watchfiles.push_back(res.target);
+    std::string ext=res.target.substr(res.target.rfind('.')+1);
+    if(ext=="html" || ext=="htm"){
+	ssi_validators(res.target,sb,res,watchdirs,watchfiles);
+    }else{
+	res.etag=file_etag(sb);
+	res.lastmod=sb.st_mtime;
+    }
+    return true;
+}
+
+// look up the request in path_cache, resolving and remembering it on a miss
+static bool
+cached_resolve(const std::string& path,const std::string& refpath,
+	header_map& hdrs,path_resolution& res)
+{
+    // the stat chain, unless pathcache already knows
+    trace_span span("resolve",path.c_str());
+    // Anyone can send any path or Referer, so paths are only interned once
+    // they've led to something, below.  Misses for ones that never have
+    // are remembered by their text instead.
+    uint32_t id=path_ids.find(path);
+    uint32_t refid=refpath==""?pathIntern::NO_ID:path_ids.find(refpath);
+    bool known=id!=pathIntern::NO_ID && (refpath=="" || refid!=pathIntern::NO_ID);
+    std::string name=refpath==""?path:path+'\0'+refpath;
+    if(known?path_cache.lookup(static_cast<path_key>(refid)<<32|id,res)
+	    :path_cache.missed(name)){
+	if(!known){
+	    res.kind=res_not_found;
+	}
+	PROBE3(file_resolved,path.c_str(),static_cast<int>(res.kind),1);
+	return true;
+    }
+    std::vector<std::string> watchdirs,watchfiles;
+    unsigned long startgen=path_cache.generation();
+    if(!resolve_path(path,refpath,hdrs,res,watchdirs,watchfiles)){
+	PROBE3(file_resolved,path.c_str(),-1,0);
+	return false;
+    }
+    // A 404 for a path that was never found only goes in the misses.  If
+    // path_ids is full we just don't cache it.
+    if(!known && res.kind==res_not_found){
+	path_cache.insert_miss(name);
+    }else if(!known){
+	id=path_ids.intern(path);
+	refid=refpath==""?pathIntern::NO_ID:path_ids.intern(refpath);
+	known=id!=pathIntern::NO_ID && (refpath=="" || refid!=pathIntern::NO_ID);
+    }
+    if(known){
+	path_cache.insert(static_cast<path_key>(refid)<<32|id,res,watchdirs,
+		watchfiles,startgen);
+    }
+    PROBE3(file_resolved,path.c_str(),static_cast<int>(res.kind),0);
+    return true;
+}
+
+void
+send_file(sockfdwrapper& sfd,http_request_line& hrl, header_map& hdrs,
+	const std::string& cache_control)
+{
+    path_resolution res;
+    std::string ext=hrl.get_ext();
+
+    // Most requests are answered by the path alone.  Only if that finds
+    // nothing do we try again relative to the Referer's directory.
+    if(!cached_resolve(hrl.get_path(),"",hdrs,res)){
+	// and send a 500 unexpected server error ??? What else?
+	send500(sfd);
+	return;
+    }
+    if(res.kind==res_not_found){
+	std::string refval=to_std(hdrs["Referer"]);
+	std::string refpath;
+	size_t offset;
+	// it's going after DOCUMENT_ROOT too, so it gets the same treatment
+	// as the request's path
+	if(refval=="" || (offset=refval.find('/',7))==std::string::npos
+		|| normalize_path(refval.substr(offset,refval.find_first_of("?#",offset)-offset),
+		    refpath)!=path_ok){
+	    send404(sfd);
 	    return;
 	}
+	if(!cached_resolve(hrl.get_path(),refpath,hdrs,res)){
+	    send500(sfd);
+	    return;
+	}
+    }
+    switch(res.kind){
+	case res_not_found:
+	    send404(sfd);
+	    return;
+	case res_redirect:
+	    send301(sfd,
+		static_cast<std::string>(hrl.get_uri())+="/",hrl.get_host(),hrl.get_port());
+	    return;
+	case res_listing:
+	    // Send the directory contents
+	    send_directory(sfd,res.target,hrl.get_path());
+	    return;
+	case res_file:
+	case res_index:
+	    // the browser's copy is still good, tell it so before we go
+	    // anywhere near the file, the resolution has all we need for that
+	    if(not_modified(hdrs,res.etag,res.lastmod)){
+		send304(sfd,res,cache_control);
+		return;
+	    }
+	    break;
     }
+    std::string filename=res.target;
     // Directories dealt with, now we know that it's a file
     // get the name of the directory the file is in
     int lastslash=filename.rfind('/');
     std::string curdir=filename.substr(0,lastslash);
 
+    ext=filename.substr(filename.rfind('.')+1);
+    if(ext!="html" && ext!="htm"){
+	send_static(sfd,filename,ext,hdrs,cache_control);
+	return;
+    }
     // this is where we get the blob
     fileblob b(filename);
     if(b.blob_size==0){
@@ -476,42 +861,29 @@ send_file(sockfdwrapper& sfd,http_request_line& hrl, std::map<std::string,std::s
 	return;
     }
     try{
-	ext=b.ext();
-	sfd <<
-	    "HTTP/1.1 200 OK\r\n"
-	    "Set-Cookie: server=patrick0.7\r\n";
-	if(ext=="ico" or ext=="jpeg" or ext=="jpg"
-		or ext=="png" or ext=="gif" or ext=="bmp"){
-	    sfd << "Content-Type: image/" << ext << "\r\n";
-	    sfd << "Content-Length: " << static_cast<int>(b.blob_size) << "\r\n";
-	    sfd << "\r\n";
-	    sfd << b;
-	}else if(ext=="js"){
-	    sfd << "Content-Type: application/javascript\r\n";
-	    sfd << "Content-Length: " << static_cast<int>(b.blob_size) << "\r\n";
-	    sfd << "\r\n";
-	    sfd << b;
-	}else if(ext=="bz2"){
-	    sfd << "Content-Type: application/x-bzip2\r\n";
-	    sfd << "Content-Length: " << static_cast<int>(b.blob_size) << "\r\n";
-	    sfd << "\r\n";
-	    sfd << b;
-	}else if(ext=="ogg"){
-	    sfd << "Content-Type: audio/ogg\r\n"
-		<< "Content-Length: " << static_cast<int>(b.blob_size) << "\r\n";
-	    sfd << "\r\n";
-	    sfd << b;
-	}else if(ext=="css"){
-	    sfd << "Content-Type: text/css\r\n"
-		<< "Content-Length: " << static_cast<int>(b.blob_size) << "\r\n";
-	    sfd << "\r\n";
-	    sfd << b;
-	}else if(ext=="html" || ext=="htm"){
+	std::stringstream head;
+	head << "HTTP/1.1 200 OK\r\n"
+	    "Set-Cookie: server=patrick0.7\r\n"
+	    "Content-Type: text/html\r\n"
+	    "ETag: " << res.etag << "\r\n"
+	    "Last-Modified: " << http_date(res.lastmod) << "\r\n"
+	    << cache_control;
+	if(hrl.is_http11()){
+	    // stream it out as we expand it, so the first bytes leave before
+	    // we've even read the includes and we never hold the whole page
+	    head << "Transfer-Encoding: chunked\r\n" << sfd.framed_response() << "\r\n";
+	    sfd << head.str();
+	    chunked_sink out(sfd);
+	    expand_includes(b,out);
+	    out.finish();
+	}else{
+	    // 1.0 clients can't do chunked, so they wait for the whole thing
 	    std::string data;
-	    expand_includes(b,data);
-	    sfd << "Content-Type: text/html\r\n"
-		<< "Content-Length: " << static_cast<int>(data.size()) << "\r\n";
-	    sfd << "\r\n";
+	    string_sink out(data);
+	    expand_includes(b,out);
+	    head << "Content-Length: " << data.size() << "\r\n"
+		<< sfd.framed_response() << "\r\n";
+	    sfd << head.str();
 	    sfd << data;
 	}
 	return;
@@ -522,97 +894,532 @@ send_file(sockfdwrapper& sfd,http_request_line& hrl, std::map<std::string,std::s
     }
 }
 
+// hand the request to the FastCGI application that owns its prefix
+void
+send_fastcgi(sockfdwrapper& sfd,fcgiPool& pool,http_request_line& hrl,
+	header_map& hdrs,request_body& body)
+{
+    trace_span span("fastcgi",hrl.get_path().c_str());
+    cgi_env env;
+    std::string prefix=pool.get_prefix();
+    if(prefix.size()>1 && prefix[prefix.size()-1]=='/'){
+	prefix.erase(prefix.size()-1);
+    }
+    cgi_environment(env,sfd.get_fd(),hrl,hdrs,prefix,to_std(hdrs["DOCUMENT_ROOT"])+prefix);
+    if(body.present()){
+	// a chunked body only has a length once we've read it all
+	body.spill();
+	std::stringstream ss;
+	ss << body.size();
+	env["CONTENT_LENGTH"]=ss.str();
+	env.erase("HTTP_TRANSFER_ENCODING");
+    }
+    try{
+	pool.run(sfd,env,hrl.is_http11(),body.present()?&body:0);
+    }catch(const fcgi_backend_unavailable& fbu){
+	std::cerr << hrl.get_path() << ": " << fbu.what() << '\n';
+	send500(sfd);
+    }catch(const socket_insert_fail& sif){
+	std::cerr << sif.what() << '\n';
+    }
+}
+
+// pass the request on to one of the route's upstream servers
+void
+send_proxy(sockfdwrapper& sfd,proxyPool& proxy,http_request_line& hrl,
+	header_map& hdrs,request_body& body)
+{
+    trace_span span("proxy",hrl.get_path().c_str());
+    try{
+	proxy.run(sfd,hrl,hdrs,body);
+    }catch(const proxy_upstream_unavailable& pua){
+	std::cerr << hrl.get_path() << ": " << pua.what() << '\n';
+	send502(sfd);
+    }catch(const socket_insert_fail& sif){
+	std::cerr << sif.what() << '\n';
+    }
+}
+
+// Scripts live under DOCUMENT_ROOT where the route says, /cgi-bin/ unless
+// it's told otherwise.  The first path segment after the route's prefix
+// names the script and the rest of the path is PATH_INFO.
 void
-log_request(sockfdwrapper& sfd,http_request_line&hrl, std::map<std::string,std::string>&hdrs)
+send_cgi(sockfdwrapper& sfd,http_request_line& hrl,
+	header_map& hdrs,request_body& body,size_t prefixlen)
+{
+    trace_span span("cgi",hrl.get_path().c_str());
+    const std::string& path=hrl.get_path();
+    size_t slash=path.find('/',prefixlen);
+    std::string script_name=path.substr(0,slash);
+    std::string script=to_std(hdrs["DOCUMENT_ROOT"])+script_name;
+    struct stat sb;
+
+    if(script_name.find("/..")!=std::string::npos || stat(script.c_str(),&sb)==-1
+	    || (sb.st_mode&S_IFMT)!=S_IFREG || access(script.c_str(),X_OK)==-1){
+	send404(sfd);
+	return;
+    }
+    cgi_env env;
+    int stdinfd=-1;
+    cgi_environment(env,sfd.get_fd(),hrl,hdrs,script_name,script);
+    if(body.present()){
+	// the script gets all of it as stdin, from a file if it's big, so
+	// it can't wedge writing output while we're still feeding it input
+	body.spill();
+	std::stringstream ss;
+	ss << body.size();
+	env["CONTENT_LENGTH"]=ss.str();
+	env.erase("HTTP_TRANSFER_ENCODING");
+	stdinfd=body.stdin_fd();
+    }
+    try{
+	run_cgi(sfd,script,env,hrl.is_http11(),stdinfd);
+    }catch(const cgi_spawn_fail& csf){
+	std::cerr << script << ": " << csf.what() << '\n';
+	send500(sfd);
+    }catch(const socket_insert_fail& sif){
+	std::cerr << sif.what() << '\n';
+    }
+    if(stdinfd!=-1){
+	close(stdinfd);
+    }
+}
+
+// what a status route shows, for people and for scripts that poll us
+void
+send_status(sockfdwrapper& sfd,const std::string& cache_control)
+{
+    std::stringstream data;
+    data << "uptime: " << time(NULL)-started_at << "s\n"
+	"requests: " << requests_served.load() << "\n"
+	"pool blocks outstanding: " << bufferPool::outstanding() << "\n"
+	"paths interned: " << path_ids.size() << "\n"
+	"routes: " << router.routes().size() << "\n";
+    std::stringstream head;
+    head << "HTTP/1.1 200 OK\r\n"
+	"Date: " << http_date(time(NULL)) << "\r\n"
+	"Content-Type: text/plain\r\n"
+	"Content-Length: " << data.str().size() << "\r\n"
+	<< cache_control << sfd.framed_response() << "\r\n";
+    try{
+	sfd << head.str() << data.str();
+    }catch(const socket_insert_fail& sif){
+	std::cerr << sif.what() << '\n';
+    }
+}
+
+void
+log_request(sockfdwrapper& sfd,http_request_line&hrl, header_map& hdrs)
 {
     std::cerr << "~logging request~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~\n"
 	<< "Method      : " << hrl.get_method() << '\n'
 	<< "URI         : " << hrl.get_uri() << '\n'
 	<< "HTTP release: " << hrl.get_major_release() << '.' << hrl.get_minor_release() << '\n';
-    for(std::map<std::string,std::string>::iterator i=hdrs.begin();i!=hdrs.end();i++){
+    for(header_map::iterator i=hdrs.begin();i!=hdrs.end();i++){
 	std::cerr << i->first << ": " << i->second << '\n';
     }
     std::cerr << "~end request~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~\n";
 }
 
-/**
- one_request is the entry point for a thread handling one request
- browserFDPointer is a pointer to our wrapper for an fd
- At entry, a client has contacted us, a socket connection exists, but we
- haven't talked to them yet.
- \param browserFDPointer a pointer to the file descriptor of the connection.
- \return void *
- */
+// 1.1 keeps the connection unless they say close, 1.0 only if they ask
+static bool
+wants_keep_alive(http_request_line& hrl,header_map& hdrs)
+{
+    std::string value;
+    header_map::iterator conn=hdrs.find("Connection");
+    if(conn!=hdrs.end()){
+	value=to_std(conn->second);
+	std::transform(value.begin(),value.end(),value.begin(),::tolower);
+    }
+    if(value.find("close")!=std::string::npos){
+	return false;
+    }
+    return hrl.is_http11() || value.find("keep-alive")!=std::string::npos;
+}
 
-void *
-one_request(void *browserFDPointer)
+// the pool, for h2 streams to be queued on like connections
+adaptiveThreadPool *stream_pool;
+unsigned classify(int fd);
+
+// each h2 stream's end of its socketpair goes to a worker, which answers
+// it like any other connection
+static bool
+dispatch_stream(int fd)
 {
-    int browser_fd=*static_cast<int *>(browserFDPointer);
-    sockfdwrapper sfd(browser_fd);
-    if(!sfd.is_valid()){
-	return browserFDPointer;
+    // the fd's new to us, so whatever connection last had its number
+    // isn't this one
+    if(capture.enabled() && static_cast<size_t>(fd)<max_parked){
+	parked[fd].connection=capture.new_connection();
     }
-    std::vector<std::string> headers;
-    std::map<std::string,std::string> mapheaders;
-    mapheaders["DOCUMENT_ROOT"]="/home/patrick/public_html";
+    return stream_pool->addjob(fd,classify(fd));
+}
 
-    const int RECV_BUF_SIZ=1024;
-    char buffer[RECV_BUF_SIZ+1];    // leave room for a trailing '\0'
-    char *bufptr;
-    std::string request;
+// the value of header name, in any case, from the header's lines
+static std::string
+header_value(arena_strings& headers,const char *name)
+{
+    size_t len=strlen(name);
+    for(arena_strings::iterator i=headers.begin();i!=headers.end();i++){
+	if(i->size()>len && (*i)[len]==':' && strncasecmp(i->c_str(),name,len)==0){
+	    size_t start=i->find_first_not_of(" \t",len+1);
+	    return start==arena_string::npos?"":i->c_str()+start;
+	}
+    }
+    return "";
+}
 
+// Upgrade: h2c, on a request without a body so it can go on as stream 1.
+// True if we switched, and then the connection's been HTTP/2 since.
+static bool
+upgrade_h2c(sockfdwrapper& sfd,const arena_string& request,arena_strings& headers,
+	http_request_line& hrl)
+{
+    std::string upgrade=header_value(headers,"Upgrade");
+    std::string settings=header_value(headers,"HTTP2-Settings");
+    std::string length=header_value(headers,"Content-Length");
+    if(upgrade.find("h2c")==std::string::npos || settings.empty() || !hrl.is_http11()
+	    || !header_value(headers,"Transfer-Encoding").empty()
+	    || (!length.empty() && length!="0") || !h2Connection::reserve()){
+	return false;
+    }
+    // the request again, without what was only for this hop
+    std::string text(request.c_str());
+    for(arena_strings::iterator i=headers.begin();i!=headers.end();i++){
+	if(strncasecmp(i->c_str(),"Upgrade:",8)!=0
+		&& strncasecmp(i->c_str(),"HTTP2-Settings:",15)!=0
+		&& strncasecmp(i->c_str(),"Connection:",11)!=0){
+	    text+=i->c_str();
+	    text+="\r\n";
+	}
+    }
+    text+="Connection: close\r\n\r\n";
+    h2Connection h2(sfd,dispatch_stream,timeouts.idle_ms);
+    if(!h2.upgraded(settings,text,hrl.get_method())){
+	return false;
+    }
+    sfd << "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+    // and now they send the whole preface, then frames
+    thread_hold hold;
+    h2.run(H2_PREFACE);
+    return true;
+}
+
+// Reads one request off sfd and answers it.  Returns true if the
+// connection's good for another one.
+static bool
+serve_request(sockfdwrapper& sfd)
+{
+    // everything the request allocates comes from here, and it all goes
+    // at once when this does, after everything below it's gone
+    arena_scope scope;
+    // where its time goes, if it turns out to be worth keeping
+    trace_scope trace("request");
+    trace_span reading("read header");
+    arena_strings headers;
+    header_map mapheaders;
+    mapheaders["DOCUMENT_ROOT"]="/home/patrick/public_html";
+
+    // Lines are looked at where they sit in sfd's receive blocks and only
+    // copied once, into the arena.
+    line_view line;
+    arena_string request;
+    size_t header_size=0;
 
     try{
-	if((bufptr=sfd.getline(buffer,RECV_BUF_SIZ+1))==NULL){
+	if(!sfd.get_line(line)){
+	    if(sfd.over_limit()){
+		send431(sfd);
+		return false;
+	    }
 	    if(sfd.is_valid() && sfd.is_closed()){
-		close(browser_fd);
-		return browserFDPointer;
+		return false;
 	    }
 	    std::cerr << "bad getline\n";
 	    send400(sfd);
-	    close(browser_fd);
-	    return browserFDPointer;
+	    return false;
 	}
-	request=bufptr;
-	while((bufptr=sfd.getline(buffer,RECV_BUF_SIZ+1))!=NULL){
-	    if(bufptr[0]=='\n' || (bufptr[0]=='\r'&&bufptr[1]=='\n')){
+	line.append_to(request);
+	header_size=line.size();
+	// if they stop partway through a line, that's the end of it
+	while(sfd.get_line(line)){
+	    if((header_size+=line.size())>timeouts.max_header){
 		break;
 	    }
-	    while(*bufptr!='\n') bufptr++;
-	    while(*bufptr=='\n' || *bufptr=='\r' || *bufptr==' ' || *bufptr=='\t'){
-		*bufptr--='\0';
+	    arena_string text;
+	    line.append_to(text);
+	    if(text=="\n" || text=="\r\n"){
+		break;
 	    }
-	    if(*buffer==' ' || *buffer=='\t'){
-		if(headers.size()>0){
-		    headers[headers.size()-1]+=buffer;
-		}
+	    text.erase(text.find_last_not_of("\r\n \t")+1);
+	    if((text[0]==' ' || text[0]=='\t') && headers.size()>0){
+		// folded onto the one before
+		headers[headers.size()-1]+=text;
+	    }else{
+		headers.push_back(text);
 	    }
-	    headers.push_back(std::string(buffer));
-	}	
-	for(std::vector<std::string>::iterator i=headers.begin();i!=headers.end();i++){
-	    std::string key;
-	    std::string value;
-	    size_t idx;
-	    if((idx=(*i).find(":"))!=std::string::npos){
-		key=std::string(*i,0,idx);
-		value=std::string(*i,idx+2);
-		mapheaders[key]=value;
+	}
+	if(sfd.over_limit() || header_size>timeouts.max_header){
+	    // a bigger header than we'll hold on to
+	    send431(sfd);
+	    return false;
+	}
+	if(sfd.timed_out()){
+	    // they didn't get the whole header to us in time
+	    send408(sfd);
+	    return false;
+	}
+	sfd.headers_done();
+	reading.finish();
+	if(request=="PRI * HTTP/2.0\r\n" && headers.empty()){
+	    // HTTP/2 with prior knowledge, what we've read is the start of
+	    // its preface
+	    if(h2Connection::reserve()){
+		h2Connection h2(sfd,dispatch_stream,timeouts.idle_ms);
+		thread_hold hold;
+		h2.run(H2_PREFACE+18);
+	    }else{
+		h2Connection::refuse(sfd);
 	    }
+	    return false;
+	}
+	for(arena_strings::iterator i=headers.begin();i!=headers.end();i++){
+	    add_header(mapheaders,*i);
 	}
 	http_request_line hrl(request.c_str(),mapheaders);
 	if(hrl.is_valid()==false){
 	    send400(sfd);
-	    return browserFDPointer;
-	} else if(hrl.get_method()=="GET"){
-	    log_request(sfd,hrl,mapheaders);
-	    send_file(sfd,hrl,mapheaders);
+	    return false;
+	}
+	if(upgrade_h2c(sfd,request,headers,hrl)){
+	    return false;
+	}
+	sfd.set_keep_alive(wants_keep_alive(hrl,mapheaders),hrl.is_http11());
+	sfd.set_head_only(hrl.get_method()=="HEAD");
+	trace.set_detail(hrl.get_path().c_str());
+	if(mapheaders.find("X-Trace")!=mapheaders.end()){
+	    // they want to see where the time went for this one
+	    trace.keep();
+	}
+	requests_served++;
+	const route *r=router.match(hrl.get_path());
+	log_request(sfd,hrl,mapheaders);
+	// Nothing reads the body until it's needed, and then only as much
+	// at a time as fits in the backend's pipe or record.
+	try{
+	    request_body body(sfd,mapheaders,max_body_size);
+	    if(r==0 || r->kind==route_none){
+		body.discard();
+		send404(sfd);
+	    }else if((r->methods&requestRouter::method_bit(hrl.get_method()))==0){
+		body.discard();
+		send405(sfd,r->allow);
+	    }else{
+		if(!r->target.empty() && (r->kind==route_static || r->kind==route_cgi)){
+		    mapheaders["DOCUMENT_ROOT"]=r->target.c_str();
+		}
+		switch(r->kind){
+		    case route_fastcgi:
+			send_fastcgi(sfd,*r->pool,hrl,mapheaders,body);
+			break;
+		    case route_cgi:
+			send_cgi(sfd,hrl,mapheaders,body,r->prefix.size());
+			break;
+		    case route_redirect:
+			body.discard();
+			send301(sfd,r->target+encode_path(hrl.get_path().substr(r->prefix.size())),
+			    hrl.get_host(),hrl.get_port());
+			break;
+		    case route_status:
+			body.discard();
+			send_status(sfd,r->cache_control);
+			break;
+		    case route_proxy:
+			send_proxy(sfd,*r->proxy,hrl,mapheaders,body);
+			break;
+		    case route_plugin:
+			try{
+			    r->plugin->run(sfd,hrl,mapheaders,body,r->prefix);
+			}catch(const plugin_handler_fail& phf){
+			    std::cerr << hrl.get_path() << ": " << phf.what() << '\n';
+			    send500(sfd);
+			}
+			break;
+		    default:
+			// static files can't take a body
+			body.discard();
+			send_file(sfd,hrl,mapheaders,r->cache_control);
+		}
+	    }
+	    // what's left of a body they sent would look like the next
+	    // request
+	    return sfd.keeping_alive() && body.finished();
+	}catch(const request_body_too_large& rbtl){
+	    std::cerr << hrl.get_path() << ": " << rbtl.what() << '\n';
+	    send413(sfd);
+	}catch(const request_body_bad& rbb){
+	    std::cerr << hrl.get_path() << ": " << rbb.what() << '\n';
+	    if(sfd.timed_out()){
+		send408(sfd);
+	    }else{
+		send400(sfd);
+	    }
+	}catch(const socket_insert_fail& sif){
+	    std::cerr << sif.what() << '\n';
 	}
     }catch(const std::bad_alloc& ba){
-	std::cerr << "one_request caught a bad_alloc() - " << ba.what() << '\n';
+	std::cerr << "serve_request caught a bad_alloc() - " << ba.what() << '\n';
+    }
+    return false;
+}
+
+// on the wheel's thread, all we do is wake the accept loop up for it
+static void
+parked_expired(void *voidpc)
+{
+    parked_conn *pc=static_cast<parked_conn*>(voidpc);
+    pc->expired=1;
+    shutdown(pc-parked,SHUT_RDWR);
+}
+
+// Put a kept-alive connection aside till it has something more to say or
+// it's been idle for timeouts.idle_ms.  When that happens the accept loop
+// sees it and queues it like a new connection, or closes it.  False if it
+// couldn't be parked, so close it.
+static bool
+park_connection(int fd)
+{
+    if(parked==0 || fd<0 || static_cast<size_t>(fd)>=max_parked){
+	return false;
+    }
+    parked_conn& pc=parked[fd];
+    pc.expired=0;
+    pc.timer.fire=parked_expired;
+    pc.timer.arg=&pc;
+    // armed first, so even if it's woken before we're out of here the
+    // accept loop's cancel finds it armed
+    conn_wheel.arm(pc.timer,timeouts.idle_ms);
+    struct epoll_event ev;
+    bzero(&ev,sizeof(ev));
+    ev.events=EPOLLIN|EPOLLRDHUP|EPOLLONESHOT;
+    ev.data.fd=fd;
+    if(epoll_ctl(accept_epoll,EPOLL_CTL_ADD,fd,&ev)==-1){
+	conn_wheel.cancel(pc.timer);
+	return false;
+    }
+    return true;
+}
+
+/**
+ one_request is the entry point for a thread handling a connection
+ browserFDPointer is a pointer to the fd.  We answer requests on it as long
+ as they're already here, and then if it's being kept alive we park it and
+ set the fd to -1 so waitAndRun leaves it open.
+ */
+void *
+one_request(void *browserFDPointer)
+{
+    int browser_fd=*static_cast<int *>(browserFDPointer);
+    bool keep=false;
+    {
+	// sfd has to be gone, and its timers with it, before the fd's
+	// closed or parked
+	sockfdwrapper sfd(browser_fd,&conn_wheel,&timeouts);
+	if(!sfd.is_valid()){
+	    return browserFDPointer;
+	}
+	// with -c, everything each request reads is copied here
+	std::string captured;
+	if(capture.enabled()){
+	    sfd.set_tap(&captured,trafficCapture::MAX_REQUEST);
+	}
+	do{
+	    unsigned long long started=capture.enabled()?trafficCapture::now():0;
+	    PROBE1(request_start,browser_fd);
+	    keep=serve_request(sfd);
+	    PROBE3(request_done,browser_fd,sfd.bytes_sent(),keep?1:0);
+	    if(!captured.empty()){
+		uint32_t conn=static_cast<size_t>(browser_fd)<max_parked?
+		    parked[browser_fd].connection:0;
+		capture.record(conn,started,trafficCapture::now()-started,
+			sfd.response_status(),captured,sfd.tap_truncated());
+		captured.clear();
+	    }
+	    if(!keep){
+		break;
+	    }
+	    sfd.next_request();
+	    // pipelined requests we've already read get answered now,
+	    // there's nowhere to put them if we park
+	}while(sfd.buffered());
+    }
+    if(keep && park_connection(browser_fd)){
+	*static_cast<int *>(browserFDPointer)=-1;
     }
     return browserFDPointer;
 }
 
+// Priority classes for the thread pool's queue.  Routes say which paths
+// are which, from -p or -r's class=, and anything else is normal.
+const unsigned CLASS_INTERACTIVE=0;
+const unsigned CLASS_NORMAL=1;
+const unsigned CLASS_BULK=2;
+
+// Peek at the request line, if it's here yet, and give back the class of
+// the route its path goes to.  The request's still there for the worker
+// to read, and if it hasn't arrived we don't wait for it.
+unsigned
+classify(int fd)
+{
+    char buf[512];
+    ssize_t len;
+    if(!classed_routes
+	    || (len=recv(fd,buf,sizeof buf-1,MSG_PEEK|MSG_DONTWAIT))<=0){
+	return CLASS_NORMAL;
+    }
+    buf[len]='\0';
+    // METHOD SP path SP ...
+    char *path=strchr(buf,' ');
+    if(path==NULL){
+	return CLASS_NORMAL;
+    }
+    path++;
+    // the same path the worker will route on
+    std::string normal;
+    if(normalize_path(std::string(path,strcspn(path," ?#\r\n")),normal)!=path_ok){
+	return CLASS_NORMAL;
+    }
+    const route *r=router.match(normal);
+    return r?r->cls:CLASS_NORMAL;
+}
+
+// -s prints what the pool's sizing policy decides, whenever there's
+// something going on, and how much the request arenas are using
+void
+log_sizing(size_t group,const pool_sample& sample,const sizing_decision& decision)
+{
+    if(!sample.completed && !sample.queued && decision.target==sample.threads){
+	return;
+    }
+    char line[256];
+    snprintf(line,sizeof line,"sizing: group %zu threads %zu -> %zu (%s) "
+	    "%.1f/s service %.1fms cpu %.1fms wait %.1fms queued %zu busy %zu\n",
+	    group,sample.threads,decision.target,decision.reason,
+	    sample.throughput,sample.mean_service*1000,sample.mean_cpu*1000,
+	    sample.mean_wait*1000,sample.queued,sample.busy);
+    std::cerr << line;
+    // and how big the request arenas have had to be, when that changes
+    static unsigned long long last_requests=0;
+    arena_stats arenas=requestArena::stats();
+    if(group==0 && arenas.requests!=last_requests){
+	last_requests=arenas.requests;
+	snprintf(line,sizeof line,"arena: high water %zu bytes, %llu of %llu "
+		"requests needed more than %zu, %llu allocations bigger than that\n",
+		arenas.high_water,arenas.overflows,arenas.requests,
+		requestArena::DEFAULT_CHUNK,arenas.big);
+	std::cerr << line;
+    }
+}
+
 template <class T>
 bool from_string(T& t,const std::string& s,std::ios_base& (*f)(std::ios_base&))
 {
@@ -620,16 +1427,268 @@ bool from_string(T& t,const std::string& s,std::ios_base& (*f)(std::ios_base&))
     return !(iss >> f >> t).fail();
 }
 
+// Too busy for them.  They get a 503, then we linger reading whatever
+// they send, so they see it, till they close or LINGER_SECS is up.
+void
+turn_away(int epollfd,int fd)
+{
+    shed_connection(fd);
+    shutdown(fd,SHUT_WR);
+    struct epoll_event lev;
+    bzero(&lev,sizeof(lev));
+    lev.events=EPOLLIN|EPOLLRDHUP;
+    lev.data.fd=fd;
+    if(lingering.size()>=MAX_LINGERING
+	    || epoll_ctl(epollfd,EPOLL_CTL_ADD,fd,&lev)==-1){
+	close(fd);
+    }else{
+	lingering[fd]=time(0)+LINGER_SECS;
+    }
+}
+
+// A parked connection woke up.  If it's sent us something it goes back on
+// the queue like a new one, if it's closed or timed out we close it.
+void
+unpark(adaptiveThreadPool& atp,int fd)
+{
+    char c;
+    ssize_t got;
+    // after the cancel the timer can't go off, so expired is settled
+    conn_wheel.cancel(parked[fd].timer);
+    epoll_ctl(accept_epoll,EPOLL_CTL_DEL,fd,0);
+    if(parked[fd].expired || (got=recv(fd,&c,1,MSG_PEEK|MSG_DONTWAIT))==0
+	    || (got==-1 && errno!=EAGAIN && errno!=EWOULDBLOCK)){
+	close(fd);
+    }else if(got==-1){
+	// nothing there after all
+	if(!park_connection(fd)){
+	    close(fd);
+	}
+    }else if(!atp.addjob(fd,classify(fd))){
+	turn_away(accept_epoll,fd);
+    }
+}
+
+// set from a signal handler, so the accept loop does the writing
+volatile sig_atomic_t trace_dump_wanted=0;
+
+void
+want_trace_dump(int)
+{
+    trace_dump_wanted=1;
+}
+
+// Everything traced so far, as Chrome trace-event JSON in
+// /tmp/httpserver-trace.<pid>.json, to load into Perfetto or
+// chrome://tracing.
+void
+dump_trace()
+{
+    std::stringstream name;
+    name << "/tmp/httpserver-trace." << getpid() << ".json";
+    std::ofstream out(name.str().c_str());
+    size_t events=requestTrace::dump(out);
+    out.close();
+    if(!out){
+	std::cerr << "couldn't write " << name.str() << '\n';
+    }else{
+	std::cerr << "wrote " << events << " trace events to " << name.str() << '\n';
+    }
+}
+
 int main(int argc, char *argv[])
 {
     const int MAX_EVENTS=64;
     int numthreads=25;
-    argc=argc;
+    int opt;
     std::cout << "argv[0]: " << argv[0] << " argc: " << argc << '\n';
-    if(argc>1){
+    size_t max_queue=jobQueue<int>::DEFAULT_MAX_DEPTH;
+    bool pin_threads=false;
+    bool show_sizing=false;
+    unsigned trace_slow_ms=0,trace_every=0;
+    std::vector<std::pair<unsigned,unsigned> > class_limits;
+    const char *capture_file=0;
+    // -p's are done once the routes they go with are all there
+    std::vector<std::pair<std::string,unsigned> > class_prefixes;
+    route files,scripts;
+    files.kind=route_static;
+    scripts.kind=route_cgi;
+    router.add("/*",files);
+    router.add("/cgi-bin/*",scripts);
+    while((opt=getopt(argc,argv,"ab:c:f:l:m:p:q:r:st:T:"))!=-1){
+	switch(opt){
+	    case 'a':
+		// -a pins threads to CPUs by NUMA node
+		pin_threads=true;
+		break;
+	    case 'b':{
+		// -b bytes is the biggest request body we'll accept
+		size_t size;
+		if(!from_string<size_t>(size,optarg,std::dec)){
+		    std::cerr << "-b wants a number of bytes, not " << optarg << '\n';
+		    exit(1);
+		}
+		max_body_size=size;
+		break;
+	    }
+	    case 'c':
+		// -c file captures every request to file for replay
+		capture_file=optarg;
+		break;
+	    case 'f':{
+		// -f prefix:nprocs:command runs nprocs copies of command as
+		// FastCGI applications for every url starting with prefix
+		std::string arg(optarg);
+		size_t c1=arg.find(':'),c2;
+		int nprocs;
+		if(c1==std::string::npos || (c2=arg.find(':',c1+1))==std::string::npos
+			|| !from_string<int>(nprocs,arg.substr(c1+1,c2-c1-1),std::dec)
+			|| nprocs<1){
+		    std::cerr << "-f wants prefix:nprocs:command, not " << arg << '\n';
+		    exit(1);
+		}
+		route app;
+		app.kind=route_fastcgi;
+		app.pool=new fcgiPool(arg.substr(0,c1),arg.substr(c2+1),nprocs);
+		router.add(arg.substr(0,c1)+"*",app);
+		break;
+	    }
+	    case 'm':{
+		// -m bytes is the biggest request line and header we'll take
+		size_t size;
+		if(!from_string<size_t>(size,optarg,std::dec) || size==0){
+		    std::cerr << "-m wants a number of bytes, not " << optarg << '\n';
+		    exit(1);
+		}
+		timeouts.max_header=size;
+		break;
+	    }
+	    case 'p':{
+		// -p prefix:class puts paths starting with prefix in
+		// priority class 0 (interactive), 1 (normal) or 2 (bulk)
+		std::string arg(optarg);
+		size_t colon=arg.rfind(':');
+		unsigned cls;
+		if(colon==std::string::npos || colon==0
+			|| !from_string<unsigned>(cls,arg.substr(colon+1),std::dec)
+			|| cls>CLASS_BULK){
+		    std::cerr << "-p wants prefix:class with class 0, 1 or 2, not " << arg << '\n';
+		    exit(1);
+		}
+		std::string pattern=arg.substr(0,colon);
+		if(pattern[pattern.size()-1]!='*'){
+		    pattern+='*';
+		}
+		class_prefixes.push_back(std::make_pair(pattern,cls));
+		break;
+	    }
+	    case 'r':{
+		// -r [METHOD,...:]pattern=kind[:arg][,class=n][,cache=s|no]
+		// says what's done with paths matching pattern
+		std::string pattern,error;
+		route r;
+		if(!parse_route(optarg,pattern,r,error) || !router.add(pattern,r)){
+		    std::cerr << "-r " << optarg << ": "
+			<< (error.empty()?"a route's pattern has to start with /":error) << '\n';
+		    exit(1);
+		}
+		if(r.kind==route_fastcgi){
+		    // the pool goes in the route we added, not our copy
+		    size_t colon=r.target.find(':');
+		    std::string prefix=pattern[pattern.size()-1]=='*'?
+			pattern.substr(0,pattern.size()-1):pattern;
+		    router.find(pattern)->pool=new fcgiPool(prefix,r.target.substr(colon+1),
+			    atoi(r.target.c_str()));
+		}else if(r.kind==route_plugin){
+		    // file.so, or file.so:arg
+		    size_t colon=r.target.find(':');
+		    try{
+			router.find(pattern)->plugin=new handlerPlugin(r.target.substr(0,colon),
+				colon==std::string::npos?"":r.target.substr(colon+1));
+		    }catch(const plugin_load_fail& plf){
+			std::cerr << "-r " << optarg << ": " << plf.what() << '\n';
+			exit(1);
+		    }
+		}else if(r.kind==route_proxy){
+		    try{
+			router.find(pattern)->proxy=new proxyPool(r.target);
+		    }catch(const proxy_config_fail& pcf){
+			std::cerr << "-r " << optarg << ": " << pcf.what() << '\n';
+			exit(1);
+		    }
+		}
+		classed_routes=classed_routes || r.cls>=0;
+		break;
+	    }
+	    case 'l':{
+		// -l class:maxthreads caps how many threads work on a
+		// class at once
+		std::string arg(optarg);
+		size_t colon=arg.find(':');
+		unsigned cls,limit;
+		if(colon==std::string::npos
+			|| !from_string<unsigned>(cls,arg.substr(0,colon),std::dec)
+			|| !from_string<unsigned>(limit,arg.substr(colon+1),std::dec)
+			|| cls>CLASS_BULK){
+		    std::cerr << "-l wants class:maxthreads with class 0, 1 or 2, not " << arg << '\n';
+		    exit(1);
+		}
+		class_limits.push_back(std::make_pair(cls,limit));
+		break;
+	    }
+	    case 'q':{
+		// -q jobs is how many connections can wait for a thread
+		// before we start turning them away, 0 for no limit
+		size_t depth;
+		if(!from_string<size_t>(depth,optarg,std::dec)){
+		    std::cerr << "-q wants a number of connections, not " << optarg << '\n';
+		    exit(1);
+		}
+		max_queue=depth;
+		break;
+	    }
+	    case 't':
+		// -t ms traces requests that take at least ms milliseconds
+		if(!from_string<unsigned>(trace_slow_ms,optarg,std::dec)){
+		    std::cerr << "-t wants milliseconds, not " << optarg << '\n';
+		    exit(1);
+		}
+		break;
+	    case 'T':
+		// -T n traces one request in every n
+		if(!from_string<unsigned>(trace_every,optarg,std::dec)){
+		    std::cerr << "-T wants a number of requests, not " << optarg << '\n';
+		    exit(1);
+		}
+		break;
+	    case 's':
+		// -s shows how the pool decides how many threads to run
+		// and how big the request arenas get
+		show_sizing=true;
+		break;
+	    default:
+		std::cerr << "usage: " << argv[0] << " [-a] [-b maxbodybytes] [-c capturefile] [-f prefix:nprocs:command]... [-l class:maxthreads]... [-m maxheaderbytes] [-p prefix:class]... [-q maxqueue] [-r route]... [-s] [-t slowms] [-T onein] [maxthreads]\n";
+		exit(1);
+	}
+    }
+    for(size_t ctr=0;ctr<class_prefixes.size();ctr++){
+	// a route for just the class, unless there's one there already
+	route *there=router.find(class_prefixes[ctr].first);
+	if(there){
+	    there->cls=class_prefixes[ctr].second;
+	}else{
+	    route settings;
+	    settings.cls=class_prefixes[ctr].second;
+	    router.add(class_prefixes[ctr].first,settings);
+	}
+	classed_routes=true;
+    }
+    router.compile();
+    started_at=time(NULL);
+    if(optind<argc){
 	// get the max thread count
 	int cnt;
-	if(from_string<int>(cnt,argv[1],std::dec)){
+	if(from_string<int>(cnt,argv[optind],std::dec)){
 	    numthreads=cnt;
 	}
     }
@@ -637,21 +1696,43 @@ int main(int argc, char *argv[])
     struct epoll_event ev, events[MAX_EVENTS];
     int listen_sock;		    /* listening socket descriptor */
 
-    // up to numthreads all calling one_request()
-    adaptiveThreadPool atp(one_request,numthreads);
-
-    // set up the attributes for our master thread
-    pthread_attr_t theattr;
-    pthread_attr_init(&theattr);
-    pthread_attr_setdetachstate(&theattr,PTHREAD_CREATE_DETACHED);
+    // which CPUs are on which NUMA node.  With -a the pool gets a group
+    // of threads for each node, pinned to it, and we accept on the first.
+    cpuTopology topology;
+    if(pin_threads){
+	std::cout << "Pinning threads to " << topology.size() << " NUMA node"
+	    << (topology.size()==1?"":"s") << " with " << topology.num_cpus()
+	    << " cpus\n";
+	const numa_node& first=topology.node(0);
+	if(sched_setaffinity(0,sizeof(first.cpus),&first.cpus)==-1){
+	    std::cerr << "sched_setaffinity: " << strerror(errno) << '\n';
+	}
+    }
 
-    //numCPU not currently used but can be used to make decisions about
-    //number of thread or whether to let the master thread do any jobs
-    ssize_t numCPU;
-    if(((numCPU = sysconf( _SC_NPROCESSORS_ONLN ))==-1)&&errno==EINVAL){
-	numCPU=1;
+    // up to numthreads all calling one_request()
+    adaptiveThreadPool atp(one_request,numthreads,shed_connection,
+	    pin_threads?&topology:0);
+    atp.set_limits(max_queue,jobQueue<int>::DEFAULT_TARGET_MS,
+	    jobQueue<int>::DEFAULT_INTERVAL_MS);
+    for(size_t ctr=0;ctr<class_limits.size();ctr++){
+	atp.set_class_limit(class_limits[ctr].first,class_limits[ctr].second);
+    }
+    if(show_sizing){
+	atp.set_observer(log_sizing);
+    }
+    // an h2 connection holds a worker and its streams need more, so no
+    // more than half can be doing either
+    stream_pool=&atp;
+    h2Connection::set_limit(numthreads/2,numthreads/2?numthreads/2:1);
+    requestTrace::configure(trace_slow_ms,trace_every);
+    if(requestTrace::enabled()){
+	// kill -USR1 writes out what's been traced
+	struct sigaction sa;
+	bzero(&sa,sizeof(sa));
+	sa.sa_handler=want_trace_dump;
+	sa.sa_flags=SA_RESTART;
+	sigaction(SIGUSR1,&sa,0);
     }
-    //std::cout << "There are " << numCPU << " cpus online.\n";
 
     //daemon(1,1);
      
@@ -666,7 +1747,7 @@ int main(int argc, char *argv[])
     // 1) epoll_create to get an epoll instance
     // 2) one or more epoll_ctl to register file descriptors to be tracked
     // 3) epoll_wait to sleep until a connection happens
-    if((epollfd=epoll_create1(0))==-1){	// step 1
+    if((epollfd=epoll_create1(EPOLL_CLOEXEC))==-1){	// step 1
 	error_exit("epoll_create1 failed",1);
     }
 
@@ -679,12 +1760,48 @@ int main(int argc, char *argv[])
 	close(epollfd);
 	error_exit("epoll_ctl failed",1);
     }
+    accept_epoll=epollfd;
+    // room to park every fd we could have open
+    struct rlimit rl;
+    if(getrlimit(RLIMIT_NOFILE,&rl)==-1 || rl.rlim_cur==RLIM_INFINITY
+	    || rl.rlim_cur>(1<<22)){
+	rl.rlim_cur=1<<22;
+    }
+    max_parked=rl.rlim_cur;
+    void *table=mmap(0,max_parked*sizeof(parked_conn),PROT_READ|PROT_WRITE,
+	    MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE,-1,0);
+    if(table==MAP_FAILED){
+	// we'll just close connections instead of keeping them
+	std::cerr << "No room for keep-alive connections: " << strerror(errno) << '\n';
+	max_parked=0;
+    }else{
+	parked=static_cast<parked_conn*>(table);
+    }
+    if(capture_file && !capture.open(capture_file)){
+	std::cerr << "Couldn't open " << capture_file << " to capture to: "
+	    << strerror(errno) << '\n';
+	exit(1);
+    }
      
+    time_t last_flush=0;
     // now enter our main loop
     while(1){
 	int num_events,retval;
-	// the -1 means no timeout
-	if((num_events=epoll_wait(epollfd,events,MAX_EVENTS,-1))==-1){ //step3
+	if(trace_dump_wanted){
+	    trace_dump_wanted=0;
+	    dump_trace();
+	}
+	if(capture.enabled() && time(0)!=last_flush){
+	    // so a capture's never more than a second or so behind
+	    capture.flush();
+	    last_flush=time(0);
+	}
+	// the -1 means no timeout, but if we're lingering on connections
+	// we turned away, might have to dump traces, or are capturing, we
+	// come back once a second
+	if((num_events=epoll_wait(epollfd,events,MAX_EVENTS,
+		lingering.empty() && !requestTrace::enabled()
+		&& !capture.enabled()?-1:1000))==-1){ //step3
 	    if(errno==EINTR){
 		// on interrupt just go around again
 		continue;
@@ -695,9 +1812,38 @@ int main(int argc, char *argv[])
 		error_exit("epoll_wait failed");
 	    }
 	}
+	if(!lingering.empty()){
+	    time_t now=time(0);
+	    std::map<int,time_t>::iterator it=lingering.begin();
+	    while(it!=lingering.end()){
+		if(it->second<=now){
+		    close(it->first);
+		    lingering.erase(it++);
+		}else{
+		    ++it;
+		}
+	    }
+	}
 	// got events, loop through them
 	for(int ctr=0;ctr<num_events;ctr++){
-	    if(!(events[ctr].events & EPOLLIN)){
+	    if(listen_sock!=events[ctr].data.fd
+		    && lingering.find(events[ctr].data.fd)==lingering.end()){
+		// a kept-alive connection with something to say, or that
+		// timed out
+		unpark(atp,events[ctr].data.fd);
+		continue;
+	    }else if(listen_sock!=events[ctr].data.fd){
+		// one we turned away.  Read what they send until they close.
+		char buf[4096];
+		int fd=events[ctr].data.fd;
+		ssize_t got;
+		while((got=recv(fd,buf,sizeof buf,MSG_DONTWAIT))>0);
+		if(got==0 || (errno!=EAGAIN && errno!=EWOULDBLOCK)){
+		    close(fd);
+		    lingering.erase(fd);
+		}
+		continue;
+	    }else if(!(events[ctr].events & EPOLLIN)){
 		std::cerr << "epoll_error" << strerror(errno) << '\n';
 		continue;
 	    } else if(listen_sock==events[ctr].data.fd){
@@ -706,8 +1852,9 @@ int main(int argc, char *argv[])
 		int infd;
 		char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
 		// accept4 let's us pass the O_NONBLOCK to save a couple
-		// of fcntl calls on the new socket.
-		if((infd=accept4(listen_sock,&in_addr,&in_len,O_NONBLOCK))==-1){
+		// of fcntl calls on the new socket.  SOCK_CLOEXEC keeps
+		// client sockets out of anything we spawn.
+		if((infd=accept4(listen_sock,&in_addr,&in_len,O_NONBLOCK|SOCK_CLOEXEC))==-1){
 		    if(errno==EAGAIN||errno==EWOULDBLOCK){
 			// no more incoming connections
 			// Of course we shouldn't get this, but let's be
@@ -730,8 +1877,24 @@ int main(int argc, char *argv[])
 		    default:
 			std::cerr << gai_strerror(retval) << '\n';
 		}
-		// push the socket onto the job queue
-		atp.addjob(infd);
+		if(capture.enabled() && static_cast<size_t>(infd)<max_parked){
+		    parked[infd].connection=capture.new_connection();
+		}
+		// classify() goes by the request line, and right after the
+		// accept it's mostly not here yet.  If it matters, wait for it
+		// parked, and unpark() queues it when it comes.
+		char c;
+		if(classed_routes && recv(infd,&c,1,MSG_PEEK|MSG_DONTWAIT)==-1
+			&& (errno==EAGAIN || errno==EWOULDBLOCK)
+			&& park_connection(infd)){
+		    continue;
+		}
+		// push the socket onto the job queue, unless it's full or
+		// jobs are waiting too long in it already.  Then they get
+		// a 503 right here and never take up a thread.
+		if(!atp.addjob(infd,classify(infd))){
+		    turn_away(epollfd,infd);
+		}
 	    }
 	} // for(int ctr=0;ctr<num_events;ctr++)
     } // while(1)
@@ -6,8 +6,11 @@
 #include <pthread.h>
 #include <semaphore.h>
 #include <queue>
+#include <utility>
 #include <errno.h>
+#include <time.h>
 #include <iostream>
+#include <atomic>
 
 class
 job_queue_empty: public std::exception
@@ -24,94 +27,421 @@ public:
     virtual ~jq_semaphore_unavailable() throw() {};
 };
 
+// Every job is stamped when it's pushed, so when it's popped we know how
+// long it sat here.  That sojourn time drives a CoDel style controller:
+// if even the quickest job through the queue in the last interval waited
+// longer than target, the queue isn't absorbing a burst, it's standing,
+// and we're overloaded.  While overloaded try_push() turns away new jobs
+// whenever the one at the head of their class has already waited past
+// target, and a job that's waited longer than a whole interval comes out
+// of wait_and_pop() marked shed, because whoever sent it has likely given
+// up on it.  A queue that's simply full turns jobs away too.
+//
+// Jobs come in NUM_CLASSES priority classes, 0 the most urgent, each a
+// FIFO of its own.  The next job is the head of the most urgent class,
+// except that every age_ms a job waits counts as one class more urgent,
+// so nothing starves.  A class can also be limited to some number of jobs
+// running at once, and then it's passed over while it's at the limit.
+// Whoever pops a job calls done() with its class when they finish it.
+// Waiting on its own class's limit is what the limit's for, not a sign
+// of overload, so for a limited class a job's wait is only counted from
+// when the class last had room, and a class at its limit is left out of
+// deciding whether we're overloaded.
 template<typename T>
 class jobQueue
 {
 public:
-    jobQueue(){
+    static const unsigned NUM_CLASSES=3;
+    // defaults for set_limits()
+    static const size_t DEFAULT_MAX_DEPTH=1024;
+    static const unsigned DEFAULT_TARGET_MS=10;
+    static const unsigned DEFAULT_INTERVAL_MS=100;
+    // default for set_aging()
+    static const unsigned DEFAULT_AGE_MS=200;
+
+    jobQueue():
+	maxdepth(DEFAULT_MAX_DEPTH),target(DEFAULT_TARGET_MS*MS),
+	interval(DEFAULT_INTERVAL_MS*MS),overloaded(false),
+	min_sojourn(NEVER),interval_end(0),age(DEFAULT_AGE_MS*MS),depth(0),
+	generation(0),waited(0),popped(0)
+    {
+	pthread_condattr_t attr;
 	pthread_mutex_init(&lock,NULL);
-	sem_init(&sem,0,0);
+	// timed waits are against CLOCK_MONOTONIC like everything else here
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr,CLOCK_MONOTONIC);
+	pthread_cond_init(&ready,&attr);
+	pthread_condattr_destroy(&attr);
+	for(unsigned cls=0;cls<NUM_CLASSES;cls++){
+	    running[cls]=0;
+	    maxrunning[cls]=0;
+	    had_room[cls]=0;
+	}
     };
 
+    // maxdepth of 0 means no limit on depth
+    void
+    set_limits(size_t maxdepth,unsigned target_ms,unsigned interval_ms)
+    {
+	pthread_mutex_lock(&lock);
+	this->maxdepth=maxdepth;
+	target=target_ms*MS;
+	interval=interval_ms*MS;
+	pthread_mutex_unlock(&lock);
+    }
+
+    // at most maxjobs of class cls running at once, 0 for no limit
+    void
+    set_class_limit(unsigned cls,unsigned maxjobs)
+    {
+	pthread_mutex_lock(&lock);
+	cls=clamp(cls);
+	maxrunning[cls]=maxjobs;
+	had_room[cls]=now();
+	pthread_mutex_unlock(&lock);
+	pthread_cond_broadcast(&ready);
+    }
+
+    // how long a job waits to count as one class more urgent
     void
-    push(T job){
+    set_aging(unsigned age_ms)
+    {
+	pthread_mutex_lock(&lock);
+	age=age_ms?age_ms*MS:1;
+	pthread_mutex_unlock(&lock);
+    }
+
+    void
+    push(T job,unsigned cls=0){
 	pthread_mutex_lock(&lock);  // got the lock
-	jobs.push(job);		    // now add the job
-	sem_post(&sem);		    // post so that the threads know
+	jobs[clamp(cls)].push(queued(std::move(job),now()));// now add the job
+	depth++;
+	pthread_cond_signal(&ready);// tell the threads
 	pthread_mutex_unlock(&lock);// unleash the horses
     }
 
-    size_t size() { return jobs.size(); }
-    int num_jobs(){ return jobs.size(); }
+    // like push() but returns false without queueing the job if we're
+    // full or overloaded.  What to tell the job is up to the caller.
+    bool
+    try_push(T job,unsigned cls=0){
+	unsigned long long stamp=now();
+	cls=clamp(cls);
+	pthread_mutex_lock(&lock);
+	if(!admit(cls,stamp)){
+	    pthread_mutex_unlock(&lock);
+	    return false;
+	}
+	jobs[cls].push(queued(std::move(job),stamp));
+	depth++;
+	pthread_cond_signal(&ready);
+	pthread_mutex_unlock(&lock);
+	return true;
+    }
+
+    // push everything from first to last into class cls, taking the lock
+    // just the once.  Moves the jobs out of the range.
+    template<typename Iter>
+    void
+    push_bulk(Iter first,Iter last,unsigned cls=0){
+	unsigned long long stamp=now();
+	size_t count=0;
+	cls=clamp(cls);
+	pthread_mutex_lock(&lock);
+	for(;first!=last;++first,++count){
+	    jobs[cls].push(queued(std::move(*first),stamp));
+	}
+	depth+=count;
+	pthread_mutex_unlock(&lock);
+	if(count>1){
+	    pthread_cond_broadcast(&ready);
+	}else if(count){
+	    pthread_cond_signal(&ready);
+	}
+    }
+
+    size_t size() { return depth; }
+    int num_jobs(){ return depth; }
+    bool is_overloaded(){ return overloaded; }
 
     T
     pop(){
-	// throws job_queue_empty if there's nothing to pop
+	// throws job_queue_empty if there's nothing we're allowed to pop
 	T job;
-	int retval;
+	unsigned cls;
+	unsigned long long stamp=now();
 	pthread_mutex_lock(&lock);
-	if(jobs.empty()){
-	    // we need to throw here as well
-	    //sd=-1;
+	if(!pick(stamp,cls)){
 	    pthread_mutex_unlock(&lock);
 	    throw job_queue_empty();
-	}else{
-	    // we think there's a job, but wait_and_pop() could have 
-	    // grabbed the semaphore and be waiting for us to release the
-	    // mutex.  So check sem_trywait and if it fails return -1
-	    retval=sem_trywait(&sem);
-	    if(retval==-1){
-		// we aren't getting it, someone else already has it
-		// one of
-		// EINTR - this could have happened on purpose.  This is how
-		//         we tell a thread to die
-		// EAGAIN - only for sem_trywait - this could be it
-		// return -1 so we harm none.
-		pthread_mutex_unlock(&lock);
-		throw jq_semaphore_unavailable();
-	    }else{
-		// semantics of std::queue require front to get a copy, and
-		// pop to get the original off.  If you do either one without
-		// have anything in the queue you've entered undefined behavior
-		// luckily, there's something, or we couldn't have got the 
-		// semaphore.  push() locks the lock, pushes a job on the 
-		// queue (really a file descriptor from a socket), posts
-		// the semaphore and then unlocks the lock.  That means we
-		// could not have gotten in here in the middle since we need
-		// the lock to get into pop()
-		job=jobs.front();
-		jobs.pop();
-	    }
 	}
+	// semantics of std::queue require front to get a copy, and
+	// pop to get the original off.  If you do either one without
+	// have anything in the queue you've entered undefined behavior
+	// luckily, pick() only says yes to a class with something in it.
+	job=take(cls,stamp);
 	pthread_mutex_unlock(&lock);
 	return job;
     }
 
+    // these two lose the class, so only for queues without class limits
     T
     wait_and_pop()
+    {
+	bool shed;
+	unsigned cls;
+	return wait_and_pop(shed,cls);
+    }
+
+    T
+    wait_and_pop(bool& shed)
+    {
+	unsigned cls;
+	return wait_and_pop(shed,cls);
+    }
+
+    // shed is set if the job waited so long while we were overloaded
+    // that it should be turned away rather than run.  cls is its class,
+    // hand it back to done() when the job's finished either way.
+    T
+    wait_and_pop(bool& shed,unsigned& cls)
     {
 	// will not return until it can return to us a socket descriptor
 
 	T job;
-	int retval;
-	retval=sem_wait(&sem);
-	if(retval==-1){
-	    // one of
-	    // EINTR - this could have happened on purpose.  This is how
-	    //         we tell a thread to die
-	    // if it does, return -1 so we harm none.
-	    // we'll have to throw here.
-	    throw job_queue_empty();
+	unsigned long long stamp;
+	pthread_mutex_lock(&lock);
+	// pthread_cond_wait is where pthread_cancel gets us, and it leaves
+	// the lock locked when it does
+	pthread_cleanup_push(unlock,&lock);
+	while(!pick(stamp=now(),cls)){
+	    pthread_cond_wait(&ready,&lock);
+	}
+	unsigned long long sojourn=head_wait(cls,stamp);
+	job=take(cls,stamp);
+	shed=overloaded && sojourn>interval;
+	pthread_cleanup_pop(1);
+	return job;
+    }
+
+    // Like wait_and_pop() but gives up after ms milliseconds, or when
+    // somebody calls wake(), and returns false.  True means job's a job,
+    // and if queued_at's given it gets when the job was queued.
+    bool
+    wait_and_pop_for(T& job,bool& shed,unsigned& cls,unsigned ms,
+	    unsigned long long *queued_at=0)
+    {
+	unsigned long long stamp=now(),deadline=stamp+ms*MS;
+	bool got=false;
+	pthread_mutex_lock(&lock);
+	pthread_cleanup_push(unlock,&lock);
+	unsigned long long started=generation;
+	while(!(got=pick(stamp,cls)) && generation==started && stamp<deadline){
+	    struct timespec ts;
+	    ts.tv_sec=static_cast<time_t>(deadline/1000000000ULL);
+	    ts.tv_nsec=static_cast<long>(deadline%1000000000ULL);
+	    pthread_cond_timedwait(&ready,&lock,&ts);
+	    stamp=now();
 	}
+	if(got){
+	    unsigned long long sojourn=head_wait(cls,stamp);
+	    if(queued_at){
+		*queued_at=jobs[cls].front().when;
+	    }
+	    job=take(cls,stamp);
+	    shed=overloaded && sojourn>interval;
+	}
+	pthread_cleanup_pop(1);
+	return got;
+    }
+
+    // everybody in wait_and_pop_for() comes back now, job or no job
+    void
+    wake()
+    {
 	pthread_mutex_lock(&lock);
-	job=jobs.front();
-	jobs.pop();
+	generation++;
 	pthread_mutex_unlock(&lock);
-	return job;
+	pthread_cond_broadcast(&ready);
+    }
+
+    // total nanoseconds the jobs popped since the last call waited, and
+    // how many of them there were
+    void
+    take_wait_stats(unsigned long long& wait_ns,size_t& count)
+    {
+	pthread_mutex_lock(&lock);
+	wait_ns=waited;
+	count=popped;
+	waited=0;
+	popped=0;
+	pthread_mutex_unlock(&lock);
+    }
+
+    // a job of class cls that came out of pop() or wait_and_pop() is done
+    void
+    done(unsigned cls)
+    {
+	cls=clamp(cls);
+	pthread_mutex_lock(&lock);
+	if(running[cls]){
+	    running[cls]--;
+	}
+	bool was_full=maxrunning[cls] && running[cls]+1==maxrunning[cls];
+	if(was_full){
+	    // its jobs start waiting on us rather than their limit now
+	    had_room[cls]=now();
+	}
+	bool waiting=!jobs[cls].empty();
+	pthread_mutex_unlock(&lock);
+	if(was_full && waiting){
+	    // somebody might have gone to sleep passing over this class
+	    pthread_cond_signal(&ready);
+	}
     }
 private:
+    static const unsigned long long MS=1000000ULL;   // nanoseconds
+    static const unsigned long long NEVER=~0ULL;
+    struct queued
+    {
+	queued(T&& job,unsigned long long when):job(std::move(job)),when(when){};
+	T job;
+	unsigned long long when;    // CLOCK_MONOTONIC nanoseconds
+    };
+
+    static unsigned long long
+    now()
+    {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec*1000000000ULL+ts.tv_nsec;
+    }
+
+    static unsigned
+    clamp(unsigned cls)
+    {
+	return cls<NUM_CLASSES?cls:NUM_CLASSES-1;
+    }
+
+    static void
+    unlock(void *mutex)
+    {
+	pthread_mutex_unlock(static_cast<pthread_mutex_t*>(mutex));
+    }
+
+    // called with the lock held.  Is cls as busy as it's allowed to be?
+    bool
+    at_limit(unsigned cls)
+    {
+	return maxrunning[cls] && running[cls]>=maxrunning[cls];
+    }
+
+    // called with the lock held, cls has to have something in it.  How
+    // long its head's waited on us, not counting time its class spent at
+    // its limit.
+    unsigned long long
+    head_wait(unsigned cls,unsigned long long stamp)
+    {
+	unsigned long long since=jobs[cls].front().when;
+	if(maxrunning[cls] && had_room[cls]>since){
+	    since=had_room[cls];
+	}
+	return stamp>since?stamp-since:0;
+    }
+
+    // called with the lock held.  Which class goes next, if any can.
+    bool
+    pick(unsigned long long stamp,unsigned& cls)
+    {
+	bool found=false;
+	long long best=0;
+	for(unsigned ctr=0;ctr<NUM_CLASSES;ctr++){
+	    if(jobs[ctr].empty() || at_limit(ctr)){
+		continue;
+	    }
+	    unsigned long long waited=stamp>jobs[ctr].front().when?
+		stamp-jobs[ctr].front().when:0;
+	    long long urgency=static_cast<long long>(ctr)
+		-static_cast<long long>(waited/age);
+	    // ties go to the class that's more urgent to begin with
+	    if(!found || urgency<best){
+		found=true;
+		best=urgency;
+		cls=ctr;
+	    }
+	}
+	return found;
+    }
+
+    // called with the lock held, cls has to have something in it
+    T
+    take(unsigned cls,unsigned long long stamp)
+    {
+	T job(std::move(jobs[cls].front().job));
+	waited+=note_sojourn(head_wait(cls,stamp),stamp);
+	popped++;
+	jobs[cls].pop();
+	depth--;
+	running[cls]++;
+	return job;
+    }
+
+    // called with the lock held as each job comes off.  At the end of each
+    // interval we're overloaded if nothing got through in under target.
+    unsigned long long
+    note_sojourn(unsigned long long sojourn,unsigned long long stamp)
+    {
+	if(sojourn<min_sojourn){
+	    min_sojourn=sojourn;
+	}
+	if(stamp>=interval_end){
+	    overloaded=(min_sojourn!=NEVER && min_sojourn>target);
+	    min_sojourn=NEVER;
+	    interval_end=stamp+interval;
+	}
+	return sojourn;
+    }
+
+    // called with the lock held.  Any class whose head has sat a whole
+    // interval means we're overloaded, unless it's sitting there because
+    // its class is at its limit, but a job's only turned away for how
+    // long its own class is taking.
+    bool
+    admit(unsigned cls,unsigned long long stamp)
+    {
+	if(maxdepth && depth>=maxdepth){
+	    return false;
+	}
+	for(unsigned ctr=0;ctr<NUM_CLASSES;ctr++){
+	    if(!jobs[ctr].empty() && !at_limit(ctr)
+		    && head_wait(ctr,stamp)>interval){
+		// nothing's come off in a whole interval, so whatever comes
+		// off next will be over target.  Don't wait for it to tell
+		// us.
+		overloaded=true;
+	    }
+	}
+	if(jobs[cls].empty() || at_limit(cls)){
+	    return true;
+	}
+	return !(overloaded && head_wait(cls,stamp)>target);
+    }
+
     pthread_mutex_t lock;
-    sem_t sem;
-    std::queue<T> jobs;
+    pthread_cond_t ready;	    // something's been pushed or finished
+    std::queue<queued> jobs[NUM_CLASSES];
+    size_t maxdepth;
+    unsigned long long target;	    // acceptable standing delay
+    unsigned long long interval;    // how long it has to stand to matter
+    std::atomic<bool> overloaded;  // is_overloaded() reads it unlocked
+    unsigned long long min_sojourn; // smallest this interval
+    unsigned long long interval_end;
+    unsigned long long age;	    // wait that's worth a class of urgency
+    std::atomic<size_t> depth;    // jobs in all classes, size() reads it unlocked
+    unsigned running[NUM_CLASSES];
+    unsigned maxrunning[NUM_CLASSES];
+    unsigned long long had_room[NUM_CLASSES];  // last dropped below its limit
+    unsigned long long generation;  // bumped by wake()
+    unsigned long long waited;	    // sojourns since take_wait_stats()
+    size_t popped;
 };
 #endif
@@ -0,0 +1,370 @@
+// copyright Patrick Horgan
+// source is open, feel free to use it as you wish with no restrictions
+// except that this copyright notice must be preserved intact
+#include "pathcache.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+// anything that could change what a path in the directory resolves to,
+// or a file's validators.  Not IN_MODIFY, since a writer's done when it
+// closes, and one that never does (a log) would fire on every write.
+const uint32_t PATHCACHE_EVENTS=IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO
+    |IN_ATTRIB|IN_DELETE_SELF|IN_MOVE_SELF|IN_CLOSE_WRITE;
+// the ones that are about one file's contents and not what's in the
+// directory
+const uint32_t PATHCACHE_FILE_EVENTS=IN_ATTRIB|IN_CLOSE_WRITE;
+// how much of the names of paths that were never found we'll hold
+const size_t PATHCACHE_MISS_BYTES=4*1024*1024;
+
+static time_t
+coarse_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE,&ts);
+    return ts.tv_sec;
+}
+
+void *
+pathcache_watcher(void *voidcache)
+{
+    pathCache *cache=static_cast<pathCache*>(voidcache);
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    // the destructor clears running and pokes wake_fd to get us out
+    struct pollfd pfds[2]={{cache->inotify_fd,POLLIN,0},{cache->wake_fd,POLLIN,0}};
+    while(cache->running){
+	if(poll(pfds,2,-1)==-1){
+	    if(errno==EINTR){
+		continue;
+	    }
+	    std::cerr << "pathcache_watcher: " << strerror(errno) << '\n';
+	    return 0;
+	}
+	if(pfds[1].revents || !cache->running){
+	    return 0;
+	}
+	if(!(pfds[0].revents&POLLIN)){
+	    continue;
+	}
+	ssize_t len=read(cache->inotify_fd,buf,sizeof buf);
+	if(len==-1){
+	    if(errno==EINTR || errno==EAGAIN){
+		continue;
+	    }
+	    std::cerr << "pathcache_watcher: " << strerror(errno) << '\n';
+	    return 0;
+	}
+	for(char *ptr=buf;ptr<buf+len;){
+	    struct inotify_event *ev=reinterpret_cast<struct inotify_event*>(ptr);
+	    if(ev->mask&IN_Q_OVERFLOW){
+		// we lost events, so we can't trust anything
+		cache->invalidate_all();
+	    }else{
+		cache->invalidate(ev->wd,ev->len?ev->name:"",ev->mask);
+	    }
+	    ptr+=sizeof(struct inotify_event)+ev->len;
+	}
+    }
+    return 0;
+}
+
+pathCache::pathCache(time_t positive_ttl,time_t negative_ttl,size_t maxentries):
+    positive_ttl(positive_ttl),negative_ttl(negative_ttl),
+    maxpershard(maxentries/NUM_SHARDS),gen(0),running(true),wake_fd(-1),lost(0)
+{
+    for(size_t ctr=0;ctr<NUM_SHARDS;ctr++){
+	pthread_rwlock_init(&shards[ctr].lock,NULL);
+	shards[ctr].miss_bytes=0;
+    }
+    pthread_mutex_init(&watchlock,NULL);
+    if((inotify_fd=inotify_init1(IN_NONBLOCK|IN_CLOEXEC))==-1){
+	// we'll still work, found things will just live for their ttl
+	std::cerr << "pathCache: inotify_init1 - " << strerror(errno) << '\n';
+    }else if((wake_fd=eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC))==-1){
+	// without a way to stop the watcher we can't start it either
+	std::cerr << "pathCache: eventfd - " << strerror(errno) << '\n';
+	close(inotify_fd);
+	inotify_fd=-1;
+    }else{
+	pthread_create(&watcher,NULL,pathcache_watcher,this);
+    }
+}
+
+pathCache::~pathCache()
+{
+    if(inotify_fd!=-1){
+	// not pthread_cancel, it could catch the watcher holding watchlock
+	// or a shard's lock in the middle of an invalidate
+	running=false;
+	uint64_t one=1;
+	if(write(wake_fd,&one,sizeof one)==-1){
+	    std::cerr << "~pathCache: " << strerror(errno) << '\n';
+	}
+	pthread_join(watcher,NULL);
+	close(wake_fd);
+	close(inotify_fd);
+    }
+    for(size_t ctr=0;ctr<NUM_SHARDS;ctr++){
+	pthread_rwlock_destroy(&shards[ctr].lock);
+    }
+    pthread_mutex_destroy(&watchlock);
+}
+
+bool
+pathCache::lookup(path_key key,path_resolution& res)
+{
+    shard& s=shard_for(key);
+    bool found=false;
+    pthread_rwlock_rdlock(&s.lock);
+    std::unordered_map<path_key,entry>::iterator i=s.entries.find(key);
+    if(i!=s.entries.end() && i->second.expires>coarse_now()){
+	res=i->second.res;
+	found=true;
+    }
+    pthread_rwlock_unlock(&s.lock);
+    return found;
+}
+
+// Takes key out of dependents and file_dependents everywhere e put it.
+// Called with watchlock held.
+void
+pathCache::forget(path_key key,const entry& e)
+{
+    for(size_t ctr=0;ctr<e.wds.size();ctr++){
+	std::map<int,std::set<path_key> >::iterator d=dependents.find(e.wds[ctr]);
+	if(d!=dependents.end()){
+	    d->second.erase(key);
+	    if(d->second.empty()){
+		dependents.erase(d);
+	    }
+	}
+    }
+    for(size_t ctr=0;ctr<e.files.size();ctr++){
+	std::map<std::string,std::set<path_key> >::iterator f=file_dependents.find(e.files[ctr]);
+	if(f!=file_dependents.end()){
+	    f->second.erase(key);
+	    if(f->second.empty()){
+		file_dependents.erase(f);
+	    }
+	}
+    }
+}
+
+// Makes room in a full shard by throwing out what's expired, and if that's
+// not enough, everything.  Called with watchlock and the shard's lock held.
+void
+pathCache::evict(shard& s,time_t now)
+{
+    for(std::unordered_map<path_key,entry>::iterator i=s.entries.begin();
+	    i!=s.entries.end();){
+	if(i->second.expires<=now){
+	    forget(i->first,i->second);
+	    i=s.entries.erase(i);
+	}else{
+	    i++;
+	}
+    }
+    if(s.entries.size()>=maxpershard){
+	for(std::unordered_map<path_key,entry>::iterator i=s.entries.begin();
+		i!=s.entries.end();i++){
+	    forget(i->first,i->second);
+	}
+	s.entries.clear();
+    }
+}
+
+void
+pathCache::insert(path_key key,const path_resolution& res,
+	const std::vector<std::string>& watchdirs,
+	const std::vector<std::string>& watchfiles,unsigned long startgen)
+{
+    time_t now=coarse_now();
+    bool negative=(res.kind==res_not_found);
+    std::vector<int> wds;
+    pthread_mutex_lock(&watchlock);
+    if(!negative && inotify_fd!=-1){
+	for(size_t ctr=0;ctr<watchdirs.size();ctr++){
+	    std::map<std::string,int>::iterator w=watched.find(watchdirs[ctr]);
+	    int wd;
+	    if(w!=watched.end()){
+		wd=w->second;
+	    }else if((wd=inotify_add_watch(inotify_fd,watchdirs[ctr].c_str(),
+			    PATHCACHE_EVENTS|IN_ONLYDIR))!=-1){
+		watched[watchdirs[ctr]]=wd;
+		watchpaths[wd]=watchdirs[ctr];
+	    }
+	    if(wd!=-1 && std::find(wds.begin(),wds.end(),wd)==wds.end()){
+		wds.push_back(wd);
+	    }
+	}
+    }
+    // If something changed in one of its directories while we were
+    // resolving, don't keep the answer.  A change to some other file in
+    // one of them throws it out too, but that's only ever a resolve that
+    // was under way just then.
+    bool stale=lost>startgen;
+    for(size_t ctr=0;ctr<wds.size() && !stale;ctr++){
+	std::map<int,unsigned long>::iterator c=changed.find(wds[ctr]);
+	stale=c!=changed.end() && c->second>startgen;
+    }
+    if(stale){
+	pthread_mutex_unlock(&watchlock);
+	return;
+    }
+    shard& s=shard_for(key);
+    pthread_rwlock_wrlock(&s.lock);
+    std::unordered_map<path_key,entry>::iterator old=s.entries.find(key);
+    if(old!=s.entries.end()){
+	forget(key,old->second);
+    }else if(s.entries.size()>=maxpershard){
+	evict(s,now);
+    }
+    entry& e=s.entries[key];
+    e.res=res;
+    e.expires=now+(negative?negative_ttl:positive_ttl);
+    e.wds=wds;
+    e.files.clear();
+    for(size_t ctr=0;ctr<wds.size();ctr++){
+	dependents[wds[ctr]].insert(key);
+    }
+    if(!wds.empty()){
+	for(size_t ctr=0;ctr<watchfiles.size();ctr++){
+	    if(std::find(e.files.begin(),e.files.end(),watchfiles[ctr])==e.files.end()){
+		e.files.push_back(watchfiles[ctr]);
+		file_dependents[watchfiles[ctr]].insert(key);
+	    }
+	}
+    }
+    pthread_rwlock_unlock(&s.lock);
+    pthread_mutex_unlock(&watchlock);
+}
+
+bool
+pathCache::missed(const std::string& name)
+{
+    shard& s=shard_for(name);
+    bool found=false;
+    pthread_rwlock_rdlock(&s.lock);
+    std::unordered_map<std::string,time_t>::iterator i=s.misses.find(name);
+    found=i!=s.misses.end() && i->second>coarse_now();
+    pthread_rwlock_unlock(&s.lock);
+    return found;
+}
+
+void
+pathCache::insert_miss(const std::string& name)
+{
+    time_t now=coarse_now();
+    shard& s=shard_for(name);
+    pthread_rwlock_wrlock(&s.lock);
+    std::unordered_map<std::string,time_t>::iterator i=s.misses.find(name);
+    if(i==s.misses.end() && (s.misses.size()>=maxpershard
+	    || s.miss_bytes+name.size()>PATHCACHE_MISS_BYTES/NUM_SHARDS)){
+	// the expired ones first, and if that's not enough, the lot
+	for(i=s.misses.begin();i!=s.misses.end();){
+	    if(i->second<=now){
+		s.miss_bytes-=i->first.size();
+		i=s.misses.erase(i);
+	    }else{
+		i++;
+	    }
+	}
+	if(s.misses.size()>=maxpershard
+		|| s.miss_bytes+name.size()>PATHCACHE_MISS_BYTES/NUM_SHARDS){
+	    s.misses.clear();
+	    s.miss_bytes=0;
+	}
+	i=s.misses.end();
+    }
+    if(i==s.misses.end()){
+	s.miss_bytes+=name.size();
+    }
+    s.misses[name]=now+negative_ttl;
+    pthread_rwlock_unlock(&s.lock);
+}
+
+size_t
+pathCache::dependencies()
+{
+    size_t n=0;
+    pthread_mutex_lock(&watchlock);
+    for(std::map<int,std::set<path_key> >::iterator d=dependents.begin();
+	    d!=dependents.end();d++){
+	n+=d->second.size();
+    }
+    pthread_mutex_unlock(&watchlock);
+    return n;
+}
+
+// Something happened in the directory wd watches.  If it's only a file
+// there being written or touched, just what was worked out from that file
+// goes, otherwise everything that depends on the directory.
+void
+pathCache::invalidate(int wd,const char *name,uint32_t mask)
+{
+    std::set<path_key> keys;
+    // count it first, so a resolve that's under way and hasn't got to
+    // insert yet doesn't keep what it found
+    unsigned long now=++gen;
+    pthread_mutex_lock(&watchlock);
+    std::map<int,std::string>::iterator w=watchpaths.find(wd);
+    if(w!=watchpaths.end()){
+	changed[wd]=now;
+    }
+    if(*name && (mask&PATHCACHE_FILE_EVENTS) && w!=watchpaths.end()){
+	std::map<std::string,std::set<path_key> >::iterator f=
+	    file_dependents.find(w->second+'/'+name);
+	if(f!=file_dependents.end()){
+	    keys.swap(f->second);
+	    file_dependents.erase(f);
+	}
+    }else{
+	std::map<int,std::set<path_key> >::iterator d=dependents.find(wd);
+	if(d!=dependents.end()){
+	    keys.swap(d->second);
+	    dependents.erase(d);
+	}
+	// Keep the watch.  If the directory itself went away the kernel
+	// drops it and sends IN_IGNORED, which lands here too, and it's
+	// forgotten.
+	if(w!=watchpaths.end() && access(w->second.c_str(),F_OK)==-1){
+	    watched.erase(w->second);
+	    changed.erase(wd);
+	    watchpaths.erase(w);
+	}
+    }
+    for(std::set<path_key>::iterator i=keys.begin();i!=keys.end();i++){
+	shard& s=shard_for(*i);
+	pthread_rwlock_wrlock(&s.lock);
+	std::unordered_map<path_key,entry>::iterator e=s.entries.find(*i);
+	if(e!=s.entries.end()){
+	    forget(*i,e->second);
+	    s.entries.erase(e);
+	}
+	pthread_rwlock_unlock(&s.lock);
+    }
+    pthread_mutex_unlock(&watchlock);
+}
+
+void
+pathCache::invalidate_all()
+{
+    unsigned long now=++gen;
+    pthread_mutex_lock(&watchlock);
+    lost=now;
+    dependents.clear();
+    file_dependents.clear();
+    for(size_t ctr=0;ctr<NUM_SHARDS;ctr++){
+	pthread_rwlock_wrlock(&shards[ctr].lock);
+	shards[ctr].entries.clear();
+	shards[ctr].misses.clear();
+	shards[ctr].miss_bytes=0;
+	pthread_rwlock_unlock(&shards[ctr].lock);
+    }
+    pthread_mutex_unlock(&watchlock);
+}
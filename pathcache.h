@@ -0,0 +1,124 @@
+// copyright Patrick Horgan
+// source is open, feel free to use it as you wish with no restrictions
+// except that this copyright notice must be preserved intact
+#ifndef pathcache_guard
+#define pathcache_guard
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <unordered_map>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+// what a request path turned out to mean on disk
+enum resolution_kind
+{
+    res_file,		// target is a file to send
+    res_index,		// a directory, target is its index.html
+    res_listing,	// a directory without one, target is the directory
+    res_redirect,	// a directory asked for without the trailing slash
+    res_not_found
+};
+
+struct path_resolution
+{
+    resolution_kind kind;
+    std::string target;
+    // for res_file and res_index, worked out when it was resolved so a
+    // revalidation can be answered without touching the disk
+    std::string etag;
+    time_t lastmod;
+};
+
+// What pathCache looks things up by, the request path's pathIntern id, and
+// in the top 32 bits the Referer directory's when that was needed.
+typedef uint64_t path_key;
+
+// A concurrent map from request path (and the Referer directory when that
+// was needed) to a path_resolution.  Found things stay until inotify tells
+// us something was added, removed or renamed in their directory, or that
+// a file they were worked out from was written and closed (or a long ttl
+// passes, in case we couldn't get a watch).  Writing to some other file
+// leaves them be, so a log file or an upload under the document root
+// doesn't throw everything out.  Things that weren't found just live for
+// a short ttl, since there's no sensible directory to watch for them
+// showing up.  Paths that have never been found at all are kept apart, by
+// their text, so a scanner's made up paths don't use up pathIntern's ids.
+class pathCache
+{
+public:
+    friend void* pathcache_watcher(void *);
+    pathCache(time_t positive_ttl=60,time_t negative_ttl=2,size_t maxentries=64*1024);
+    ~pathCache();
+    bool
+    lookup(path_key key,path_resolution& res);
+    // Call before doing the work of resolving, and hand it back to insert.
+    // If anything changed in one of its watchdirs in between, insert won't
+    // keep the result.
+    unsigned long
+    generation() const { return gen; };
+    // watchdirs are the directories whose entries could change the answer,
+    // and watchfiles the files in them whose contents could.
+    void
+    insert(path_key key,const path_resolution& res,
+	    const std::vector<std::string>& watchdirs,
+	    const std::vector<std::string>& watchfiles,unsigned long startgen);
+    // Misses for paths that don't have a path_key, by name, which is
+    // anything that says what was asked, for negative_ttl.  There's only
+    // so much room for them, and when it's full they all go.
+    bool
+    missed(const std::string& name);
+    void
+    insert_miss(const std::string& name);
+    // how many key and directory pairs we're keeping track of
+    size_t dependencies();
+private:
+    pathCache(const pathCache&);
+    const pathCache& operator=(const pathCache&);
+    struct entry
+    {
+	path_resolution res;
+	time_t expires;
+	std::vector<int> wds;	    // the watches it's in dependents under
+	std::vector<std::string> files;	// and where it's in file_dependents
+    };
+    static const size_t NUM_SHARDS=16;
+    struct shard
+    {
+	pthread_rwlock_t lock;
+	std::unordered_map<path_key,entry> entries;
+	std::unordered_map<std::string,time_t> misses;
+	size_t miss_bytes;
+    };
+    // ids are handed out in order, so the low bits spread them fine
+    shard& shard_for(path_key key)
+	{ return shards[key%NUM_SHARDS]; };
+    shard& shard_for(const std::string& name)
+	{ return shards[std::hash<std::string>()(name)%NUM_SHARDS]; };
+    void invalidate(int wd,const char *name,uint32_t mask);
+    void invalidate_all();
+    void forget(path_key key,const entry& e);
+    void evict(shard& s,time_t now);
+    shard shards[NUM_SHARDS];
+    time_t positive_ttl;
+    time_t negative_ttl;
+    size_t maxpershard;
+    std::atomic<unsigned long> gen;	// counts changes we've heard about
+    int inotify_fd;
+    pthread_t watcher;
+    std::atomic<bool> running;	// cleared to tell the watcher to stop
+    int wake_fd;		// an eventfd written to wake it up for that
+    // which directories we're watching and which keys depend on them.
+    // Anybody who wants a shard's lock too takes this one first.
+    pthread_mutex_t watchlock;
+    std::map<std::string,int> watched;
+    std::map<int,std::string> watchpaths;
+    std::map<int,std::set<path_key> > dependents;
+    std::map<std::string,std::set<path_key> > file_dependents;
+    std::map<int,unsigned long> changed;	// gen at a watch's last change
+    unsigned long lost;			// and when we last lost events
+};
+#endif
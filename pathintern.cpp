@@ -0,0 +1,190 @@
+// copyright Patrick Horgan
+// source is open, feel free to use it as you wish with no restrictions
+// except that this copyright notice must be preserved intact
+#include "pathintern.h"
+#include <cctype>
+#include <cstring>
+#include <strings.h>
+
+static int
+hex_value(char c)
+{
+    if(c>='0' && c<='9'){
+	return c-'0';
+    }
+    if(c>='a' && c<='f'){
+	return c-'a'+10;
+    }
+    if(c>='A' && c<='F'){
+	return c-'A'+10;
+    }
+    return -1;
+}
+
+path_status
+normalize_path(const std::string& raw,std::string& out)
+{
+    size_t idx=0;
+    out.clear();
+    // absolute-form, GET http://host/path HTTP/1.1
+    if(strncasecmp(raw.c_str(),"http://",7)==0 || strncasecmp(raw.c_str(),"https://",8)==0){
+	idx=raw.find('/',raw.find("//")+2);
+	if(idx==std::string::npos){
+	    out="/";
+	    return path_ok;
+	}
+    }
+    if(idx==raw.size() || raw[idx]!='/'){
+	return path_not_path;
+    }
+    out.reserve(raw.size()-idx);
+    out+='/';
+    size_t seg=1;	    // where the segment we're on starts in out
+    for(idx++;;idx++){
+	if(idx==raw.size() || raw[idx]=='/'){
+	    // that's a whole segment, see what it was
+	    size_t len=out.size()-seg;
+	    if(len==1 && out[seg]=='.'){
+		out.resize(seg);
+	    }else if(len==2 && out[seg]=='.' && out[seg+1]=='.'){
+		if(seg==1){
+		    return path_above_root;
+		}
+		// back past the / that ends the one before, to the one
+		// that starts it
+		out.resize(out.rfind('/',seg-2)+1);
+	    }else if(len>0 && idx<raw.size()){
+		out+='/';
+	    }
+	    // and if it was empty, from //, it just goes away
+	    if(idx==raw.size()){
+		return path_ok;
+	    }
+	    seg=out.size();
+	    continue;
+	}
+	char c=raw[idx];
+	if(c=='%'){
+	    int hi,lo;
+	    if(idx+2>=raw.size() || (hi=hex_value(raw[idx+1]))<0
+		    || (lo=hex_value(raw[idx+2]))<0){
+		return path_bad_escape;
+	    }
+	    c=static_cast<char>(hi<<4|lo);
+	    idx+=2;
+	    // a control character's no better for being escaped
+	    if(c=='/' || static_cast<unsigned char>(c)<0x20 || c==0x7f){
+		return path_bad_escape;
+	    }
+	}else if(static_cast<unsigned char>(c)<0x20 || c==0x7f){
+	    return path_not_path;
+	}
+	out+=c;
+    }
+}
+
+std::string
+encode_path(const std::string& path)
+{
+    static const char hex[]="0123456789ABCDEF";
+    std::string out;
+    out.reserve(path.size());
+    for(size_t idx=0;idx<path.size();idx++){
+	unsigned char c=static_cast<unsigned char>(path[idx]);
+	// unreserved, sub-delims, and : @ /, RFC 3986's pchar and /
+	if(isalnum(c) || strchr("-._~!$&'()*+,;=:@/",c)){
+	    out+=static_cast<char>(c);
+	}else{
+	    out+='%';
+	    out+=hex[c>>4];
+	    out+=hex[c&0xf];
+	}
+    }
+    return out;
+}
+
+pathIntern::pathIntern(size_t maxids,size_t maxbytes):
+    maxids(maxids),maxbytes(maxbytes),bytes(0),next(1)
+{
+    for(size_t ctr=0;ctr<NUM_SHARDS;ctr++){
+	pthread_rwlock_init(&shards[ctr].lock,0);
+    }
+    pthread_mutex_init(&chunk_lock,0);
+    size_t chunks=maxids/CHUNK+1;
+    by_id=new std::atomic<std::atomic<const std::string*>*>[chunks];
+    for(size_t ctr=0;ctr<chunks;ctr++){
+	by_id[ctr]=0;
+    }
+}
+
+pathIntern::~pathIntern()
+{
+    for(size_t ctr=0;ctr<maxids/CHUNK+1;ctr++){
+	delete[] by_id[ctr];
+    }
+    delete[] by_id;
+    pthread_mutex_destroy(&chunk_lock);
+    for(size_t ctr=0;ctr<NUM_SHARDS;ctr++){
+	pthread_rwlock_destroy(&shards[ctr].lock);
+    }
+}
+
+uint32_t
+pathIntern::find(const std::string& path)
+{
+    shard& s=shard_for(path);
+    uint32_t id=NO_ID;
+    pthread_rwlock_rdlock(&s.lock);
+    std::unordered_map<std::string,uint32_t>::iterator i=s.ids.find(path);
+    if(i!=s.ids.end()){
+	id=i->second;
+    }
+    pthread_rwlock_unlock(&s.lock);
+    return id;
+}
+
+uint32_t
+pathIntern::intern(const std::string& path)
+{
+    uint32_t id=find(path);
+    if(id!=NO_ID){
+	return id;
+    }
+    shard& s=shard_for(path);
+    pthread_rwlock_wrlock(&s.lock);
+    std::unordered_map<std::string,uint32_t>::iterator i=s.ids.find(path);
+    if(i!=s.ids.end()){
+	// someone beat us to it
+	id=i->second;
+    }else if(bytes.fetch_add(path.size())+path.size()>maxbytes){
+	// no room for it, the other shards might have taken the last of it
+	bytes-=path.size();
+	id=NO_ID;
+    }else if(next>maxids || (id=next++)>maxids){
+	// they're all gone.  The test first is so next can't go on up
+	// past maxids and wrap.
+	bytes-=path.size();
+	id=NO_ID;
+    }else{
+	std::atomic<const std::string*> *chunk=by_id[id/CHUNK];
+	if(chunk==0){
+	    pthread_mutex_lock(&chunk_lock);
+	    if((chunk=by_id[id/CHUNK])==0){
+		chunk=new std::atomic<const std::string*>[CHUNK];
+		by_id[id/CHUNK]=chunk;
+	    }
+	    pthread_mutex_unlock(&chunk_lock);
+	}
+	// a map's keys stay put, so that's where the id's path lives.  It's
+	// set before anyone can find the id, since they'd need our lock.
+	chunk[id%CHUNK]=&s.ids.insert(std::make_pair(path,id)).first->first;
+    }
+    pthread_rwlock_unlock(&s.lock);
+    return id;
+}
+
+const std::string&
+pathIntern::path(uint32_t id) const
+{
+    return *by_id[id/CHUNK][id%CHUNK].load();
+}
@@ -0,0 +1,76 @@
+// copyright Patrick Horgan
+// source is open, feel free to use it as you wish with no restrictions
+// except that this copyright notice must be preserved intact
+#ifndef pathintern_guard
+#define pathintern_guard
+#include <string>
+#include <atomic>
+#include <unordered_map>
+#include <pthread.h>
+#include <stdint.h>
+
+enum path_status
+{
+    path_ok,
+    path_bad_escape,	// a % without two hex digits, or a / or control character
+    path_above_root,	// more ..s than there are directories to go up
+    path_not_path	// doesn't start with a /, and isn't http://host/...
+};
+
+// Turns a request path into the one way we write it, in one pass: %xx's
+// decoded, // made /, ./ dropped, and dir/../ dropped.  What comes out
+// always starts with / and can't get above it, so it's safe to put after
+// DOCUMENT_ROOT.  A trailing / stays, directories need it.  An
+// absolute-form request's scheme and host are skipped.  Control
+// characters, escaped or not, and %2F are turned down, since they'd mean
+// something different once decoded.  out's only good if it returns
+// path_ok.
+path_status normalize_path(const std::string& raw,std::string& out);
+
+// The other way, %xx for anything that can't go in a path as it is, for
+// when a path has to go back out in a Location: or a link.
+std::string encode_path(const std::string& path);
+
+// Hands out a small number for each different path, the same one every
+// time, so caches and counters can key on a uint32_t instead of hashing
+// and comparing strings.  Ids start at 1 and are never reused, and the
+// path an id stands for never moves, so path() is good forever and takes
+// no lock.  Interning's sharded like pathCache.  There can only be
+// maxids of them, and only maxbytes of path in all, since anyone can send
+// us paths, and past either intern() gives back NO_ID and callers have to
+// do without.  Paths already in keep their ids.
+class pathIntern
+{
+public:
+    static const uint32_t NO_ID=0;
+    pathIntern(size_t maxids=1<<20,size_t maxbytes=64<<20);
+    ~pathIntern();
+    uint32_t intern(const std::string& path);
+    // NO_ID if it's never been interned
+    uint32_t find(const std::string& path);
+    // the path for an id intern() gave out
+    const std::string& path(uint32_t id) const;
+    size_t size() const { return next>maxids?maxids:next-1; };
+    size_t bytes_used() const { return bytes; };
+private:
+    pathIntern(const pathIntern&);
+    const pathIntern& operator=(const pathIntern&);
+    static const size_t NUM_SHARDS=16;
+    static const size_t CHUNK=4096;	    // paths in a chunk of by_id
+    struct shard
+    {
+	pthread_rwlock_t lock;
+	std::unordered_map<std::string,uint32_t> ids;
+    };
+    shard& shard_for(const std::string& path)
+	{ return shards[std::hash<std::string>()(path)%NUM_SHARDS]; };
+    shard shards[NUM_SHARDS];
+    // id to path, in chunks that are only made when they're needed
+    std::atomic<std::atomic<const std::string*>*> *by_id;
+    pthread_mutex_t chunk_lock;
+    size_t maxids;
+    size_t maxbytes;
+    std::atomic<size_t> bytes;	    // of paths interned so far
+    std::atomic<uint32_t> next;
+};
+#endif
@@ -0,0 +1,108 @@
+// copyright Patrick Horgan
+// source is open, feel free to use it as you wish with no restrictions
+// except that this copyright notice must be preserved intact
+#ifndef plugin_guard
+#define plugin_guard
+// What a handler plugin sees of the server.  It's plain C so plugins can be
+// written in anything that can make a C shared object, and so it doesn't
+// change when the server's C++ does.  A plugin is a .so with one
+// symbol in it, hs_plugin_v1, an hs_plugin that says which version of this
+// it was built against and where its functions are.  The server dlopen()s
+// it at startup for a route like
+//
+//     -r /hello/*=plugin:/path/to/hello.so[:arg]
+//
+// calls init(arg) once, and then calls handle() on the worker thread that
+// has the connection, for every request the route gets.  That's lots of
+// threads at once, so handle() has to be thread safe.
+//
+// Nothing a plugin gets from us is good after handle() returns HS_DONE or
+// HS_ERROR.  Strings we hand over aren't NUL terminated, they're views.
+#include <stddef.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// bump this if anything below changes in a way old plugins would notice
+#define HS_PLUGIN_ABI 1
+#define HS_PLUGIN_SYMBOL "hs_plugin_v1"
+
+// what handle() gives back
+#define HS_DONE 0	    // the response is finished
+#define HS_SUSPEND 1	    // call me again once what I wait()ed on is ready
+#define HS_ERROR -1	    // a 500 if nothing's been sent yet, or we hang up
+
+typedef struct hs_str
+{
+    const char *data;
+    size_t len;
+} hs_str;
+
+typedef struct hs_header
+{
+    hs_str name;
+    hs_str value;
+} hs_header;
+
+typedef struct hs_request hs_request;
+typedef struct hs_response hs_response;
+
+struct hs_request
+{
+    hs_str method;
+    hs_str path;	    // normalized, without the query
+    hs_str query;
+    hs_str path_info;	    // the path past the route's prefix
+    int http11;		    // 0 for HTTP/1.0
+    size_t nheaders;
+    const hs_header *headers;
+    // The idx'th CGI/1.1 meta-variable, REMOTE_ADDR, SERVER_PORT and so
+    // on, the same ones a CGI script would get.  They're only worked out
+    // if a plugin asks.  0 past the last one, 1 otherwise.
+    int (*var)(const hs_request *req,size_t idx,hs_str *name,hs_str *value);
+    // Up to len more bytes of the body, 0 when it's all been read, -1 if
+    // the client sent something that doesn't make sense.
+    ssize_t (*read_body)(const hs_request *req,void *buf,size_t len);
+    void *server;	    // ours
+};
+
+// Set the status and headers before the first write().  If there's no
+// Content-Length we'll chunk the body for HTTP/1.1 clients and hold on to
+// it to count for 1.0 ones, so Transfer-Encoding is ours and header()
+// turns it down, along with a second or non-numeric Content-Length.
+// Writes past a Content-Length are dropped, and if the body doesn't come
+// to what it said the connection's closed after it.  Everything gives
+// back 0, or -1 if the client has gone away and handle() should give up,
+// or for header() if the header's not allowed.
+struct hs_response
+{
+    int (*status)(hs_response *resp,int code,const char *reason);
+    int (*header)(hs_response *resp,const char *name,const char *value);
+    int (*write)(hs_response *resp,const void *data,size_t len);
+    // Before returning HS_SUSPEND, say what to wait for: poll() events on
+    // fd, for at most timeout_ms.  handle() gets called again with
+    // ready set to the events that happened, 0 if the time ran out.
+    int (*wait)(hs_response *resp,int fd,short events,int timeout_ms);
+    short ready;
+    void *state;	    // the plugin's, kept from one handle() to the next
+    void *server;	    // ours
+};
+
+typedef struct hs_plugin
+{
+    unsigned abi;	    // HS_PLUGIN_ABI
+    const char *name;
+    // once at startup, with the arg from the route, if there was one.
+    // Anything but 0 and the server won't start.  Can be NULL.
+    int (*init)(const char *arg);
+    int (*handle)(const hs_request *req,hs_response *resp);
+    // once at shutdown.  Can be NULL.
+    void (*fini)(void);
+} hs_plugin;
+
+#ifdef __cplusplus
+}
+#endif
+#endif
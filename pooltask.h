@@ -0,0 +1,321 @@
+// copyright Patrick Horgan
+// source is open, feel free to use it as you wish with no restrictions
+// except that this copyright notice must be preserved intact
+#ifndef pooltask_guard
+#define pooltask_guard
+#include <pthread.h>
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// What goes through an adaptiveThreadPool's queue.  It's either a socket
+// for the pool's task function, which is all it ever used to be and costs
+// no more than the int did to run, or any callable at all.  Callables up
+// to INLINE_SIZE bytes that can be moved without throwing live right in
+// here, so a lambda capturing a few pointers never touches the heap;
+// bigger ones get allocated.  Like a unique_ptr it can be moved, not
+// copied.
+class pool_task
+{
+public:
+    static const size_t INLINE_SIZE=48;
+
+    pool_task():ops(0),fd(-1){};
+    static pool_task
+    for_fd(int fd)
+    {
+	pool_task t;
+	t.fd=fd;
+	return t;
+    }
+    template<typename F,typename=typename std::enable_if<
+	!std::is_same<typename std::decay<F>::type,pool_task>::value>::type>
+    pool_task(F&& f):ops(0)
+    {
+	typedef typename std::decay<F>::type callable;
+	if(fits<callable>::value){
+	    new(&storage) callable(std::forward<F>(f));
+	    ops=&inline_ops<callable>::ops;
+	}else{
+	    *reinterpret_cast<callable**>(&storage)=new callable(std::forward<F>(f));
+	    ops=&heap_ops<callable>::ops;
+	}
+    }
+    pool_task(pool_task&& other):ops(other.ops)
+    {
+	take(other);
+    }
+    pool_task&
+    operator=(pool_task&& other)
+    {
+	if(this!=&other){
+	    clear();
+	    ops=other.ops;
+	    take(other);
+	}
+	return *this;
+    }
+    ~pool_task(){ clear(); };
+    bool is_fd() const { return ops==0; };
+    int get_fd() const { return fd; };
+    // true if the callable's stored in here rather than on the heap
+    bool is_inline() const { return ops && ops->inlined; };
+    void operator()(){ ops->invoke(&storage); };
+private:
+    pool_task(const pool_task&);
+    const pool_task& operator=(const pool_task&);
+    typedef std::aligned_storage<INLINE_SIZE>::type storage_type;
+    struct operations
+    {
+	void (*invoke)(void *);
+	void (*move)(void *to,void *from);  // and destroy from
+	void (*destroy)(void *);
+	bool inlined;
+    };
+    template<typename F>
+    struct fits
+    {
+	static const bool value=sizeof(F)<=INLINE_SIZE
+	    && std::alignment_of<F>::value<=std::alignment_of<storage_type>::value
+	    && std::is_nothrow_move_constructible<F>::value;
+    };
+    template<typename F>
+    struct inline_ops
+    {
+	static void invoke(void *p){ (*static_cast<F*>(p))(); };
+	static void move(void *to,void *from)
+	{
+	    new(to) F(std::move(*static_cast<F*>(from)));
+	    static_cast<F*>(from)->~F();
+	};
+	static void destroy(void *p){ static_cast<F*>(p)->~F(); };
+	static const operations ops;
+    };
+    template<typename F>
+    struct heap_ops
+    {
+	static void invoke(void *p){ (**static_cast<F**>(p))(); };
+	static void move(void *to,void *from){ *static_cast<F**>(to)=*static_cast<F**>(from); };
+	static void destroy(void *p){ delete *static_cast<F**>(p); };
+	static const operations ops;
+    };
+    void
+    take(pool_task& other)
+    {
+	if(ops){
+	    ops->move(&storage,&other.storage);
+	    other.ops=0;
+	}else{
+	    fd=other.fd;
+	}
+	other.fd=-1;
+    }
+    void
+    clear()
+    {
+	if(ops){
+	    ops->destroy(&storage);
+	    ops=0;
+	}
+    }
+    const operations *ops;
+    union
+    {
+	int fd;
+	storage_type storage;
+    };
+};
+
+template<typename F>
+const pool_task::operations pool_task::inline_ops<F>::ops=
+    { invoke, move, destroy, true };
+template<typename F>
+const pool_task::operations pool_task::heap_ops<F>::ops=
+    { invoke, move, destroy, false };
+
+// what get() throws if the task was thrown away without ever running
+class
+pool_broken_promise: public std::exception
+{
+public:
+    pool_broken_promise(){};
+    virtual ~pool_broken_promise() throw() {};
+    virtual const char* what() const throw()
+    {
+	return "pool task destroyed without running";
+    };
+};
+
+// Where a submitted task's result or exception waits for get().
+template<typename R>
+struct pool_result
+{
+    pool_result():has_value(false){};
+    ~pool_result()
+    {
+	if(has_value){
+	    reinterpret_cast<R*>(&value)->~R();
+	}
+    };
+    template<typename F>
+    void run(F& f){ new(&value) R(f()); has_value=true; };
+    R get(){ return std::move(*reinterpret_cast<R*>(&value)); };
+    bool has_value;
+    typename std::aligned_storage<sizeof(R),std::alignment_of<R>::value>::type value;
+};
+
+// a reference result is kept as a pointer to what it refers to
+template<typename R>
+struct pool_result<R&>
+{
+    pool_result():ptr(0){};
+    template<typename F>
+    void run(F& f){ ptr=&f(); };
+    R& get(){ return *ptr; };
+    R *ptr;
+};
+
+template<>
+struct pool_result<void>
+{
+    template<typename F>
+    void run(F& f){ f(); };
+    void get(){};
+};
+
+template<typename R>
+struct pool_future_state
+{
+    pool_future_state():ready(false)
+    {
+	pthread_mutex_init(&lock,NULL);
+	pthread_cond_init(&cond,NULL);
+    };
+    ~pool_future_state()
+    {
+	pthread_cond_destroy(&cond);
+	pthread_mutex_destroy(&lock);
+    };
+    // called on the worker thread
+    template<typename F>
+    void
+    run(F& f)
+    {
+	try{
+	    result.run(f);
+	}catch(...){
+	    error=std::current_exception();
+	}
+	pthread_mutex_lock(&lock);
+	ready=true;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+    };
+    // called when the task's going away without having run, so get()
+    // throws rather than waiting forever
+    void
+    abandon()
+    {
+	pthread_mutex_lock(&lock);
+	if(!ready){
+	    error=std::make_exception_ptr(pool_broken_promise());
+	    ready=true;
+	    pthread_cond_broadcast(&cond);
+	}
+	pthread_mutex_unlock(&lock);
+    };
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool ready;
+    std::exception_ptr error;
+    pool_result<R> result;
+};
+
+// What submit() hands back.  get() waits for the task and gives its result,
+// or throws what it threw, and can only be called once.
+template<typename R>
+class pool_future
+{
+public:
+    pool_future(){};
+    explicit pool_future(const std::shared_ptr<pool_future_state<R> >& state):state(state){};
+    bool valid() const { return state.get()!=0; };
+    bool
+    is_ready() const
+    {
+	pthread_mutex_lock(&state->lock);
+	bool ready=state->ready;
+	pthread_mutex_unlock(&state->lock);
+	return ready;
+    }
+    void
+    wait() const
+    {
+	pthread_mutex_lock(&state->lock);
+	while(!state->ready){
+	    pthread_cond_wait(&state->cond,&state->lock);
+	}
+	pthread_mutex_unlock(&state->lock);
+    }
+    R
+    get()
+    {
+	wait();
+	std::shared_ptr<pool_future_state<R> > done;
+	done.swap(state);
+	if(done->error){
+	    std::rethrow_exception(done->error);
+	}
+	return done->result.get();
+    }
+private:
+    std::shared_ptr<pool_future_state<R> > state;
+};
+
+// The callables submit() and submit_then() actually queue.  Written out
+// rather than as lambdas since a C++11 lambda can't move f into itself.
+// A runner lets go of its state once it's run, so if it still has it when
+// it's destroyed the task never ran and its future's broken.  One that's
+// been moved from has nothing to let go of.
+template<typename F,typename R>
+struct pool_future_runner
+{
+    pool_future_runner(F&& f,const std::shared_ptr<pool_future_state<R> >& state):
+	f(std::move(f)),state(state){};
+    pool_future_runner(const F& f,const std::shared_ptr<pool_future_state<R> >& state):
+	f(f),state(state){};
+    pool_future_runner(pool_future_runner&& other)
+	    noexcept(std::is_nothrow_move_constructible<F>::value):
+	f(std::move(other.f)),state(std::move(other.state)){};
+    ~pool_future_runner()
+    {
+	if(state){
+	    state->abandon();
+	}
+    };
+    void
+    operator()()
+    {
+	std::shared_ptr<pool_future_state<R> > running;
+	running.swap(state);
+	running->run(f);
+    };
+    F f;
+    std::shared_ptr<pool_future_state<R> > state;
+};
+
+template<typename F,typename C,typename R>
+struct pool_then_runner
+{
+    template<typename FF,typename CC>
+    pool_then_runner(FF&& f,CC&& c):f(std::forward<FF>(f)),c(std::forward<CC>(c)){};
+    void operator()(){ run(std::is_void<R>()); };
+    void run(std::true_type){ f(); c(); };
+    void run(std::false_type){ c(f()); };
+    F f;
+    C c;
+};
+#endif
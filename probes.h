@@ -0,0 +1,63 @@
+// copyright Patrick Horgan
+// source is open, feel free to use it as you wish with no restrictions
+// except that this copyright notice must be preserved intact
+#ifndef probes_guard
+#define probes_guard
+
+// USDT probes, the SystemTap kind, that perf, bpftrace and stap can all
+// attach to in a running server.  Each is a nop in the code and a note in
+// the binary that says where it is and where its arguments are, so
+// they cost nothing till someone attaches.  If there's no sys/sdt.h
+// (systemtap-sdt-dev or systemtap-sdt-devel has it), or you build with
+// -DNO_PROBES, they're compiled out, arguments and all, so the arguments
+// mustn't do anything that has to happen.
+//
+// The provider's httpserver.  Scripts depend on the arguments, so only
+// ever add new ones on the end.
+//
+// job_queued(int fd, unsigned cls, int accepted)
+//	addjob() put fd in the queue for class cls, or with accepted 0,
+//	the queue was full and it didn't.
+// job_start(int fd, unsigned cls, unsigned long long wait_ns)
+//	a worker took a job off the queue after it waited wait_ns.  fd is
+//	-1 for something submit()ted.
+// job_done(int fd, unsigned cls, unsigned long long service_ns)
+//	the worker's finished with it, service_ns after job_start.
+// thread_spawn(int node, size_t threads)
+//	queueOne() started a worker for the group on NUMA node (-1 for
+//	no node), which now has threads of them.
+// recv(int fd, long nbytes)
+//	getbytes() did a recv, 0 when they closed and -1 when it failed.
+// send_partial(int fd, long sent, size_t asked)
+//	sendall()'s send only took some of what it was given.
+// send_eagain(int fd, size_t left, size_t sent)
+//	sendall() or sendfile() found the socket full with left still to
+//	go, and is about to wait for room.  sent's how much of the response
+//	has gone so far.
+// file_resolved(const char *path, int kind, int cached)
+//	send_file() found out what path is, kind's a resolution_kind or -1
+//	if it couldn't tell, and cached is 1 if pathcache already knew.  A
+//	path that's retried relative to the Referer fires it twice.
+// request_start(int fd)
+//	one_request() is about to read a request on fd.
+// request_done(int fd, size_t bytes_sent, int keep_alive)
+//	it's answered, with bytes_sent of response, and keep_alive says if
+//	the connection's good for another.
+
+#if !defined(NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_PROBES 1
+#endif
+#endif
+
+#ifdef HAVE_PROBES
+#define PROBE1(name,a) DTRACE_PROBE1(httpserver,name,a)
+#define PROBE2(name,a,b) DTRACE_PROBE2(httpserver,name,a,b)
+#define PROBE3(name,a,b,c) DTRACE_PROBE3(httpserver,name,a,b,c)
+#else
+#define PROBE1(name,a) do{}while(0)
+#define PROBE2(name,a,b) do{}while(0)
+#define PROBE3(name,a,b,c) do{}while(0)
+#endif
+#endif
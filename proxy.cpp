@@ -0,0 +1,738 @@
+// copyright Patrick Horgan
+// source is open, feel free to use it as you wish with no restrictions
+// except that this copyright notice must be preserved intact
+#include "proxy.h"
+#include "pathintern.h"
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <strings.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+// how often the health checker wakes up, and how many failed probes in a
+// row before we stop sending an upstream anything
+const unsigned int PROXY_CHECK_SECS=2;
+const size_t PROXY_MAX_FAILURES=2;
+// how long we'll wait on an upstream for one read or write
+const time_t PROXY_IO_TIMEOUT=30;
+// kept-alive connections we hold on to for each upstream, past that
+// they're closed when they're done
+const size_t PROXY_MAX_IDLE=64;
+// the most of a response's header we'll hold
+const size_t PROXY_MAX_HEAD=64*1024;
+
+// only meant for one hop, so they're not passed on either way
+static bool
+hop_by_hop(const char *name)
+{
+    static const char *hop[]={ "Connection","Keep-Alive","Proxy-Connection",
+	"Proxy-Authenticate","Proxy-Authorization","TE","Trailer",
+	"Transfer-Encoding","Upgrade" };
+    for(size_t ctr=0;ctr<sizeof hop/sizeof hop[0];ctr++){
+	if(strcasecmp(name,hop[ctr])==0){
+	    return true;
+	}
+    }
+    return false;
+}
+
+// A Content-Length's value, all digits with maybe some space after.  False
+// if it's anything else or too big to be one.
+static bool
+parse_length(const char *value,uint64_t& length)
+{
+    const char *at=value;
+    length=0;
+    for(;*at>='0' && *at<='9';at++){
+	if(length>(UINT64_MAX-(*at-'0'))/10){
+	    return false;
+	}
+	length=length*10+(*at-'0');
+    }
+    if(at==value){
+	return false;
+    }
+    return at[strspn(at," \t")]=='\0';
+}
+
+// Splits a Transfer-Encoding list into the codings before the last one
+// and the last one, lower cased, 9112 6.1.
+static std::string
+last_coding(const std::string& codings,std::string& before)
+{
+    before.clear();
+    size_t end=codings.find_last_not_of(" \t,");
+    if(end==std::string::npos){
+	return "";
+    }
+    size_t comma=codings.rfind(',',end);
+    size_t start=comma==std::string::npos?0:codings.find_first_not_of(" \t",comma+1);
+    if(comma!=std::string::npos){
+	size_t keep=codings.find_last_not_of(" \t,",comma);
+	if(keep!=std::string::npos){
+	    before=codings.substr(0,keep+1);
+	}
+    }
+    std::string last=codings.substr(start,end+1-start);
+    for(size_t ctr=0;ctr<last.size();ctr++){
+	last[ctr]=tolower(last[ctr]);
+    }
+    return last;
+}
+
+static bool
+sendfull(int fd,const char *buf,size_t len)
+{
+    while(len){
+	ssize_t retval=send(fd,buf,len,MSG_NOSIGNAL);
+	if(retval==-1){
+	    if(errno==EINTR){
+		continue;
+	    }
+	    return false;
+	}
+	buf+=retval;
+	len-=retval;
+    }
+    return true;
+}
+
+// What's come back on an upstream connection that we've read but haven't
+// passed on yet.  Headers and chunk sizes come through here, and bodies
+// only as far as they came in the same reads.
+class upstream_reader
+{
+public:
+    upstream_reader(int fd):fd(fd),got_any(false){};
+    // a line without its \r\n, false if it doesn't come or it's too long
+    bool get_line(std::string& line);
+    // up to len of what we've read moved onto the end of out
+    size_t take(std::string& out,uint64_t len);
+    bool empty() const { return buf.empty(); };
+    // if anything at all came
+    bool heard() const { return got_any; };
+    int get_fd() const { return fd; };
+private:
+    bool fill();
+    int fd;
+    std::string buf;
+    bool got_any;
+};
+
+bool
+upstream_reader::fill()
+{
+    char chunk[16384];
+    ssize_t got;
+    while((got=recv(fd,chunk,sizeof chunk,0))==-1 && errno==EINTR);
+    if(got<=0){
+	return false;
+    }
+    got_any=true;
+    buf.append(chunk,got);
+    return true;
+}
+
+bool
+upstream_reader::get_line(std::string& line)
+{
+    size_t nl;
+    while((nl=buf.find('\n'))==std::string::npos){
+	if(buf.size()>PROXY_MAX_HEAD || !fill()){
+	    return false;
+	}
+    }
+    line.assign(buf,0,nl);
+    buf.erase(0,nl+1);
+    if(!line.empty() && line[line.size()-1]=='\r'){
+	line.erase(line.size()-1);
+    }
+    return true;
+}
+
+size_t
+upstream_reader::take(std::string& out,uint64_t len)
+{
+    size_t here=len<buf.size()?static_cast<size_t>(len):buf.size();
+    out.append(buf,0,here);
+    buf.erase(0,here);
+    return here;
+}
+
+// len bytes of body on to the client.  What we've already read goes on
+// the end of out, and if there's more, out's sent and the rest is spliced
+// from the upstream.  False if the upstream ran out first.
+static bool
+relay(upstream_reader& in,sockfdwrapper& sfd,std::string& out,uint64_t len)
+{
+    len-=in.take(out,len);
+    if(len==0){
+	return true;
+    }
+    if(!out.empty()){
+	sfd.sendall(out.data(),out.size());
+	out.clear();
+    }
+    return sfd.splice_from(in.get_fd(),len)==len;
+}
+
+// A chunked body, passed on chunked to 1.1 clients and put back together
+// for 1.0 ones.  The chunk sizes are read, and the chunks relay()ed.
+static bool
+relay_chunked(upstream_reader& in,sockfdwrapper& sfd,std::string& out,bool http11)
+{
+    std::string line;
+    while(true){
+	if(!in.get_line(line)){
+	    return false;
+	}
+	char *end;
+	unsigned long long size=strtoull(line.c_str(),&end,16);
+	if(end==line.c_str()){
+	    return false;
+	}
+	if(size==0){
+	    break;
+	}
+	if(http11){
+	    char hex[24];
+	    snprintf(hex,sizeof hex,"%llx\r\n",size);
+	    out+=hex;
+	}
+	if(!relay(in,sfd,out,size) || !in.get_line(line) || !line.empty()){
+	    return false;
+	}
+	if(http11){
+	    out+="\r\n";
+	}
+    }
+    // the last chunk, any trailers and the blank line
+    if(http11){
+	out+="0\r\n";
+    }
+    do{
+	if(!in.get_line(line)){
+	    return false;
+	}
+	if(http11){
+	    out+=line+"\r\n";
+	}
+    }while(!line.empty());
+    return true;
+}
+
+// the request's body, spliced if it has a length and chunked again if not
+static bool
+send_body(int fd,request_body& body)
+{
+    if(!body.is_chunked()){
+	return body.splice_to(fd);
+    }
+    char buf[16*1024];
+    size_t got;
+    std::string chunk;
+    while((got=body.read(buf,sizeof buf))){
+	char hex[24];
+	snprintf(hex,sizeof hex,"%zx\r\n",got);
+	chunk=hex;
+	chunk.append(buf,got);
+	chunk+="\r\n";
+	if(!sendfull(fd,chunk.data(),chunk.size())){
+	    return false;
+	}
+    }
+    return sendfull(fd,"0\r\n\r\n",5);
+}
+
+// the client's address for X-Forwarded-For, "" if it came on a unix
+// socket, which is what h2 streams come on
+static std::string
+client_address(int fd)
+{
+    struct sockaddr_storage addr;
+    socklen_t len=sizeof(addr);
+    char host[NI_MAXHOST];
+    if(getpeername(fd,reinterpret_cast<struct sockaddr*>(&addr),&len)==-1
+	    || (addr.ss_family!=AF_INET && addr.ss_family!=AF_INET6)
+	    || getnameinfo(reinterpret_cast<struct sockaddr*>(&addr),len,
+		host,sizeof host,0,0,NI_NUMERICHOST)!=0){
+	return "";
+    }
+    return host;
+}
+
+void *
+proxy_health(void *voidpool)
+{
+    proxyPool *pool=static_cast<proxyPool*>(voidpool);
+    pthread_mutex_lock(&pool->lock);
+    while(pool->running){
+	struct timespec when;
+	clock_gettime(CLOCK_REALTIME,&when);
+	when.tv_sec+=PROXY_CHECK_SECS;
+	pthread_cond_timedwait(&pool->wake,&pool->lock,&when);
+	if(!pool->running){
+	    break;
+	}
+	pthread_mutex_unlock(&pool->lock);
+	pool->health_check();
+	pthread_mutex_lock(&pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+proxyPool::proxyPool(const std::string& list):next(0),running(true)
+{
+    for(size_t from=0;from<=list.size();){
+	size_t comma=list.find(',',from);
+	std::string one=list.substr(from,comma==std::string::npos?std::string::npos:comma-from);
+	if(!one.empty()){
+	    add_upstream(one);
+	}
+	if(comma==std::string::npos){
+	    break;
+	}
+	from=comma+1;
+    }
+    if(upstreams.empty()){
+	throw proxy_config_fail("proxy wants at least one upstream");
+    }
+    pthread_mutex_init(&lock,NULL);
+    pthread_cond_init(&wake,NULL);
+    pthread_create(&checker,NULL,proxy_health,this);
+}
+
+proxyPool::~proxyPool()
+{
+    // the checker finishes whatever probe it's in and sees running
+    pthread_mutex_lock(&lock);
+    running=false;
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&lock);
+    pthread_join(checker,NULL);
+    for(size_t ctr=0;ctr<upstreams.size();ctr++){
+	for(size_t idx=0;idx<upstreams[ctr].idle.size();idx++){
+	    close(upstreams[ctr].idle[idx]);
+	}
+    }
+    pthread_cond_destroy(&wake);
+    pthread_mutex_destroy(&lock);
+}
+
+void
+proxyPool::add_upstream(const std::string& spec)
+{
+    upstream up;
+    up.name=spec;
+    up.busy=0;
+    up.failures=0;
+    up.ejected=false;
+    bzero(&up.addr,sizeof(up.addr));
+    if(spec.compare(0,5,"unix:")==0){
+	struct sockaddr_un *sun=reinterpret_cast<struct sockaddr_un*>(&up.addr);
+	std::string path=spec.substr(5);
+	if(path.empty() || path.size()>=sizeof(sun->sun_path)){
+	    throw proxy_config_fail("a unix socket upstream wants a path that fits, not "+spec);
+	}
+	sun->sun_family=AF_UNIX;
+	strncpy(sun->sun_path,path.c_str(),sizeof(sun->sun_path)-1);
+	up.addrlen=sizeof(struct sockaddr_un);
+    }else{
+	size_t colon=spec.rfind(':');
+	if(colon==std::string::npos || colon==0 || colon+1==spec.size()){
+	    throw proxy_config_fail("an upstream is host:port or unix:/path, not "+spec);
+	}
+	std::string host=spec.substr(0,colon);
+	if(host[0]=='[' && host[host.size()-1]==']'){
+	    host=host.substr(1,host.size()-2);
+	}
+	struct addrinfo hints,*res;
+	bzero(&hints,sizeof(hints));
+	hints.ai_family=AF_UNSPEC;
+	hints.ai_socktype=SOCK_STREAM;
+	int err=getaddrinfo(host.c_str(),spec.c_str()+colon+1,&hints,&res);
+	if(err!=0){
+	    throw proxy_config_fail(spec+": "+gai_strerror(err));
+	}
+	memcpy(&up.addr,res->ai_addr,res->ai_addrlen);
+	up.addrlen=res->ai_addrlen;
+	freeaddrinfo(res);
+    }
+    upstreams.push_back(up);
+}
+
+int
+proxyPool::connect_to(const upstream& up)
+{
+    struct timeval tv={ PROXY_IO_TIMEOUT,0 };
+    int fd;
+
+    if((fd=socket(up.addr.ss_family,SOCK_STREAM|SOCK_CLOEXEC,0))==-1){
+	return -1;
+    }
+    if(connect(fd,reinterpret_cast<const struct sockaddr*>(&up.addr),up.addrlen)==-1){
+	close(fd);
+	return -1;
+    }
+    setsockopt(fd,SOL_SOCKET,SO_RCVTIMEO,&tv,sizeof(tv));
+    setsockopt(fd,SOL_SOCKET,SO_SNDTIMEO,&tv,sizeof(tv));
+    if(up.addr.ss_family!=AF_UNIX){
+	// a head and then a body shouldn't wait on each other's acks
+	int one=1;
+	setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one));
+    }
+    return fd;
+}
+
+// Pick the upstream that isn't ejected with the fewest requests in flight
+// and hand back one of its idle connections, or a new one if it has none.
+// reused tells the caller whether the connection might have gone stale.
+// An upstream we can't connect to is ejected right away.
+int
+proxyPool::checkout(size_t& which,bool& reused)
+{
+    int fd=-1;
+    pthread_mutex_lock(&lock);
+    which=upstreams.size();
+    for(size_t ctr=0;ctr<upstreams.size();ctr++){
+	size_t idx=(next+ctr)%upstreams.size();
+	if(!upstreams[idx].ejected && (which==upstreams.size()
+		    || upstreams[idx].busy<upstreams[which].busy)){
+	    which=idx;
+	}
+    }
+    if(which==upstreams.size()){
+	pthread_mutex_unlock(&lock);
+	return -1;
+    }
+    next=(which+1)%upstreams.size();
+    upstream& up=upstreams[which];
+    up.busy++;
+    while(up.idle.size()){
+	fd=up.idle.back();
+	up.idle.pop_back();
+	// one they've closed, or that's saying something when it shouldn't
+	// be, is no good to us
+	char c;
+	if(recv(fd,&c,1,MSG_PEEK|MSG_DONTWAIT)==-1 && (errno==EAGAIN || errno==EWOULDBLOCK)){
+	    reused=true;
+	    pthread_mutex_unlock(&lock);
+	    return fd;
+	}
+	close(fd);
+    }
+    pthread_mutex_unlock(&lock);
+    reused=false;
+    if((fd=connect_to(up))==-1){
+	checkin(which,-1,false);
+	pthread_mutex_lock(&lock);
+	eject(up,"won't take a connection");
+	pthread_mutex_unlock(&lock);
+    }
+    return fd;
+}
+
+void
+proxyPool::checkin(size_t which,int fd,bool reusable)
+{
+    pthread_mutex_lock(&lock);
+    upstream& up=upstreams[which];
+    up.busy--;
+    if(fd!=-1){
+	if(reusable && !up.ejected && up.idle.size()<PROXY_MAX_IDLE){
+	    up.idle.push_back(fd);
+	}else{
+	    close(fd);
+	}
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+// called with lock held
+void
+proxyPool::eject(upstream& up,const char *why)
+{
+    if(!up.ejected){
+	std::cerr << "proxyPool: " << up.name << ' ' << why << ", ejecting it\n";
+	up.ejected=true;
+    }
+    for(size_t idx=0;idx<up.idle.size();idx++){
+	close(up.idle[idx]);
+    }
+    up.idle.clear();
+}
+
+bool
+proxyPool::ejected(size_t which)
+{
+    pthread_mutex_lock(&lock);
+    bool out=upstreams[which].ejected;
+    pthread_mutex_unlock(&lock);
+    return out;
+}
+
+// Send the request down fd and relay the response.  If nothing came back
+// and we haven't used up any of the body, it can go again somewhere else.
+proxyPool::outcome
+proxyPool::one_try(sockfdwrapper& sfd,int fd,const std::string& head,bool http11,
+	bool head_only,request_body& body,bool& reusable)
+{
+    reusable=false;
+    if(!sendfull(fd,head.data(),head.size())){
+	return retry;
+    }
+    if(body.present() && !send_body(fd,body)){
+	return body.size()?failed:retry;
+    }
+    upstream_reader in(fd);
+    std::string line,field,codings;
+    std::vector<std::string> fields;
+    int status;
+    bool has_length,keep;
+    uint64_t length;
+    do{
+	if(!in.get_line(line)){
+	    return in.heard() || body.size()?failed:retry;
+	}
+	if(line.size()<12 || line.compare(0,7,"HTTP/1.")!=0){
+	    return failed;
+	}
+	status=atoi(line.c_str()+9);
+	keep=line[7]=='1';
+	has_length=false;
+	length=0;
+	codings.clear();
+	fields.clear();
+	while(true){
+	    if(!in.get_line(field)){
+		return failed;
+	    }
+	    if(field.empty()){
+		break;
+	    }
+	    size_t colon=field.find(':');
+	    if(colon==std::string::npos){
+		continue;
+	    }
+	    std::string name=field.substr(0,colon);
+	    size_t vstart=field.find_first_not_of(" \t",colon+1);
+	    const char *value=vstart==std::string::npos?"":field.c_str()+vstart;
+	    if(strcasecmp(name.c_str(),"Connection")==0){
+		if(strcasestr(value,"close")){
+		    keep=false;
+		}else if(strcasestr(value,"keep-alive")){
+		    keep=true;
+		}
+	    }else if(strcasecmp(name.c_str(),"Transfer-Encoding")==0){
+		codings+=(codings.empty()?"":", ")+std::string(value);
+	    }else if(strcasecmp(name.c_str(),"Content-Length")==0){
+		// Two that don't agree, or one that isn't a number, and
+		// there's no telling where the response ends.  Only the one
+		// we've checked goes on.
+		uint64_t n;
+		if(!parse_length(value,n) || (has_length && n!=length)){
+		    std::cerr << "proxyPool: upstream sent a bad Content-Length\n";
+		    return failed;
+		}
+		has_length=true;
+		length=n;
+		continue;
+	    }
+	    if(!hop_by_hop(name.c_str())){
+		fields.push_back(field);
+	    }
+	}
+	// a 100 Continue, and ours already went from request_body
+    }while(status/100==1);
+
+    // Transfer-Encoding's the length over Content-Length.  If chunked's
+    // last we take it off, and any codings under it go on with ours.  If
+    // it isn't, the body ends when they close, 9112 6.3.
+    std::string others;
+    bool chunked=!codings.empty() && last_coding(codings,others)=="chunked";
+    if(!codings.empty()){
+	has_length=false;
+	if(!chunked){
+	    others=codings;
+	}
+    }
+    bool no_body=head_only || status==204 || status==304;
+    bool to_eof=!no_body && !chunked && !has_length;
+    std::string out="HTTP/1.1"+line.substr(8)+"\r\n";
+    for(size_t ctr=0;ctr<fields.size();ctr++){
+	out+=fields[ctr]+"\r\n";
+    }
+    if(has_length){
+	char hdr[48];
+	snprintf(hdr,sizeof hdr,"Content-Length: %llu\r\n",static_cast<unsigned long long>(length));
+	out+=hdr;
+    }
+    if(no_body || (!chunked && has_length)){
+	out+=sfd.framed_response();
+    }else if(chunked && http11){
+	out+="Transfer-Encoding: "+(others.empty()?"":others+", ")+"chunked\r\n";
+	out+=sfd.framed_response();
+    }else{
+	if(!others.empty()){
+	    out+="Transfer-Encoding: "+others+"\r\n";
+	}
+	// it ends when we close
+	out+="Connection: close\r\n";
+    }
+    out+="\r\n";
+    bool whole=true;
+    if(chunked && !no_body){
+	whole=relay_chunked(in,sfd,out,http11);
+    }else if(has_length && !no_body){
+	whole=relay(in,sfd,out,length);
+    }else if(to_eof){
+	relay(in,sfd,out,UINT64_MAX);
+    }
+    if(!out.empty()){
+	sfd.sendall(out.data(),out.size());
+    }
+    if(!whole){
+	// they've been promised more than they're going to get, and
+	// closing is the only way left to tell them
+	std::cerr << "proxyPool: upstream went away partway through a response\n";
+	shutdown(sfd.get_fd(),SHUT_RDWR);
+	return done;
+    }
+    reusable=keep && !to_eof && in.empty();
+    return done;
+}
+
+void
+proxyPool::run(sockfdwrapper& sfd,http_request_line& hrl,header_map& hdrs,
+	request_body& body)
+{
+    // the request as it came, less what was only for the hop to us
+    std::string head=hrl.get_method()+' '+encode_path(hrl.get_path());
+    std::string query=hrl.get_query();
+    if(!query.empty()){
+	head+='?'+query;
+    }
+    head+=" HTTP/1.1\r\n";
+    std::string forwarded_for,length;
+    bool has_host=false;
+    for(header_map::iterator i=hdrs.begin();i!=hdrs.end();i++){
+	const char *name=i->first.c_str();
+	if(i->first=="DOCUMENT_ROOT" || hop_by_hop(name) || strcasecmp(name,"Expect")==0){
+	    continue;
+	}
+	if(strcasecmp(name,"Content-Length")==0){
+	    length=i->second.c_str();
+	    continue;
+	}
+	if(strcasecmp(name,"X-Forwarded-For")==0){
+	    forwarded_for=i->second.c_str();
+	    continue;
+	}
+	has_host=has_host || strcasecmp(name,"Host")==0;
+	head+=name;
+	head+=": ";
+	head+=i->second.c_str();
+	head+="\r\n";
+    }
+    if(!has_host){
+	head+="Host: "+(hrl.get_host().empty()?std::string("localhost"):hrl.get_host())+"\r\n";
+    }
+    std::string client=client_address(sfd.get_fd());
+    if(!client.empty()){
+	forwarded_for+=(forwarded_for.empty()?"":", ")+client;
+    }
+    if(!forwarded_for.empty()){
+	head+="X-Forwarded-For: "+forwarded_for+"\r\n";
+    }
+    if(body.present()){
+	head+=body.is_chunked()?"Transfer-Encoding: chunked\r\n":"Content-Length: "+length+"\r\n";
+    }
+    head+="\r\n";
+
+    // A kept-alive connection the upstream closed under us fails before we
+    // hear anything, so then it's safe to try again, and an upstream we
+    // can't connect to is ejected, so the next try goes somewhere else.
+    for(size_t tries=0;tries<=upstreams.size();tries++){
+	size_t which;
+	bool reused,reusable;
+	int fd;
+	if((fd=checkout(which,reused))==-1){
+	    continue;
+	}
+	outcome how;
+	try{
+	    how=one_try(sfd,fd,head,hrl.is_http11(),hrl.get_method()=="HEAD",body,reusable);
+	}catch(...){
+	    checkin(which,fd,false);
+	    throw;
+	}
+	checkin(which,fd,reusable);
+	if(how==done){
+	    return;
+	}
+	if(how==failed || !reused || body.size()){
+	    break;
+	}
+    }
+    throw proxy_upstream_unavailable();
+}
+
+// OPTIONS * is about the least an HTTP server can be asked, and anything
+// that answers it with a status line is alive
+bool
+proxyPool::probe(const upstream& up)
+{
+    struct timeval tv={ 2,0 };
+    char answer[5];
+    int fd;
+
+    if((fd=connect_to(up))==-1){
+	return false;
+    }
+    setsockopt(fd,SOL_SOCKET,SO_RCVTIMEO,&tv,sizeof(tv));
+    std::string request="OPTIONS * HTTP/1.1\r\nHost: "
+	+(up.addr.ss_family==AF_UNIX?std::string("localhost"):up.name)
+	+"\r\nConnection: close\r\n\r\n";
+    bool alive=sendfull(fd,request.data(),request.size());
+    size_t got=0;
+    while(alive && got<sizeof answer){
+	ssize_t retval=recv(fd,answer+got,sizeof answer-got,0);
+	if(retval==-1 && errno==EINTR){
+	    continue;
+	}
+	alive=retval>0;
+	got+=alive?retval:0;
+    }
+    close(fd);
+    return alive && memcmp(answer,"HTTP/",5)==0;
+}
+
+void
+proxyPool::health_check()
+{
+    for(size_t ctr=0;ctr<upstreams.size();ctr++){
+	upstream& up=upstreams[ctr];
+	bool alive=probe(up);
+	pthread_mutex_lock(&lock);
+	if(alive){
+	    if(up.ejected){
+		std::cerr << "proxyPool: " << up.name << " is answering again\n";
+	    }
+	    up.ejected=false;
+	    up.failures=0;
+	}else if(++up.failures>=PROXY_MAX_FAILURES){
+	    eject(up,"isn't answering");
+	}
+	pthread_mutex_unlock(&lock);
+    }
+}
@@ -0,0 +1,101 @@
+// copyright Patrick Horgan
+// source is open, feel free to use it as you wish with no restrictions
+// except that this copyright notice must be preserved intact
+#ifndef proxy_guard
+#define proxy_guard
+#include <string>
+#include <vector>
+#include <exception>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "http.h"
+#include "requestbody.h"
+#include "sockfdwrapper.h"
+
+// nothing's been sent to the client and no upstream would answer, so it
+// gets a 502
+class
+proxy_upstream_unavailable: public std::exception
+{
+public:
+    proxy_upstream_unavailable(){};
+    virtual ~proxy_upstream_unavailable() throw() {};
+    virtual const char* what() const throw()
+    {
+	return "no upstream server could take the request";
+    };
+};
+
+// an upstream in the list that doesn't make sense or won't resolve
+class
+proxy_config_fail: public std::exception
+{
+public:
+    proxy_config_fail(const std::string& why):why(why){};
+    virtual ~proxy_config_fail() throw() {};
+    virtual const char* what() const throw()
+    {
+	return why.c_str();
+    };
+private:
+    std::string why;
+};
+
+// Application servers we pass requests on to, as HTTP/1.1 over TCP or unix
+// sockets.  Each upstream keeps the connections it's done with open for
+// the next request, so most requests don't connect at all.  A request goes
+// to whichever upstream has the fewest in flight.  Bodies go both ways a
+// piece at a time, spliced from socket to socket where we know the length,
+// so none is ever all in memory.
+class proxyPool
+{
+public:
+    friend void* proxy_health(void *);
+    // upstreams is a comma separated list of host:port, [v6addr]:port
+    // and unix:/path.  Throws proxy_config_fail if one's no good.
+    proxyPool(const std::string& upstreams);
+    ~proxyPool();
+    // Passes the request on and streams the response back to sfd.  Throws
+    // proxy_upstream_unavailable if nothing was sent to the client and no
+    // upstream would answer.  If the upstream goes away partway through the
+    // response, the client's connection is shut down so they know it's
+    // cut short.
+    void
+    run(sockfdwrapper& sfd,http_request_line& hrl,header_map& hdrs,request_body& body);
+    // Probes every upstream.  Ones that don't answer twice in a row are
+    // ejected, and get nothing till they answer again.
+    void
+    health_check();
+    size_t size() const { return upstreams.size(); };
+    bool ejected(size_t which);
+private:
+    proxyPool();
+    proxyPool(const proxyPool&);
+    const proxyPool& operator=(const proxyPool&);
+    struct upstream
+    {
+	std::string name;	    // as it was given, for Host: and logs
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	std::vector<int> idle;	    // kept-alive connections nobody's using
+	size_t busy;		    // requests in flight right now
+	size_t failures;	    // failed probes in a row
+	bool ejected;
+    };
+    enum outcome { done, retry, failed };
+    void add_upstream(const std::string& spec);
+    int connect_to(const upstream&);
+    int checkout(size_t&,bool&);
+    void checkin(size_t,int,bool);
+    void eject(upstream&,const char *why);
+    bool probe(const upstream&);
+    outcome one_try(sockfdwrapper&,int,const std::string&,bool,bool,request_body&,bool&);
+    std::vector<upstream> upstreams;
+    size_t next;		    // where looking for the least busy starts,
+				    // so ties take turns
+    pthread_mutex_t lock;	    // upstreams' idle, busy and ejected, and running
+    pthread_cond_t wake;	    // the checker should look at running
+    pthread_t checker;
+    bool running;
+};
+#endif
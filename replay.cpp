@@ -0,0 +1,1112 @@
+// copyright Patrick Horgan
+// source is open, feel free to use it as you wish with no restrictions
+// except that this copyright notice must be preserved intact
+
+// replay sends the requests in a capture made with httpserver -c to a
+// server again, each connection's requests on one connection of its own,
+// at the times they first came or sped up or slowed down.  Then it says
+// which requests got a different status than they did the first time, and
+// how long they took this time against how long they took then.
+//
+//    replay [-2] [-a host] [-p port] [-s speed] [-c maxconns] [-d ndiffs] capturefile
+//
+// speed 2 sends them twice as fast as they first came, 0 sends each as soon
+// as its connection's free.  maxconns caps how many connections are open at
+// once, past that a connection waits to start.  ndiffs is how many of the
+// requests whose status changed to list.  -2 sends each connection's
+// requests as streams on one HTTP/2 connection instead, cleartext with
+// prior knowledge, each at its time whether the ones before have been
+// answered or not.
+#include "capture.h"
+#include "h2frame.h"
+#include "hpack.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+// what happened to one request this time
+struct replay_result
+{
+    replay_result():status(0),latency_us(0),done(false),retries(0){};
+    int status;		    // 0 if no answer came
+    unsigned long long latency_us;
+    bool done;
+    unsigned retries;	    // how often -2 sent it again on a new connection
+};
+
+// A server can turn an HTTP/2 connection away when it has all it'll take,
+// and then we try again on another, waiting twice as long each time.
+const unsigned MAX_RETRIES=6;
+const useconds_t RETRY_WAIT_US=5000;
+
+// one captured connection and everything sent on it
+struct replay_conn
+{
+    std::vector<size_t> requests;   // indexes into the records, in order
+    pthread_t tid;
+};
+
+static std::vector<capture_record> records;
+static std::vector<replay_result> results;
+static struct addrinfo *target=0;
+static double speed=1.0;
+static bool use_h2=false;
+static unsigned long long replay_began;
+static sem_t conn_slots;
+
+static unsigned long long
+now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec*1000000ULL+ts.tv_nsec/1000;
+}
+
+// till when a captured time comes round again, at speed
+static void
+wait_for(uint64_t captured_us)
+{
+    if(speed<=0){
+	return;
+    }
+    unsigned long long when=replay_began+static_cast<unsigned long long>(captured_us/speed);
+    unsigned long long now=now_us();
+    if(when>now){
+	usleep(static_cast<useconds_t>(when-now));
+    }
+}
+
+static int
+connect_to_target()
+{
+    int fd=socket(target->ai_family,target->ai_socktype|SOCK_CLOEXEC,target->ai_protocol);
+    if(fd==-1){
+	return -1;
+    }
+    // nothing we replay should take this long
+    struct timeval tv;
+    tv.tv_sec=30;
+    tv.tv_usec=0;
+    setsockopt(fd,SOL_SOCKET,SO_RCVTIMEO,&tv,sizeof tv);
+    setsockopt(fd,SOL_SOCKET,SO_SNDTIMEO,&tv,sizeof tv);
+    if(connect(fd,target->ai_addr,target->ai_addrlen)==-1){
+	close(fd);
+	return -1;
+    }
+    return fd;
+}
+
+static bool
+send_all(int fd,const std::string& s)
+{
+    size_t cnt=0;
+    while(cnt<s.size()){
+	ssize_t sent=send(fd,s.data()+cnt,s.size()-cnt,MSG_NOSIGNAL);
+	if(sent==-1){
+	    if(errno==EINTR){
+		continue;
+	    }
+	    return false;
+	}
+	cnt+=sent;
+    }
+    return true;
+}
+
+// Reads responses off one connection.  Whatever comes after one response
+// is kept for the next.
+class response_reader
+{
+public:
+    response_reader(int fd):fd(fd){};
+    // Reads one whole response.  False if the connection went away or
+    // sent something that isn't one.  keep says if it's good for another.
+    bool read_response(bool head_request,int& status,bool& keep);
+private:
+    bool fill();
+    bool need(size_t n);
+    bool get_line(std::string& line);
+    int fd;
+    std::string buf;
+};
+
+// read some more onto the end of buf
+bool
+response_reader::fill()
+{
+    char chunk[16384];
+    ssize_t got;
+    while((got=recv(fd,chunk,sizeof chunk,0))==-1 && errno==EINTR);
+    if(got<=0){
+	return false;
+    }
+    buf.append(chunk,got);
+    return true;
+}
+
+bool
+response_reader::need(size_t n)
+{
+    while(buf.size()<n){
+	if(!fill()){
+	    return false;
+	}
+    }
+    return true;
+}
+
+bool
+response_reader::get_line(std::string& line)
+{
+    size_t nl;
+    while((nl=buf.find('\n'))==std::string::npos){
+	if(!fill()){
+	    return false;
+	}
+    }
+    line=buf.substr(0,nl+1);
+    buf.erase(0,nl+1);
+    line.erase(line.find_last_not_of("\r\n")+1);
+    return true;
+}
+
+bool
+response_reader::read_response(bool head_request,int& status,bool& keep)
+{
+    std::string line;
+    if(!get_line(line) || line.compare(0,7,"HTTP/1.")!=0 || line.size()<12){
+	return false;
+    }
+    status=atoi(line.c_str()+9);
+    if(status/100==1 && status!=101){
+	// a 100 Continue, the answer's after it
+	while(get_line(line) && !line.empty());
+	return read_response(head_request,status,keep);
+    }
+    keep=line[7]=='1';
+    bool chunked=false,have_length=false;
+    size_t length=0;
+    while(true){
+	if(!get_line(line)){
+	    return false;
+	}
+	if(line.empty()){
+	    break;
+	}
+	size_t colon=line.find(':');
+	if(colon==std::string::npos){
+	    continue;
+	}
+	std::string name=line.substr(0,colon);
+	size_t vstart=line.find_first_not_of(" \t",colon+1);
+	std::string value=vstart==std::string::npos?"":line.substr(vstart);
+	if(strcasecmp(name.c_str(),"Content-Length")==0){
+	    have_length=true;
+	    length=strtoul(value.c_str(),0,10);
+	}else if(strcasecmp(name.c_str(),"Transfer-Encoding")==0){
+	    chunked=strcasestr(value.c_str(),"chunked")!=0;
+	}else if(strcasecmp(name.c_str(),"Connection")==0){
+	    if(strcasestr(value.c_str(),"close")){
+		keep=false;
+	    }else if(strcasestr(value.c_str(),"keep-alive")){
+		keep=true;
+	    }
+	}
+    }
+    if(head_request || status/100==1 || status==204 || status==304){
+	return true;
+    }
+    if(chunked){
+	while(true){
+	    if(!get_line(line)){
+		return false;
+	    }
+	    size_t size=strtoul(line.c_str(),0,16);
+	    if(size==0){
+		break;
+	    }
+	    // the chunk and its \r\n
+	    if(!need(size+2)){
+		return false;
+	    }
+	    buf.erase(0,size+2);
+	}
+	// trailers, if any, then the blank line
+	while(get_line(line) && !line.empty());
+	return true;
+    }
+    if(have_length){
+	if(!need(length)){
+	    return false;
+	}
+	buf.erase(0,length);
+	return true;
+    }
+    // it ends when they close
+    while(fill());
+    buf.clear();
+    keep=false;
+    return true;
+}
+
+// Plays one connection's requests, a thread for each connection.  If the
+// server closes it and there are more to send, we open another like a
+// browser would.
+static void *
+play_connection(void *voidconn)
+{
+    replay_conn *conn=static_cast<replay_conn*>(voidconn);
+    int fd=-1;
+    response_reader *reader=0;
+    for(size_t ctr=0;ctr<conn->requests.size();ctr++){
+	size_t idx=conn->requests[ctr];
+	const capture_record& rec=records[idx];
+	replay_result& res=results[idx];
+	wait_for(rec.start_us);
+	if(fd==-1){
+	    if((fd=connect_to_target())==-1){
+		res.done=true;
+		continue;
+	    }
+	    reader=new response_reader(fd);
+	}
+	unsigned long long started=now_us();
+	bool keep=false;
+	if(send_all(fd,rec.request)
+		&& reader->read_response(rec.request.compare(0,5,"HEAD ")==0,res.status,keep)){
+	    res.latency_us=now_us()-started;
+	}else{
+	    res.status=0;
+	}
+	res.done=true;
+	if(!keep || res.status==0){
+	    delete reader;
+	    reader=0;
+	    close(fd);
+	    fd=-1;
+	}
+    }
+    if(fd!=-1){
+	delete reader;
+	close(fd);
+    }
+    sem_post(&conn_slots);
+    return 0;
+}
+
+// With -2 a connection's requests are streams on one HTTP/2 connection.
+// The connection's thread sends each at its time, and a thread of the
+// h2_client's own reads whatever comes back and says which request it
+// answers.
+struct h2_sent
+{
+    size_t idx;			// into the records
+    unsigned long long started;
+    int64_t window;		// how much body they'll take on it
+    int status;
+    bool end_headers_stream;	// the HEADERS being continued ended it
+};
+
+struct h2_client
+{
+    h2_client(int fd);
+    ~h2_client();
+    int fd;
+    pthread_t reader;
+    pthread_mutex_t lock;	// what's below, but not fd
+    pthread_mutex_t write_lock;	// fd and encoder, so frames don't interleave
+    pthread_cond_t changed;
+    hpackEncoder encoder;
+    hpackDecoder decoder;	// only the reader uses it
+    uint32_t next_stream;
+    bool dead;			// no new streams, it's going or gone
+    bool reader_done;
+    uint32_t goaway_last;	// streams past this the server didn't look at
+    int64_t send_window;
+    uint32_t initial_window;
+    uint32_t max_frame;
+    uint64_t taken;		// DATA we haven't given back window for
+    std::map<uint32_t,h2_sent> streams;	// sent and not answered yet
+    std::vector<size_t> retry;	// to send again on another connection
+};
+
+h2_client::h2_client(int fd):fd(fd),decoder(hpackTable::DEFAULT_SIZE,1<<20),
+    next_stream(1),dead(false),reader_done(false),goaway_last(H2_MAX_WINDOW),
+    send_window(H2_DEFAULT_WINDOW),initial_window(H2_DEFAULT_WINDOW),
+    max_frame(H2_DEFAULT_FRAME_SIZE),taken(0)
+{
+    pthread_mutex_init(&lock,0);
+    pthread_mutex_init(&write_lock,0);
+    pthread_cond_init(&changed,0);
+}
+
+h2_client::~h2_client()
+{
+    close(fd);
+    pthread_cond_destroy(&changed);
+    pthread_mutex_destroy(&write_lock);
+    pthread_mutex_destroy(&lock);
+}
+
+static void
+put_frame(std::string& out,uint8_t type,uint8_t flags,uint32_t stream,
+	const char *payload,size_t len)
+{
+    h2_put_frame_header(out,static_cast<uint32_t>(len),type,flags,stream);
+    out.append(payload,len);
+}
+
+static bool
+h2_write(h2_client *cl,const std::string& frames)
+{
+    pthread_mutex_lock(&cl->write_lock);
+    bool ok=send_all(cl->fd,frames);
+    pthread_mutex_unlock(&cl->write_lock);
+    return ok;
+}
+
+// A stream's done, one way or another.  Called with lock held.
+static void
+h2_finished(h2_client *cl,std::map<uint32_t,h2_sent>::iterator it,bool answered,bool refused)
+{
+    size_t idx=it->second.idx;
+    if(refused && results[idx].retries<MAX_RETRIES){
+	results[idx].retries++;
+	cl->retry.push_back(idx);
+    }else{
+	results[idx].status=answered?it->second.status:0;
+	results[idx].latency_us=answered?now_us()-it->second.started:0;
+	results[idx].done=true;
+    }
+    cl->streams.erase(it);
+    pthread_cond_broadcast(&cl->changed);
+}
+
+static bool
+recv_all(h2_client *cl,uint8_t *p,size_t len)
+{
+    while(len){
+	ssize_t got=recv(cl->fd,p,len,0);
+	if(got==-1 && (errno==EAGAIN || errno==EWOULDBLOCK)){
+	    // the receive timeout, and it only matters if we're waiting
+	    pthread_mutex_lock(&cl->lock);
+	    bool waiting=!cl->streams.empty();
+	    pthread_mutex_unlock(&cl->lock);
+	    if(waiting){
+		return false;
+	    }
+	    continue;
+	}
+	if(got==-1 && errno==EINTR){
+	    continue;
+	}
+	if(got<=0){
+	    return false;
+	}
+	p+=got;
+	len-=got;
+    }
+    return true;
+}
+
+// The reader's side of one frame.  False if the connection can't go on.
+static bool
+h2_frame(h2_client *cl,const h2_frame_header& fh,std::vector<uint8_t>& payload,
+	std::string& block,uint32_t& continuing)
+{
+    const uint8_t *p=payload.data();
+    size_t len=fh.length;
+    std::string reply;
+    if(continuing && (fh.type!=H2_CONTINUATION || fh.stream!=continuing)){
+	return false;
+    }
+    if(fh.type==H2_DATA || fh.type==H2_HEADERS){
+	if(fh.stream==0){
+	    return false;
+	}
+	if(fh.flags&H2_PADDED){
+	    if(len==0 || p[0]>=len){
+		return false;
+	    }
+	    len-=p[0]+1;
+	    p++;
+	}
+    }
+    pthread_mutex_lock(&cl->lock);
+    std::map<uint32_t,h2_sent>::iterator it=cl->streams.find(fh.stream);
+    bool ok=true;
+    switch(fh.type){
+	case H2_DATA:
+	    cl->taken+=fh.length;
+	    if(cl->taken>=H2_MAX_WINDOW/2){
+		std::string n;
+		h2_put32(n,static_cast<uint32_t>(cl->taken));
+		put_frame(reply,H2_WINDOW_UPDATE,0,0,n.data(),4);
+		cl->taken=0;
+	    }
+	    if(it!=cl->streams.end() && (fh.flags&H2_END_STREAM)){
+		h2_finished(cl,it,true,false);
+	    }
+	    break;
+	case H2_HEADERS:
+	case H2_CONTINUATION:
+	    if(fh.type==H2_HEADERS){
+		if(fh.flags&H2_PRIORITY_FLAG){
+		    if(len<5){
+			ok=false;
+			break;
+		    }
+		    p+=5;
+		    len-=5;
+		}
+		if(it!=cl->streams.end()){
+		    it->second.end_headers_stream=(fh.flags&H2_END_STREAM)!=0;
+		}
+	    }else if(!continuing){
+		ok=false;
+		break;
+	    }
+	    block.append(reinterpret_cast<const char*>(p),len);
+	    if(!(fh.flags&H2_END_HEADERS)){
+		continuing=fh.stream;
+		break;
+	    }
+	    continuing=0;
+	    {
+		header_list fields;
+		if(!cl->decoder.decode(reinterpret_cast<const uint8_t*>(block.data()),
+			    block.size(),fields)){
+		    ok=false;
+		    break;
+		}
+		block.clear();
+		if(it==cl->streams.end()){
+		    break;
+		}
+		for(size_t ctr=0;ctr<fields.size();ctr++){
+		    if(fields[ctr].name==":status"){
+			int status=atoi(fields[ctr].value.c_str());
+			// a 100 Continue isn't the answer
+			if(status>=200 || it->second.status==0){
+			    it->second.status=status;
+			}
+		    }
+		}
+		if(it->second.end_headers_stream){
+		    h2_finished(cl,it,true,false);
+		}
+	    }
+	    break;
+	case H2_RST_STREAM:
+	    if(len!=4){
+		ok=false;
+	    }else if(it!=cl->streams.end()){
+		h2_finished(cl,it,false,h2_get32(p)==H2_REFUSED_STREAM);
+	    }
+	    break;
+	case H2_SETTINGS:
+	    if(fh.flags&H2_ACK){
+		break;
+	    }
+	    if(len%6){
+		ok=false;
+		break;
+	    }
+	    for(size_t off=0;off<len;off+=6){
+		uint16_t id=static_cast<uint16_t>(p[off]<<8|p[off+1]);
+		uint32_t value=h2_get32(p+off+2);
+		if(id==H2_SETTINGS_INITIAL_WINDOW_SIZE){
+		    int64_t delta=static_cast<int64_t>(value)-cl->initial_window;
+		    cl->initial_window=value;
+		    for(it=cl->streams.begin();it!=cl->streams.end();++it){
+			it->second.window+=delta;
+		    }
+		}else if(id==H2_SETTINGS_MAX_FRAME_SIZE){
+		    cl->max_frame=value;
+		}else if(id==H2_SETTINGS_HEADER_TABLE_SIZE){
+		    pthread_mutex_lock(&cl->write_lock);
+		    cl->encoder.set_max_size(value);
+		    pthread_mutex_unlock(&cl->write_lock);
+		}
+	    }
+	    put_frame(reply,H2_SETTINGS,H2_ACK,0,0,0);
+	    pthread_cond_broadcast(&cl->changed);
+	    break;
+	case H2_PING:
+	    if(len!=8){
+		ok=false;
+	    }else if(!(fh.flags&H2_ACK)){
+		put_frame(reply,H2_PING,H2_ACK,0,reinterpret_cast<const char*>(p),8);
+	    }
+	    break;
+	case H2_GOAWAY:
+	    if(len<8){
+		ok=false;
+		break;
+	    }
+	    cl->dead=true;
+	    cl->goaway_last=h2_get32(p)&0x7fffffff;
+	    // the ones it didn't get to can go again somewhere else
+	    for(it=cl->streams.upper_bound(cl->goaway_last);it!=cl->streams.end();){
+		h2_finished(cl,it++,false,true);
+	    }
+	    pthread_cond_broadcast(&cl->changed);
+	    break;
+	case H2_WINDOW_UPDATE:
+	    if(len!=4){
+		ok=false;
+		break;
+	    }
+	    if(fh.stream==0){
+		cl->send_window+=h2_get32(p)&0x7fffffff;
+	    }else if(it!=cl->streams.end()){
+		it->second.window+=h2_get32(p)&0x7fffffff;
+	    }
+	    pthread_cond_broadcast(&cl->changed);
+	    break;
+	case H2_PUSH_PROMISE:
+	    // we said no
+	    ok=false;
+	    break;
+	default:
+	    break;
+    }
+    pthread_mutex_unlock(&cl->lock);
+    return ok && (reply.empty() || h2_write(cl,reply));
+}
+
+// the h2_client's thread, reading frames till it's closed
+static void *
+read_h2(void *voidclient)
+{
+    h2_client *cl=static_cast<h2_client*>(voidclient);
+    std::vector<uint8_t> payload;
+    std::string block;
+    uint32_t continuing=0;
+    uint8_t head[H2_FRAME_HEADER_LEN];
+    while(recv_all(cl,head,sizeof head)){
+	h2_frame_header fh=h2_parse_frame_header(head);
+	// we never said it could be more than the default
+	if(fh.length>H2_DEFAULT_FRAME_SIZE){
+	    break;
+	}
+	payload.resize(fh.length);
+	if((fh.length && !recv_all(cl,payload.data(),fh.length))
+		|| !h2_frame(cl,fh,payload,block,continuing)){
+	    break;
+	}
+    }
+    pthread_mutex_lock(&cl->lock);
+    cl->dead=true;
+    cl->reader_done=true;
+    while(!cl->streams.empty()){
+	h2_finished(cl,cl->streams.begin(),false,false);
+    }
+    pthread_cond_broadcast(&cl->changed);
+    pthread_mutex_unlock(&cl->lock);
+    return 0;
+}
+
+// A connection with the preface and our settings sent, and its reader
+// going.  We take all the server will send and don't want pushes.
+static h2_client *
+h2_connect()
+{
+    int fd=connect_to_target();
+    if(fd==-1){
+	return 0;
+    }
+    int one=1;
+    setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&one,sizeof one);
+    std::string hello(H2_PREFACE,H2_PREFACE_LEN);
+    h2_put_frame_header(hello,12,H2_SETTINGS,0,0);
+    h2_put_setting(hello,H2_SETTINGS_ENABLE_PUSH,0);
+    h2_put_setting(hello,H2_SETTINGS_INITIAL_WINDOW_SIZE,H2_MAX_WINDOW);
+    h2_put_frame_header(hello,4,H2_WINDOW_UPDATE,0,0);
+    h2_put32(hello,H2_MAX_WINDOW-H2_DEFAULT_WINDOW);
+    if(!send_all(fd,hello)){
+	close(fd);
+	return 0;
+    }
+    h2_client *cl=new h2_client(fd);
+    if(pthread_create(&cl->reader,0,read_h2,cl)!=0){
+	delete cl;
+	return 0;
+    }
+    return cl;
+}
+
+// Everything's been sent that's going to be.  Waits for the answers, puts
+// what has to go again on the front of todo, and closes the connection.
+static void
+h2_done(h2_client *cl,std::deque<size_t>& todo)
+{
+    pthread_mutex_lock(&cl->lock);
+    while(!cl->streams.empty() && !cl->reader_done){
+	pthread_cond_wait(&cl->changed,&cl->lock);
+    }
+    pthread_mutex_unlock(&cl->lock);
+    if(!cl->reader_done){
+	std::string bye;
+	h2_put_frame_header(bye,8,H2_GOAWAY,0,0);
+	h2_put32(bye,0);
+	h2_put32(bye,H2_NO_ERROR);
+	h2_write(cl,bye);
+    }
+    shutdown(cl->fd,SHUT_RDWR);
+    pthread_join(cl->reader,0);
+    todo.insert(todo.begin(),cl->retry.begin(),cl->retry.end());
+    delete cl;
+}
+
+// what's left of a chunked body after the chunks are put together
+static bool
+dechunk(const std::string& in,size_t pos,std::string& out)
+{
+    while(true){
+	size_t nl=in.find('\n',pos);
+	if(nl==std::string::npos){
+	    return false;
+	}
+	size_t size=strtoul(in.c_str()+pos,0,16);
+	pos=nl+1;
+	if(size==0){
+	    // trailers, and h2 would have them in a HEADERS of their own
+	    return true;
+	}
+	if(pos+size>in.size()){
+	    return false;
+	}
+	out.append(in,pos,size);
+	if((nl=in.find('\n',pos+size))==std::string::npos){
+	    return false;
+	}
+	pos=nl+1;
+    }
+}
+
+// The HTTP/2 headers and body for a captured HTTP/1 request.  False if
+// it's not one that can be a stream.
+static bool
+h2_request(const std::string& request,header_list& fields,std::string& body)
+{
+    size_t end=request.find("\r\n\r\n");
+    size_t skip=4;
+    if(end==std::string::npos){
+	if((end=request.find("\n\n"))==std::string::npos){
+	    return false;
+	}
+	skip=2;
+    }
+    std::istringstream head(request.substr(0,end));
+    std::string line,method,target,authority;
+    std::getline(head,line);
+    std::istringstream request_line(line);
+    request_line >> method >> target;
+    if(target.empty() || method=="CONNECT"){
+	return false;
+    }
+    if(target.compare(0,7,"http://")==0){
+	size_t slash=target.find('/',7);
+	authority=target.substr(7,slash==std::string::npos?std::string::npos:slash-7);
+	target=slash==std::string::npos?"/":target.substr(slash);
+    }
+    header_list rest;
+    bool chunked=false;
+    while(std::getline(head,line)){
+	line.erase(line.find_last_not_of("\r")+1);
+	size_t colon=line.find(':');
+	if(colon==std::string::npos){
+	    continue;
+	}
+	std::string name=line.substr(0,colon);
+	for(size_t ctr=0;ctr<name.size();ctr++){
+	    name[ctr]=static_cast<char>(tolower(name[ctr]));
+	}
+	size_t vstart=line.find_first_not_of(" \t",colon+1);
+	std::string value=vstart==std::string::npos?"":line.substr(vstart);
+	value.erase(value.find_last_not_of(" \t")+1);
+	if(name=="host"){
+	    if(authority.empty()){
+		authority=value;
+	    }
+	}else if(name=="transfer-encoding"){
+	    chunked=strcasestr(value.c_str(),"chunked")!=0;
+	}else if(name=="te"){
+	    if(strcasecmp(value.c_str(),"trailers")==0){
+		rest.push_back(header_field(name,value));
+	    }
+	}else if(name!="connection" && name!="keep-alive" && name!="proxy-connection"
+		&& name!="upgrade" && name!="http2-settings"
+		&& !(chunked && name=="content-length")){
+	    rest.push_back(header_field(name,value));
+	}
+    }
+    fields.push_back(header_field(":method",method));
+    fields.push_back(header_field(":scheme","http"));
+    if(!authority.empty()){
+	fields.push_back(header_field(":authority",authority));
+    }
+    fields.push_back(header_field(":path",target));
+    if(chunked){
+	if(!dechunk(request,end+skip,body)){
+	    return false;
+	}
+	for(size_t ctr=0;ctr<rest.size();ctr++){
+	    if(rest[ctr].name=="content-length"){
+		rest.erase(rest.begin()+ctr--);
+	    }
+	}
+	std::ostringstream length;
+	length << body.size();
+	rest.push_back(header_field("content-length",length.str()));
+    }else{
+	body=request.substr(end+skip);
+    }
+    fields.insert(fields.end(),rest.begin(),rest.end());
+    return true;
+}
+
+// Starts one stream and sends its body as the windows let us.  False if
+// the connection's going away and it wasn't sent.
+static bool
+h2_send(h2_client *cl,size_t idx,const header_list& fields,const std::string& body)
+{
+    pthread_mutex_lock(&cl->write_lock);
+    pthread_mutex_lock(&cl->lock);
+    if(cl->dead){
+	pthread_mutex_unlock(&cl->lock);
+	pthread_mutex_unlock(&cl->write_lock);
+	return false;
+    }
+    uint32_t id=cl->next_stream;
+    cl->next_stream+=2;
+    h2_sent& sent=cl->streams[id];
+    sent.idx=idx;
+    sent.started=now_us();
+    sent.window=cl->initial_window;
+    sent.status=0;
+    sent.end_headers_stream=false;
+    size_t max_frame=cl->max_frame;
+    pthread_mutex_unlock(&cl->lock);
+    std::string block,frames;
+    cl->encoder.encode(fields,block);
+    for(size_t off=0;off==0 || off<block.size();off+=max_frame){
+	size_t len=std::min(max_frame,block.size()-off);
+	uint8_t flags=off+len==block.size()?H2_END_HEADERS:0;
+	if(off==0 && body.empty()){
+	    flags|=H2_END_STREAM;
+	}
+	put_frame(frames,off==0?H2_HEADERS:H2_CONTINUATION,flags,id,block.data()+off,len);
+    }
+    bool ok=send_all(cl->fd,frames);
+    pthread_mutex_unlock(&cl->write_lock);
+    for(size_t off=0;ok && off<body.size();){
+	pthread_mutex_lock(&cl->lock);
+	std::map<uint32_t,h2_sent>::iterator it;
+	while((it=cl->streams.find(id))!=cl->streams.end() && !cl->dead
+		&& (cl->send_window<=0 || it->second.window<=0)){
+	    pthread_cond_wait(&cl->changed,&cl->lock);
+	}
+	if(it==cl->streams.end() || cl->dead){
+	    // it's been answered or it never will be, either way the
+	    // reader's said so
+	    pthread_mutex_unlock(&cl->lock);
+	    return true;
+	}
+	size_t len=std::min(std::min(body.size()-off,static_cast<size_t>(cl->max_frame)),
+		static_cast<size_t>(std::min(cl->send_window,it->second.window)));
+	cl->send_window-=len;
+	it->second.window-=len;
+	pthread_mutex_unlock(&cl->lock);
+	frames.clear();
+	put_frame(frames,H2_DATA,off+len==body.size()?H2_END_STREAM:0,id,body.data()+off,len);
+	ok=h2_write(cl,frames);
+	off+=len;
+    }
+    if(!ok){
+	// the reader finds out too when the server's gone
+	pthread_mutex_lock(&cl->lock);
+	cl->dead=true;
+	pthread_mutex_unlock(&cl->lock);
+	shutdown(cl->fd,SHUT_RDWR);
+    }
+    return true;
+}
+
+// play_connection for -2
+static void *
+play_h2_connection(void *voidconn)
+{
+    replay_conn *conn=static_cast<replay_conn*>(voidconn);
+    std::deque<size_t> todo(conn->requests.begin(),conn->requests.end());
+    h2_client *cl=0;
+    while(true){
+	if(cl){
+	    pthread_mutex_lock(&cl->lock);
+	    bool dead=cl->dead;
+	    pthread_mutex_unlock(&cl->lock);
+	    if(dead || todo.empty()){
+		h2_done(cl,todo);
+		cl=0;
+	    }
+	}
+	if(todo.empty()){
+	    break;
+	}
+	size_t idx=todo.front();
+	todo.pop_front();
+	replay_result& res=results[idx];
+	wait_for(records[idx].start_us);
+	header_list fields;
+	std::string body;
+	if(!h2_request(records[idx].request,fields,body)){
+	    res.done=true;
+	    continue;
+	}
+	if(cl==0){
+	    if(res.retries){
+		usleep(RETRY_WAIT_US<<res.retries);
+	    }
+	    if((cl=h2_connect())==0){
+		res.done=true;
+		continue;
+	    }
+	}
+	if(!h2_send(cl,idx,fields,body)){
+	    // it went away just now, so again on a new one
+	    if(res.retries<MAX_RETRIES){
+		res.retries++;
+		todo.push_front(idx);
+	    }else{
+		res.done=true;
+	    }
+	}
+    }
+    sem_post(&conn_slots);
+    return 0;
+}
+
+static unsigned long long
+percentile(const std::vector<unsigned long long>& sorted,double p)
+{
+    if(sorted.empty()){
+	return 0;
+    }
+    size_t idx=static_cast<size_t>(p*(sorted.size()-1)+0.5);
+    return sorted[idx];
+}
+
+static void
+show_latencies(const char *what,std::vector<unsigned long long>& us)
+{
+    std::sort(us.begin(),us.end());
+    char line[160];
+    snprintf(line,sizeof line,"%-10s %8.2f %8.2f %8.2f %8.2f %8.2f\n",what,
+	    percentile(us,0.5)/1000.0,percentile(us,0.9)/1000.0,
+	    percentile(us,0.99)/1000.0,percentile(us,0.999)/1000.0,
+	    us.empty()?0.0:us.back()/1000.0);
+    std::cout << line;
+}
+
+// the request line, for saying which request it was
+static std::string
+request_line(const std::string& request)
+{
+    size_t end=request.find_first_of("\r\n");
+    return request.substr(0,end==std::string::npos?request.size():end);
+}
+
+int
+main(int argc,char *argv[])
+{
+    const char *host="localhost";
+    const char *port="8080";
+    unsigned maxconns=512;
+    size_t ndiffs=20;
+    int opt;
+    while((opt=getopt(argc,argv,"2a:c:d:p:s:"))!=-1){
+	switch(opt){
+	    case '2':
+		use_h2=true;
+		break;
+	    case 'a':
+		host=optarg;
+		break;
+	    case 'c':
+		maxconns=static_cast<unsigned>(atoi(optarg));
+		break;
+	    case 'd':
+		ndiffs=static_cast<size_t>(atoi(optarg));
+		break;
+	    case 'p':
+		port=optarg;
+		break;
+	    case 's':
+		speed=atof(optarg);
+		break;
+	    default:
+		optind=argc+1;
+	}
+    }
+    if(optind!=argc-1 || maxconns==0){
+	std::cerr << "usage: " << argv[0] << " [-2] [-a host] [-p port] [-s speed] [-c maxconns] [-d ndiffs] capturefile\n";
+	exit(1);
+    }
+    FILE *in=open_capture(argv[optind]);
+    if(in==0){
+	std::cerr << argv[optind] << " isn't a capture from httpserver -c\n";
+	exit(1);
+    }
+    capture_record rec;
+    size_t truncated=0;
+    while(read_capture(in,rec)){
+	// the server would sit waiting for the rest of one that was cut short
+	if(rec.flags&CAPTURE_TRUNCATED){
+	    truncated++;
+	    continue;
+	}
+	records.push_back(rec);
+    }
+    fclose(in);
+    if(truncated){
+	std::cerr << truncated << " requests were too big to capture whole, "
+	    "and aren't replayed\n";
+    }
+    results.resize(records.size());
+
+    struct addrinfo hints;
+    bzero(&hints,sizeof hints);
+    hints.ai_family=AF_UNSPEC;
+    hints.ai_socktype=SOCK_STREAM;
+    int err;
+    if((err=getaddrinfo(host,port,&hints,&target))!=0){
+	std::cerr << host << ':' << port << ": " << gai_strerror(err) << '\n';
+	exit(1);
+    }
+
+    // Connections in the order they started, with their requests in the
+    // order they started.  Connection 0 is one we don't know, so each of
+    // its requests gets one to itself.
+    std::vector<size_t> order(records.size());
+    for(size_t idx=0;idx<order.size();idx++){
+	order[idx]=idx;
+    }
+    std::stable_sort(order.begin(),order.end(),[](size_t a,size_t b){
+	return records[a].start_us<records[b].start_us;
+    });
+    std::map<uint32_t,replay_conn*> by_id;
+    std::vector<replay_conn*> conns;
+    for(size_t ctr=0;ctr<order.size();ctr++){
+	uint32_t id=records[order[ctr]].connection;
+	replay_conn *conn;
+	if(id==0 || by_id.find(id)==by_id.end()){
+	    conn=new replay_conn;
+	    conns.push_back(conn);
+	    if(id){
+		by_id[id]=conn;
+	    }
+	}else{
+	    conn=by_id[id];
+	}
+	conn->requests.push_back(order[ctr]);
+    }
+
+    sem_init(&conn_slots,0,maxconns);
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr,256*1024);
+    replay_began=now_us();
+    if(!records.empty() && speed>0){
+	// the first request goes right away
+	replay_began-=static_cast<unsigned long long>(records[order[0]].start_us/speed);
+    }
+    size_t started=0;
+    for(size_t ctr=0;ctr<conns.size();ctr++){
+	wait_for(records[conns[ctr]->requests[0]].start_us);
+	sem_wait(&conn_slots);
+	if(pthread_create(&conns[ctr]->tid,&attr,
+		    use_h2?play_h2_connection:play_connection,conns[ctr])!=0){
+	    std::cerr << "couldn't start a thread for a connection: " << strerror(errno) << '\n';
+	    sem_post(&conn_slots);
+	    conns[ctr]->requests.clear();
+	    continue;
+	}
+	started++;
+    }
+    for(size_t ctr=0;ctr<conns.size();ctr++){
+	if(!conns[ctr]->requests.empty()){
+	    pthread_join(conns[ctr]->tid,0);
+	}
+    }
+    double secs=(now_us()-replay_began)/1e6;
+    pthread_attr_destroy(&attr);
+
+    // what came back, against what came back the first time
+    std::map<std::pair<int,int>,size_t> transitions;
+    std::vector<unsigned long long> then,now;
+    std::vector<size_t> changed;
+    size_t failed=0,retries=0;
+    for(size_t idx=0;idx<records.size();idx++){
+	if(!results[idx].done){
+	    continue;
+	}
+	retries+=results[idx].retries;
+	transitions[std::make_pair(static_cast<int>(records[idx].status),results[idx].status)]++;
+	if(results[idx].status==0){
+	    failed++;
+	    continue;
+	}
+	then.push_back(records[idx].duration_us);
+	now.push_back(results[idx].latency_us);
+	if(records[idx].status && records[idx].status!=results[idx].status){
+	    changed.push_back(idx);
+	}
+    }
+    std::cout << "replayed " << records.size() << " requests on " << started
+	<< " connections in " << secs << "s, " << failed << " got no answer\n";
+    if(retries){
+	std::cout << "the server turned connections away, and requests were sent "
+	    << retries << " more times\n";
+    }
+    std::cout << "\nstatus      then -> now    requests\n";
+    for(std::map<std::pair<int,int>,size_t>::iterator it=transitions.begin();
+	    it!=transitions.end();++it){
+	char line[80];
+	snprintf(line,sizeof line,"            %4d -> %-4d %10zu%s\n",it->first.first,
+		it->first.second,it->second,
+		it->first.first && it->first.first!=it->first.second?"  changed":"");
+	std::cout << line;
+    }
+    for(size_t ctr=0;ctr<changed.size() && ctr<ndiffs;ctr++){
+	if(ctr==0){
+	    std::cout << "\nchanged:\n";
+	}
+	size_t idx=changed[ctr];
+	std::cout << "    " << records[idx].status << " -> " << results[idx].status
+	    << "  " << request_line(records[idx].request) << '\n';
+    }
+    // then's time in the server, now's the time the client saw
+    std::cout << "\nlatency ms     p50      p90      p99    p99.9      max\n";
+    show_latencies("then",then);
+    show_latencies("now",now);
+    freeaddrinfo(target);
+    return failed!=0 || !changed.empty();
+}
@@ -0,0 +1,393 @@
+// copyright Patrick Horgan
+// source is open, feel free to use it as you wish with no restrictions
+// except that this copyright notice must be preserved intact
+#include "requestbody.h"
+#include <cerrno>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+
+// longest chunk-size or trailer line we'll put up with
+const size_t MAX_CHUNK_LINE=4096;
+
+request_body::request_body(sockfdwrapper& sfd,header_map& hdrs,
+	size_t maxsize):
+    sfd(sfd),has_body(false),chunked(false),done(false),expect_continue(false),remaining(0),
+    total(0),maxsize(maxsize),spillfd(-1)
+{
+    header_map::iterator te=hdrs.find("Transfer-Encoding");
+    header_map::iterator cl=hdrs.find("Content-Length");
+    header_map::iterator ex=hdrs.find("Expect");
+
+    if(te!=hdrs.end() && cl!=hdrs.end()){
+	throw request_body_bad("both Transfer-Encoding and Content-Length");
+    }
+    if(te!=hdrs.end()){
+	arena_string value(te->second);
+	std::transform(value.begin(),value.end(),value.begin(),::tolower);
+	if(value!="chunked"){
+	    throw request_body_bad("unsupported Transfer-Encoding");
+	}
+	chunked=true;
+    }else if(cl!=hdrs.end()){
+	const arena_string& value=cl->second;
+	if(value.size()==0 || value.size()>18){
+	    throw request_body_bad("bad Content-Length");
+	}
+	for(size_t ctr=0;ctr<value.size();ctr++){
+	    if(!isdigit(value[ctr])){
+		throw request_body_bad("bad Content-Length");
+	    }
+	    remaining=remaining*10+(value[ctr]-'0');
+	}
+	if(remaining>maxsize){
+	    throw request_body_too_large();
+	}
+    }
+    has_body=chunked || remaining>0;
+    if(!has_body){
+	done=true;
+    }
+    if(ex!=hdrs.end()){
+	arena_string value(ex->second);
+	std::transform(value.begin(),value.end(),value.begin(),::tolower);
+	expect_continue=(value=="100-continue");
+    }
+}
+
+request_body::~request_body()
+{
+    if(spillfd!=-1){
+	close(spillfd);
+    }
+}
+
+// The client's waiting for us to say we want the body before sending it.
+// We only say so once we actually start reading.
+void
+request_body::send_continue()
+{
+    if(expect_continue){
+	expect_continue=false;
+	sfd << "HTTP/1.1 100 Continue\r\n\r\n";
+    }
+}
+
+// a whole line, however many reads it takes
+bool
+request_body::read_line(std::string& line)
+{
+    line_view view;
+    line.clear();
+    if(!sfd.get_line(view)){
+	if(sfd.over_limit()){
+	    throw request_body_bad("chunk line too long");
+	}
+	return false;
+    }
+    if(view.size()>MAX_CHUNK_LINE){
+	throw request_body_bad("chunk line too long");
+    }
+    view.append_to(line);
+    return true;
+}
+
+size_t
+request_body::read(char *buf,size_t len)
+{
+    std::string line;
+    if(done || len==0){
+	return 0;
+    }
+    send_continue();
+    if(chunked && remaining==0){
+	// chunk = chunk-size [ chunk-extension ] CRLF chunk-data CRLF
+	size_t size=0,ctr;
+	if(!read_line(line)){
+	    throw request_body_bad("client went away before a chunk");
+	}
+	for(ctr=0;ctr<line.size() && ishexdigit(line[ctr]) && ctr<16;ctr++){
+	    char c=line[ctr];
+	    size=size*16+(isdigit(c)?c-'0':(c|0x20)-'a'+10);
+	}
+	if(ctr==0 || (ctr<line.size() && ishexdigit(line[ctr]))){
+	    throw request_body_bad("bad chunk size");
+	}
+	if(size==0){
+	    // last-chunk, then trailers we ignore up to a blank line
+	    while(read_line(line) && line!="\r\n" && line!="\n");
+	    done=true;
+	    return 0;
+	}
+	// total's never over maxsize, and this way a huge size can't wrap
+	if(size>maxsize-total){
+	    throw request_body_too_large();
+	}
+	remaining=size;
+    }
+    if(len>remaining){
+	len=remaining;
+    }
+    size_t got=sfd.read(buf,len);
+    if(got==0){
+	throw request_body_bad("client went away in the body");
+    }
+    remaining-=got;
+    total+=got;
+    if(remaining==0){
+	if(!chunked){
+	    done=true;
+	}else if(!read_line(line) || (line!="\r\n" && line!="\n")){
+	    throw request_body_bad("no CRLF after a chunk");
+	}
+    }
+    return got;
+}
+
+void
+request_body::discard()
+{
+    char buf[4096];
+    while(read(buf,sizeof buf));
+}
+
+static int
+make_tempfile()
+{
+    int fd;
+    const char *dir=getenv("TMPDIR");
+    std::string path=dir?dir:P_tmpdir;
+    // O_TMPFILE never has a name, otherwise make one and unlink it
+    if((fd=open(path.c_str(),O_TMPFILE|O_RDWR|O_CLOEXEC,0600))!=-1){
+	return fd;
+    }
+    path+="/httpserver.body.XXXXXX";
+    if((fd=mkostemp(&path[0],O_CLOEXEC))!=-1){
+	unlink(path.c_str());
+    }
+    return fd;
+}
+
+static void
+write_all(int fd,const char *buf,size_t len)
+{
+    while(len){
+	ssize_t retval=write(fd,buf,len);
+	if(retval==-1){
+	    if(errno==EINTR){
+		continue;
+	    }
+	    throw request_body_bad("couldn't write the body to a temp file");
+	}
+	buf+=retval;
+	len-=retval;
+    }
+}
+
+// Move len bytes from the socket to outfd through a pipe, so they never
+// come up into user space.  Only for Content-Length bodies, and only after
+// what's in sockfdwrapper's buffer has been taken out.  It stops short if
+// the client does or outfd won't take them, and out_failed says which.
+// While there's a capture they're read instead, so it gets them too.
+size_t
+request_body::splice_out(int outfd,size_t len,bool& out_failed)
+{
+    int pipefd[2];
+    size_t moved=0;
+    out_failed=false;
+    if(sfd.tapping()){
+	char buf[16*1024];
+	size_t got;
+	while(moved<len && !out_failed
+		&& (got=sfd.read(buf,len-moved<sizeof buf?len-moved:sizeof buf))){
+	    for(size_t sent=0;sent<got;){
+		ssize_t retval=send(outfd,buf+sent,got-sent,MSG_NOSIGNAL);
+		if(retval==-1 && errno==ENOTSOCK){
+		    retval=write(outfd,buf+sent,got-sent);
+		}
+		if(retval==-1 && errno==EINTR){
+		    continue;
+		}
+		if(retval<=0){
+		    out_failed=true;
+		    break;
+		}
+		sent+=retval;
+	    }
+	    moved+=got;
+	}
+	return moved;
+    }
+    if(pipe2(pipefd,O_CLOEXEC)==-1){
+	throw request_body_bad("no pipe for the body");
+    }
+    while(moved<len && !out_failed){
+	ssize_t in=splice(sfd.get_fd(),NULL,pipefd[1],NULL,len-moved,
+		SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+	if(in==-1 && (errno==EAGAIN || errno==EINTR)){
+	    // the same deadline and minimum rate as a read()
+	    if(!sfd.wait_body()){
+		break;
+	    }
+	    continue;
+	}
+	if(in<=0){
+	    break;
+	}
+	bool keep_up=sfd.body_spliced(in);
+	while(in>0){
+	    ssize_t out=splice(pipefd[0],NULL,outfd,NULL,in,SPLICE_F_MOVE);
+	    if(out==-1 && errno==EINTR){
+		continue;
+	    }
+	    if(out<=0){
+		out_failed=true;
+		break;
+	    }
+	    in-=out;
+	    moved+=out;
+	}
+	if(!keep_up){
+	    break;
+	}
+    }
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return moved;
+}
+
+size_t
+request_body::splice_to_file(size_t len)
+{
+    bool failed;
+    size_t moved=splice_out(spillfd,len,failed);
+    if(failed){
+	throw request_body_bad("couldn't write the body to a temp file");
+    }
+    if(moved<len){
+	throw request_body_bad("client went away in the body");
+    }
+    return moved;
+}
+
+bool
+request_body::splice_to(int outfd)
+{
+    char buf[16*1024];
+    size_t got;
+
+    send_continue();
+    while(sfd.buffered() && remaining && (got=read(buf,sizeof buf))){
+	for(size_t sent=0;sent<got;){
+	    ssize_t retval=send(outfd,buf+sent,got-sent,MSG_NOSIGNAL);
+	    if(retval==-1 && errno==EINTR){
+		continue;
+	    }
+	    if(retval<=0){
+		return false;
+	    }
+	    sent+=retval;
+	}
+    }
+    if(remaining){
+	bool failed;
+	size_t moved=splice_out(outfd,remaining,failed);
+	total+=moved;
+	remaining-=moved;
+	if(failed){
+	    return false;
+	}
+	if(remaining){
+	    throw request_body_bad("client went away in the body");
+	}
+	done=true;
+    }
+    return true;
+}
+
+void
+request_body::spill()
+{
+    char buf[16*1024];
+    size_t got;
+
+    send_continue();
+    if(!chunked && remaining>MEM_MAX){
+	// we know it's big, so straight to a file, and whatever isn't
+	// already buffered gets spliced there
+	if((spillfd=make_tempfile())==-1){
+	    throw request_body_bad("no temp file for the body");
+	}
+	while(sfd.buffered() && (got=read(buf,sizeof buf))){
+	    write_all(spillfd,buf,got);
+	}
+	if(remaining){
+	    size_t moved=splice_to_file(remaining);
+	    total+=moved;
+	    remaining=0;
+	}
+	done=true;
+	return;
+    }
+    while((got=read(buf,sizeof buf))){
+	if(spillfd==-1 && memory.size()+got>MEM_MAX){
+	    // it grew too big for memory, move what we have to a file
+	    if((spillfd=make_tempfile())==-1){
+		throw request_body_bad("no temp file for the body");
+	    }
+	    write_all(spillfd,memory.data(),memory.size());
+	    std::string().swap(memory);
+	}
+	if(spillfd!=-1){
+	    write_all(spillfd,buf,got);
+	}else{
+	    memory.append(buf,got);
+	}
+    }
+}
+
+size_t
+request_body::copy_out(char *buf,size_t len,off_t offset)
+{
+    if(spillfd!=-1){
+	ssize_t retval;
+	while((retval=pread(spillfd,buf,len,offset))==-1 && errno==EINTR);
+	return retval<0?0:retval;
+    }
+    if(static_cast<size_t>(offset)>=memory.size()){
+	return 0;
+    }
+    if(len>memory.size()-offset){
+	len=memory.size()-offset;
+    }
+    memcpy(buf,memory.data()+offset,len);
+    return len;
+}
+
+int
+request_body::stdin_fd()
+{
+    int fd;
+    if(spillfd!=-1){
+	// a dup shares the offset, so start it at the beginning
+	lseek(spillfd,0,SEEK_SET);
+	return fcntl(spillfd,F_DUPFD_CLOEXEC,0);
+    }
+    int pipefd[2];
+    if(pipe2(pipefd,O_CLOEXEC)==-1){
+	return -1;
+    }
+    // it's at most MEM_MAX which is what a pipe holds by default, but
+    // make sure so the write can't block with nobody reading yet
+    if(memory.size()>static_cast<size_t>(fcntl(pipefd[1],F_GETPIPE_SZ))){
+	fcntl(pipefd[1],F_SETPIPE_SZ,memory.size());
+    }
+    fd=pipefd[0];
+    ssize_t retval=write(pipefd[1],memory.data(),memory.size());
+    close(pipefd[1]);
+    if(retval!=static_cast<ssize_t>(memory.size())){
+	close(fd);
+	return -1;
+    }
+    return fd;
+}
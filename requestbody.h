@@ -0,0 +1,100 @@
+// copyright Patrick Horgan
+// source is open, feel free to use it as you wish with no restrictions
+// except that this copyright notice must be preserved intact
+#ifndef requestbody_guard
+#define requestbody_guard
+#include <map>
+#include <string>
+#include <exception>
+#include <sys/types.h>
+#include "http.h"
+#include "sockfdwrapper.h"
+
+// the body's bigger than we're willing to take, that's a 413
+class
+request_body_too_large: public std::exception
+{
+public:
+    request_body_too_large(){};
+    virtual ~request_body_too_large() throw() {};
+    virtual const char* what() const throw()
+    {
+	return "request body is larger than the limit";
+    };
+};
+
+// bad Content-Length, bad chunk, or the client went away mid body
+class
+request_body_bad: public std::exception
+{
+public:
+    request_body_bad(const char *why):why(why){};
+    virtual ~request_body_bad() throw() {};
+    virtual const char* what() const throw()
+    {
+	return why;
+    };
+private:
+    const char *why;
+};
+
+// Reads a request body off the connection, a piece at a time, whether it
+// came with a Content-Length or Transfer-Encoding: chunked, and never more
+// than maxsize bytes of it.  read() streams it straight out of the
+// sockfdwrapper's buffer.  spill() takes the whole thing off the socket,
+// into memory if it's small and into an unlinked temp file if it's not,
+// for the backends that need all of it before they start.
+class request_body
+{
+public:
+    // most of a body we'll keep in memory when spilling
+    static const size_t MEM_MAX=64*1024;
+    // throws request_body_bad if the framing headers make no sense, or
+    // there's both a Transfer-Encoding and a Content-Length, since then
+    // something between us and the client may have framed it differently.
+    // Throws request_body_too_large if Content-Length says it's over
+    // maxsize.
+    request_body(sockfdwrapper& sfd,header_map& hdrs,
+	    size_t maxsize);
+    ~request_body();
+    bool present() const { return has_body; };
+    bool is_chunked() const { return chunked; };
+    // all of it's off the socket, so whatever comes next is the next
+    // request
+    bool finished() const { return done; };
+    // up to len bytes of the body, 0 when there's no more
+    size_t read(char *buf,size_t len);
+    // read whatever's left so the connection can be used again
+    void discard();
+    // take the rest of the body off the socket.  Afterwards size() says
+    // how big it was and copy_out() and stdin_fd() get at it.
+    void spill();
+    size_t size() const { return total; };
+    // Sends the rest of a Content-Length body on to outfd, a socket,
+    // what's buffered and then the rest spliced straight from the client.
+    // False if outfd wouldn't take it.
+    bool splice_to(int outfd);
+    size_t copy_out(char *buf,size_t len,off_t offset);
+    // an fd a CGI script can have as stdin, either a pipe we've already
+    // filled or the temp file.  Caller closes it.
+    int stdin_fd();
+private:
+    request_body();
+    request_body(const request_body&);
+    const request_body& operator=(const request_body&);
+    bool read_line(std::string& line);
+    size_t splice_out(int outfd,size_t len,bool& out_failed);
+    size_t splice_to_file(size_t len);
+    void send_continue();
+    sockfdwrapper& sfd;
+    bool has_body;
+    bool chunked;
+    bool done;
+    bool expect_continue;
+    size_t remaining;	    // left of Content-Length or the current chunk
+    size_t total;	    // bytes of body read so far
+    size_t maxsize;
+    std::string memory;	    // spilled body if it was small
+    int spillfd;	    // spilled body if it wasn't
+};
+#endif
@@ -0,0 +1,362 @@
+// copyright Patrick Horgan
+// source is open, feel free to use it as you wish with no restrictions
+// except that this copyright notice must be preserved intact
+#include "router.h"
+#include <cstdlib>
+#include <sstream>
+
+static const int DEFAULT_CLASS=1;	    // normal
+
+requestRouter::requestRouter():root(new node)
+{
+}
+
+requestRouter::~requestRouter()
+{
+    free_nodes(root);
+    for(size_t ctr=0;ctr<all.size();ctr++){
+	delete all[ctr];
+    }
+}
+
+void
+requestRouter::free_nodes(node *n)
+{
+    for(size_t ctr=0;ctr<n->children.size();ctr++){
+	free_nodes(n->children[ctr]);
+    }
+    delete n;
+}
+
+unsigned
+requestRouter::method_bit(const std::string& method)
+{
+    if(method=="GET"){
+	return method_get;
+    }else if(method=="HEAD"){
+	return method_head;
+    }else if(method=="POST"){
+	return method_post;
+    }else if(method=="PUT"){
+	return method_put;
+    }else if(method=="DELETE"){
+	return method_delete;
+    }else if(method=="OPTIONS"){
+	return method_options;
+    }
+    return 0;
+}
+
+bool
+requestRouter::add(const std::string& pattern,const route& r)
+{
+    if(pattern.empty() || pattern[0]!='/'){
+	return false;
+    }
+    bool is_prefix=pattern[pattern.size()-1]=='*';
+    std::string path=is_prefix?pattern.substr(0,pattern.size()-1):pattern;
+    // down the trie as far as path matches, splitting the edge where it
+    // stops matching partway along
+    node *n=root;
+    size_t pos=0;
+    while(pos<path.size()){
+	node *next=0;
+	for(size_t ctr=0;ctr<n->children.size();ctr++){
+	    if(n->children[ctr]->label[0]==path[pos]){
+		next=n->children[ctr];
+		break;
+	    }
+	}
+	if(next==0){
+	    next=new node;
+	    next->label=path.substr(pos);
+	    n->children.push_back(next);
+	    n=next;
+	    pos=path.size();
+	    break;
+	}
+	size_t same=0;
+	while(same<next->label.size() && pos+same<path.size()
+		&& next->label[same]==path[pos+same]){
+	    same++;
+	}
+	if(same<next->label.size()){
+	    // the new path leaves this edge partway, so it's two edges now
+	    node *rest=new node;
+	    rest->label=next->label.substr(same);
+	    rest->children.swap(next->children);
+	    rest->exact=next->exact;
+	    rest->prefix=next->prefix;
+	    next->label.erase(same);
+	    next->children.push_back(rest);
+	    next->exact=next->prefix=0;
+	}
+	n=next;
+	pos+=same;
+    }
+    route *mine=new route(r);
+    mine->prefix=path;
+    route *&slot=is_prefix?n->prefix:n->exact;
+    if(slot){
+	for(size_t ctr=0;ctr<all.size();ctr++){
+	    if(all[ctr]==slot){
+		all.erase(all.begin()+ctr);
+		break;
+	    }
+	}
+	delete slot;
+    }
+    slot=mine;
+    all.push_back(mine);
+    return true;
+}
+
+route *
+requestRouter::find(const std::string& pattern)
+{
+    if(pattern.empty()){
+	return 0;
+    }
+    bool is_prefix=pattern[pattern.size()-1]=='*';
+    size_t len=pattern.size()-(is_prefix?1:0);
+    node *n=root;
+    size_t pos=0;
+    while(pos<len){
+	node *next=0;
+	for(size_t ctr=0;ctr<n->children.size();ctr++){
+	    if(n->children[ctr]->label[0]==pattern[pos]){
+		next=n->children[ctr];
+		break;
+	    }
+	}
+	if(next==0 || next->label.size()>len-pos
+		|| pattern.compare(pos,next->label.size(),next->label)!=0){
+	    return 0;
+	}
+	pos+=next->label.size();
+	n=next;
+    }
+    return is_prefix?n->prefix:n->exact;
+}
+
+void
+requestRouter::compile()
+{
+    compile(root,0);
+}
+
+// above is the closest prefix route over n, what its routes inherit from
+void
+requestRouter::compile(node *n,const route *above)
+{
+    route *rs[2]={n->prefix,n->exact};
+    for(size_t ctr=0;ctr<2;ctr++){
+	route *r=rs[ctr];
+	if(r==0){
+	    continue;
+	}
+	if(r->kind==route_none && above){
+	    r->kind=above->kind;
+	    r->target=above->target;
+	    r->pool=above->pool;
+	    r->plugin=above->plugin;
+	    r->proxy=above->proxy;
+	    r->prefix=above->prefix;
+	    if(r->methods==0){
+		r->methods=above->methods;
+	    }
+	}
+	if(r->methods==0){
+	    switch(r->kind){
+		case route_cgi:
+		case route_fastcgi:
+		case route_plugin:
+		    r->methods=method_get|method_post|method_put;
+		    break;
+		case route_proxy:
+		    // it's up to the upstream what it takes
+		    r->methods=method_get|method_head|method_post|method_put
+			|method_delete|method_options;
+		    break;
+		case route_redirect:
+		default:
+		    // a HEAD's answered like a GET, less the body
+		    r->methods=method_get|method_head;
+	    }
+	}
+	if(ctr==1 && r->kind==route_cgi){
+	    // the script's named by the segment after the last /
+	    r->prefix.erase(r->prefix.rfind('/')+1);
+	}
+	if(r->cls<0){
+	    r->cls=above?above->cls:DEFAULT_CLASS;
+	}
+	if(r->max_age==-2 && above){
+	    r->max_age=above->max_age;
+	}
+	if(r->max_age==-1){
+	    r->cache_control="Cache-Control: no-cache\r\n";
+	}else if(r->max_age>=0){
+	    std::ostringstream cc;
+	    cc << "Cache-Control: max-age=" << r->max_age << "\r\n";
+	    r->cache_control=cc.str();
+	}
+	static const char *names[]={"GET","HEAD","POST","PUT","DELETE","OPTIONS"};
+	r->allow="";
+	for(size_t bit=0;bit<6;bit++){
+	    if(r->methods&(1u<<bit)){
+		r->allow+=(r->allow.empty()?"":", ")+std::string(names[bit]);
+	    }
+	}
+	if(ctr==0){
+	    // an exact route here inherits from the prefix route here
+	    above=r;
+	}
+    }
+    for(size_t ctr=0;ctr<n->children.size();ctr++){
+	compile(n->children[ctr],above);
+    }
+}
+
+const route *
+requestRouter::match(const char *path,size_t len) const
+{
+    const node *n=root;
+    const route *best=root->prefix;
+    size_t pos=0;
+    while(pos<len){
+	const node *next=0;
+	for(size_t ctr=0;ctr<n->children.size();ctr++){
+	    if(n->children[ctr]->label[0]==path[pos]){
+		next=n->children[ctr];
+		break;
+	    }
+	}
+	if(next==0 || next->label.size()>len-pos
+		|| next->label.compare(0,std::string::npos,path+pos,next->label.size())!=0){
+	    return best;
+	}
+	pos+=next->label.size();
+	n=next;
+	if(n->prefix){
+	    best=n->prefix;
+	}
+    }
+    // all of the path matched, so an exact route here wins
+    return n->exact?n->exact:best;
+}
+
+bool
+parse_route(const std::string& spec,std::string& pattern,route& r,
+	std::string& error)
+{
+    size_t start=0;
+    if(!spec.empty() && spec[0]!='/'){
+	// METHOD,METHOD:/pattern
+	size_t colon=spec.find(':');
+	if(colon==std::string::npos){
+	    error="a route's pattern has to start with /";
+	    return false;
+	}
+	std::string methods=spec.substr(0,colon);
+	for(size_t from=0;from<=methods.size();){
+	    size_t comma=methods.find(',',from);
+	    std::string one=methods.substr(from,comma==std::string::npos?std::string::npos:comma-from);
+	    unsigned bit=requestRouter::method_bit(one);
+	    if(bit==0){
+		error="don't know the method "+one;
+		return false;
+	    }
+	    r.methods|=bit;
+	    if(comma==std::string::npos){
+		break;
+	    }
+	    from=comma+1;
+	}
+	start=colon+1;
+    }
+    size_t equals=spec.find('=',start);
+    if(equals==std::string::npos || spec[start]!='/'){
+	error="a route looks like /pattern=kind";
+	return false;
+    }
+    pattern=spec.substr(start,equals-start);
+    // settings are on the end, anything else with a comma is the argument
+    std::string what,arg;
+    size_t piece=equals+1;
+    bool first=true;
+    while(piece<=spec.size()){
+	size_t comma=spec.find(',',piece);
+	std::string one=spec.substr(piece,comma==std::string::npos?std::string::npos:comma-piece);
+	if(first){
+	    what=one;
+	    first=false;
+	}else if(one.compare(0,6,"class=")==0){
+	    char *end;
+	    long cls=strtol(one.c_str()+6,&end,10);
+	    if(*end || end==one.c_str()+6 || cls<0 || cls>2){
+		error="class has to be 0, 1 or 2, not "+one.substr(6);
+		return false;
+	    }
+	    r.cls=static_cast<int>(cls);
+	}else if(one.compare(0,6,"cache=")==0){
+	    char *end;
+	    long secs=strtol(one.c_str()+6,&end,10);
+	    if(one.substr(6)=="no"){
+		r.max_age=-1;
+	    }else if(*end || end==one.c_str()+6 || secs<0){
+		error="cache has to be seconds or no, not "+one.substr(6);
+		return false;
+	    }else{
+		r.max_age=static_cast<int>(secs);
+	    }
+	}else{
+	    what+=','+one;
+	}
+	if(comma==std::string::npos){
+	    break;
+	}
+	piece=comma+1;
+    }
+    size_t colon=what.find(':');
+    std::string kind=what.substr(0,colon);
+    if(colon!=std::string::npos){
+	arg=what.substr(colon+1);
+    }
+    if(kind=="static"){
+	r.kind=route_static;
+    }else if(kind=="cgi"){
+	r.kind=route_cgi;
+    }else if(kind=="fastcgi"){
+	r.kind=route_fastcgi;
+	if(arg.find(':')==std::string::npos || atoi(arg.c_str())<1){
+	    error="fastcgi wants nprocs:command";
+	    return false;
+	}
+    }else if(kind=="status"){
+	r.kind=route_status;
+    }else if(kind=="redirect"){
+	r.kind=route_redirect;
+	if(arg.empty()){
+	    error="redirect wants somewhere to send them";
+	    return false;
+	}
+    }else if(kind=="plugin"){
+	r.kind=route_plugin;
+	if(arg.empty()){
+	    error="plugin wants the .so to load";
+	    return false;
+	}
+    }else if(kind=="proxy"){
+	r.kind=route_proxy;
+	if(arg.empty()){
+	    error="proxy wants upstreams to send them to";
+	    return false;
+	}
+    }else{
+	error="don't know what a "+kind+" route is";
+	return false;
+    }
+    r.target=arg;
+    return true;
+}
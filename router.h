@@ -0,0 +1,107 @@
+// copyright Patrick Horgan
+// source is open, feel free to use it as you wish with no restrictions
+// except that this copyright notice must be preserved intact
+#ifndef router_guard
+#define router_guard
+#include <string>
+#include <vector>
+
+class fcgiPool;
+class handlerPlugin;
+class proxyPool;
+
+enum route_kind
+{
+    route_none,		// only settings, what it does comes from above it
+    route_static,	// files under target (DOCUMENT_ROOT if it's "")
+    route_cgi,		// scripts, the segment after the prefix names one
+    route_fastcgi,	// the FastCGI applications in pool
+    route_status,	// how the server's doing, as text
+    route_redirect,	// 301 to target, plus what's past the prefix
+    route_plugin,	// a handler plugin, run on the worker
+    route_proxy		// passed on to the upstream servers in proxy
+};
+
+enum route_method
+{
+    method_get=1,
+    method_head=2,
+    method_post=4,
+    method_put=8,
+    method_delete=16,
+    method_options=32
+};
+
+// What to do with requests for a path, and how.  Anything a route doesn't
+// set it gets from the closest prefix route above it in the trie when the
+// router's compiled, so -p /api/:0 can change /api/'s class and leave it
+// served like everything else under /.
+struct route
+{
+    route():kind(route_none),methods(0),pool(0),plugin(0),proxy(0),cls(-1),max_age(-2){};
+    route_kind kind;
+    unsigned methods;	    // route_methods it takes, 0 to inherit
+    std::string target;
+    fcgiPool *pool;
+    handlerPlugin *plugin;
+    proxyPool *proxy;
+    int cls;		    // priority class, -1 to inherit
+    int max_age;	    // seconds for Cache-Control, -1 no-cache, -2 inherit
+    // worked out by compile()
+    std::string prefix;	    // the pattern without its *
+    std::string cache_control;	// the whole header line, or ""
+    std::string allow;	    // for a 405's Allow:
+};
+
+// The routes, in a radix trie keyed on their patterns.  A pattern's a path,
+// which only matches that path, or a path ending in *, which matches
+// anything starting with it.  match() goes down the trie once, so it costs
+// about the length of the path however many routes there are, and gives
+// back the exact route if there is one, otherwise the longest prefix.
+class requestRouter
+{
+public:
+    requestRouter();
+    ~requestRouter();
+    // Adding a pattern that's already there replaces its route.  False if
+    // the pattern doesn't start with /.
+    bool add(const std::string& pattern,const route& r);
+    // Call once they're all added, before match().  Fills in what routes
+    // inherit and works out their headers.
+    void compile();
+    // the route added with exactly that pattern, 0 if there isn't one
+    route *find(const std::string& pattern);
+    // 0 if nothing matches
+    const route *match(const char *path,size_t len) const;
+    const route *match(const std::string& path) const
+	{ return match(path.data(),path.size()); };
+    // every route, in the order added
+    const std::vector<route*>& routes() const { return all; };
+    static unsigned method_bit(const std::string& method);
+private:
+    requestRouter(const requestRouter&);
+    const requestRouter& operator=(const requestRouter&);
+    struct node
+    {
+	node():exact(0),prefix(0){};
+	std::string label;	    // the bit of path on the way in
+	std::vector<node*> children;	// no two start with the same byte
+	route *exact;
+	route *prefix;
+    };
+    void compile(node *n,const route *above);
+    void free_nodes(node *n);
+    node *root;
+    std::vector<route*> all;
+};
+
+// Parses -r's spec, [METHOD,...:]pattern=kind[:arg][,setting]...  kind is
+// static, cgi, fastcgi, status, redirect, plugin or proxy.  static and cgi
+// take a document root, fastcgi takes nprocs:command, redirect a url,
+// plugin file.so with maybe :arg for its init() after it, and proxy a
+// comma separated list of upstreams.  The
+// settings are class=n and cache=seconds or cache=no.  False, with error
+// saying why, if it doesn't make sense.
+bool parse_route(const std::string& spec,std::string& pattern,route& r,
+	std::string& error);
+#endif
@@ -0,0 +1,150 @@
+// copyright Patrick Horgan
+// source is open, feel free to use it as you wish with no restrictions
+// except that this copyright notice must be preserved intact
+#include "sizingpolicy.h"
+#include <cmath>
+
+static size_t
+clamp_threads(size_t threads,size_t maxthreads)
+{
+    if(threads>maxthreads){
+	threads=maxthreads;
+    }
+    return threads?threads:1;
+}
+
+sizing_decision
+fixedSizePolicy::decide(const pool_sample& sample)
+{
+    sizing_decision decision;
+    decision.target=clamp_threads(threads,sample.maxthreads);
+    decision.reason="fixed";
+    return decision;
+}
+
+size_t
+fixedSizePolicy::initial(size_t maxthreads,size_t) const
+{
+    return clamp_threads(threads,maxthreads);
+}
+
+hillClimbingPolicy::hillClimbingPolicy(unsigned period_ms,double gain,
+	double latency_tolerance,double wait_target,unsigned probe_periods,
+	size_t max_step):
+    period(period_ms?period_ms:1),gain(gain),latency_tolerance(latency_tolerance),
+    wait_target(wait_target),probe_periods(probe_periods),
+    max_step(max_step?max_step:1),last_threads(0),last_throughput(0),
+    last_service(0),step(1),plateau(0)
+{
+}
+
+// one a cpu to start, but at least two so a thread stuck on a slow client
+// doesn't stop everything until we've had a look
+size_t
+hillClimbingPolicy::initial(size_t maxthreads,size_t cpus) const
+{
+    return clamp_threads(cpus>2?cpus:2,maxthreads);
+}
+
+sizing_decision
+hillClimbingPolicy::decide(const pool_sample& sample)
+{
+    sizing_decision decision;
+    size_t threads=sample.threads?sample.threads:1;
+    decision.target=threads;
+
+    // Little's law, how many threads the work kept busy on average
+    double in_use=sample.throughput*sample.mean_service;
+    // CPU bound work can't use more threads than there are CPUs for it
+    size_t cpu_cap=sample.maxthreads;
+    if(sample.mean_service>0 && sample.cpus){
+	double share=sample.mean_cpu/sample.mean_service;
+	if(share>0.05){
+	    cpu_cap=static_cast<size_t>(std::ceil(sample.cpus/share));
+	}
+    }
+    // Work's waiting on us if it's waiting longer than we'd like, or if
+    // it's there and everyone's busy.  A queue that's there but being
+    // drained by idle threads is just the moment we looked.
+    bool waiting=sample.mean_wait>wait_target
+	|| (sample.queued && sample.busy>=threads);
+
+    if(!waiting){
+	// keep what's in use and one spare, never less than we started
+	// with so the next burst isn't met by one thread, and start over
+	// next time
+	size_t need=static_cast<size_t>(std::ceil(in_use))+1;
+	if(need<sample.busy+1){
+	    need=sample.busy+1;
+	}
+	if(need<initial(sample.maxthreads,sample.cpus)){
+	    need=initial(sample.maxthreads,sample.cpus);
+	}
+	if(threads>need){
+	    decision.target=threads-1;
+	    decision.reason="spare";
+	}else{
+	    decision.reason="steady";
+	}
+	last_threads=0;
+	step=1;
+	plateau=0;
+    }else if(threads>=cpu_cap){
+	decision.target=cpu_cap;
+	decision.reason=cpu_cap<sample.maxthreads?"cpu bound":"at most";
+	last_threads=0;
+	step=1;
+    }else if(sample.completed==0){
+	// everybody's stuck on something, likely slow clients, and there's
+	// no throughput to climb by.  More threads is all we can do.
+	decision.target=threads+step;
+	decision.reason="stalled";
+	step=step*2<max_step?step*2:max_step;
+	last_threads=0;
+    }else if(last_threads==0){
+	// first look at this load, start climbing from here
+	decision.target=threads+step;
+	decision.reason="climbing";
+	last_threads=threads;
+	last_throughput=sample.throughput;
+	last_service=sample.mean_service;
+    }else if(threads>last_threads){
+	// we went up last time, was it worth it?
+	if(sample.throughput>last_throughput*(1+gain)){
+	    step=step*2<max_step?step*2:max_step;
+	    decision.target=threads+step;
+	    decision.reason="climbing";
+	    last_threads=threads;
+	    last_throughput=sample.throughput;
+	    last_service=sample.mean_service;
+	}else if(sample.mean_service>last_service*(1+latency_tolerance)){
+	    // no more done, and what's done took longer, go back
+	    decision.target=last_threads;
+	    decision.reason="latency";
+	    step=1;
+	    plateau=0;
+	}else{
+	    decision.reason="plateau";
+	    step=1;
+	    plateau=0;
+	    last_threads=threads;
+	    last_throughput=sample.throughput;
+	    last_service=sample.mean_service;
+	}
+    }else if(++plateau>=probe_periods){
+	// still waiting at the top, see if one more helps now
+	plateau=0;
+	decision.target=threads+1;
+	decision.reason="probing";
+	last_threads=threads;
+	last_throughput=sample.throughput;
+	last_service=sample.mean_service;
+    }else{
+	decision.reason="plateau";
+    }
+    if(decision.target>cpu_cap){
+	decision.target=cpu_cap;
+    }
+    decision.target=clamp_threads(decision.target,sample.maxthreads);
+    return decision;
+}
@@ -0,0 +1,94 @@
+// copyright Patrick Horgan
+// source is open, feel free to use it as you wish with no restrictions
+// except that this copyright notice must be preserved intact
+#ifndef sizingpolicy_guard
+#define sizingpolicy_guard
+#include <cstddef>
+
+// What one group of an adaptiveThreadPool did over the last period.  All
+// the means are per job that finished in the period.
+struct pool_sample
+{
+    double period;		// seconds this covers
+    size_t completed;		// jobs finished
+    double throughput;		// completed per second
+    double mean_service;	// wall clock seconds running a job
+    double mean_cpu;		// of that, seconds on a CPU
+    double mean_wait;		// seconds in the queue first
+    size_t queued;		// waiting right now
+    size_t threads;		// how many threads there are now
+    size_t busy;		// how many of them are running jobs now
+    size_t maxthreads;		// never more than this
+    size_t cpus;		// the group's threads can run on
+};
+
+// What a policy decided and why, for whoever's tuning it.
+struct sizing_decision
+{
+    size_t target;		// threads the group should have
+    const char *reason;
+};
+
+// Decides how many threads a group of the pool should have, once a period,
+// from what was measured.  The pool clones one for each group, so a policy
+// can keep whatever history it likes.
+class sizingPolicy
+{
+public:
+    virtual ~sizingPolicy(){};
+    virtual sizingPolicy* clone() const=0;
+    virtual sizing_decision decide(const pool_sample& sample)=0;
+    // threads to start with
+    virtual size_t initial(size_t maxthreads,size_t cpus) const=0;
+    virtual unsigned period_ms() const { return 500; };
+};
+
+// Always threads threads (or maxthreads if that's less).
+class fixedSizePolicy: public sizingPolicy
+{
+public:
+    fixedSizePolicy(size_t threads):threads(threads){};
+    virtual sizingPolicy* clone() const { return new fixedSizePolicy(*this); };
+    virtual sizing_decision decide(const pool_sample& sample);
+    virtual size_t initial(size_t maxthreads,size_t cpus) const;
+private:
+    size_t threads;
+};
+
+// The default.  When work is waiting it adds threads and watches what
+// happens to throughput: while each step up buys at least gain more jobs a
+// second it keeps climbing, doubling the step, and when a step buys nothing
+// it stops there.  If the step made jobs slower (service time grew by more
+// than latency_tolerance without the throughput to show for it) the
+// threads were only fighting over something, so it steps back down.
+// Little's law says how many threads the work actually keeps busy
+// (throughput times service time), and when there are more than that
+// with nothing waiting it lets the extras go, one a period.  The share of
+// service time spent on a CPU caps it too, since CPU bound jobs can't use
+// more threads than cpus/share.  Every probe_periods periods of waiting
+// work at a plateau it tries one more, in case things changed.
+class hillClimbingPolicy: public sizingPolicy
+{
+public:
+    hillClimbingPolicy(unsigned period_ms=500,double gain=0.05,
+	    double latency_tolerance=0.25,double wait_target=0.01,
+	    unsigned probe_periods=4,size_t max_step=8);
+    virtual sizingPolicy* clone() const { return new hillClimbingPolicy(*this); };
+    virtual sizing_decision decide(const pool_sample& sample);
+    virtual size_t initial(size_t maxthreads,size_t cpus) const;
+    virtual unsigned period_ms() const { return period; };
+private:
+    unsigned period;
+    double gain;
+    double latency_tolerance;
+    double wait_target;		// seconds in the queue we'll put up with
+    unsigned probe_periods;
+    size_t max_step;
+    // how it went last time we changed
+    size_t last_threads;
+    double last_throughput;
+    double last_service;
+    size_t step;
+    unsigned plateau;		// periods since we stopped climbing
+};
+#endif
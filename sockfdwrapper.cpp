@@ -2,87 +2,337 @@
 // source is open, feel free to use it as you wish with no restrictions
 // except that this copyright notice must be preserved intact
 #include "sockfdwrapper.h"
+#include "probes.h"
+#include "trace.h"
 #include <errno.h>
+#include <fcntl.h>
 #include <iostream>
 #include <strings.h>
+#include <poll.h>
+#include <sys/sendfile.h>
+#include <time.h>
 #include <unistd.h>
 
-sockfdwrapper::sockfdwrapper(int i):fd(i),valid(true),open(true),epoll_fd(0)
+// These run on the timerWheel's thread with its lock held.  All they do is
+// shut the socket down, which wakes up the worker blocked on it, and the
+// worker sees why when it gets back.
+void
+sockfdwrapper_read_expired(void *voidsfd)
 {
-    // get our epoll_fd to monitor the socket
-    if((epoll_fd=epoll_create1(0))==-1){
-	valid=false;
-	return;
+    sockfdwrapper *sfd=static_cast<sockfdwrapper*>(voidsfd);
+    sfd->expired=1;
+    shutdown(sfd->fd,SHUT_RD);
+}
+
+void
+sockfdwrapper_write_expired(void *voidsfd)
+{
+    sockfdwrapper *sfd=static_cast<sockfdwrapper*>(voidsfd);
+    sfd->expired=1;
+    shutdown(sfd->fd,SHUT_RDWR);
+}
+
+static unsigned long long
+monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec*1000000000ULL+ts.tv_nsec;
+}
+
+sockfdwrapper::sockfdwrapper(int i,timerWheel *wheel,const conn_timeouts *timeouts):
+    fd(i),valid(true),open(true),keep_alive(false),http11(false),framed(false),
+    too_big(false),spent(0),head(0),tail(0),cur(0),held(0),wheel(wheel),
+    read_timer(sockfdwrapper_read_expired,this),
+    write_timer(sockfdwrapper_write_expired,this),reading(reading_idle),
+    expired(0),body_bytes(0),sent_bytes(0),body_wait_ns(0),send_wait_ns(0),
+    response_bytes(0),status(0),tap(0),head_only(false),in_body(false),
+    newlines(0),tap_limit(0),tap_cut(false)
+{
+    if(timeouts){
+	this->timeouts=*timeouts;
     }
-    bzero(&ev,sizeof(ev));
-    bzero(rawbuffer,RECV_BUF_SIZ);
-    ev.events=EPOLLIN;	// level trigger with non-blocking socket
-    // tell it we're monitoring the socket
-    ev.data.fd=fd;
-    if(epoll_ctl(epoll_fd,EPOLL_CTL_ADD,fd,&ev)==-1){
-	valid=false;
-	return;
+    if(wheel){
+	// the clock starts now for the first byte of the request
+	wheel->arm(read_timer,this->timeouts.idle_ms);
     }
-    // initialize our markers
-    begin=cur=end=rawbuffer;
+    // there's no buffer until there's something to read
 }
 
 sockfdwrapper::~sockfdwrapper()
 {
-    if(epoll_fd){
-	// if we had an opened socket try to close it.  It can fail, and
-	// if so would return -1 and set errno.  We don't check it because
-	// we're destroying the socket wrapper and no longer care about the
-	// state of the socket
-	::close(epoll_fd);
+    if(wheel){
+	// after this neither can fire, so the fd can't be shut down after
+	// it's been closed and handed to somebody else
+	wheel->cancel(read_timer);
+	wheel->cancel(write_timer);
+    }
+    release_buffer();
+}
+
+// give all the blocks back, whatever's in them is gone
+void
+sockfdwrapper::release_buffer()
+{
+    recv_block *b=spent?spent:head;
+    while(b){
+	recv_block *next=b->next;
+	bufferPool::put(reinterpret_cast<char*>(b));
+	b=next;
+    }
+    spent=head=tail=0;
+    cur=0;
+    held=0;
+}
+
+// nobody can be looking at the blocks we've read past any more
+void
+sockfdwrapper::release_spent()
+{
+    while(spent!=head){
+	recv_block *next=spent->next;
+	bufferPool::put(reinterpret_cast<char*>(spent));
+	spent=next;
+    }
+}
+
+// n bytes have been read, move cur past them and on into the next block
+// whenever we get to the end of one.  The ones we leave behind are spent.
+void
+sockfdwrapper::consume(size_t n)
+{
+    held-=n;
+    while(true){
+	size_t here=head->fill-cur;
+	if(n<here || head==tail){
+	    if(tap){
+		tap_out(cur,n);
+	    }
+	    cur+=n;
+	    return;
+	}
+	if(tap){
+	    tap_out(cur,here);
+	}
+	n-=here;
+	head=head->next;
+	cur=head->data();
+    }
+}
+
+// as much of what was read as tap has room for
+void
+sockfdwrapper::tap_out(const char *data,size_t len)
+{
+    size_t room=tap_limit>tap->size()?tap_limit-tap->size():0;
+    if(len>room){
+	len=room;
+	tap_cut=true;
+    }
+    tap->append(data,len);
+}
+
+void
+sockfdwrapper::set_keep_alive(bool wanted,bool http11)
+{
+    keep_alive=wanted;
+    this->http11=http11;
+}
+
+const char *
+sockfdwrapper::framed_response()
+{
+    framed=true;
+    if(!keep_alive){
+	return "Connection: close\r\n";
+    }
+    // 1.1 keeps connections unless told otherwise, 1.0 has to be told
+    return http11?"":"Connection: keep-alive\r\n";
+}
+
+// Anything they've already sent of the next request stays in the buffer,
+// and if there's some of it the clock's running on the rest of its header.
+// If not, we don't need the buffer while we wait.
+void
+sockfdwrapper::next_request()
+{
+    framed=false;
+    keep_alive=false;
+    too_big=false;
+    body_bytes=sent_bytes=response_bytes=0;
+    status=0;
+    head_only=in_body=false;
+    newlines=0;
+    tap_cut=false;
+    body_wait_ns=send_wait_ns=0;
+    release_spent();
+    if(held==0){
+	release_buffer();
+	reading=reading_idle;
+    }else{
+	reading=reading_header;
+    }
+    if(wheel){
+	wheel->arm(read_timer,reading==reading_idle?timeouts.idle_ms:timeouts.header_ms);
+    }
+}
+
+void
+sockfdwrapper::headers_done()
+{
+    if(wheel){
+	wheel->cancel(read_timer);
     }
+    reading=reading_body;
+}
+
+// Have we been waiting on them long enough to judge, and if so have they
+// kept up min_rate bytes a second for that time?
+bool
+sockfdwrapper::rate_ok(size_t bytes,unsigned long long waited_ns) const
+{
+    if(waited_ns<timeouts.rate_grace_ms*1000000ULL){
+	return true;
+    }
+    return bytes*1000000000ULL>=timeouts.min_rate*waited_ns;
+}
+
+bool
+sockfdwrapper::wait_body()
+{
+    struct pollfd pfd;
+    pfd.fd=fd;
+    pfd.events=POLLIN;
+    trace_span span("recv wait");
+    if(!wheel){
+	int ready;
+	while((ready=poll(&pfd,1,15000))==-1 && errno==EINTR);
+	return ready>0;
+    }
+    if(expired){
+	return false;
+    }
+    unsigned long long waitstart=monotonic_ns();
+    wheel->arm(read_timer,timeouts.body_ms);
+    while(poll(&pfd,1,-1)==-1 && errno==EINTR);
+    wheel->cancel(read_timer);
+    body_wait_ns+=monotonic_ns()-waitstart;
+    if(expired){
+	std::cerr << "sockfdwrapper::wait_body() - timed out\n";
+	open=false;
+	return false;
+    }
+    return true;
+}
+
+bool
+sockfdwrapper::body_spliced(size_t n)
+{
+    body_bytes+=n;
+    if(tap && n){
+	tap_cut=true;
+    }
+    if(wheel && !rate_ok(body_bytes,body_wait_ns)){
+	std::cerr << "sockfdwrapper::body_spliced() - body slower than minimum rate\n";
+	too_slow(SHUT_RD);
+	open=false;
+	return false;
+    }
+    return true;
+}
+
+// shut down like the deadline for the same direction would have
+void
+sockfdwrapper::too_slow(int how)
+{
+    expired=1;
+    shutdown(fd,how);
 }
 
 /**
- getline(char *buffer,size_t len)
- reads in at most one less that len characters.  Reading stops when we can't
- get any more characters, or when we find \n.  If a \n is found, then it is
- stored in the buffer, and in any case a \0 terminates the returned characters
- 
- buffer - place to store the characters
- len    - size of the buffer
-
- return value - the buffer, or if the call fails, returns NULL (0).
+ get_line(line_view& line)
+ finds the next \n in what's buffered, reading more until there is one,
+ and hands back a view of everything up to and including it.  A line that
+ doesn't fit in what's left of a block goes on into another one, so
+ nothing's ever copied and nothing's cut off, but we won't hold more than
+ max_header bytes waiting for the end of one.
+
+ line - where the view goes
+ return value - true if there's a whole line in line, false if we're never
+ going to get one.  If it's because of max_header over_limit() says so.
  */
-char*
-sockfdwrapper::getline(char *buffer,size_t len)
-{
-    size_t cnt=0,retval;
-    char *bufptr=buffer;
-
-    if(cur==end){
-	// if the buffer is empty we call this once.  That means that
-	// if a user calls us they need to check and see if the last
-	// character is '\n' of the returned buffer and if so, try to
-	// call again.
-	if(valid && open){
-	    if((retval=getbytes())==0 or !valid or !open){
-		std::cerr << "getbytes: " << retval << ", valid: " << valid << ", open: " << open << "\n";
-		return NULL;
+bool
+sockfdwrapper::get_line(line_view& line)
+{
+    size_t scanned=0;	    // bytes after cur we know have no \n
+
+    release_spent();
+    while(true){
+	if(held>scanned){
+	    // pick up where we left off
+	    recv_block *b=head;
+	    char *p=cur;
+	    size_t skip=scanned;
+	    while(skip>=static_cast<size_t>(b->fill-p) && b!=tail){
+		skip-=b->fill-p;
+		b=b->next;
+		p=b->data();
 	    }
-	}else{
-	    std::cerr << "Not valid and open, valid: " << valid << ", open: " << open << "\n";
-	    return NULL;
+	    p+=skip;
+	    while(true){
+		char *nl=static_cast<char*>(memchr(p,'\n',b->fill-p));
+		if(nl){
+		    scanned+=nl-p+1;
+		    line.first=head;
+		    line.start=cur;
+		    line.len=scanned;
+		    consume(scanned);
+		    return true;
+		}
+		scanned+=b->fill-p;
+		if(b==tail){
+		    break;
+		}
+		b=b->next;
+		p=b->data();
+	    }
+	}
+	if(!valid || !open || static_cast<size_t>(getbytes())<=scanned){
+	    return false;
 	}
     }
-    while(*cur!='\n' && cur<end && cnt<len-1){
-	if(cur!=end){
-	    *bufptr++=*cur++;
-	    cnt++;
-	}else{
-	    break;
+}
+
+/**
+ read(char *buffer,size_t len)
+ hands back up to len bytes, what's already buffered if there is any,
+ otherwise whatever one getbytes() brings in.  Unlike getline it doesn't
+ care about \n or \0 so it's what you use for request bodies.
+
+ return value - number of bytes, 0 if the other end closed, we timed out,
+ or something went wrong.
+ */
+size_t
+sockfdwrapper::read(char *buffer,size_t len)
+{
+    release_spent();
+    if(held==0){
+	if(!valid || !open || getbytes()==0){
+	    return 0;
 	}
     }
-    if(*cur=='\n' && cur<end && cnt<len-1){
-	*bufptr++=*cur++;
+    size_t cnt=0;
+    while(cnt<len && held){
+	size_t here=head->fill-cur;
+	if(here>len-cnt){
+	    here=len-cnt;
+	}
+	memcpy(buffer+cnt,cur,here);
+	cnt+=here;
+	consume(here);
     }
-    *bufptr='\0';
-    return buffer;
+    release_spent();
+    return cnt;
 }
 
 /** 
@@ -94,77 +344,180 @@ sockfdwrapper::getline(char *buffer,size_t len)
 ssize_t
 sockfdwrapper::getbytes()
 {
-    ssize_t num_events;
+    int ready;
 
     if(!valid || !open){
-	return end-cur;
-    }
-    if(cur==end){
-	// if you've consumed all the bytes, we just move the curpointer and
-	// end to the beginning of the buffer to make room to read more.
-	cur=end=begin;
-    }else if(cur!=begin){
-	// if you call getbytes() before consuming all the bytes in the buffer,
-	// then the existing bytes get copied to the beginning of the buffer
-	// before we try to get more.  It's more efficient to consume all of
-	// the bytes to avoid this move
-	size_t numbytes=end-cur;
-	memmove(rawbuffer,cur,numbytes);
-	cur=begin;
-	end=begin+numbytes;
-    }
-    if(end==begin+RECV_BUF_SIZ){
-	// We're already full so return
-	return end-begin;
-    }
-
-    while(1){	// loop so that we can continue if a signal interrupts the epoll
-	// the 15000 ms timeout means that the epoll will return in 15 seconds
+	return held;
+    }
+    if(head && held==0){
+	// if you've consumed all the bytes, we just start over at the
+	// beginning of the block to make room to read more.
+	cur=head->fill=head->data();
+    }
+    if(head && tail->fill==tail->limit()){
+	if(held>=timeouts.max_header){
+	    // that's all we'll hold, if they haven't finished by now
+	    // they're not going to
+	    too_big=true;
+	    return held;
+	}
+	if(head==tail && cur-head->data()>=head->limit()-cur){
+	    // it's cheaper to move what's left of the block to the
+	    // beginning than to start another
+	    memmove(head->data(),cur,held);
+	    cur=head->data();
+	    head->fill=cur+held;
+	}else{
+	    // otherwise it goes on in a new one
+	    recv_block *b=reinterpret_cast<recv_block*>(bufferPool::get());
+	    b->next=0;
+	    b->fill=b->data();
+	    tail->next=b;
+	    tail=b;
+	}
+    }
+
+    // With a wheel the header deadline runs across every read of the
+    // header, however the bytes dribble in.  A body only gets body_ms for
+    // each wait, but it also has to keep up the minimum rate.
+    unsigned long long waitstart=0;
+    size_t had=held;
+    if(wheel && reading==reading_body){
+	wheel->arm(read_timer,timeouts.body_ms);
+	waitstart=monotonic_ns();
+    }
+    // It's one fd, so poll() does it without an epoll instance of our own
+    // for every connection.
+    struct pollfd pfd;
+    pfd.fd=fd;
+    pfd.events=POLLIN;
+    trace_span span("recv wait");
+    while(1){	// loop so that we can continue if a signal interrupts the poll
+	// the 15000 ms timeout means that the poll will return in 15 seconds
 	// whether anything is there or not.  We check for <= 0 for the 
 	// return value.  0 would mean we timed out, -1 means an error.
-	if((num_events=epoll_wait(epoll_fd,events,MAX_EVENTS,15000))<=0){
-	    if(num_events==-1){
+	// With a wheel we wait as long as it takes, it will shut the
+	// socket down when the time's up.
+	if((ready=poll(&pfd,1,wheel?-1:15000))<=0){
+	    if(ready==-1){
 		if(errno==EINTR){
 		    // got interrupted by signal, just restart
 		    continue;
 		}
 		// any other error, like bad file descriptor can't write memory,
-		// or the epoll_fd is bad, we set valid to false so they won't
-		// get in again, but we still return number of available bytes
-		std::cerr << "sockfdwrapper::getbytes() - problem from epoll_wait: " << strerror(errno) << '\n';
+		// we set valid to false so they won't get in again, but we
+		// still return number of available bytes
+		std::cerr << "sockfdwrapper::getbytes() - problem from poll: " << strerror(errno) << '\n';
 		valid=false;
 	    }
 	} else{
-	    // got events, we only expect EPOLLIN on fd
-	    for(size_t ctr=0;ctr<static_cast<size_t>(num_events);ctr++){
-		if(!(events[ctr].events & EPOLLIN)){
+	    // hangups and errors come back as a recv of 0 or -1
+	    if(pfd.revents & (POLLIN|POLLHUP|POLLERR)){
+		if(head==0){
+		    // we don't borrow a buffer till there's something to put
+		    // in it, so a connection waiting on its client holds none
+		    spent=head=tail=reinterpret_cast<recv_block*>(bufferPool::get());
+		    head->next=0;
+		    cur=head->fill=head->data();
+		}
+		// Data is available to be read
+		ssize_t nbytes=recv(fd,tail->fill,tail->limit()-tail->fill,0);
+		PROBE2(recv,fd,static_cast<long>(nbytes));
+		if(nbytes>0){
+		    // got some bytes
+		    tail->fill+=nbytes;
+		    held+=nbytes;
+		}else if(nbytes==0){
+		    //other side did orderly close of socket
+		    std::cerr << "sockfdwrapper::getbytes() - other end shutdown in an orderly fashion.\n";
+		    open=false;
+		}else if(errno==EINTR || errno==EAGAIN || errno==EWOULDBLOCK){
+		    // nothing after all, back to waiting
 		    continue;
-		}else if(fd==events[ctr].data.fd){
-		    // this is us!  Data is available to be read
-		    while(1){
-			ssize_t nbytes;
-			if((nbytes=recv(fd,end,RECV_BUF_SIZ-(begin-end),0))<=0){
-			    if(nbytes==0){
-				//other side did orderly close of socket
-				std::cerr << "sockfdwrapper::getbytes() - other end shutdown in an orderly fashion.\n";
-				open=false;
-			    }
-			    break;
-			}else if(nbytes==-1){
-			    // handle error cases
-			    continue;
-			}else{
-			    // got some bytes
-			    end+=nbytes;
-			    break;
-			}
-		    }
+		}else{
+		    // reset or some such, nothing more is coming
+		    open=false;
 		}
 	    }
 	}
 	break;	    // unless someone continued, we break out of the while(1);
     }
-    return end-cur;
+    if(wheel){
+	if(reading==reading_body){
+	    wheel->cancel(read_timer);
+	    body_bytes+=held-had;
+	    body_wait_ns+=monotonic_ns()-waitstart;
+	    if(open && !rate_ok(body_bytes,body_wait_ns)){
+		std::cerr << "sockfdwrapper::getbytes() - body slower than minimum rate\n";
+		too_slow(SHUT_RD);
+		open=false;
+	    }
+	}else if(reading==reading_idle && held){
+	    // their request's started, now they have header_ms to finish
+	    // sending all of the header
+	    reading=reading_header;
+	    wheel->arm(read_timer,timeouts.header_ms);
+	}
+    }
+    if(expired && open){
+	std::cerr << "sockfdwrapper::getbytes() - timed out\n";
+	open=false;
+    }
+    return held;
+}
+
+// The socket's full, so wait for room.  With a wheel, write_ms is how long
+// we'll wait, and the waits add up against the minimum rate.
+void
+sockfdwrapper::wait_writable()
+{
+    struct pollfd pfd;
+    pfd.fd=fd;
+    pfd.events=POLLOUT;
+    trace_span span("send stall");
+    if(!wheel){
+	if(poll(&pfd,1,15000)==0){
+	    valid=false;
+	    throw socket_insert_fail(ETIMEDOUT);
+	}
+	return;
+    }
+    unsigned long long waitstart=monotonic_ns();
+    wheel->arm(write_timer,timeouts.write_ms);
+    while(poll(&pfd,1,-1)==-1 && errno==EINTR);
+    wheel->cancel(write_timer);
+    send_wait_ns+=monotonic_ns()-waitstart;
+    if(expired){
+	valid=false;
+	throw socket_insert_fail(ETIMEDOUT);
+    }
+    if(!rate_ok(sent_bytes,send_wait_ns)){
+	too_slow(SHUT_RDWR);
+	valid=false;
+	throw socket_insert_fail(ETIMEDOUT);
+    }
+}
+
+// For a HEAD, how much of msg is still the response's header, watching
+// for the blank line at its end.  An interim 1xx has a header of its own
+// and then the real one comes.
+size_t
+sockfdwrapper::header_part(const char *msg,size_t len)
+{
+    for(size_t idx=0;idx<len;idx++){
+	if(msg[idx]=='\n'){
+	    if(++newlines==2){
+		newlines=0;
+		in_body=status/100!=1;
+		if(in_body){
+		    return idx+1;
+		}
+	    }
+	}else if(msg[idx]!='\r'){
+	    newlines=0;
+	}
+    }
+    return len;
 }
 
 void
@@ -174,22 +527,154 @@ sockfdwrapper::sendall(const char *msg,size_t len)
     // send binary data that might include '\0'.
     size_t cnt=0;
     ssize_t retval;
+    if((response_bytes==0 || status/100==1) && len>=12 && memcmp(msg,"HTTP/1.",7)==0){
+	// "HTTP/1.1 200 ", remember the 200, and after a 100 Continue
+	// what comes next is the real answer
+	status=atoi(msg+9);
+    }
+    if(head_only){
+	len=in_body?0:header_part(msg,len);
+    }
     while(cnt<len){
 	retval=send(fd,msg+cnt,len-cnt,MSG_NOSIGNAL);
 	if(retval==-1){
 	    // error
-	    if(errno==EAGAIN or errno==EWOULDBLOCK or errno==EINTR){
-		// EAGAIN or EWOULDBLOCK 'cause we filled buffers try again
+	    if(errno==EINTR){
 		// EINTR 'cause someone invoked a signal handler
 		continue;
 	    }
+	    if(errno==EAGAIN or errno==EWOULDBLOCK){
+		// EAGAIN or EWOULDBLOCK 'cause we filled buffers, wait for
+		// them to drain and try again
+		PROBE3(send_eagain,fd,len-cnt,response_bytes);
+		wait_writable();
+		continue;
+	    }
+	    // whatever we sent of the response, the connection's no good
+	    // for another one
+	    valid=false;
+	    if(expired){
+		throw socket_insert_fail(ETIMEDOUT);
+	    }
 	    // I could return something but this is called from
 	    // inserters that have to keep returning the sockfdwrapper&
 	    // so that you can chain.  There's no place to return an
 	    // error code.
 	    throw socket_insert_fail(errno);
 	}else{
+	    if(static_cast<size_t>(retval)<len-cnt){
+		PROBE3(send_partial,fd,static_cast<long>(retval),len-cnt);
+	    }
 	    cnt+=retval;
+	    response_bytes+=retval;
+	    if(send_wait_ns){
+		// only what went after we first had to wait says how
+		// fast they're taking it, the rest just filled buffers
+		sent_bytes+=retval;
+	    }
+	}
+    }
+}
+
+/**
+ * sendfile(int filefd, off_t offset, size_t len)
+ * sends len bytes of filefd starting at offset straight out of the page
+ * cache, so the file never has to be read into our memory.  Throws
+ * socket_insert_fail like sendall.  When the socket's full we wait for it
+ * to drain, but not forever, see wait_writable().
+ */
+void
+sockfdwrapper::sendfile(int filefd,off_t offset,size_t len)
+{
+    if(head_only && in_body){
+	return;
+    }
+    while(len){
+	ssize_t retval=::sendfile(fd,filefd,&offset,len);
+	if(retval==-1){
+	    if(errno==EINTR){
+		continue;
+	    }
+	    if(errno==EAGAIN or errno==EWOULDBLOCK){
+		PROBE3(send_eagain,fd,len,response_bytes);
+		wait_writable();
+		continue;
+	    }
+	    valid=false;
+	    throw socket_insert_fail(expired?ETIMEDOUT:errno);
+	}else if(retval==0){
+	    // the file got shorter under us, nothing more we can send
+	    valid=false;
+	    throw socket_insert_fail(EIO);
+	}
+	len-=retval;
+	response_bytes+=retval;
+	if(send_wait_ns){
+	    sent_bytes+=retval;
+	}
+    }
+}
+
+size_t
+sockfdwrapper::splice_from(int infd,size_t len)
+{
+    int pipefd[2];
+    size_t moved=0;
+    if(head_only && in_body){
+	// it still has to be taken from infd, it's just not sent on
+	char buf[4096];
+	while(moved<len){
+	    ssize_t in=::read(infd,buf,std::min(len-moved,sizeof buf));
+	    if(in==-1 && errno==EINTR){
+		continue;
+	    }
+	    if(in<=0){
+		break;
+	    }
+	    moved+=in;
+	}
+	return moved;
+    }
+    if(pipe2(pipefd,O_CLOEXEC)==-1){
+	valid=false;
+	throw socket_insert_fail(errno);
+    }
+    while(moved<len){
+	ssize_t in=splice(infd,NULL,pipefd[1],NULL,std::min<size_t>(len-moved,64*1024),
+		SPLICE_F_MOVE);
+	if(in==-1 && errno==EINTR){
+	    continue;
+	}
+	if(in<=0){
+	    break;
+	}
+	// and all of what's in the pipe out before any more goes in
+	while(in>0){
+	    ssize_t out=splice(pipefd[0],NULL,fd,NULL,in,SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+	    if(out==-1){
+		if(errno==EINTR){
+		    continue;
+		}
+		if(errno==EAGAIN or errno==EWOULDBLOCK){
+		    PROBE3(send_eagain,fd,in,response_bytes);
+		    wait_writable();
+		    continue;
+		}
+		int err=expired?ETIMEDOUT:errno;
+		close(pipefd[0]);
+		close(pipefd[1]);
+		valid=false;
+		throw socket_insert_fail(err);
+	    }
+	    in-=out;
+	    moved+=out;
+	    response_bytes+=out;
+	    if(send_wait_ns){
+		sent_bytes+=out;
+	    }
 	}
     }
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return moved;
 }
@@ -9,12 +9,68 @@
 #include <sstream>
 #include <exception>
 #include <sys/socket.h>
-#include <sys/epoll.h>
 #include <iostream>
+#include <atomic>
+#include "bufferpool.h"
 #include "http.h"
+#include "timerwheel.h"
 
-const int MAX_EVENTS=64;
-const size_t RECV_BUF_SIZ=8*1024;
+// The receive buffer's a chain of these, each at the front of a
+// bufferPool block with what's been received right after it.
+struct recv_block
+{
+    recv_block *next;
+    char *fill;		    // where what's been received ends
+    char *data() { return reinterpret_cast<char*>(this+1); };
+    char *limit() { return reinterpret_cast<char*>(this)+bufferPool::BLOCK_SIZE; };
+};
+
+// A line still sitting in the receive blocks, \n and all.  It's only good
+// till the next call that reads from the sockfdwrapper.  Most lines are in
+// one block, but one that ran off the end of a block goes on in the next.
+struct line_view
+{
+    line_view():first(0),start(0),len(0){};
+    size_t size() const { return len; };
+    // copy it onto the end of s, any string with append(const char*,size_t)
+    template<class S> void append_to(S& s) const
+    {
+	const recv_block *b=first;
+	const char *p=start;
+	size_t left=len;
+	while(left){
+	    size_t here=b->fill-p;
+	    if(here>left){
+		here=left;
+	    }
+	    s.append(p,here);
+	    left-=here;
+	    if((b=b->next)){
+		p=reinterpret_cast<const char*>(b+1);
+	    }
+	}
+    };
+    const recv_block *first;
+    const char *start;
+    size_t len;
+};
+
+// How long we'll wait on a client, all in milliseconds, and how much of a
+// request we'll hold on to before they've sent a whole header.
+struct conn_timeouts
+{
+    conn_timeouts():idle_ms(15000),header_ms(20000),body_ms(20000),
+	write_ms(20000),min_rate(500),rate_grace_ms(5000),max_header(64*1024){};
+    unsigned idle_ms;	    // for the first byte of a request
+    unsigned header_ms;	    // from there for the whole header, however
+			    // it dribbles in
+    unsigned body_ms;	    // for each next piece of a body
+    unsigned write_ms;	    // for room in a full socket to send more
+    size_t min_rate;	    // bytes/second a body or response has to move
+			    // at while we're waiting on the client, once
+    unsigned rate_grace_ms; // we've waited this long in all
+    size_t max_header;	    // bytes, for the request line and headers
+};
 class
 socket_insert_fail: public std::exception
 {
@@ -43,11 +99,71 @@ public:
     // this is just so we have a class so we can make operator<<s that
     // will insert into a socket.  You can't insert into an int.  This
     // lets us pass the socket to an inserter so that it can send to it.
-    sockfdwrapper(int i);
+    // With a wheel, waits on the client never time out on their own; the
+    // deadlines in timeouts shut the socket down from the wheel's thread
+    // instead, which wakes us.  Without one we just wait 15 seconds for
+    // each read like always.
+    sockfdwrapper(int i,timerWheel *wheel=0,const conn_timeouts *timeouts=0);
+    // Call once the request line and headers are in.  Stops the header
+    // deadline and starts timing reads as body reads.
+    void headers_done();
+    // true if a deadline or the minimum rate is why we stopped
+    bool timed_out() const { return expired!=0; };
     void sendall(const char *msg, size_t len);
-    char *getline(char *,size_t);
+    void sendfile(int filefd, off_t offset, size_t len);
+    // For a HEAD.  Whatever's sent after the response's blank line is
+    // dropped, so whoever answers can send the body as for a GET.  Till
+    // next_request().
+    void set_head_only(bool only) { head_only=only; };
+    // Up to len bytes from infd, a socket, straight to the client through
+    // a pipe without coming up into user space.  Fewer only if infd ran
+    // out or timed out.
+    size_t splice_from(int infd,size_t len);
+    // The next line, reading as often as it takes to get all of it.
+    // False if it's not all there and isn't coming, because they went
+    // away, we timed out, or holding it would take more than max_header.
+    bool get_line(line_view& line);
+    // true if the last get_line failed because the line was too big
+    bool over_limit() const { return too_big; };
+    size_t read(char *,size_t);
+    size_t buffered() const { return held; };
+    // For a body that's spliced from the socket around us.  wait_body()
+    // waits for more of it the way read() would, with body_ms and the
+    // minimum rate, and is false if it's not coming.  body_spliced() says
+    // how much was moved, and is false if that's too slow.  The tap never
+    // sees spliced bytes, so they mark it truncated.
+    bool wait_body();
+    bool body_spliced(size_t n);
+    // how much of the response to this request we've sent
+    size_t bytes_sent() const { return response_bytes; };
+    // the status it started with, 0 if it didn't start with a status line
+    int response_status() const { return status; };
+    // Everything read from here on, request line, headers and body, gets
+    // added to the end of tap, till it's set to 0, but only till tap has
+    // limit bytes in it.  tap_truncated() says if any were left out since
+    // the request started.
+    void
+    set_tap(std::string *tap,size_t limit=static_cast<size_t>(-1))
+    {
+	this->tap=tap;
+	tap_limit=limit;
+    };
+    bool tap_truncated() const { return tap_cut; };
+    bool tapping() const { return tap!=0; };
+    // Keep-alive.  One's only kept if the client asked (wanted, going by
+    // its Connection: header and whether it's http11), and whoever sent
+    // the response knew its length and called framed_response(), and
+    // nothing went wrong.  framed_response() gives back the Connection:
+    // header to put in the response, if it needs one.
+    void set_keep_alive(bool wanted,bool http11);
+    const char *framed_response();
+    bool keeping_alive() const
+	{ return keep_alive && framed && valid && open && !expired; };
+    // start over on the next request on this connection
+    void next_request();
     bool is_closed(){ return open==false; };
     bool is_valid(){ return valid==true; };
+    int get_fd() const { return fd; };
     ~sockfdwrapper();
 private:
     // we don't use or allow default or copy constructors, or the 
@@ -56,15 +172,52 @@ private:
     sockfdwrapper();
     sockfdwrapper(const sockfdwrapper&);
     const sockfdwrapper& operator=(const sockfdwrapper&);
+    enum phase { reading_idle, reading_header, reading_body };
+    friend void sockfdwrapper_read_expired(void *);
+    friend void sockfdwrapper_write_expired(void *);
     ssize_t getbytes(void);
+    void release_buffer();
+    void release_spent();
+    void consume(size_t n);
+    void wait_writable();
+    void too_slow(int how);
+    bool rate_ok(size_t bytes,unsigned long long waited_ns) const;
     int fd;
     bool valid;
     bool open;
-    int epoll_fd;
-    struct epoll_event ev;
-    struct epoll_event events[MAX_EVENTS];
-    char rawbuffer[RECV_BUF_SIZ];
-    char *begin,*cur,*end;
+    bool keep_alive;
+    bool http11;
+    bool framed;
+    bool too_big;
+    // Blocks are borrowed from bufferPool when there's something to read,
+    // and all 0 when we don't have any.  Unread bytes start at cur in head
+    // and go on to tail->fill.  Blocks from spent up to head have been
+    // read, but a line_view might still be looking at them.
+    recv_block *spent,*head,*tail;
+    char *cur;
+    size_t held;		    // unread bytes in all the blocks
+    timerWheel *wheel;
+    conn_timeouts timeouts;
+    // A read that runs out of time only shuts down our reading side, so
+    // there's still a chance to send a 408.  A stalled write has to shut
+    // down both to wake up the poll waiting on it.
+    wheel_timer read_timer,write_timer;
+    phase reading;
+    std::atomic<int> expired;	    // set from the wheel's thread
+    // for the minimum rate, how much has moved each way and how long we
+    // spent waiting on the client for it
+    size_t body_bytes,sent_bytes;
+    unsigned long long body_wait_ns,send_wait_ns;
+    size_t response_bytes;	    // all of it, waited for or not
+    int status;
+    std::string *tap;
+    bool head_only;
+    bool in_body;		    // the response's header's all gone out
+    unsigned newlines;		    // in a row, looking for its end
+    size_t header_part(const char *msg,size_t len);
+    size_t tap_limit;
+    bool tap_cut;		    // tap's missing some of this request
+    void tap_out(const char *data,size_t len);
 };
 
 inline
@@ -0,0 +1,160 @@
+// copyright Patrick Horgan
+// source is open, feel free to use it as you wish with no restrictions
+// except that this copyright notice must be preserved intact
+#include "ssi.h"
+#include "trace.h"
+#include <cstdio>
+
+void
+chunked_sink::send_chunk(const uint8_t *data,size_t len)
+{
+    char sizeline[24];
+    snprintf(sizeline,sizeof sizeline,"%zx\r\n",len);
+    sfd << sizeline;
+    sfd.sendall(reinterpret_cast<const char*>(data),len);
+    sfd << "\r\n";
+}
+
+void
+chunked_sink::write(const uint8_t *data,size_t len)
+{
+    if(len==0){
+	return;		// an empty chunk would end the body
+    }
+    if(used+len>CHUNK_SIZ){
+	flush();
+	if(len>=CHUNK_SIZ){
+	    // no point copying something that's a chunk all by itself
+	    send_chunk(data,len);
+	    return;
+	}
+    }
+    memcpy(buf+10+used,data,len);
+    used+=len;
+}
+
+void
+chunked_sink::flush()
+{
+    if(used==0){
+	return;
+    }
+    // the size line goes right up against the data
+    char sizeline[12];
+    int n=snprintf(sizeline,sizeof sizeline,"%zx\r\n",used);
+    uint8_t *start=buf+10-n;
+    memcpy(start,sizeline,n);
+    buf[10+used]='\r';
+    buf[10+used+1]='\n';
+    sfd.sendall(reinterpret_cast<const char*>(start),n+used+2);
+    used=0;
+}
+
+void
+chunked_sink::finish()
+{
+    flush();
+    sfd << "0\r\n\r\n";
+}
+
+void
+expand_includes(fileblob& b,ssi_sink& out,std::vector<std::string> *deps,int depth)
+{
+    // each include nests inside the one that included it
+    trace_span span("expand_includes",b.path.c_str());
+    // We have to check for included files
+    // format is something like:
+    // <!--#include virtual="/cgi-bin/counter.pl" -->
+    // There's also file= but we don't support it, nor do we support
+    // any other SSI.
+
+    const char* searchSSIinclude="<!--#include";
+    const char* searchVirtual="virtual";
+    const char* searchSSIEnd="-->";
+    fileblob::iterator start,foundit,last=b.begin();
+
+    while(last!=b.end() && (foundit=std::search(last,b.end(),searchSSIinclude,searchSSIinclude+12))!=b.end()){
+	start=foundit; // remember beginning in case we can't use it
+	// out gets from beginning to the include
+	out.write(last,foundit-last);
+	// search for virtual
+	if((foundit=std::search(foundit+12,b.end(),searchVirtual,searchVirtual+7))==b.end()){
+	    // didn't find virtual, so look for end of SSI tag
+	    foundit=std::search(start,b.end(),searchSSIEnd,searchSSIEnd+3);
+	    if(foundit!=b.end()){
+		// if we found the ending -->, add to output and skip
+		out.write(start,foundit+3-start);
+		last=foundit+3;
+	    }else{
+		// no end of tag in the whole thing!!! skip to end
+		out.write(start,b.end()-start);
+		last=b.end();
+	    }
+	    continue;
+	}
+	// Found the word virtual and foundit points at it
+	foundit+=7;	// get past "virtual" then find the = sign
+	while(foundit!=b.end() && *foundit!='=') foundit++;
+	if(foundit!=b.end()){
+	    foundit++;	// skip the equal sign
+	}
+	// now skip ws
+	while(foundit!=b.end() && (*foundit==' ' || *foundit=='\t' || *foundit=='\r' || *foundit=='\n')) foundit++;
+	// after white space expect 'filename' or "filename"
+	if(foundit==b.end() || (*foundit!='\'' && *foundit!='"')){
+	    // found virtual= but then no ' or "
+	    // skip to end of ssi element if found
+	    foundit=std::search(start,b.end(),searchSSIEnd,searchSSIEnd+3);
+	    if(foundit!=b.end()){
+		out.write(start,foundit+3-start);
+		last=foundit+3;
+	    }else{
+		out.write(start,b.end()-start);
+		last=b.end();
+	    }
+	    continue;
+	}
+	fileblob::iterator idx;
+	char sep=*foundit++;	// remember ' or "
+	idx=foundit;
+	while(idx!=b.end() && *idx!=sep) idx++;
+	if(idx==b.end()){
+	    // malformed file with 'filename.... and never a '
+	    out.write(start,b.end()-start);
+	    last=b.end();
+	    continue;
+	}
+	// found a name between quotes, look for such a file
+	std::string thefile=b.curdir()+"/"+std::string(foundit,idx);
+	if(deps){
+	    deps->push_back(thefile);
+	}
+	if(depth<SSI_MAX_DEPTH){
+	    fileblob tfb(thefile);
+	    if(tfb.blob_size!=0){
+		expand_includes(tfb,out,deps,depth+1);
+	    }else{
+		// what do we do if the file doesn't open
+	    }
+	}else{
+	    std::cerr << b.path << ": includes nested more than "
+		<< SSI_MAX_DEPTH << " deep, skipping " << thefile << '\n';
+	}
+	// now skip to end of the SSI tag and skip it.
+	foundit=std::search(++idx,b.end(),searchSSIEnd,searchSSIEnd+3);
+	if(foundit!=b.end()){
+	    // if we found the ending --> just skip past it.
+	    last=foundit+3;
+	}else{
+	    // otherwise, add the data past the idx to the end to the
+	    // output.  The would let something like
+	    // <--#include virtual="some.file"
+	    // work incorrectly but what else do we do?
+	    out.write(idx,b.end()-idx);
+	    last=b.end();
+	}
+    }
+    // If we never found an include last is still pointing at the start.  
+    // Otherwise, it's pointing past the -->, or if not found at end()
+    out.write(last,b.end()-last);   // Add the rest
+}
@@ -0,0 +1,71 @@
+// copyright Patrick Horgan
+// source is open, feel free to use it as you wish with no restrictions
+// except that this copyright notice must be preserved intact
+#ifndef ssi_guard
+#define ssi_guard
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "http.h"
+#include "sockfdwrapper.h"
+
+// expand_includes writes what it expands to one of these, so the same code
+// can build a string or stream straight out to a socket
+class ssi_sink
+{
+public:
+    virtual void write(const uint8_t *data,size_t len)=0;
+    virtual ~ssi_sink(){};
+};
+
+// collects everything, for when we need to know how long it is first
+class string_sink: public ssi_sink
+{
+public:
+    string_sink(std::string& data):data(data){};
+    virtual void
+    write(const uint8_t *ptr,size_t len)
+	{ data.append(reinterpret_cast<const char*>(ptr),len); };
+private:
+    std::string& data;
+};
+
+// throws it all away, for when we only want to know what got included
+class null_sink: public ssi_sink
+{
+public:
+    virtual void write(const uint8_t *,size_t){};
+};
+
+// Sends what it's given as HTTP/1.1 chunks.  Little pieces get gathered
+// up into one chunk of up to CHUNK_SIZ so we don't do a send for every
+// literal between two includes, big pieces go out as they are.  Call
+// finish() to flush and send the last-chunk.
+class chunked_sink: public ssi_sink
+{
+public:
+    static const size_t CHUNK_SIZ=16*1024;
+    chunked_sink(sockfdwrapper& sfd):sfd(sfd),used(0){};
+    virtual void write(const uint8_t *data,size_t len);
+    void flush();
+    void finish();
+private:
+    chunked_sink(const chunked_sink&);
+    const chunked_sink& operator=(const chunked_sink&);
+    void send_chunk(const uint8_t *data,size_t len);
+    sockfdwrapper& sfd;
+    size_t used;
+    // room in front for the chunk size line, and after for the \r\n, so
+    // a whole chunk goes out with one send
+    uint8_t buf[10+CHUNK_SIZ+2];
+};
+
+// How deep includes can nest before we decide a page includes itself
+const int SSI_MAX_DEPTH=16;
+
+// Expand <!--#include virtual="file" --> in b, writing the result to out.
+// If deps isn't 0 every file we tried to include gets pushed onto it.
+void
+expand_includes(fileblob& b,ssi_sink& out,std::vector<std::string> *deps=0,
+	int depth=0);
+#endif
@@ -0,0 +1,96 @@
+// A FastCGI application for testfastcgi, single threaded the way most of
+// them are, so it only ever serves the connection it accepted last.  It
+// answers with its pid, after sleeping DELAY_MS if it's given.  With DIE
+// it dies partway through its answer.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+static int
+readfull(int fd,unsigned char *buf,size_t len)
+{
+    while(len){
+	ssize_t got=read(fd,buf,len);
+	if(got<=0){
+	    return 0;
+	}
+	buf+=got;
+	len-=(size_t)got;
+    }
+    return 1;
+}
+
+static void
+record(int fd,unsigned char type,int id,const char *data,size_t len)
+{
+    unsigned char hdr[8]={ 1,type,(unsigned char)(id>>8),(unsigned char)id,
+	(unsigned char)(len>>8),(unsigned char)len,0,0 };
+    write(fd,hdr,8);
+    if(len){
+	write(fd,data,len);
+    }
+}
+
+// the value of name in a block of name-value pairs, short lengths only
+static long
+param(const unsigned char *pairs,size_t len,const char *name)
+{
+    size_t at=0;
+    while(at+2<=len){
+	size_t nlen=pairs[at],vlen=pairs[at+1];
+	at+=2;
+	if(nlen==strlen(name) && memcmp(pairs+at,name,nlen)==0){
+	    char value[128];
+	    memcpy(value,pairs+at+nlen,vlen);
+	    value[vlen]='\0';
+	    return atol(value);
+	}
+	at+=nlen+vlen;
+    }
+    return 0;
+}
+
+int
+main()
+{
+    int fd;
+    while((fd=accept(0,0,0))!=-1){
+	unsigned char hdr[8],content[65536+256];
+	int keep=0;
+	long delay=0,die=0;
+	while(readfull(fd,hdr,8)){
+	    size_t clen=(size_t)(hdr[4]<<8|hdr[5]);
+	    int id=hdr[2]<<8|hdr[3];
+	    if(!readfull(fd,content,clen+hdr[6])){
+		break;
+	    }
+	    if(hdr[1]==1){		// FCGI_BEGIN_REQUEST
+		keep=content[2]&1;
+		delay=0;
+	    }else if(hdr[1]==4 && clen){	// FCGI_PARAMS
+		delay=param(content,clen,"DELAY_MS");
+		die=param(content,clen,"DIE");
+	    }else if(hdr[1]==5 && clen==0){	// the end of FCGI_STDIN
+		char out[128],end[8]={ 0 };
+		int len;
+		usleep((useconds_t)delay*1000);
+		len=snprintf(out,sizeof out,"Content-Type: text/plain\r\n\r\npid %d",(int)getpid());
+		record(fd,6,id,out,(size_t)len);
+		if(die){
+		    _exit(1);
+		}
+		record(fd,6,id,0,0);
+		record(fd,3,id,end,8);
+		if(!keep){
+		    break;
+		}
+	    }else if(hdr[1]==9){		// FCGI_GET_VALUES
+		record(fd,10,0,0,0);
+	    }
+	}
+	close(fd);
+    }
+    return 0;
+}
@@ -0,0 +1,80 @@
+// A plugin for testplugin to load, that does something different for
+// each path it's asked for.
+#include <string.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include "../plugin.h"
+
+static int
+fixture_init(const char *arg)
+{
+    return arg && strcmp(arg,"refuse")==0;
+}
+
+static int
+is(const hs_request *req,const char *what)
+{
+    return req->path_info.len==strlen(what)
+	&& memcmp(req->path_info.data,what,req->path_info.len)==0;
+}
+
+static int
+fixture(const hs_request *req,hs_response *resp)
+{
+    if(is(req,"/small")){
+	resp->header(resp,"X-Small","yes");
+	resp->write(resp,"hello",5);
+    }else if(is(req,"/big")){
+	char buf[1000];
+	int ctr;
+	memset(buf,'b',sizeof buf);
+	for(ctr=0;ctr<40;ctr++){
+	    resp->write(resp,buf,sizeof buf);
+	}
+    }else if(is(req,"/wait")){
+	if(resp->state==0){
+	    struct itimerspec when;
+	    int tfd=timerfd_create(CLOCK_MONOTONIC,0);
+	    memset(&when,0,sizeof when);
+	    when.it_value.tv_nsec=10*1000000;
+	    timerfd_settime(tfd,0,&when,0);
+	    resp->state=(void*)(long)(tfd+1);
+	    resp->wait(resp,tfd,POLLIN,1000);
+	    return HS_SUSPEND;
+	}
+	close((int)(long)resp->state-1);
+	resp->write(resp,resp->ready&POLLIN?"waited":"timed out",
+		resp->ready&POLLIN?6:9);
+    }else if(is(req,"/body")){
+	char buf[100];
+	ssize_t n;
+	while((n=req->read_body(req,buf,sizeof buf))>0){
+	    resp->write(resp,buf,(size_t)n);
+	}
+    }else if(is(req,"/short") || is(req,"/long")){
+	if(resp->header(resp,"Transfer-Encoding","chunked")==0
+		|| resp->header(resp,"Content-Length","12abc")==0
+		|| resp->header(resp,"Content-Length","8")!=0
+		|| resp->header(resp,"Content-Length","8")==0){
+	    return HS_ERROR;
+	}
+	resp->write(resp,is(req,"/short")?"hello":"hello there",is(req,"/short")?5:11);
+    }else if(is(req,"/inject")){
+	if(resp->header(resp,"X-Bad","a\r\nSet-Cookie: x")==0){
+	    return HS_ERROR;
+	}
+	resp->status(resp,204,"No Content");
+    }else{
+	return HS_ERROR;
+    }
+    return HS_DONE;
+}
+
+const hs_plugin hs_plugin_v1={
+    HS_PLUGIN_ABI,
+    "fixture",
+    fixture_init,
+    fixture,
+    NULL
+};
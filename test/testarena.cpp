@@ -0,0 +1,84 @@
+#include "../arena.h"
+#include <iostream>
+
+int
+main()
+{
+    size_t tests=0,passed=0,failed=0;
+
+    std::cout << "test 1 - containers in a scope use the arena, and it's empty after - ";
+    tests++;
+    requestArena *inside=0;
+    size_t used=0;
+    {
+	arena_scope scope;
+	inside=requestArena::current();
+	{
+	    arena_map headers;
+	    headers["Host"]="localhost:8080";
+	    headers["User-Agent"]="a user agent long enough not to fit in the string";
+	    used=scope.arena().used();
+	}
+    }
+    if(inside==0 || used==0 || requestArena::current()!=0 || inside->used()!=0
+	    || inside->high_water()!=used){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+
+    std::cout << "test 2 - allocations are aligned - ";
+    tests++;
+    bool aligned=true;
+    {
+	requestArena arena(256);
+	for(int ctr=0;ctr<100;ctr++){
+	    arena.allocate(1,1);
+	    void *p=arena.allocate(sizeof(double),alignof(double));
+	    aligned=aligned && reinterpret_cast<size_t>(p)%alignof(double)==0;
+	}
+    }
+    if(!aligned){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+
+    std::cout << "test 3 - a request that overflows makes the next one fit - ";
+    tests++;
+    arena_stats before=requestArena::stats();
+    for(int round=0;round<2;round++){
+	arena_scope scope;
+	arena_strings lines;
+	for(int ctr=0;ctr<200;ctr++){
+	    lines.push_back(arena_string(200,'x'));
+	}
+    }
+    arena_stats after=requestArena::stats();
+    if(after.requests!=before.requests+2 || after.overflows!=before.overflows+1
+	    || after.high_water<200*200){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+
+    std::cout << "test 4 - without a scope it's plain new and delete - ";
+    tests++;
+    arena_string outside(100,'y');
+    if(outside.get_allocator().arena!=0 || outside.size()!=100){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+    std::cout << tests << " tests, passed: " << passed << ", failed: " << failed << '\n';
+
+    return 0;
+}
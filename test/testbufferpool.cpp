@@ -0,0 +1,87 @@
+#include "../bufferpool.h"
+#include <pthread.h>
+#include <iostream>
+#include <vector>
+
+void *
+other_thread(void *voidblock)
+{
+    // a block put on another thread goes on that thread's free list
+    bufferPool::put(static_cast<char*>(voidblock));
+    char *mine=bufferPool::get();
+    return mine==voidblock?mine:0;
+}
+
+int
+main()
+{
+    size_t tests=0,passed=0,failed=0;
+
+    std::cout << "test 1 - a block put back is the next one handed out - ";
+    tests++;
+    char *first=bufferPool::get();
+    first[0]='a';
+    first[bufferPool::BLOCK_SIZE-1]='z';
+    bufferPool::put(first);
+    char *again=bufferPool::get();
+    if(again!=first || bufferPool::outstanding()!=1){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+    bufferPool::put(again);
+
+    std::cout << "test 2 - outstanding counts blocks out, and only KEEP are kept - ";
+    tests++;
+    std::vector<char*> blocks;
+    for(size_t ctr=0;ctr<bufferPool::KEEP*2;ctr++){
+	blocks.push_back(bufferPool::get());
+    }
+    size_t out=bufferPool::outstanding();
+    for(size_t ctr=0;ctr<blocks.size();ctr++){
+	bufferPool::put(blocks[ctr]);
+    }
+    // the first KEEP put back were kept, the rest went back to malloc
+    bool reused=true;
+    for(size_t ctr=0;ctr<bufferPool::KEEP;ctr++){
+	reused=reused && bufferPool::get()==blocks[bufferPool::KEEP-1-ctr];
+    }
+    if(out!=bufferPool::KEEP*2 || !reused || bufferPool::outstanding()!=bufferPool::KEEP){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+
+    std::cout << "test 3 - putting 0 does nothing - ";
+    tests++;
+    bufferPool::put(0);
+    if(bufferPool::outstanding()!=bufferPool::KEEP){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+
+    std::cout << "test 4 - threads have their own free blocks - ";
+    tests++;
+    char *given=bufferPool::get();
+    pthread_t tid;
+    void *result=0;
+    pthread_create(&tid,0,other_thread,given);
+    pthread_join(tid,&result);
+    if(result!=given){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+    std::cout << tests << " tests, passed: " << passed << ", failed: " << failed << '\n';
+
+    return 0;
+}
@@ -0,0 +1,146 @@
+#include "../dircache.h"
+#include <cstdlib>
+#include <iostream>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// what the client gets when cache sends directory's listing
+static std::string
+listing(dirCache& cache,const std::string& directory,const std::string& path)
+{
+    int fds[2];
+    socketpair(AF_UNIX,SOCK_STREAM,0,fds);
+    {
+	sockfdwrapper sfd(fds[0]);
+	cache.send(sfd,directory,path);
+    }
+    close(fds[0]);
+    std::string got;
+    char buf[4096];
+    ssize_t n;
+    while((n=read(fds[1],buf,sizeof buf))>0){
+	got.append(buf,n);
+    }
+    close(fds[1]);
+    return got;
+}
+
+static void
+touch(const std::string& path)
+{
+    close(open(path.c_str(),O_CREAT|O_WRONLY,0644));
+}
+
+int
+main()
+{
+    size_t tests=0,passed=0,failed=0;
+    char top[]="/tmp/testdircache.XXXXXX";
+    std::string dir=mkdtemp(top);
+    std::string a=dir+"/a",b=dir+"/b",c=dir+"/c";
+    mkdir(a.c_str(),0755);
+    mkdir(b.c_str(),0755);
+    mkdir(c.c_str(),0755);
+
+    std::cout << "test 1 - hrefs are percent encoded and names escaped - ";
+    tests++;
+    {
+	dirCache cache(false);
+	touch(a+"/two words");
+	touch(a+"/x:y");
+	touch(a+"/q&r#s?t");
+	std::string got=listing(cache,a,"/a/<b>/");
+	if(got.find("<a href=\"two%20words\">two words</a>")==std::string::npos
+		|| got.find("<a href=\"./x:y\">x:y</a>")==std::string::npos
+		|| got.find("<a href=\"q&amp;r%23s%3Ft\">q&amp;r#s?t</a>")==std::string::npos
+		|| got.find("<h1>/a/&lt;b&gt;/</h1>")==std::string::npos){
+	    std::cout << "failed\n";
+	    failed++;
+	}else{
+	    std::cout << "passed\n";
+	    passed++;
+	}
+    }
+
+    std::cout << "test 2 - one entry per directory, titled for each request - ";
+    tests++;
+    {
+	dirCache cache(false);
+	std::string one=listing(cache,a,"/a/");
+	std::string two=listing(cache,a,"/other/");
+	size_t len=atoi(two.c_str()+two.find("Content-Length: ")+16);
+	if(cache.size()!=1 || one.find("<h1>/a/</h1>")==std::string::npos
+		|| two.find("<h1>/other/</h1>")==std::string::npos
+		|| len!=two.size()-two.find("\r\n\r\n")-4){
+	    std::cout << "failed\n";
+	    failed++;
+	}else{
+	    std::cout << "passed\n";
+	    passed++;
+	}
+    }
+
+    std::cout << "test 3 - the one used longest ago is the one that goes - ";
+    tests++;
+    {
+	dirCache cache(false,2);
+	listing(cache,a,"/a/");
+	listing(cache,b,"/b/");
+	listing(cache,a,"/a/");
+	listing(cache,c,"/c/");
+	if(cache.size()!=2 || !cache.cached(a) || cache.cached(b) || !cache.cached(c)){
+	    std::cout << "failed\n";
+	    failed++;
+	}else{
+	    std::cout << "passed\n";
+	    passed++;
+	}
+    }
+
+    std::cout << "test 4 - a changed directory is read again - ";
+    tests++;
+    {
+	dirCache cache(false);
+	std::string before=listing(cache,b,"/b/");
+	touch(b+"/new");
+	std::string after=listing(cache,b,"/b/");
+	if(before.find("\"new\"")!=std::string::npos || after.find("<a href=\"new\">new</a>")==std::string::npos){
+	    std::cout << "failed\n";
+	    failed++;
+	}else{
+	    std::cout << "passed\n";
+	    passed++;
+	}
+    }
+    std::cout << "test 5 - a listing leaves the connection open for the next request - ";
+    tests++;
+    {
+	dirCache cache(false);
+	int fds[2];
+	socketpair(AF_UNIX,SOCK_STREAM,0,fds);
+	bool kept;
+	{
+	    sockfdwrapper sfd(fds[0]);
+	    sfd.set_keep_alive(true,true);
+	    cache.send(sfd,c,"/c/");
+	    kept=sfd.keeping_alive();
+	}
+	close(fds[0]);
+	char buf[4096];
+	ssize_t n=read(fds[1],buf,sizeof buf);
+	close(fds[1]);
+	std::string got(buf,n>0?n:0);
+	if(!kept || got.find("Connection: close")!=std::string::npos){
+	    std::cout << "failed\n";
+	    failed++;
+	}else{
+	    std::cout << "passed\n";
+	    passed++;
+	}
+    }
+    std::cout << tests << " tests, passed: " << passed << ", failed: " << failed << '\n';
+    system(("rm -rf "+dir).c_str());
+
+    return 0;
+}
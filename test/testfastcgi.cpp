@@ -0,0 +1,214 @@
+#include "../fastcgi.h"
+#include "../cgienv.h"
+#include <csignal>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+// Has the pool run a request and gives back what the client got.  unavail
+// says if the pool threw fcgi_backend_unavailable.  die has the
+// application die partway through its answer.
+static std::string
+exchange(fcgiPool& pool,long delay_ms,bool& unavail,bool die=false)
+{
+    int fds[2];
+    socketpair(AF_UNIX,SOCK_STREAM,0,fds);
+    std::map<std::string,std::string> params;
+    params["REQUEST_METHOD"]="GET";
+    if(delay_ms){
+	std::stringstream ss;
+	ss << delay_ms;
+	params["DELAY_MS"]=ss.str();
+    }
+    if(die){
+	params["DIE"]="1";
+    }
+    unavail=false;
+    {
+	sockfdwrapper sfd(fds[0]);
+	try{
+	    pool.run(sfd,params,false);
+	}catch(const fcgi_backend_unavailable&){
+	    unavail=true;
+	}
+    }
+    close(fds[0]);
+    std::string got;
+    char buf[4096];
+    ssize_t n;
+    while((n=read(fds[1],buf,sizeof buf))>0){
+	got.append(buf,n);
+    }
+    close(fds[1]);
+    return got;
+}
+
+// the pid the application put in its answer, or 0 if there wasn't one
+static int
+pid_of(const std::string& got)
+{
+    size_t at=got.find("\r\n\r\npid ");
+    return at==std::string::npos?0:atoi(got.c_str()+at+8);
+}
+
+struct slow_arg
+{
+    fcgiPool *pool;
+    int pid;
+};
+
+static void *
+slow_request(void *voidarg)
+{
+    slow_arg *arg=static_cast<slow_arg*>(voidarg);
+    bool unavail;
+    arg->pid=pid_of(exchange(*arg->pool,200,unavail));
+    return 0;
+}
+
+static double
+now()
+{
+    struct timeval tv;
+    gettimeofday(&tv,0);
+    return tv.tv_sec+tv.tv_usec/1e6;
+}
+
+int
+main()
+{
+    size_t tests=0,passed=0,failed=0;
+    bool unavail;
+
+    std::cout << "test 1 - requests past nprocs wait their turn for the one connection - ";
+    tests++;
+    {
+	fcgiPool pool("/f/","./fcgi_fixture",1);
+	slow_arg args[4];
+	pthread_t tids[4];
+	double started=now();
+	for(size_t ctr=0;ctr<4;ctr++){
+	    args[ctr].pool=&pool;
+	    pthread_create(&tids[ctr],0,slow_request,&args[ctr]);
+	}
+	bool all=true;
+	for(size_t ctr=0;ctr<4;ctr++){
+	    pthread_join(tids[ctr],0);
+	    all=all && args[ctr].pid!=0 && args[ctr].pid==args[0].pid;
+	}
+	if(!all || now()-started>5){
+	    std::cout << "failed\n";
+	    failed++;
+	}else{
+	    std::cout << "passed\n";
+	    passed++;
+	}
+    }
+
+    std::cout << "test 2 - with two copies both get used - ";
+    tests++;
+    {
+	fcgiPool pool("/f/","./fcgi_fixture",2);
+	slow_arg args[2];
+	pthread_t tids[2];
+	for(size_t ctr=0;ctr<2;ctr++){
+	    args[ctr].pool=&pool;
+	    pthread_create(&tids[ctr],0,slow_request,&args[ctr]);
+	}
+	for(size_t ctr=0;ctr<2;ctr++){
+	    pthread_join(tids[ctr],0);
+	}
+	if(!args[0].pid || !args[1].pid || args[0].pid==args[1].pid){
+	    std::cout << "failed\n";
+	    failed++;
+	}else{
+	    std::cout << "passed\n";
+	    passed++;
+	}
+    }
+
+    std::cout << "test 3 - health checks go over the connection and leave a healthy app be - ";
+    tests++;
+    {
+	fcgiPool pool("/f/","./fcgi_fixture",1);
+	// once before it's ever been connected to, then with the connection
+	// a request left behind
+	pool.health_check();
+	int before=pid_of(exchange(pool,0,unavail));
+	for(size_t ctr=0;ctr<4;ctr++){
+	    pool.health_check();
+	}
+	std::string got=exchange(pool,0,unavail);
+	if(!before || unavail || pid_of(got)!=before
+		|| got.compare(0,17,"HTTP/1.1 200 OK\r\n")!=0){
+	    std::cout << "failed\n";
+	    failed++;
+	}else{
+	    std::cout << "passed\n";
+	    passed++;
+	}
+    }
+
+    std::cout << "test 4 - a dead app's restarted and its old connection dropped - ";
+    tests++;
+    {
+	fcgiPool pool("/f/","./fcgi_fixture",1);
+	int before=pid_of(exchange(pool,0,unavail));
+	kill(before,SIGKILL);
+	usleep(100000);
+	pool.health_check();
+	int after=pid_of(exchange(pool,0,unavail));
+	if(!before || unavail || !after || after==before){
+	    std::cout << "failed\n";
+	    failed++;
+	}else{
+	    std::cout << "passed\n";
+	    passed++;
+	}
+    }
+
+    std::cout << "test 5 - an app that dies partway through cuts the response off, no 500 after it - ";
+    tests++;
+    {
+	fcgiPool pool("/f/","./fcgi_fixture",1);
+	std::string got=exchange(pool,0,unavail,true);
+	if(unavail || got.compare(0,17,"HTTP/1.1 200 OK\r\n")!=0
+		|| got.find(" 500 ")!=std::string::npos || !pid_of(got)){
+	    std::cout << "failed\n";
+	    failed++;
+	}else{
+	    std::cout << "passed\n";
+	    passed++;
+	}
+    }
+
+    std::cout << "test 6 - a Proxy header doesn't become HTTP_PROXY - ";
+    tests++;
+    {
+	int fds[2];
+	socketpair(AF_UNIX,SOCK_STREAM,0,fds);
+	arena_scope scope;
+	header_map hdrs;
+	add_header(hdrs,"Host: example.com");
+	add_header(hdrs,"Proxy: http://evil.example:8080/");
+	add_header(hdrs,"X-Other: kept");
+	http_request_line hrl("GET /f/app HTTP/1.1",hdrs);
+	cgi_env env;
+	cgi_environment(env,fds[0],hrl,hdrs,"/f/app","/f/app");
+	close(fds[0]);
+	close(fds[1]);
+	if(env.count("HTTP_PROXY") || env["HTTP_X_OTHER"]!="kept" || env["HTTP_HOST"]!="example.com"){
+	    std::cout << "failed\n";
+	    failed++;
+	}else{
+	    std::cout << "passed\n";
+	    passed++;
+	}
+    }
+    std::cout << tests << " tests, passed: " << passed << ", failed: " << failed << '\n';
+
+    return 0;
+}
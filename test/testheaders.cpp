@@ -0,0 +1,106 @@
+#include "../http.h"
+#include <iostream>
+
+int
+main()
+{
+    size_t tests=0,passed=0,failed=0;
+    arena_scope scope;
+
+    std::cout << "test 1 - header lines go in the map by name - ";
+    tests++;
+    {
+	header_map hdrs;
+	bool all=add_header(hdrs,"Host: example.com") && add_header(hdrs,"X-Empty:")
+	    && add_header(hdrs,"X-Tight:value") && !add_header(hdrs,"no colon here")
+	    && !add_header(hdrs,": no name");
+	all=all && hdrs["Host"]=="example.com" && hdrs["X-Empty"]==""
+	    && hdrs["X-Tight"]=="value" && hdrs.size()==3;
+	if(!all){
+	    std::cout << "failed\n";
+	    failed++;
+	}else{
+	    std::cout << "passed\n";
+	    passed++;
+	}
+    }
+
+    std::cout << "test 2 - a client can't say where the DOCUMENT_ROOT is - ";
+    tests++;
+    {
+	header_map hdrs;
+	hdrs["DOCUMENT_ROOT"]="/home/patrick/public_html";
+	bool all=!add_header(hdrs,"DOCUMENT_ROOT: /usr/lib")
+	    && !add_header(hdrs,"document_root: /usr/lib")
+	    && !add_header(hdrs,"Document_Root:/usr/lib");
+	if(!all || hdrs.size()!=1 || hdrs["DOCUMENT_ROOT"]!="/home/patrick/public_html"){
+	    std::cout << "failed\n";
+	    failed++;
+	}else{
+	    std::cout << "passed\n";
+	    passed++;
+	}
+    }
+    std::cout << "test 3 - etags match weakly or strongly - ";
+    tests++;
+    {
+	bool all=etag_matches("\"a\", \"b\"","\"b\"",false)
+	    && !etag_matches("\"a\", \"b\"","\"c\"",false)
+	    && etag_matches("*","\"c\"",false)
+	    && etag_matches("W/\"a\"","\"a\"",true)
+	    && etag_matches("\"a\"","W/\"a\"",true)
+	    && !etag_matches("W/\"a\"","\"a\"",false)
+	    && !etag_matches("\"a\"","W/\"a\"",false);
+	if(!all){
+	    std::cout << "failed\n";
+	    failed++;
+	}else{
+	    std::cout << "passed\n";
+	    passed++;
+	}
+    }
+
+    std::cout << "test 4 - If-None-Match wins over If-Modified-Since - ";
+    tests++;
+    {
+	time_t lastmod=784111777;	// Sun, 06 Nov 1994 08:49:37 GMT
+	header_map none,newer,older,both,tagged;
+	add_header(newer,"If-Modified-Since: Sun, 06 Nov 1994 08:49:37 GMT");
+	add_header(older,"If-Modified-Since: Sun, 06 Nov 1994 08:49:36 GMT");
+	add_header(both,"If-Modified-Since: Sun, 06 Nov 1994 08:49:37 GMT");
+	add_header(both,"If-None-Match: \"other\"");
+	add_header(tagged,"If-None-Match: W/\"x\", \"tag\"");
+	bool all=!not_modified(none,"\"tag\"",lastmod)
+	    && not_modified(newer,"\"tag\"",lastmod)
+	    && !not_modified(older,"\"tag\"",lastmod)
+	    && !not_modified(both,"\"tag\"",lastmod)
+	    && not_modified(tagged,"\"tag\"",lastmod)
+	    && not_modified(tagged,"W/\"x\"",lastmod);
+	if(!all){
+	    std::cout << "failed\n";
+	    failed++;
+	}else{
+	    std::cout << "passed\n";
+	    passed++;
+	}
+    }
+    std::cout << "test 5 - names don't care about case, and repeats are joined - ";
+    tests++;
+    {
+	header_map hdrs;
+	add_header(hdrs,"content-length: 5");
+	add_header(hdrs,"Content-Length: 10");
+	add_header(hdrs,"ACCEPT: text/html");
+	if(hdrs.size()!=2 || hdrs["Content-Length"]!="5, 10"
+		|| hdrs.find("Accept")==hdrs.end() || hdrs["accept"]!="text/html"){
+	    std::cout << "failed\n";
+	    failed++;
+	}else{
+	    std::cout << "passed\n";
+	    passed++;
+	}
+    }
+    std::cout << tests << " tests, passed: " << passed << ", failed: " << failed << '\n';
+
+    return 0;
+}
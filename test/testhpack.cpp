@@ -0,0 +1,209 @@
+#include "../hpack.h"
+#include <iostream>
+#include <string>
+
+// hex, spaces allowed, to bytes
+std::string
+unhex(const char *hex)
+{
+    std::string out;
+    int half=-1;
+    for(;*hex;hex++){
+	if(*hex==' '){
+	    continue;
+	}
+	int v=*hex<='9'?*hex-'0':*hex-'a'+10;
+	if(half<0){
+	    half=v;
+	}else{
+	    out+=static_cast<char>(half<<4|v);
+	    half=-1;
+	}
+    }
+    return out;
+}
+
+bool
+decodes(hpackDecoder& dec,const std::string& block,header_list& fields)
+{
+    fields.clear();
+    return dec.decode(reinterpret_cast<const uint8_t*>(block.data()),block.size(),fields);
+}
+
+bool
+same(const header_list& fields,const char *const *want,size_t count)
+{
+    if(fields.size()!=count){
+	return false;
+    }
+    for(size_t idx=0;idx<count;idx++){
+	if(fields[idx].name!=want[2*idx] || fields[idx].value!=want[2*idx+1]){
+	    return false;
+	}
+    }
+    return true;
+}
+
+// the three requests of RFC 7541 C.3 and C.4
+const char *req1[]={":method","GET",":scheme","http",":path","/",
+    ":authority","www.example.com"};
+const char *req2[]={":method","GET",":scheme","http",":path","/",
+    ":authority","www.example.com","cache-control","no-cache"};
+const char *req3[]={":method","GET",":scheme","https",":path","/index.html",
+    ":authority","www.example.com","custom-key","custom-value"};
+
+header_list
+make_list(const char *const *fields,size_t count)
+{
+    header_list list;
+    for(size_t idx=0;idx<count;idx++){
+	list.push_back(header_field(fields[2*idx],fields[2*idx+1]));
+    }
+    return list;
+}
+
+int
+main()
+{
+    size_t tests=0,passed=0,failed=0;
+    header_list got;
+
+    std::cout << "test 1 - Huffman codes round trip and bad padding's caught - ";
+    tests++;
+    std::string all,coded,back;
+    for(int c=0;c<256;c++){
+	all+=static_cast<char>(c);
+    }
+    huffman_encode(all,coded);
+    bool ok=coded.size()==huffman_length(all)
+	&& huffman_decode(reinterpret_cast<const uint8_t*>(coded.data()),coded.size(),back)
+	&& back==all;
+    coded.clear();
+    huffman_encode("www.example.com",coded);
+    ok=ok && coded==unhex("f1e3 c2e5 f23a 6ba0 ab90 f4ff");
+    // a whole byte of padding, and padding that isn't all 1s
+    std::string pad=unhex("f1e3 c2e5 f23a 6ba0 ab90 f4ff ff"),zero=unhex("f1e3 c2e5 f23a 6ba0 ab90 f4fe");
+    back.clear();
+    ok=ok && !huffman_decode(reinterpret_cast<const uint8_t*>(pad.data()),pad.size(),back);
+    back.clear();
+    ok=ok && !huffman_decode(reinterpret_cast<const uint8_t*>(zero.data()),zero.size(),back);
+    if(!ok){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+
+    std::cout << "test 2 - RFC 7541 C.3, literals and the dynamic table - ";
+    tests++;
+    hpackDecoder plain;
+    ok=decodes(plain,unhex("8286 8441 0f77 7777 2e65 7861 6d70 6c65 2e63 6f6d"),got)
+	&& same(got,req1,4)
+	&& decodes(plain,unhex("8286 84be 5808 6e6f 2d63 6163 6865"),got)
+	&& same(got,req2,5)
+	&& decodes(plain,unhex("8287 85bf 400a 6375 7374 6f6d 2d6b 6579 0c63 7573 746f 6d2d 7661 6c75 65"),got)
+	&& same(got,req3,5);
+    if(!ok){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+
+    std::cout << "test 3 - RFC 7541 C.4, Huffman both ways - ";
+    tests++;
+    const char *c4[]={"8286 8441 8cf1 e3c2 e5f2 3a6b a0ab 90f4 ff",
+	"8286 84be 5886 a8eb 1064 9cbf",
+	"8287 85bf 4088 25a8 49e9 5ba9 7d7f 8925 a849 e95b b8e8 b4bf"};
+    const char *const *reqs[]={req1,req2,req3};
+    size_t counts[]={4,5,5};
+    hpackDecoder huff;
+    hpackEncoder enc;
+    ok=true;
+    for(int idx=0;idx<3;idx++){
+	std::string out;
+	enc.encode(make_list(reqs[idx],counts[idx]),out);
+	ok=ok && out==unhex(c4[idx])
+	    && decodes(huff,unhex(c4[idx]),got) && same(got,reqs[idx],counts[idx]);
+    }
+    if(!ok){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+
+    std::cout << "test 4 - eviction, size updates and bad indexes - ";
+    tests++;
+    hpackTable table;
+    table.set_max_size(100);
+    table.add(header_field("aaaa","1111"));	    // 40 each
+    table.add(header_field("bbbb","2222"));
+    table.add(header_field("cccc","3333"));
+    ok=table.count()==2 && table.at(0).name=="cccc" && table.at(1).name=="bbbb";
+    table.add(header_field(std::string(100,'x'),""));
+    ok=ok && table.count()==0;
+    hpackDecoder small(256);
+    // size update past what we allowed, one after a field, one to 0 that
+    // empties the table so 62 isn't there any more
+    ok=ok && !decodes(small,unhex("3fe2 01"),got)
+	&& !decodes(small,unhex("823f e101"),got);
+    hpackDecoder gone(256);
+    ok=ok && decodes(gone,unhex("4003 6162 6303 7879 7a"),got)
+	&& decodes(gone,unhex("be"),got) && got.size()==1 && got[0].value=="xyz"
+	&& !decodes(gone,unhex("20be"),got)
+	&& !decodes(gone,unhex("80"),got)
+	&& !decodes(gone,unhex("ff ffff ffff ff"),got);
+    // 62 again and again is a lot more than 100 bytes
+    hpackDecoder bomb(4096,100);
+    ok=ok && decodes(bomb,unhex("4003 6162 6303 7879 7a"),got)
+	&& !decodes(bomb,unhex("bebe bebe"),got);
+    if(!ok){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+
+    std::cout << "test 5 - what we encode we decode, with a smaller table - ";
+    tests++;
+    hpackEncoder out_side;
+    hpackDecoder in_side;
+    ok=true;
+    for(int round=0;round<50;round++){
+	if(round==20){
+	    out_side.set_max_size(0);
+	}
+	header_list fields;
+	fields.push_back(header_field(":status",round%2?"200":"404"));
+	fields.push_back(header_field("content-length",std::to_string(round*37)));
+	fields.push_back(header_field("x-round",std::to_string(round%5)));
+	fields.push_back(header_field("set-cookie","id=secret"));
+	fields.push_back(header_field("x-long",std::string(round*10,'q')));
+	std::string block;
+	out_side.encode(fields,block);
+	header_list back;
+	if(!in_side.decode(reinterpret_cast<const uint8_t*>(block.data()),block.size(),back)
+		|| back.size()!=fields.size()){
+	    ok=false;
+	    break;
+	}
+	for(size_t idx=0;idx<fields.size();idx++){
+	    ok=ok && back[idx].name==fields[idx].name && back[idx].value==fields[idx].value;
+	}
+    }
+    if(!ok){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+    std::cout << tests << " tests, passed: " << passed << ", failed: " << failed << '\n';
+
+    return 0;
+}
@@ -0,0 +1,470 @@
+#include "../http2.h"
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cstdio>
+#include <iostream>
+#include <string>
+
+// The backends: a thread for each stream that reads the HTTP/1.1 request
+// we made of it and answers by its path.
+void *
+backend(void *arg)
+{
+    int fd=static_cast<int>(reinterpret_cast<long>(arg));
+    std::string req;
+    char buf[4096];
+    ssize_t n;
+    struct pollfd pfd;
+    pfd.fd=fd;
+    pfd.events=POLLIN;
+    // the whole request, to the end of a chunked body if it has one
+    while(req.find("\r\n\r\n")==std::string::npos
+	    || (req.find("Transfer-Encoding: chunked")!=std::string::npos && req.find("\r\n0\r\n\r\n")==std::string::npos)){
+	poll(&pfd,1,1000);
+	if((n=read(fd,buf,sizeof buf))<=0){
+	    break;
+	}
+	req.append(buf,n);
+    }
+    std::string resp;
+    if(req.compare(0,11,"GET /small ")==0){
+	resp="HTTP/1.1 200 OK\r\nContent-Length: 5\r\nConnection: close\r\n\r\nhello";
+    }else if(req.compare(0,13,"GET /chunked ")==0){
+	resp="HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\nConnection: close\r\n\r\n"
+	    "3\r\nabc\r\n3\r\ndef\r\n0\r\n\r\n";
+    }else if(req.compare(0,9,"GET /big ")==0){
+	resp="HTTP/1.1 200 OK\r\nContent-Length: 100000\r\n\r\n"+std::string(100000,'b');
+    }else if(req.compare(0,11,"POST /echo ")==0){
+	// what we were sent, so the test can see how it was framed
+	resp="HTTP/1.1 200 OK\r\n\r\n"+req;
+    }else{
+	resp="HTTP/1.1 404 Not Found\n\n";
+    }
+    size_t sent=0;
+    pfd.events=POLLOUT;
+    while(sent<resp.size()){
+	poll(&pfd,1,1000);
+	if((n=send(fd,resp.data()+sent,resp.size()-sent,MSG_NOSIGNAL))>0){
+	    sent+=n;
+	}else if(errno!=EAGAIN){
+	    break;
+	}
+    }
+    close(fd);
+    return 0;
+}
+
+bool
+dispatch(int fd)
+{
+    pthread_t tid;
+    if(pthread_create(&tid,0,backend,reinterpret_cast<void*>(static_cast<long>(fd)))!=0){
+	return false;
+    }
+    pthread_detach(tid);
+    return true;
+}
+
+// the server, on the other end of the client's socketpair
+void *
+server(void *arg)
+{
+    int fd=static_cast<int>(reinterpret_cast<long>(arg));
+    {
+	sockfdwrapper sfd(fd);
+	h2Connection h2(sfd,dispatch,2000);
+	h2.run(H2_PREFACE);
+    }
+    close(fd);
+    return 0;
+}
+
+// the client's end of one connection
+struct client
+{
+    client()
+    {
+	int fds[2];
+	socketpair(AF_UNIX,SOCK_STREAM,0,fds);
+	fd=fds[0];
+	pthread_create(&tid,0,server,reinterpret_cast<void*>(static_cast<long>(fds[1])));
+    };
+    ~client()
+    {
+	shutdown(fd,SHUT_RDWR);
+	pthread_join(tid,0);
+	close(fd);
+    };
+    void send(const std::string& s){ ::send(fd,s.data(),s.size(),MSG_NOSIGNAL); };
+    void frame(uint8_t type,uint8_t flags,uint32_t stream,const std::string& payload)
+    {
+	std::string f;
+	h2_put_frame_header(f,payload.size(),type,flags,stream);
+	send(f+payload);
+    };
+    void get(uint32_t stream,const char *path)
+    {
+	header_list fields;
+	fields.push_back(header_field(":method","GET"));
+	fields.push_back(header_field(":scheme","http"));
+	fields.push_back(header_field(":path",path));
+	fields.push_back(header_field(":authority","test"));
+	std::string block;
+	encoder.encode(fields,block);
+	frame(H2_HEADERS,H2_END_HEADERS|H2_END_STREAM,stream,block);
+    };
+    // the next frame, false if there isn't one within a second
+    bool next(h2_frame_header& fh,std::string& payload)
+    {
+	while(in.size()<H2_FRAME_HEADER_LEN
+		|| in.size()<H2_FRAME_HEADER_LEN+h2_parse_frame_header(
+		    reinterpret_cast<const uint8_t*>(in.data())).length){
+	    struct pollfd pfd;
+	    pfd.fd=fd;
+	    pfd.events=POLLIN;
+	    char buf[16384];
+	    ssize_t n;
+	    if(poll(&pfd,1,1000)<=0 || (n=read(fd,buf,sizeof buf))<=0){
+		return false;
+	    }
+	    in.append(buf,n);
+	}
+	fh=h2_parse_frame_header(reinterpret_cast<const uint8_t*>(in.data()));
+	payload=in.substr(H2_FRAME_HEADER_LEN,fh.length);
+	in.erase(0,H2_FRAME_HEADER_LEN+fh.length);
+	return true;
+    };
+    int fd;
+    pthread_t tid;
+    std::string in;
+    hpackEncoder encoder;
+    hpackDecoder decoder;
+};
+
+std::string
+setting(uint16_t id,uint32_t value)
+{
+    std::string s;
+    h2_put_setting(s,id,value);
+    return s;
+}
+
+std::string
+be32(uint32_t value)
+{
+    std::string s;
+    h2_put32(s,value);
+    return s;
+}
+
+// each stream's :status and body, the order DATA came in, and whether
+// streams were ended or reset, till every stream in want has ended or
+// nothing's coming
+struct responses
+{
+    std::map<uint32_t,std::string> status,body;
+    std::map<uint32_t,uint32_t> reset;
+    std::vector<uint32_t> order;
+    size_t ended;
+    uint32_t goaway;
+    responses():ended(0),goaway(0xffffffff){};
+    void read(client& c,size_t want)
+    {
+	h2_frame_header fh;
+	std::string p;
+	while(ended<want && c.next(fh,p)){
+	    if(fh.type==H2_HEADERS){
+		header_list fields;
+		c.decoder.decode(reinterpret_cast<const uint8_t*>(p.data()),p.size(),fields);
+		status[fh.stream]=fields.empty()?"":fields[0].value;
+	    }else if(fh.type==H2_DATA){
+		body[fh.stream]+=p;
+		if(!p.empty()){
+		    order.push_back(fh.stream);
+		}
+	    }else if(fh.type==H2_RST_STREAM){
+		reset[fh.stream]=h2_get32(reinterpret_cast<const uint8_t*>(p.data()));
+		ended++;
+	    }else if(fh.type==H2_GOAWAY){
+		goaway=h2_get32(reinterpret_cast<const uint8_t*>(p.data()+4));
+		return;
+	    }
+	    if((fh.type==H2_HEADERS || fh.type==H2_DATA) && (fh.flags&H2_END_STREAM)){
+		ended++;
+	    }
+	}
+    };
+};
+
+int
+main()
+{
+    size_t tests=0,passed=0,failed=0;
+    h2Connection::set_limit(100);
+    for(int ctr=0;ctr<9;ctr++){
+	h2Connection::reserve();
+    }
+    h2_frame_header fh;
+    std::string p;
+
+    std::cout << "test 1 - settings first, then acks and pings answered - ";
+    tests++;
+    {
+	client c;
+	c.send(H2_PREFACE);
+	c.frame(H2_SETTINGS,0,0,"");
+	c.frame(H2_PING,0,0,"12345678");
+	bool ok=c.next(fh,p) && fh.type==H2_SETTINGS && fh.flags==0
+	    && p.find(setting(H2_SETTINGS_MAX_CONCURRENT_STREAMS,32))!=std::string::npos;
+	bool acked=false,ponged=false;
+	while(c.next(fh,p) && !(acked && ponged)){
+	    acked=acked || (fh.type==H2_SETTINGS && fh.flags==H2_ACK);
+	    ponged=ponged || (fh.type==H2_PING && fh.flags==H2_ACK && p=="12345678");
+	}
+	if(!ok || !acked || !ponged){
+	    std::cout << "failed\n";
+	    failed++;
+	}else{
+	    std::cout << "passed\n";
+	    passed++;
+	}
+    }
+
+    std::cout << "test 2 - streams at once, lengths and chunks and 404s - ";
+    tests++;
+    {
+	client c;
+	c.send(H2_PREFACE);
+	c.frame(H2_SETTINGS,0,0,"");
+	c.get(1,"/small");
+	c.get(3,"/chunked");
+	c.get(5,"/nothing");
+	responses r;
+	r.read(c,3);
+	if(r.ended!=3 || r.status[1]!="200" || r.body[1]!="hello"
+		|| r.status[3]!="200" || r.body[3]!="abcdef"
+		|| r.status[5]!="404" || !r.body[5].empty()){
+	    std::cout << "failed\n";
+	    failed++;
+	}else{
+	    std::cout << "passed\n";
+	    passed++;
+	}
+    }
+
+    std::cout << "test 3 - no more DATA than their windows let us send - ";
+    tests++;
+    {
+	client c;
+	c.send(H2_PREFACE);
+	c.frame(H2_SETTINGS,0,0,setting(H2_SETTINGS_INITIAL_WINDOW_SIZE,1000));
+	c.get(1,"/big");
+	responses r;
+	r.read(c,1);
+	bool held=r.ended==0 && r.body[1].size()==1000;
+	c.frame(H2_WINDOW_UPDATE,0,1,be32(200000));
+	r.read(c,1);
+	// 65535 is all the connection's window lets through
+	bool conn=r.ended==0 && r.body[1].size()==65535;
+	c.frame(H2_WINDOW_UPDATE,0,0,be32(100000));
+	r.read(c,1);
+	if(!held || !conn || r.ended!=1 || r.body[1]!=std::string(100000,'b')){
+	    std::cout << "failed\n";
+	    failed++;
+	}else{
+	    std::cout << "passed\n";
+	    passed++;
+	}
+    }
+
+    std::cout << "test 4 - a body without a length is chunked for the backend - ";
+    tests++;
+    {
+	client c;
+	c.send(H2_PREFACE);
+	c.frame(H2_SETTINGS,0,0,"");
+	header_list fields;
+	fields.push_back(header_field(":method","POST"));
+	fields.push_back(header_field(":scheme","http"));
+	fields.push_back(header_field(":path","/echo"));
+	fields.push_back(header_field("content-type","text/plain"));
+	fields.push_back(header_field("cookie","a=1"));
+	fields.push_back(header_field("cookie","b=2"));
+	std::string block;
+	c.encoder.encode(fields,block);
+	c.frame(H2_HEADERS,H2_END_HEADERS,1,block);
+	c.frame(H2_DATA,0,1,"hello ");
+	c.frame(H2_DATA,H2_END_STREAM,1,"there");
+	responses r;
+	r.read(c,1);
+	const std::string& got=r.body[1];
+	if(r.ended!=1 || got.find("Transfer-Encoding: chunked\r\n")==std::string::npos
+		|| got.find("Content-Type: text/plain\r\n")==std::string::npos
+		|| got.find("Cookie: a=1; b=2\r\n")==std::string::npos
+		|| got.find("6\r\nhello \r\n5\r\nthere\r\n0\r\n\r\n")==std::string::npos){
+	    std::cout << "failed\n";
+	    failed++;
+	}else{
+	    std::cout << "passed\n";
+	    passed++;
+	}
+    }
+
+    std::cout << "test 5 - a stream waits on what it depends on, siblings share by weight - ";
+    tests++;
+    {
+	client c;
+	c.send(H2_PREFACE);
+	// nothing can go till we open the windows, so everything's waiting
+	// when the scheduler first gets to choose
+	c.frame(H2_SETTINGS,0,0,setting(H2_SETTINGS_INITIAL_WINDOW_SIZE,0));
+	c.frame(H2_WINDOW_UPDATE,0,0,be32(1000000));
+	c.get(1,"/big");
+	c.get(3,"/big");
+	c.get(5,"/big");
+	// 3 on 1, and 5 next to 1 with much less weight
+	c.frame(H2_PRIORITY,0,3,be32(1)+std::string(1,'\xff'));
+	c.frame(H2_PRIORITY,0,5,be32(0)+std::string(1,'\x0f'));
+	c.frame(H2_PRIORITY,0,1,be32(0)+std::string(1,'\xff'));
+	responses r;
+	r.read(c,0);
+	usleep(200000);
+	c.frame(H2_WINDOW_UPDATE,0,1,be32(200000));
+	c.frame(H2_WINDOW_UPDATE,0,3,be32(200000));
+	c.frame(H2_WINDOW_UPDATE,0,5,be32(200000));
+	r.read(c,3);
+	// none of 3 till 1's done, and 1 gets 16 times what 5 does
+	size_t first3=0,fives=0,ones=0;
+	while(first3<r.order.size() && r.order[first3]!=3){
+	    first3++;
+	}
+	for(size_t idx=0;idx<first3;idx++){
+	    (r.order[idx]==1?ones:fives)++;
+	}
+	if(r.ended!=3 || ones!=7 || fives>2 || r.body[3].size()!=100000){
+	    std::cout << "failed\n";
+	    failed++;
+	}else{
+	    std::cout << "passed\n";
+	    passed++;
+	}
+    }
+
+    std::cout << "test 6 - a broken preface or header block ends the connection - ";
+    tests++;
+    {
+	client bad_preface;
+	bad_preface.send("GET / HTTP/1.1\r\n\r\nxxxxxx");
+	responses r1;
+	r1.read(bad_preface,1);
+	client bad_block;
+	bad_block.send(H2_PREFACE);
+	bad_block.frame(H2_SETTINGS,0,0,"");
+	bad_block.frame(H2_HEADERS,H2_END_HEADERS|H2_END_STREAM,1,"\xff\xff\xff\xff\xff");
+	responses r2;
+	r2.read(bad_block,1);
+	client even;
+	even.send(H2_PREFACE);
+	even.get(2,"/small");
+	responses r3;
+	r3.read(even,1);
+	if(r1.goaway!=H2_PROTOCOL_ERROR || r2.goaway!=H2_COMPRESSION_ERROR
+		|| r3.goaway!=H2_PROTOCOL_ERROR){
+	    std::cout << "failed\n";
+	    failed++;
+	}else{
+	    std::cout << "passed\n";
+	    passed++;
+	}
+    }
+
+    std::cout << "test 7 - DATA has to add up to the content-length - ";
+    tests++;
+    {
+	client c;
+	c.send(H2_PREFACE);
+	c.frame(H2_SETTINGS,0,0,"");
+	const char *lengths[][2]={ { "5", 0 }, { "10", 0 }, { "5", "6" }, { "5", "5" }, { "5x", 0 } };
+	for(uint32_t idx=0;idx<5;idx++){
+	    header_list fields;
+	    fields.push_back(header_field(":method","POST"));
+	    fields.push_back(header_field(":scheme","http"));
+	    fields.push_back(header_field(":path","/echo"));
+	    fields.push_back(header_field("content-length",lengths[idx][0]));
+	    if(lengths[idx][1]){
+		fields.push_back(header_field("content-length",lengths[idx][1]));
+	    }
+	    std::string block;
+	    c.encoder.encode(fields,block);
+	    c.frame(H2_HEADERS,H2_END_HEADERS,idx*2+1,block);
+	}
+	// too much, too little, then the one that's right
+	c.frame(H2_DATA,H2_END_STREAM,1,"hello there");
+	c.frame(H2_DATA,H2_END_STREAM,3,"hi");
+	c.frame(H2_DATA,H2_END_STREAM,7,"hello");
+	responses r;
+	r.read(c,5);
+	const std::string& got=r.body[7];
+	size_t at=got.find("Content-Length: 5\r\n");
+	if(r.reset[1]!=H2_PROTOCOL_ERROR || r.reset[3]!=H2_PROTOCOL_ERROR
+		|| r.reset[5]!=H2_PROTOCOL_ERROR || r.reset[9]!=H2_PROTOCOL_ERROR
+		|| r.status[7]!="200" || r.reset.count(7)
+		|| at==std::string::npos || got.find("Content-Length",at+1)!=std::string::npos){
+	    std::cout << "failed\n";
+	    failed++;
+	}else{
+	    std::cout << "passed\n";
+	    passed++;
+	}
+    }
+
+    std::cout << "test 8 - streams past the limit for all connections are refused - ";
+    tests++;
+    {
+	h2Connection::set_limit(100,2);
+	client c;
+	c.send(H2_PREFACE);
+	c.frame(H2_SETTINGS,0,0,"");
+	header_list fields;
+	fields.push_back(header_field(":method","POST"));
+	fields.push_back(header_field(":scheme","http"));
+	fields.push_back(header_field(":path","/echo"));
+	std::string block;
+	client other;
+	other.send(H2_PREFACE);
+	other.frame(H2_SETTINGS,0,0,"");
+	other.encoder.encode(fields,block);
+	other.frame(H2_HEADERS,H2_END_HEADERS,1,block);
+	// the other connection's server thread has to have taken it first
+	usleep(100000);
+	c.encoder.encode(fields,block="");
+	c.frame(H2_HEADERS,H2_END_HEADERS,1,block);
+	// both of those are waiting on their bodies, so there's no room
+	c.get(3,"/small");
+	responses refused;
+	refused.read(c,1);
+	c.frame(H2_DATA,H2_END_STREAM,1,"");
+	other.frame(H2_DATA,H2_END_STREAM,1,"");
+	responses first,second;
+	first.read(c,1);
+	second.read(other,1);
+	// and once they're done there is
+	c.get(5,"/small");
+	responses after;
+	after.read(c,1);
+	h2Connection::set_limit(100);
+	if(refused.reset[3]!=H2_REFUSED_STREAM || first.status[1]!="200"
+		|| second.status[1]!="200" || after.body[5]!="hello"){
+	    std::cout << "failed\n";
+	    failed++;
+	}else{
+	    std::cout << "passed\n";
+	    passed++;
+	}
+    }
+    std::cout << tests << " tests, passed: " << passed << ", failed: " << failed << '\n';
+
+    return 0;
+}
@@ -0,0 +1,156 @@
+#include "../jobQueue.h"
+#include <iostream>
+#include <unistd.h>
+
+int
+main()
+{
+    size_t tests=0,passed=0,failed=0;
+    bool shed;
+
+    std::cout << "test 1 - try_push stops at maxdepth - ";
+    tests++;
+    jobQueue<int> a;
+    a.set_limits(3,10,100);
+    if(!a.try_push(1) || !a.try_push(2) || !a.try_push(3) || a.try_push(4)){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+    tests++;
+    std::cout << "test 2 - room again after a pop - ";
+    if(a.wait_and_pop(shed)!=1 || shed || !a.try_push(4)){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+    tests++;
+    std::cout << "test 3 - head waiting past interval means overloaded - ";
+    jobQueue<int> b;
+    b.set_limits(0,10,50);
+    b.try_push(1);
+    usleep(60000);
+    if(b.try_push(2) || !b.is_overloaded()){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+    tests++;
+    std::cout << "test 4 - overloaded pop of a job older than interval is shed - ";
+    if(b.wait_and_pop(shed)!=1 || !shed){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+    tests++;
+    std::cout << "test 5 - quick jobs for an interval clear overload - ";
+    for(int ctr=0;ctr<10;ctr++){
+	b.push(ctr);
+	b.wait_and_pop(shed);
+	usleep(10000);
+    }
+    if(b.is_overloaded() || !b.try_push(1)){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+    tests++;
+    std::cout << "test 6 - more urgent class goes first - ";
+    jobQueue<int> c;
+    unsigned cls;
+    c.push(1,2);
+    c.push(2,1);
+    c.push(3,0);
+    int first=c.wait_and_pop(shed,cls);
+    unsigned firstcls=cls;
+    int second=c.wait_and_pop(shed,cls);
+    int third=c.wait_and_pop(shed,cls);
+    if(first!=3 || firstcls!=0 || second!=2 || third!=1){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+    c.done(0);
+    c.done(1);
+    c.done(2);
+    tests++;
+    std::cout << "test 7 - a job that's waited long enough ages past a more urgent one - ";
+    c.set_aging(20);
+    c.push(1,2);
+    usleep(50000);	    // two classes' worth of waiting
+    c.push(2,1);
+    if(c.wait_and_pop(shed,cls)!=1 || cls!=2){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+    c.done(cls);
+    c.wait_and_pop(shed,cls);
+    c.done(cls);
+    tests++;
+    std::cout << "test 8 - a class at its limit is passed over until done() - ";
+    c.set_aging(10000);
+    c.set_class_limit(0,1);
+    c.push(1,0);
+    c.push(2,0);
+    c.push(3,2);
+    int one=c.wait_and_pop(shed,cls);
+    int two=c.wait_and_pop(shed,cls);
+    bool blocked=false;
+    try{
+	c.pop();
+    }catch(const job_queue_empty&){
+	blocked=true;
+    }
+    c.done(0);
+    int three=c.pop();
+    if(one!=1 || two!=3 || !blocked || three!=2){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+    tests++;
+    std::cout << "test 9 - waiting on a class's own limit isn't overload - ";
+    jobQueue<int> d;
+    d.set_limits(0,10,50);
+    d.set_class_limit(2,1);
+    d.push(1,2);
+    d.push(2,2);
+    unsigned first_cls;
+    d.wait_and_pop(shed,first_cls);
+    // 2 sits behind its limit for two intervals
+    usleep(100000);
+    bool admitted=d.try_push(3,0) && d.try_push(4,2);
+    bool calm=!d.is_overloaded();
+    d.wait_and_pop(shed,cls);
+    d.done(cls);
+    d.done(first_cls);
+    bool shed_two=true;
+    int got=d.wait_and_pop(shed_two,cls);
+    if(!admitted || !calm || got!=2 || shed_two || d.is_overloaded()){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+    std::cout << tests << " tests, passed: " << passed << ", failed: " << failed << '\n';
+
+    return 0;
+}
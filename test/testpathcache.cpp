@@ -0,0 +1,226 @@
+#include "../pathcache.h"
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static path_resolution
+found(const std::string& target)
+{
+    path_resolution res;
+    res.kind=res_file;
+    res.target=target;
+    res.etag="\"1\"";
+    res.lastmod=0;
+    return res;
+}
+
+static void
+touch(const std::string& path)
+{
+    close(open(path.c_str(),O_CREAT|O_WRONLY,0644));
+}
+
+int
+main()
+{
+    size_t tests=0,passed=0,failed=0;
+    path_resolution res;
+    char top[]="/tmp/testpathcache.XXXXXX";
+    std::string dir=mkdtemp(top);
+    std::vector<std::string> watchdirs(1,dir),nofiles;
+
+    std::cout << "test 1 - what's inserted is found, and nothing else - ";
+    tests++;
+    {
+	pathCache cache;
+	cache.insert(1,found(dir+"/a"),watchdirs,nofiles,cache.generation());
+	if(!cache.lookup(1,res) || res.target!=dir+"/a" || cache.lookup(2,res)){
+	    std::cout << "failed\n";
+	    failed++;
+	}else{
+	    std::cout << "passed\n";
+	    passed++;
+	}
+    }
+
+    std::cout << "test 2 - inserting a hot path again doesn't grow its dependents - ";
+    tests++;
+    {
+	pathCache cache;
+	std::vector<std::string> twice(2,dir);
+	for(size_t ctr=0;ctr<1000;ctr++){
+	    cache.insert(1,found(dir+"/a"),twice,nofiles,cache.generation());
+	}
+	if(cache.dependencies()!=1){
+	    std::cout << "failed\n";
+	    failed++;
+	}else{
+	    std::cout << "passed\n";
+	    passed++;
+	}
+    }
+
+    std::cout << "test 3 - an evicted entry's dependents go with it - ";
+    tests++;
+    {
+	// one entry a shard, and 1 and 17 share one
+	pathCache cache(60,2,16);
+	cache.insert(1,found(dir+"/a"),watchdirs,nofiles,cache.generation());
+	cache.insert(17,found(dir+"/b"),watchdirs,nofiles,cache.generation());
+	if(cache.dependencies()!=1 || cache.lookup(1,res) || !cache.lookup(17,res)){
+	    std::cout << "failed\n";
+	    failed++;
+	}else{
+	    std::cout << "passed\n";
+	    passed++;
+	}
+    }
+
+    std::cout << "test 4 - a new file in the directory drops what depends on it - ";
+    tests++;
+    {
+	pathCache cache;
+	cache.insert(1,found(dir+"/a"),watchdirs,nofiles,cache.generation());
+	touch(dir+"/new");
+	usleep(100000);
+	if(cache.lookup(1,res) || cache.dependencies()!=0){
+	    std::cout << "failed\n";
+	    failed++;
+	}else{
+	    std::cout << "passed\n";
+	    passed++;
+	}
+    }
+
+    std::cout << "test 5 - an answer found before a change isn't kept - ";
+    tests++;
+    {
+	pathCache cache;
+	// the watch has to be there already to see the change
+	cache.insert(2,found(dir+"/b"),watchdirs,nofiles,cache.generation());
+	unsigned long startgen=cache.generation();
+	touch(dir+"/newer");
+	usleep(100000);
+	cache.insert(1,found(dir+"/a"),watchdirs,nofiles,startgen);
+	if(cache.lookup(1,res)){
+	    std::cout << "failed\n";
+	    failed++;
+	}else{
+	    std::cout << "passed\n";
+	    passed++;
+	}
+    }
+    std::cout << "test 6 - writing a file only drops what was worked out from it - ";
+    tests++;
+    {
+	pathCache cache;
+	touch(dir+"/a");
+	touch(dir+"/b");
+	usleep(100000);
+	cache.insert(1,found(dir+"/a"),watchdirs,std::vector<std::string>(1,dir+"/a"),
+		cache.generation());
+	cache.insert(2,found(dir+"/b"),watchdirs,std::vector<std::string>(1,dir+"/b"),
+		cache.generation());
+	FILE *f=fopen((dir+"/a").c_str(),"w");
+	fputs("changed",f);
+	fclose(f);
+	usleep(100000);
+	if(cache.lookup(1,res) || !cache.lookup(2,res) || cache.dependencies()!=1){
+	    std::cout << "failed\n";
+	    failed++;
+	}else{
+	    std::cout << "passed\n";
+	    passed++;
+	}
+    }
+
+    std::cout << "test 7 - a file that's written and kept open drops nothing till it's closed - ";
+    tests++;
+    {
+	pathCache cache;
+	touch(dir+"/log");
+	usleep(100000);
+	cache.insert(1,found(dir+"/a"),watchdirs,std::vector<std::string>(1,dir+"/a"),
+		cache.generation());
+	cache.insert(2,found(dir+"/log"),watchdirs,std::vector<std::string>(1,dir+"/log"),
+		cache.generation());
+	int fd=open((dir+"/log").c_str(),O_WRONLY|O_APPEND);
+	for(size_t ctr=0;ctr<100;ctr++){
+	    write(fd,"a line\n",7);
+	}
+	usleep(100000);
+	unsigned long startgen=cache.generation();
+	cache.insert(3,found(dir+"/c"),watchdirs,nofiles,startgen);
+	bool all=cache.lookup(1,res) && cache.lookup(2,res) && cache.lookup(3,res);
+	close(fd);
+	usleep(100000);
+	all=all && cache.lookup(1,res) && !cache.lookup(2,res);
+	if(!all){
+	    std::cout << "failed\n";
+	    failed++;
+	}else{
+	    std::cout << "passed\n";
+	    passed++;
+	}
+    }
+
+    std::cout << "test 8 - misses for unknown paths are kept a short while, and only so many - ";
+    tests++;
+    {
+	pathCache cache(60,1,32);
+	cache.insert_miss("/nope");
+	bool all=cache.missed("/nope") && !cache.missed("/other");
+	char name[32];
+	for(size_t ctr=0;ctr<1000;ctr++){
+	    snprintf(name,sizeof name,"/scan%zu",ctr);
+	    cache.insert_miss(name);
+	}
+	size_t kept=0;
+	for(size_t ctr=0;ctr<1000;ctr++){
+	    snprintf(name,sizeof name,"/scan%zu",ctr);
+	    kept+=cache.missed(name)?1:0;
+	}
+	all=all && cache.missed(name) && kept<=32;
+	cache.insert_miss("/later");
+	sleep(2);
+	all=all && !cache.missed("/later");
+	if(!all){
+	    std::cout << "failed\n";
+	    failed++;
+	}else{
+	    std::cout << "passed\n";
+	    passed++;
+	}
+    }
+    std::cout << "test 9 - caches come and go while their directory's busy - ";
+    tests++;
+    {
+	bool all=true;
+	for(size_t ctr=0;ctr<200 && all;ctr++){
+	    pathCache cache;
+	    cache.insert(1,found(dir+"/busy"),watchdirs,nofiles,cache.generation());
+	    touch(dir+"/busy");
+	    unlink((dir+"/busy").c_str());
+	    // now and then give the watcher time to drop it, the rest of the
+	    // caches go away while it's still busy
+	    if(ctr%20==0){
+		usleep(10000);
+		all=!cache.lookup(1,res);
+	    }
+	}
+	if(!all){
+	    std::cout << "failed\n";
+	    failed++;
+	}else{
+	    std::cout << "passed\n";
+	    passed++;
+	}
+    }
+    std::cout << tests << " tests, passed: " << passed << ", failed: " << failed << '\n';
+    system(("rm -rf "+dir).c_str());
+
+    return 0;
+}
@@ -0,0 +1,187 @@
+#include "../pathintern.h"
+#include <pthread.h>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+struct normalize_case
+{
+    const char *raw;
+    path_status status;
+    const char *normal;
+};
+
+static pathIntern shared(100000);
+static const size_t PER_THREAD=2000;
+
+void *
+intern_some(void *voidids)
+{
+    std::vector<uint32_t> *ids=static_cast<std::vector<uint32_t>*>(voidids);
+    for(size_t ctr=0;ctr<PER_THREAD;ctr++){
+	std::ostringstream path;
+	path << "/dir" << ctr%50 << "/file" << ctr;
+	ids->push_back(shared.intern(path.str()));
+    }
+    return 0;
+}
+
+int
+main()
+{
+    size_t tests=0,passed=0,failed=0;
+
+    std::cout << "test 1 - paths that name the same file normalize the same - ";
+    tests++;
+    normalize_case cases[]={
+	{"/a/b.css",path_ok,"/a/b.css"},
+	{"/a//b.css",path_ok,"/a/b.css"},
+	{"/a/./b.css",path_ok,"/a/b.css"},
+	{"/%61/b.css",path_ok,"/a/b.css"},
+	{"/a/c/../b.css",path_ok,"/a/b.css"},
+	{"/a/c/%2e%2E/b.css",path_ok,"/a/b.css"},
+	{"http://example.com/a/b.css",path_ok,"/a/b.css"},
+	{"/",path_ok,"/"},
+	{"//",path_ok,"/"},
+	{"/sub/",path_ok,"/sub/"},
+	{"/sub/.",path_ok,"/sub/"},
+	{"/sub/x/..",path_ok,"/sub/"},
+	{"/my%20file.html",path_ok,"/my file.html"},
+	{"http://example.com",path_ok,"/"},
+    };
+    bool all=true;
+    for(size_t ctr=0;ctr<sizeof cases/sizeof cases[0];ctr++){
+	std::string out;
+	if(normalize_path(cases[ctr].raw,out)!=cases[ctr].status || out!=cases[ctr].normal){
+	    std::cout << cases[ctr].raw << " gave " << out << ' ';
+	    all=false;
+	}
+    }
+    if(!all){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+
+    std::cout << "test 2 - paths we won't look up are turned down - ";
+    tests++;
+    normalize_case bad[]={
+	{"/..",path_above_root,""},
+	{"/a/../..",path_above_root,""},
+	{"/a/../../etc/passwd",path_above_root,""},
+	{"/%2e%2e/etc/passwd",path_above_root,""},
+	{"/a%2fb",path_bad_escape,""},
+	{"/a%00b",path_bad_escape,""},
+	{"/a%0d%0ab",path_bad_escape,""},
+	{"/a%1fb",path_bad_escape,""},
+	{"/a%7Fb",path_bad_escape,""},
+	{"/a%4",path_bad_escape,""},
+	{"/a%zz",path_bad_escape,""},
+	{"a/b",path_not_path,""},
+	{"*",path_not_path,""},
+	{"/a\tb",path_not_path,""},
+    };
+    all=true;
+    for(size_t ctr=0;ctr<sizeof bad/sizeof bad[0];ctr++){
+	std::string out;
+	if(normalize_path(bad[ctr].raw,out)!=bad[ctr].status){
+	    std::cout << bad[ctr].raw << ' ';
+	    all=false;
+	}
+    }
+    if(!all){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+
+    std::cout << "test 3 - encode_path undoes the decoding - ";
+    tests++;
+    std::string back;
+    std::string encoded=encode_path("/my file/100%/a+b.html");
+    if(encoded!="/my%20file/100%25/a+b.html"
+	    || normalize_path(encoded,back)!=path_ok || back!="/my file/100%/a+b.html"){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+
+    std::cout << "test 4 - a path gets the same id every time, and back - ";
+    tests++;
+    pathIntern ids(3);
+    uint32_t a=ids.intern("/a"),b=ids.intern("/b"),again=ids.intern("/a");
+    if(a==pathIntern::NO_ID || b==pathIntern::NO_ID || a==b || again!=a
+	    || ids.path(a)!="/a" || ids.path(b)!="/b" || ids.find("/c")!=pathIntern::NO_ID
+	    || ids.size()!=2){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+
+    std::cout << "test 5 - once it's full new paths get NO_ID, old ones still work - ";
+    tests++;
+    uint32_t c=ids.intern("/c"),d=ids.intern("/d");
+    if(c==pathIntern::NO_ID || d!=pathIntern::NO_ID || ids.intern("/a")!=a
+	    || ids.size()!=3){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+
+    std::cout << "test 6 - paths past maxbytes get NO_ID, old ones still work - ";
+    tests++;
+    pathIntern small(100,8);
+    uint32_t first=small.intern("/abcde"),second=small.intern("/fghij");
+    uint32_t third=small.intern("/k");
+    if(first==pathIntern::NO_ID || second!=pathIntern::NO_ID
+	    || third==pathIntern::NO_ID || small.intern("/abcde")!=first
+	    || small.bytes_used()!=8 || small.intern("/l")!=pathIntern::NO_ID){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+
+    std::cout << "test 7 - threads interning the same paths get the same ids - ";
+    tests++;
+    const size_t NTHREADS=4;
+    pthread_t tids[NTHREADS];
+    std::vector<uint32_t> got[NTHREADS];
+    for(size_t ctr=0;ctr<NTHREADS;ctr++){
+	pthread_create(&tids[ctr],0,intern_some,&got[ctr]);
+    }
+    for(size_t ctr=0;ctr<NTHREADS;ctr++){
+	pthread_join(tids[ctr],0);
+    }
+    all=shared.size()==PER_THREAD;
+    for(size_t ctr=1;ctr<NTHREADS;ctr++){
+	all=all && got[ctr]==got[0];
+    }
+    for(size_t ctr=0;all && ctr<PER_THREAD;ctr++){
+	std::ostringstream path;
+	path << "/dir" << ctr%50 << "/file" << ctr;
+	all=got[0][ctr]!=pathIntern::NO_ID && shared.path(got[0][ctr])==path.str();
+    }
+    if(!all){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+    std::cout << tests << " tests, passed: " << passed << ", failed: " << failed << '\n';
+
+    return 0;
+}
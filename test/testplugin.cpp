@@ -0,0 +1,168 @@
+#include "../handlerplugin.h"
+#include <sys/socket.h>
+#include <unistd.h>
+#include <iostream>
+#include <string>
+
+// Sends request down one end of a socketpair, has the plugin answer it on
+// the other, and gives back what the client got.
+std::string
+exchange(handlerPlugin& plugin,const std::string& request,bool& threw,
+	bool *kept=0)
+{
+    int fds[2];
+    socketpair(AF_UNIX,SOCK_STREAM,0,fds);
+    write(fds[1],request.c_str(),request.size());
+    threw=false;
+    {
+	sockfdwrapper sfd(fds[0]);
+	line_view line;
+	std::string first;
+	header_map hdrs;
+	sfd.get_line(line);
+	line.append_to(first);
+	while(sfd.get_line(line)){
+	    std::string text;
+	    line.append_to(text);
+	    if(text=="\r\n"){
+		break;
+	    }
+	    size_t colon=text.find(':');
+	    hdrs[arena_string(text.substr(0,colon).c_str())]=
+		arena_string(text.substr(colon+2,text.size()-colon-4).c_str());
+	}
+	sfd.headers_done();
+	http_request_line hrl(first.c_str(),hdrs);
+	sfd.set_keep_alive(true,hrl.is_http11());
+	request_body body(sfd,hdrs,1<<20);
+	try{
+	    plugin.run(sfd,hrl,hdrs,body,"/p/");
+	}catch(const plugin_handler_fail&){
+	    threw=true;
+	}
+	if(kept){
+	    *kept=sfd.keeping_alive();
+	}
+    }
+    close(fds[0]);
+    std::string got;
+    char buf[4096];
+    ssize_t n;
+    while((n=read(fds[1],buf,sizeof buf))>0){
+	got.append(buf,n);
+    }
+    close(fds[1]);
+    return got;
+}
+
+int
+main()
+{
+    size_t tests=0,passed=0,failed=0;
+    bool threw;
+
+    std::cout << "test 1 - a plugin that isn't there or won't start isn't loaded - ";
+    tests++;
+    bool missing=false,refused=false;
+    try{
+	handlerPlugin nope("./no_such_plugin.so","");
+    }catch(const plugin_load_fail&){
+	missing=true;
+    }
+    try{
+	handlerPlugin no("./plugin_fixture.so","refuse");
+    }catch(const plugin_load_fail&){
+	refused=true;
+    }
+    if(!missing || !refused){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+
+    handlerPlugin plugin("./plugin_fixture.so","");
+
+    std::cout << "test 2 - a small answer goes out whole with a length - ";
+    tests++;
+    std::string got=exchange(plugin,"GET /p/small HTTP/1.1\r\nHost: x\r\n\r\n",threw);
+    if(threw || got.compare(0,17,"HTTP/1.1 200 OK\r\n")!=0
+	    || got.find("X-Small: yes\r\n")==std::string::npos
+	    || got.find("Content-Length: 5\r\n")==std::string::npos
+	    || got.find("Transfer-Encoding")!=std::string::npos
+	    || got.substr(got.size()-9)!="\r\n\r\nhello"){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+
+    std::cout << "test 3 - a big one's chunked for 1.1 and counted for 1.0 - ";
+    tests++;
+    got=exchange(plugin,"GET /p/big HTTP/1.1\r\nHost: x\r\n\r\n",threw);
+    std::string old=exchange(plugin,"GET /p/big HTTP/1.0\r\n\r\n",threw);
+    if(got.find("Transfer-Encoding: chunked\r\n")==std::string::npos
+	    || got.substr(got.size()-7)!="\r\n0\r\n\r\n"
+	    || old.find("Content-Length: 40000\r\n")==std::string::npos
+	    || old.size()-old.find("\r\n\r\n")-4!=40000){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+
+    std::cout << "test 4 - a plugin can suspend on an fd and carry on - ";
+    tests++;
+    got=exchange(plugin,"GET /p/wait HTTP/1.1\r\nHost: x\r\n\r\n",threw);
+    if(threw || got.substr(got.size()-6)!="waited"){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+
+    std::cout << "test 5 - bodies in, failures and header injection out - ";
+    tests++;
+    got=exchange(plugin,"POST /p/body HTTP/1.1\r\nHost: x\r\nContent-Length: 11\r\n\r\nhello there",threw);
+    bool all=!threw && got.substr(got.size()-11)=="hello there";
+    got=exchange(plugin,"GET /p/nothing HTTP/1.1\r\nHost: x\r\n\r\n",threw);
+    all=all && threw && got.empty();
+    got=exchange(plugin,"GET /p/inject HTTP/1.1\r\nHost: x\r\n\r\n",threw);
+    all=all && !threw && got.compare(0,24,"HTTP/1.1 204 No Content\r")==0
+	&& got.find("Set-Cookie")==std::string::npos
+	&& got.find("Content-Length")==std::string::npos;
+    if(!all){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+    std::cout << "test 6 - a wrong Content-Length closes the connection, no chunking of their own - ";
+    tests++;
+    bool kept;
+    got=exchange(plugin,"GET /p/short HTTP/1.1\r\nHost: x\r\n\r\n",threw,&kept);
+    all=!threw && !kept && got.find("Content-Length: 8\r\n")!=std::string::npos
+	&& got.find("Connection: close\r\n")!=std::string::npos
+	&& got.find("Transfer-Encoding")==std::string::npos
+	&& got.substr(got.size()-5)=="hello";
+    got=exchange(plugin,"GET /p/long HTTP/1.1\r\nHost: x\r\n\r\n",threw,&kept);
+    all=all && !threw && !kept && got.substr(got.size()-10)=="\r\nhello th"
+	&& got.find("Transfer-Encoding")==std::string::npos;
+    got=exchange(plugin,"GET /p/small HTTP/1.1\r\nHost: x\r\n\r\n",threw,&kept);
+    all=all && !threw && kept;
+    if(!all){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+    std::cout << tests << " tests, passed: " << passed << ", failed: " << failed << '\n';
+
+    return 0;
+}
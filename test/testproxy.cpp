@@ -0,0 +1,491 @@
+#include "../proxy.h"
+#include <atomic>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// A little HTTP/1.1 server to be upstream, that keeps connections open and
+// counts them.  Its answers say who it is and what it saw.
+struct upstream_server
+{
+    std::string name;
+    int lfd;
+    std::atomic<int> accepted;
+    pthread_t tid;
+};
+
+// a line without its \r\n, from what's come so far on fd
+static bool
+get_line(int fd,std::string& buf,std::string& line)
+{
+    size_t nl;
+    while((nl=buf.find('\n'))==std::string::npos){
+	char chunk[4096];
+	ssize_t got=recv(fd,chunk,sizeof chunk,0);
+	if(got<=0){
+	    return false;
+	}
+	buf.append(chunk,got);
+    }
+    line=buf.substr(0,nl);
+    buf.erase(0,nl+1);
+    if(!line.empty() && line[line.size()-1]=='\r'){
+	line.erase(line.size()-1);
+    }
+    return true;
+}
+
+static bool
+get_bytes(int fd,std::string& buf,size_t len,std::string& out)
+{
+    while(buf.size()<len){
+	char chunk[65536];
+	ssize_t got=recv(fd,chunk,sizeof chunk,0);
+	if(got<=0){
+	    return false;
+	}
+	buf.append(chunk,got);
+    }
+    out=buf.substr(0,len);
+    buf.erase(0,len);
+    return true;
+}
+
+static void
+send_string(int fd,const std::string& s)
+{
+    size_t sent=0;
+    while(sent<s.size()){
+	ssize_t n=send(fd,s.data()+sent,s.size()-sent,MSG_NOSIGNAL);
+	if(n<=0){
+	    return;
+	}
+	sent+=n;
+    }
+}
+
+struct upstream_conn
+{
+    upstream_server *server;
+    int fd;
+};
+
+static void *
+serve_upstream_conn(void *voidconn)
+{
+    upstream_conn *conn=static_cast<upstream_conn*>(voidconn);
+    std::string buf,line;
+    while(get_line(conn->fd,buf,line)){
+	std::string path=line.substr(line.find(' ')+1);
+	path.erase(path.find(' '));
+	size_t length=0;
+	bool chunked=false,saw_connection=false;
+	while(get_line(conn->fd,buf,line) && !line.empty()){
+	    if(line.compare(0,16,"Content-Length: ")==0){
+		length=atoi(line.c_str()+16);
+	    }else if(line=="Transfer-Encoding: chunked"){
+		chunked=true;
+	    }else if(line.compare(0,11,"Connection:")==0){
+		saw_connection=true;
+	    }
+	}
+	std::string body,piece;
+	if(chunked){
+	    while(get_line(conn->fd,buf,line)){
+		size_t size=strtoul(line.c_str(),0,16);
+		if(size==0){
+		    get_line(conn->fd,buf,line);
+		    break;
+		}
+		get_bytes(conn->fd,buf,size,piece);
+		body+=piece;
+		get_line(conn->fd,buf,line);
+	    }
+	}else if(length){
+	    get_bytes(conn->fd,buf,length,body);
+	}
+	unsigned long sum=0;
+	for(size_t ctr=0;ctr<body.size();ctr++){
+	    sum=sum*31+static_cast<unsigned char>(body[ctr]);
+	}
+	if(path=="/slow"){
+	    usleep(300000);
+	}
+	char saw[128];
+	snprintf(saw,sizeof saw,"X-Saw: %s %zu %lu %s\r\n",conn->server->name.c_str(),
+		body.size(),sum,saw_connection?"connection":"clean");
+	std::string answer="HTTP/1.1 200 OK\r\nKeep-Alive: timeout=5\r\n";
+	answer+=saw;
+	if(path=="/chunked"){
+	    answer+="Transfer-Encoding: chunked\r\n\r\n5\r\nhello\r\n6\r\n there\r\n0\r\nX-Done: yes\r\n\r\n";
+	}else if(path=="/twolengths"){
+	    answer+="Content-Length: 5\r\nContent-Length: 6\r\n\r\nhello!";
+	}else if(path=="/badlength"){
+	    answer+="Content-Length: 5x\r\n\r\nhello";
+	}else if(path=="/samelength"){
+	    answer+="Content-Length: 5\r\ncontent-length: 5 \r\n\r\nhello";
+	}else if(path=="/gzip"){
+	    answer+="Transfer-Encoding: gzip\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nhello\r\n0\r\n\r\n";
+	}else if(path=="/notlast"){
+	    // chunked isn't last, so it ends when we close, length or not
+	    answer+="Transfer-Encoding: chunked, gzip\r\nContent-Length: 3\r\n\r\nraw bytes";
+	    send_string(conn->fd,answer);
+	    break;
+	}else{
+	    std::string text="you asked for "+path;
+	    char len[64];
+	    snprintf(len,sizeof len,"Content-Length: %zu\r\n\r\n",text.size());
+	    answer+=len+text;
+	}
+	send_string(conn->fd,answer);
+    }
+    close(conn->fd);
+    delete conn;
+    return 0;
+}
+
+static void *
+run_upstream(void *voidserver)
+{
+    upstream_server *server=static_cast<upstream_server*>(voidserver);
+    int fd;
+    while((fd=accept(server->lfd,0,0))!=-1){
+	server->accepted++;
+	upstream_conn *conn=new upstream_conn;
+	conn->server=server;
+	conn->fd=fd;
+	pthread_t tid;
+	pthread_create(&tid,0,serve_upstream_conn,conn);
+	pthread_detach(tid);
+    }
+    return 0;
+}
+
+// on 127.0.0.1 with a port of its own, and where says what to tell the pool
+static void
+start_tcp(upstream_server& server,const char *name,std::string& where)
+{
+    server.name=name;
+    server.accepted=0;
+    server.lfd=socket(AF_INET,SOCK_STREAM,0);
+    struct sockaddr_in addr;
+    socklen_t len=sizeof addr;
+    bzero(&addr,sizeof addr);
+    addr.sin_family=AF_INET;
+    addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+    bind(server.lfd,reinterpret_cast<struct sockaddr*>(&addr),sizeof addr);
+    listen(server.lfd,16);
+    getsockname(server.lfd,reinterpret_cast<struct sockaddr*>(&addr),&len);
+    char spec[64];
+    snprintf(spec,sizeof spec,"127.0.0.1:%d",ntohs(addr.sin_port));
+    where=spec;
+    pthread_create(&server.tid,0,run_upstream,&server);
+}
+
+static void
+start_unix(upstream_server& server,const char *name,const std::string& path)
+{
+    server.name=name;
+    server.accepted=0;
+    server.lfd=socket(AF_UNIX,SOCK_STREAM,0);
+    struct sockaddr_un addr;
+    bzero(&addr,sizeof addr);
+    addr.sun_family=AF_UNIX;
+    strncpy(addr.sun_path,path.c_str(),sizeof addr.sun_path-1);
+    unlink(path.c_str());
+    bind(server.lfd,reinterpret_cast<struct sockaddr*>(&addr),sizeof addr);
+    listen(server.lfd,16);
+    pthread_create(&server.tid,0,run_upstream,&server);
+}
+
+static void
+stop(upstream_server& server)
+{
+    shutdown(server.lfd,SHUT_RDWR);
+    pthread_join(server.tid,0);
+    close(server.lfd);
+}
+
+struct feed_arg
+{
+    int fd;
+    const std::string *request;
+};
+
+static void *
+feed(void *voidarg)
+{
+    feed_arg *arg=static_cast<feed_arg*>(voidarg);
+    send_string(arg->fd,*arg->request);
+    return 0;
+}
+
+// Sends request down one end of a socketpair, has the pool pass it on from
+// the other, and gives back what the client got.
+static std::string
+exchange(proxyPool& pool,const std::string& request,bool& unavailable)
+{
+    int fds[2];
+    socketpair(AF_UNIX,SOCK_STREAM,0,fds);
+    unavailable=false;
+    // a big body won't fit in the socket, so it's fed from a thread
+    feed_arg arg={ fds[1],&request };
+    pthread_t feeder;
+    pthread_create(&feeder,0,feed,&arg);
+    {
+	sockfdwrapper sfd(fds[0]);
+	line_view line;
+	std::string first;
+	header_map hdrs;
+	sfd.get_line(line);
+	line.append_to(first);
+	first.erase(first.find_last_not_of("\r\n")+1);
+	while(sfd.get_line(line)){
+	    std::string text;
+	    line.append_to(text);
+	    if(text=="\r\n"){
+		break;
+	    }
+	    size_t colon=text.find(':');
+	    hdrs[arena_string(text.substr(0,colon).c_str())]=
+		arena_string(text.substr(colon+2,text.size()-colon-4).c_str());
+	}
+	sfd.headers_done();
+	http_request_line hrl(first.c_str(),hdrs);
+	sfd.set_keep_alive(true,hrl.is_http11());
+	request_body body(sfd,hdrs,1<<24);
+	try{
+	    pool.run(sfd,hrl,hdrs,body);
+	}catch(const proxy_upstream_unavailable&){
+	    unavailable=true;
+	}
+    }
+    pthread_join(feeder,0);
+    close(fds[0]);
+    std::string got;
+    char buf[4096];
+    ssize_t n;
+    while((n=read(fds[1],buf,sizeof buf))>0){
+	got.append(buf,n);
+    }
+    close(fds[1]);
+    return got;
+}
+
+struct slow_arg
+{
+    proxyPool *pool;
+    std::string got;
+};
+
+static void *
+slow_request(void *voidarg)
+{
+    slow_arg *arg=static_cast<slow_arg*>(voidarg);
+    bool unavailable;
+    arg->got=exchange(*arg->pool,"GET /slow HTTP/1.1\r\nHost: x\r\n\r\n",unavailable);
+    return 0;
+}
+
+int
+main()
+{
+    size_t tests=0,passed=0,failed=0;
+    bool unavailable;
+    upstream_server one,two,three;
+    std::string where_one,where_two;
+    start_tcp(one,"one",where_one);
+    start_tcp(two,"two",where_two);
+    char unix_path[64];
+    snprintf(unix_path,sizeof unix_path,"/tmp/testproxy.%d.sock",getpid());
+    start_unix(three,"three",unix_path);
+
+    std::cout << "test 1 - upstreams that make no sense aren't taken - ";
+    tests++;
+    bool empty=false,bad=false;
+    try{
+	proxyPool nothing("");
+    }catch(const proxy_config_fail&){
+	empty=true;
+    }
+    try{
+	proxyPool noport("localhost");
+    }catch(const proxy_config_fail&){
+	bad=true;
+    }
+    if(!empty || !bad){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+
+    std::cout << "test 2 - answers come back clean on a kept connection - ";
+    tests++;
+    {
+	proxyPool pool(where_one);
+	std::string a=exchange(pool,"GET /a%20b?q=1 HTTP/1.1\r\nHost: x\r\nConnection: keep-alive\r\n\r\n",unavailable);
+	std::string b=exchange(pool,"GET /b HTTP/1.1\r\nHost: x\r\n\r\n",unavailable);
+	if(a.compare(0,17,"HTTP/1.1 200 OK\r\n")!=0
+		|| a.find("X-Saw: one 0 0 clean\r\n")==std::string::npos
+		|| a.find("Keep-Alive")!=std::string::npos
+		|| a.substr(a.size()-24)!="you asked for /a%20b?q=1"
+		|| b.substr(b.size()-16)!="you asked for /b"
+		|| one.accepted!=1){
+	    std::cout << "failed\n";
+	    failed++;
+	}else{
+	    std::cout << "passed\n";
+	    passed++;
+	}
+    }
+
+    std::cout << "test 3 - chunked stays chunked for 1.1 and is undone for 1.0 - ";
+    tests++;
+    {
+	proxyPool pool(where_one);
+	std::string trailer="5\r\nhello\r\n6\r\n there\r\n0\r\nX-Done: yes\r\n\r\n";
+	std::string got=exchange(pool,"GET /chunked HTTP/1.1\r\nHost: x\r\n\r\n",unavailable);
+	std::string old=exchange(pool,"GET /chunked HTTP/1.0\r\n\r\n",unavailable);
+	if(got.find("Transfer-Encoding: chunked\r\n")==std::string::npos
+		|| got.substr(got.size()-trailer.size())!=trailer
+		|| old.find("Transfer-Encoding")!=std::string::npos
+		|| old.find("Connection: close\r\n")==std::string::npos
+		|| old.substr(old.size()-15)!="\r\n\r\nhello there"){
+	    std::cout << "failed\n";
+	    failed++;
+	}else{
+	    std::cout << "passed\n";
+	    passed++;
+	}
+    }
+
+    std::cout << "test 4 - bodies go up whole, with a length or chunked - ";
+    tests++;
+    {
+	proxyPool pool("unix:"+std::string(unix_path));
+	std::string body;
+	unsigned long sum=0;
+	for(size_t ctr=0;ctr<300000;ctr++){
+	    body+=static_cast<char>('a'+ctr%23);
+	    sum=sum*31+static_cast<unsigned char>(body[ctr]);
+	}
+	char want[64];
+	snprintf(want,sizeof want,"X-Saw: three 300000 %lu clean\r\n",sum);
+	std::string got=exchange(pool,"POST /up HTTP/1.1\r\nHost: x\r\nContent-Length: 300000\r\n\r\n"+body,unavailable);
+	std::string chunked="POST /up HTTP/1.1\r\nHost: x\r\nTransfer-Encoding: chunked\r\n\r\n";
+	for(size_t off=0;off<body.size();off+=100000){
+	    chunked+="186a0\r\n"+body.substr(off,100000)+"\r\n";
+	}
+	chunked+="0\r\n\r\n";
+	std::string again=exchange(pool,chunked,unavailable);
+	if(got.find(want)==std::string::npos || again.find(want)==std::string::npos){
+	    std::cout << "failed\n";
+	    failed++;
+	}else{
+	    std::cout << "passed\n";
+	    passed++;
+	}
+    }
+
+    std::cout << "test 5 - the upstream with the fewest outstanding gets it - ";
+    tests++;
+    {
+	proxyPool pool(where_one+","+where_two);
+	slow_arg arg;
+	arg.pool=&pool;
+	pthread_t slow;
+	pthread_create(&slow,0,slow_request,&arg);
+	usleep(100000);
+	std::string a=exchange(pool,"GET /a HTTP/1.1\r\nHost: x\r\n\r\n",unavailable);
+	std::string b=exchange(pool,"GET /b HTTP/1.1\r\nHost: x\r\n\r\n",unavailable);
+	pthread_join(slow,0);
+	const char *busy=arg.got.find("X-Saw: one")!=std::string::npos?"X-Saw: one":"X-Saw: two";
+	if(arg.got.find("X-Saw:")==std::string::npos
+		|| a.find("X-Saw:")==std::string::npos || a.find(busy)!=std::string::npos
+		|| b.find("X-Saw:")==std::string::npos || b.find(busy)!=std::string::npos){
+	    std::cout << "failed\n";
+	    failed++;
+	}else{
+	    std::cout << "passed\n";
+	    passed++;
+	}
+    }
+
+    std::cout << "test 6 - a dead upstream's ejected till a health check finds it back - ";
+    tests++;
+    {
+	proxyPool pool("unix:"+std::string(unix_path)+","+where_two);
+	stop(three);
+	std::string a=exchange(pool,"GET /a HTTP/1.1\r\nHost: x\r\n\r\n",unavailable);
+	std::string b=exchange(pool,"GET /b HTTP/1.1\r\nHost: x\r\n\r\n",unavailable);
+	bool all=!unavailable && a.find("X-Saw: two")!=std::string::npos
+	    && b.find("X-Saw: two")!=std::string::npos && pool.ejected(0) && !pool.ejected(1);
+	stop(two);
+	pool.health_check();
+	pool.health_check();
+	std::string c=exchange(pool,"GET /c HTTP/1.1\r\nHost: x\r\n\r\n",unavailable);
+	all=all && unavailable && c.empty() && pool.ejected(1);
+	start_unix(three,"three",unix_path);
+	pool.health_check();
+	std::string d=exchange(pool,"GET /d HTTP/1.1\r\nHost: x\r\n\r\n",unavailable);
+	all=all && !unavailable && d.find("X-Saw: three")!=std::string::npos && !pool.ejected(0);
+	if(!all){
+	    std::cout << "failed\n";
+	    failed++;
+	}else{
+	    std::cout << "passed\n";
+	    passed++;
+	}
+    }
+
+    std::cout << "test 7 - a Content-Length that can't be trusted is a 502, a good one goes on once - ";
+    tests++;
+    {
+	proxyPool pool(where_one);
+	bool two_unavailable,bad_unavailable;
+	exchange(pool,"GET /twolengths HTTP/1.1\r\nHost: x\r\n\r\n",two_unavailable);
+	exchange(pool,"GET /badlength HTTP/1.1\r\nHost: x\r\n\r\n",bad_unavailable);
+	std::string same=exchange(pool,"GET /samelength HTTP/1.1\r\nHost: x\r\n\r\n",unavailable);
+	size_t at=same.find("Content-Length: 5\r\n");
+	if(!two_unavailable || !bad_unavailable || unavailable || at==std::string::npos
+		|| same.find("ontent-length",at+2)!=std::string::npos
+		|| same.substr(same.size()-9)!="\r\n\r\nhello"){
+	    std::cout << "failed\n";
+	    failed++;
+	}else{
+	    std::cout << "passed\n";
+	    passed++;
+	}
+    }
+
+    std::cout << "test 8 - other transfer codings are kept, and without chunked last it's read to the end - ";
+    tests++;
+    {
+	proxyPool pool(where_one);
+	std::string gzip=exchange(pool,"GET /gzip HTTP/1.1\r\nHost: x\r\n\r\n",unavailable);
+	std::string notlast=exchange(pool,"GET /notlast HTTP/1.1\r\nHost: x\r\n\r\n",unavailable);
+	if(gzip.find("Transfer-Encoding: gzip, chunked\r\n")==std::string::npos
+		|| gzip.substr(gzip.size()-15)!="5\r\nhello\r\n0\r\n\r\n"
+		|| notlast.find("Transfer-Encoding: chunked, gzip\r\n")==std::string::npos
+		|| notlast.find("Content-Length")!=std::string::npos
+		|| notlast.find("Connection: close\r\n")==std::string::npos
+		|| notlast.substr(notlast.size()-13)!="\r\n\r\nraw bytes"){
+	    std::cout << "failed\n";
+	    failed++;
+	}else{
+	    std::cout << "passed\n";
+	    passed++;
+	}
+    }
+    std::cout << tests << " tests, passed: " << passed << ", failed: " << failed << '\n';
+    unlink(unix_path);
+
+    return 0;
+}
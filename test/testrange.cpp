@@ -0,0 +1,136 @@
+#include "../http.h"
+#include <iostream>
+#include <assert.h>
+
+// run one parse_range and compare against what we expect, ranges are
+// given as pairs first,last in expected
+static bool
+check(const char *spec,off_t size,range_result want,const off_t *expected=0,size_t nexpected=0)
+{
+    std::vector<byte_range> ranges;
+    range_result got=parse_range(spec,size,ranges);
+    if(got!=want || ranges.size()!=nexpected){
+	std::cout << "for '" << spec << "' got " << got << " with " << ranges.size() << " ranges ";
+	return false;
+    }
+    for(size_t ctr=0;ctr<nexpected;ctr++){
+	if(ranges[ctr].first!=expected[2*ctr] || ranges[ctr].last!=expected[2*ctr+1]){
+	    std::cout << "range " << ctr << " is " << ranges[ctr].first << '-' << ranges[ctr].last << ' ';
+	    return false;
+	}
+    }
+    return true;
+}
+
+int
+main()
+{
+    size_t tests=0,passed=0,failed=0;
+    const off_t r1[]={ 0,99 };
+    const off_t r2[]={ 900,999 };
+    const off_t r3[]={ 500,999 };
+    const off_t r4[]={ 0,0,10,19,990,999 };
+    const off_t r5[]={ 0,999 };
+    const off_t r6[]={ 990,999 };
+    tests++;
+    std::cout << "test 1 - bytes=0-99 - ";
+    if(!check("bytes=0-99",1000,range_ok,r1,1)){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+    tests++;
+    std::cout << "test 2 - bytes=-100 suffix - ";
+    if(!check("bytes=-100",1000,range_ok,r2,1)){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+    tests++;
+    std::cout << "test 3 - bytes=500- open ended - ";
+    if(!check("bytes=500-",1000,range_ok,r3,1)){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+    tests++;
+    std::cout << "test 4 - bytes=0-0, 10-19,-10 multiple - ";
+    if(!check("bytes=0-0, 10-19,-10",1000,range_ok,r4,3)){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+    tests++;
+    std::cout << "test 5 - bytes=0-5000 clipped - ";
+    if(!check("bytes=0-5000",1000,range_ok,r5,1)){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+    tests++;
+    std::cout << "test 6 - bytes=-5000 suffix longer than the file - ";
+    if(!check("bytes=-5000",1000,range_ok,r5,1)){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+    tests++;
+    std::cout << "test 7 - bytes=1000-2000 unsatisfiable - ";
+    if(!check("bytes=1000-2000",1000,range_unsatisfiable)){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+    tests++;
+    std::cout << "test 8 - bytes=-0 unsatisfiable - ";
+    if(!check("bytes=-0",1000,range_unsatisfiable)){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+    tests++;
+    std::cout << "test 9 - bytes=20-10 backwards gets ignored - ";
+    if(!check("bytes=20-10",1000,range_none)){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+    tests++;
+    std::cout << "test 10 - items=0-10 wrong unit gets ignored - ";
+    if(!check("items=0-10",1000,range_none)){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+    tests++;
+    std::cout << "test 11 - bytes=2000-,990-1100 keeps the satisfiable one - ";
+    if(!check("bytes=2000-,990-1100",1000,range_ok,r6,1)){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+    std::cout << tests << " tests, passed: " << passed << ", failed: " << failed << '\n';
+    return 0;
+}
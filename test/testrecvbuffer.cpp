@@ -0,0 +1,136 @@
+#include "../sockfdwrapper.h"
+#include <sys/socket.h>
+#include <unistd.h>
+#include <iostream>
+#include <string>
+
+// what's in fds[1] and then closed is what the sockfdwrapper on fds[0]
+// gets to read
+void
+feed(int *fds,const std::string& data)
+{
+    socketpair(AF_UNIX,SOCK_STREAM,0,fds);
+    int sndbuf=1024*1024;
+    setsockopt(fds[1],SOL_SOCKET,SO_SNDBUF,&sndbuf,sizeof sndbuf);
+    write(fds[1],data.c_str(),data.size());
+    close(fds[1]);
+}
+
+int
+main()
+{
+    size_t tests=0,passed=0,failed=0;
+    int fds[2];
+
+    std::cout << "test 1 - a line longer than a block comes back whole - ";
+    tests++;
+    {
+	std::string longline(3*bufferPool::BLOCK_SIZE,'c');
+	feed(fds,"GET / HTTP/1.1\r\nCookie: "+longline+"\r\nHost: x\r\n\r\n");
+	sockfdwrapper sfd(fds[0]);
+	line_view line;
+	std::string first,cookie,host;
+	bool ok=sfd.get_line(line);
+	line.append_to(first);
+	ok=ok && sfd.get_line(line);
+	line.append_to(cookie);
+	ok=ok && sfd.get_line(line);
+	line.append_to(host);
+	if(!ok || first!="GET / HTTP/1.1\r\n" || cookie!="Cookie: "+longline+"\r\n"
+		|| host!="Host: x\r\n" || line.size()!=9){
+	    std::cout << "failed\n";
+	    failed++;
+	}else{
+	    std::cout << "passed\n";
+	    passed++;
+	}
+	close(fds[0]);
+    }
+
+    std::cout << "test 2 - lines, then the rest with read(), across blocks - ";
+    tests++;
+    {
+	std::string lines,body;
+	for(int ctr=0;ctr<2000;ctr++){
+	    lines+="0123456789\n";
+	}
+	for(size_t ctr=0;ctr<2*bufferPool::BLOCK_SIZE;ctr++){
+	    body+=static_cast<char>('a'+ctr%26);
+	}
+	feed(fds,lines+body);
+	sockfdwrapper sfd(fds[0]);
+	line_view line;
+	bool ok=true;
+	for(int ctr=0;ctr<2000 && ok;ctr++){
+	    std::string text;
+	    ok=sfd.get_line(line);
+	    line.append_to(text);
+	    ok=ok && text=="0123456789\n";
+	}
+	std::string got;
+	char buf[1000];
+	size_t n;
+	while((n=sfd.read(buf,sizeof buf))){
+	    got.append(buf,n);
+	}
+	if(!ok || got!=body || sfd.buffered()!=0){
+	    std::cout << "failed\n";
+	    failed++;
+	}else{
+	    std::cout << "passed\n";
+	    passed++;
+	}
+	close(fds[0]);
+    }
+
+    std::cout << "test 3 - a line bigger than max_header is refused - ";
+    tests++;
+    {
+	conn_timeouts timeouts;
+	timeouts.max_header=4*bufferPool::BLOCK_SIZE;
+	feed(fds,std::string(6*bufferPool::BLOCK_SIZE,'x')+"\n");
+	sockfdwrapper sfd(fds[0],0,&timeouts);
+	line_view line;
+	if(sfd.get_line(line) || !sfd.over_limit()){
+	    std::cout << "failed\n";
+	    failed++;
+	}else{
+	    std::cout << "passed\n";
+	    passed++;
+	}
+	close(fds[0]);
+    }
+
+    std::cout << "test 4 - a last line with no \\n isn't a line - ";
+    tests++;
+    {
+	feed(fds,"one\ntwo");
+	sockfdwrapper sfd(fds[0]);
+	line_view line;
+	std::string text;
+	bool first=sfd.get_line(line);
+	line.append_to(text);
+	if(!first || text!="one\n" || sfd.get_line(line) || sfd.over_limit()
+		|| sfd.buffered()!=3){
+	    std::cout << "failed\n";
+	    failed++;
+	}else{
+	    std::cout << "passed\n";
+	    passed++;
+	}
+	close(fds[0]);
+    }
+
+    std::cout << "test 5 - every block goes back to the pool - ";
+    tests++;
+    if(bufferPool::outstanding()!=0){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+    std::cout << tests << " tests, passed: " << passed << ", failed: " << failed << '\n';
+
+    return 0;
+}
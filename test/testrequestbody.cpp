@@ -0,0 +1,246 @@
+#include "../requestbody.h"
+#include <iostream>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+// What happened when a request with these header lines and then rest on
+// the wire had its body read: the body, "bad", or "too large".  after gets
+// the line that followed the body, which had better be the next request.
+static std::string
+read_body(const char *header_lines[],const std::string& rest,size_t maxsize,
+	std::string& after)
+{
+    arena_scope scope;
+    int fds[2];
+    socketpair(AF_UNIX,SOCK_STREAM,0,fds);
+    write(fds[1],rest.data(),rest.size());
+    shutdown(fds[1],SHUT_WR);
+    std::string got;
+    after.clear();
+    {
+	sockfdwrapper sfd(fds[0]);
+	header_map hdrs;
+	for(size_t ctr=0;header_lines[ctr];ctr++){
+	    add_header(hdrs,header_lines[ctr]);
+	}
+	try{
+	    request_body body(sfd,hdrs,maxsize);
+	    char buf[7];
+	    size_t n;
+	    while((n=body.read(buf,sizeof buf))>0){
+		got.append(buf,n);
+	    }
+	    line_view line;
+	    if(body.finished() && sfd.get_line(line)){
+		line.append_to(after);
+	    }
+	}catch(const request_body_bad&){
+	    got="bad";
+	}catch(const request_body_too_large&){
+	    got="too large";
+	}
+    }
+    close(fds[0]);
+    close(fds[1]);
+    return got;
+}
+
+// a client that sends its body a byte every 100ms, till it's shut out
+static void *
+trickle(void *arg)
+{
+    int fd=static_cast<int>(reinterpret_cast<long>(arg));
+    for(size_t ctr=0;ctr<100 && send(fd,"x",1,MSG_NOSIGNAL)==1;ctr++){
+	usleep(100000);
+    }
+    return 0;
+}
+
+// the whole of a body, too much for the socket to hold at once
+static void *
+feed(void *arg)
+{
+    int fd=static_cast<int>(reinterpret_cast<long>(arg));
+    std::string body(200000,'b');
+    for(size_t sent=0;sent<body.size();){
+	ssize_t n=send(fd,body.data()+sent,body.size()-sent,MSG_NOSIGNAL);
+	if(n<=0){
+	    break;
+	}
+	sent+=n;
+    }
+    shutdown(fd,SHUT_WR);
+    return 0;
+}
+
+static double
+now()
+{
+    struct timeval tv;
+    gettimeofday(&tv,0);
+    return tv.tv_sec+tv.tv_usec/1e6;
+}
+
+int
+main()
+{
+    size_t tests=0,passed=0,failed=0;
+    std::string after;
+
+    std::cout << "test 1 - a Content-Length body, however the name's written - ";
+    tests++;
+    {
+	const char *upper[]={ "Content-Length: 11",0 };
+	const char *lower[]={ "content-length: 11",0 };
+	bool all=read_body(upper,"hello thereGET /next HTTP/1.1\r\n",1024,after)=="hello there"
+	    && after=="GET /next HTTP/1.1\r\n";
+	all=all && read_body(lower,"hello thereGET /next HTTP/1.1\r\n",1024,after)=="hello there"
+	    && after=="GET /next HTTP/1.1\r\n";
+	if(!all){
+	    std::cout << "failed\n";
+	    failed++;
+	}else{
+	    std::cout << "passed\n";
+	    passed++;
+	}
+    }
+
+    std::cout << "test 2 - a chunked body, however the name's written - ";
+    tests++;
+    {
+	const char *lower[]={ "transfer-encoding: Chunked",0 };
+	std::string chunks="5\r\nhello\r\n6;ext=1\r\n there\r\n0\r\nX-Trailer: yes\r\n\r\nGET /next HTTP/1.1\r\n";
+	if(read_body(lower,chunks,1024,after)!="hello there" || after!="GET /next HTTP/1.1\r\n"){
+	    std::cout << "failed\n";
+	    failed++;
+	}else{
+	    std::cout << "passed\n";
+	    passed++;
+	}
+    }
+
+    std::cout << "test 3 - framing that could be read two ways is turned down - ";
+    tests++;
+    {
+	const char *both[]={ "Transfer-Encoding: chunked","content-length: 5",0 };
+	const char *twice[]={ "Content-Length: 5","content-length: 10",0 };
+	const char *coded[]={ "Transfer-Encoding: gzip, chunked",0 };
+	bool all=read_body(both,"5\r\nhello\r\n0\r\n\r\n",1024,after)=="bad"
+	    && read_body(twice,"helloworld",1024,after)=="bad"
+	    && read_body(coded,"5\r\nhello\r\n0\r\n\r\n",1024,after)=="bad";
+	if(!all){
+	    std::cout << "failed\n";
+	    failed++;
+	}else{
+	    std::cout << "passed\n";
+	    passed++;
+	}
+    }
+
+    std::cout << "test 4 - sizes past the limit don't wrap around it - ";
+    tests++;
+    {
+	const char *chunked[]={ "Transfer-Encoding: chunked",0 };
+	const char *length[]={ "Content-Length: 2000",0 };
+	bool all=read_body(chunked,"3\r\nabc\r\nffffffffffffffff\r\nxyz",1024,after)=="too large"
+	    && read_body(chunked,"1ffffffffffffffff\r\nxyz",1024,after)=="bad"
+	    && read_body(chunked,"400\r\n",1024,after)!="too large"
+	    && read_body(chunked,"3\r\nabc\r\n3fe\r\n",1024,after)=="too large"
+	    && read_body(length,"",1024,after)=="too large";
+	if(!all){
+	    std::cout << "failed\n";
+	    failed++;
+	}else{
+	    std::cout << "passed\n";
+	    passed++;
+	}
+    }
+
+    std::cout << "test 5 - a big body that's spliced still has to keep up the minimum rate - ";
+    tests++;
+    {
+	arena_scope scope;
+	timerWheel wheel(10);
+	conn_timeouts timeouts;
+	timeouts.body_ms=1000;
+	timeouts.rate_grace_ms=300;
+	timeouts.min_rate=1000;
+	int fds[2];
+	socketpair(AF_UNIX,SOCK_STREAM,0,fds);
+	pthread_t tid;
+	pthread_create(&tid,0,trickle,reinterpret_cast<void*>(static_cast<long>(fds[1])));
+	double started=now();
+	bool bad=false;
+	{
+	    sockfdwrapper sfd(fds[0],&wheel,&timeouts);
+	    sfd.headers_done();
+	    header_map hdrs;
+	    add_header(hdrs,"Content-Length: 200000");
+	    try{
+		request_body body(sfd,hdrs,1<<20);
+		body.spill();
+	    }catch(const request_body_bad&){
+		bad=true;
+	    }
+	}
+	double took=now()-started;
+	shutdown(fds[0],SHUT_RDWR);
+	close(fds[0]);
+	pthread_join(tid,0);
+	close(fds[1]);
+	if(!bad || took>3){
+	    std::cout << "failed\n";
+	    failed++;
+	}else{
+	    std::cout << "passed\n";
+	    passed++;
+	}
+    }
+
+    std::cout << "test 6 - with a tap on, a big body's all in it, or it's marked cut - ";
+    tests++;
+    {
+	bool all=true;
+	size_t limits[]={ 1<<20, 1000 };
+	for(size_t ctr=0;ctr<2;ctr++){
+	    arena_scope scope;
+	    int fds[2];
+	    socketpair(AF_UNIX,SOCK_STREAM,0,fds);
+	    pthread_t tid;
+	    pthread_create(&tid,0,feed,reinterpret_cast<void*>(static_cast<long>(fds[1])));
+	    std::string tap;
+	    size_t size=0;
+	    bool truncated=false;
+	    {
+		sockfdwrapper sfd(fds[0]);
+		sfd.set_tap(&tap,limits[ctr]);
+		header_map hdrs;
+		add_header(hdrs,"Content-Length: 200000");
+		try{
+		    request_body body(sfd,hdrs,1<<20);
+		    body.spill();
+		    size=body.size();
+		}catch(const request_body_bad&){
+		}
+		truncated=sfd.tap_truncated();
+	    }
+	    pthread_join(tid,0);
+	    close(fds[0]);
+	    close(fds[1]);
+	    all=all && size==200000
+		&& tap.size()==(ctr==0?200000:1000) && truncated==(ctr==1);
+	}
+	if(!all){
+	    std::cout << "failed\n";
+	    failed++;
+	}else{
+	    std::cout << "passed\n";
+	    passed++;
+	}
+    }
+    std::cout << tests << " tests, passed: " << passed << ", failed: " << failed << '\n';
+
+    return 0;
+}
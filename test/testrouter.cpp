@@ -0,0 +1,168 @@
+#include "../router.h"
+#include <iostream>
+#include <string>
+
+struct match_case
+{
+    const char *path;
+    const char *target;	    // of the route it should get, 0 for none
+};
+
+static route
+make_route(route_kind kind,const char *target)
+{
+    route r;
+    r.kind=kind;
+    r.target=target;
+    return r;
+}
+
+int
+main()
+{
+    size_t tests=0,passed=0,failed=0;
+
+    std::cout << "test 1 - exact beats prefix and the longest prefix wins - ";
+    tests++;
+    requestRouter router;
+    router.add("/*",make_route(route_static,"root"));
+    router.add("/cgi-bin/*",make_route(route_cgi,"cgi"));
+    router.add("/cgi-bin/special",make_route(route_static,"special"));
+    router.add("/c*",make_route(route_static,"c"));
+    router.add("/api/v1/*",make_route(route_static,"v1"));
+    router.add("/api/v2/*",make_route(route_static,"v2"));
+    router.add("/api/*",make_route(route_static,"api"));
+    router.compile();
+    match_case cases[]={
+	{"/",  "root"},
+	{"/index.html","root"},
+	{"/cgi-bin/echo","cgi"},
+	{"/cgi-bin/","cgi"},
+	{"/cgi-bin","c"},
+	{"/cgi-bin/special","special"},
+	{"/cgi-bin/specialist","cgi"},
+	{"/cat","c"},
+	{"/api/v1/x","v1"},
+	{"/api/v2/","v2"},
+	{"/api/v3/x","api"},
+	{"/ap","root"},
+    };
+    bool all=true;
+    for(size_t ctr=0;ctr<sizeof cases/sizeof cases[0];ctr++){
+	const route *r=router.match(cases[ctr].path);
+	if(r==0 || r->target!=cases[ctr].target){
+	    std::cout << cases[ctr].path << " went to " << (r?r->target:"nothing") << ' ';
+	    all=false;
+	}
+    }
+    requestRouter empty;
+    empty.add("/only",make_route(route_status,""));
+    empty.compile();
+    all=all && empty.match("/other")==0 && empty.match("/onl")==0
+	&& empty.match("/only")!=0 && empty.match("/only/")==0;
+    if(!all){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+
+    std::cout << "test 2 - routes get what they don't set from the prefix above - ";
+    tests++;
+    requestRouter inherits;
+    route top=make_route(route_static,"/srv");
+    top.max_age=300;
+    inherits.add("/*",top);
+    route settings;
+    settings.cls=0;
+    inherits.add("/fast/*",settings);
+    route nocache;
+    nocache.max_age=-1;
+    inherits.add("/fast/live",nocache);
+    route scripts=make_route(route_cgi,"");
+    inherits.add("/scripts/*",scripts);
+    inherits.add("/scripts/one",route());
+    inherits.compile();
+    const route *root=inherits.match("/x");
+    const route *fast=inherits.match("/fast/x");
+    const route *live=inherits.match("/fast/live");
+    const route *script=inherits.match("/scripts/x");
+    const route *one=inherits.match("/scripts/one");
+    all=root && root->cls==1 && root->cache_control=="Cache-Control: max-age=300\r\n"
+	&& root->allow=="GET, HEAD"
+	&& (root->methods&requestRouter::method_bit("HEAD"))
+	&& fast && fast->kind==route_static && fast->target=="/srv" && fast->cls==0
+	&& fast->cache_control==root->cache_control
+	&& live && live->kind==route_static && live->cls==0
+	&& live->cache_control=="Cache-Control: no-cache\r\n"
+	&& script && script->allow=="GET, POST, PUT" && script->prefix=="/scripts/"
+	&& one && one->kind==route_cgi && one->prefix=="/scripts/";
+    if(!all){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+
+    std::cout << "test 3 - adding a pattern again replaces it, find gets it - ";
+    tests++;
+    requestRouter again;
+    again.add("/a/*",make_route(route_static,"first"));
+    again.add("/ab",make_route(route_static,"ab"));
+    again.add("/a/*",make_route(route_static,"second"));
+    again.compile();
+    all=again.routes().size()==2 && again.match("/a/x")->target=="second"
+	&& again.find("/a/*") && again.find("/a/*")->target=="second"
+	&& again.find("/a")==0 && again.find("/ab")->target=="ab"
+	&& again.find("/ab*")==0 && !again.add("nope",route());
+    if(!all){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+
+    std::cout << "test 4 - route specs parse, and bad ones say why - ";
+    tests++;
+    std::string pattern,error;
+    route parsed;
+    all=parse_route("GET,POST:/api/*=redirect:http://x/a,b,class=0,cache=no",
+	    pattern,parsed,error)
+	&& pattern=="/api/*" && parsed.kind==route_redirect
+	&& parsed.target=="http://x/a,b" && parsed.cls==0 && parsed.max_age==-1
+	&& parsed.methods==(method_get|method_post);
+    route app;
+    all=all && parse_route("/app/*=fastcgi:4:/usr/bin/app",pattern,app,error)
+	&& app.kind==route_fastcgi && app.target=="4:/usr/bin/app" && app.methods==0;
+    const char *bad[]={
+	"/x=bogus",
+	"PATCH:/x=static",
+	"x=static",
+	"/x",
+	"/x=static,class=3",
+	"/x=static,cache=soon",
+	"/x=fastcgi:app",
+	"/x=redirect",
+    };
+    for(size_t ctr=0;ctr<sizeof bad/sizeof bad[0];ctr++){
+	route r;
+	error="";
+	if(parse_route(bad[ctr],pattern,r,error) || error.empty()){
+	    std::cout << bad[ctr] << " parsed ";
+	    all=false;
+	}
+    }
+    if(!all){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+    std::cout << tests << " tests, passed: " << passed << ", failed: " << failed << '\n';
+
+    return 0;
+}
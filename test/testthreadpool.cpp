@@ -0,0 +1,321 @@
+#include "../adaptiveThreadPool.h"
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+std::atomic<int> ran;
+
+void *
+no_fds(void *)
+{
+    return 0;
+}
+
+struct counter
+{
+    void operator()(){ ran++; };
+};
+
+struct setter
+{
+    setter(std::atomic<int>& where):where(where){};
+    void operator()(int value){ where=value; };
+    std::atomic<int>& where;
+};
+
+int
+six_times_seven()
+{
+    return 6*7;
+}
+
+int the_answer=42;
+
+int&
+answer_ref()
+{
+    return the_answer;
+}
+
+std::string
+fails()
+{
+    throw std::runtime_error("on purpose");
+}
+
+// a sizing policy the test can steer
+std::atomic<size_t> wanted(4);
+struct steered: public sizingPolicy
+{
+    virtual sizingPolicy* clone() const { return new steered(*this); };
+    virtual sizing_decision
+    decide(const pool_sample&)
+    {
+	sizing_decision decision;
+	decision.target=wanted;
+	decision.reason="steered";
+	return decision;
+    };
+    virtual size_t initial(size_t,size_t) const { return wanted; };
+    virtual unsigned period_ms() const { return 50; };
+};
+
+std::atomic<size_t> seen_threads(0);
+
+// A job that keeps its thread till the one after it has run, which it
+// only can if holding the thread got the pool another one.
+std::atomic<int> holding(0),after(0);
+
+bool
+hold_till_after()
+{
+    thread_hold hold;
+    holding=1;
+    for(int ctr=0;ctr<200 && !after;ctr++){
+	usleep(10000);
+    }
+    return after!=0;
+}
+
+void
+runs_after()
+{
+    after=1;
+}
+
+void
+watch(size_t,const pool_sample& sample,const sizing_decision&)
+{
+    seen_threads=sample.threads;
+}
+
+// a group with work waiting on 4 threads that each spend 50ms on a job
+pool_sample
+busy_sample(size_t threads,double throughput,double service)
+{
+    pool_sample sample;
+    sample.period=0.5;
+    sample.completed=static_cast<size_t>(throughput*sample.period);
+    sample.throughput=throughput;
+    sample.mean_service=service;
+    sample.mean_cpu=0.001;
+    sample.mean_wait=0.05;
+    sample.queued=10;
+    sample.threads=threads;
+    sample.busy=threads;
+    sample.maxthreads=20;
+    sample.cpus=4;
+    return sample;
+}
+
+int
+main()
+{
+    size_t tests=0,passed=0,failed=0;
+    adaptiveThreadPool atp(no_fds,4);
+
+    std::cout << "test 1 - small callables are stored inline, big ones aren't - ";
+    tests++;
+    char big[200]={0};
+    pool_task small_task((counter()));
+    pool_task big_task([big]() { ran+=big[0]; });
+    pool_task moved(std::move(small_task));
+    if(!moved.is_inline() || big_task.is_inline() || !small_task.is_fd()
+	    || !pool_task::for_fd(3).is_fd() || pool_task::for_fd(3).get_fd()!=3){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+    std::cout << "test 2 - submit's future gets the result - ";
+    tests++;
+    pool_future<int> answer=atp.submit(six_times_seven);
+    if(answer.get()!=42){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+    std::cout << "test 3 - submit's future rethrows what the task threw - ";
+    tests++;
+    pool_future<std::string> oops=atp.submit(fails);
+    bool caught=false;
+    try{
+	oops.get();
+    }catch(const std::runtime_error& re){
+	caught=std::string(re.what())=="on purpose";
+    }
+    if(!caught){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+    std::cout << "test 4 - submit_then hands the result to the callback - ";
+    tests++;
+    std::atomic<int> got(0);
+    atp.submit_then(six_times_seven,setter(got));
+    pool_future<void> after=atp.submit(counter());
+    after.get();
+    for(int ctr=0;ctr<100 && got!=42;ctr++){
+	usleep(10000);
+    }
+    if(got!=42){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+    std::cout << "test 5 - submit_bulk runs every one - ";
+    tests++;
+    ran=0;
+    std::vector<counter> many(1000);
+    atp.submit_bulk(many.begin(),many.end());
+    for(int ctr=0;ctr<200 && ran!=1000;ctr++){
+	usleep(10000);
+    }
+    if(ran!=1000){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+    std::cout << "test 6 - hill climbing climbs while it pays and stops when it doesn't - ";
+    tests++;
+    hillClimbingPolicy climber;
+    sizing_decision first=climber.decide(busy_sample(4,80,0.05));
+    sizing_decision second=climber.decide(busy_sample(5,100,0.05));
+    sizing_decision third=climber.decide(busy_sample(7,101,0.05));
+    if(first.target!=5 || second.target!=7 || third.target!=7
+	    || std::string(third.reason)!="plateau"){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+    std::cout << "test 7 - hill climbing backs off when latency grows, caps CPU bound work and trims spares - ";
+    tests++;
+    hillClimbingPolicy slower,cpu_bound,quiet;
+    slower.decide(busy_sample(4,80,0.05));
+    sizing_decision backed=slower.decide(busy_sample(5,80,0.08));
+    pool_sample hot=busy_sample(4,80,0.05);
+    hot.mean_cpu=hot.mean_service;
+    sizing_decision capped=cpu_bound.decide(hot);
+    pool_sample idle=busy_sample(10,20,0.05);
+    idle.queued=0;
+    idle.mean_wait=0;
+    idle.busy=1;
+    sizing_decision trimmed=quiet.decide(idle);
+    if(backed.target!=4 || std::string(backed.reason)!="latency"
+	    || capped.target!=4 || trimmed.target!=9){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+    std::cout << "test 8 - the pool grows and shrinks to what its policy says - ";
+    tests++;
+    steered policy;
+    adaptiveThreadPool steered_pool(no_fds,8,0,0,&policy);
+    steered_pool.set_observer(watch);
+    bool grew=false,shrank=false;
+    wanted=6;
+    for(int ctr=0;ctr<100 && !grew;ctr++){
+	usleep(10000);
+	grew=seen_threads==6;
+    }
+    wanted=1;
+    for(int ctr=0;ctr<200 && !shrank;ctr++){
+	usleep(10000);
+	shrank=seen_threads==1;
+    }
+    if(!grew || !shrank || steered_pool.submit(six_times_seven).get()!=42){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+
+    std::cout << "test 9 - a held thread doesn't keep the queue behind it waiting - ";
+    tests++;
+    fixedSizePolicy single(1);
+    adaptiveThreadPool one_thread(no_fds,4,0,0,&single);
+    pool_future<bool> held=one_thread.submit(hold_till_after);
+    for(int ctr=0;ctr<200 && !holding;ctr++){
+	usleep(10000);
+    }
+    one_thread.submit(runs_after);
+    if(!held.get()){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+
+    std::cout << "test 10 - a pool runs what's queued and then goes away - ";
+    tests++;
+    ran=0;
+    {
+	adaptiveThreadPool short_lived(no_fds,4);
+	for(int ctr=0;ctr<4;ctr++){
+	    short_lived.submit_then([](){ usleep(50000); },[](){ ran++; });
+	}
+	usleep(10000);
+    }
+    if(ran!=4){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+    std::cout << "test 11 - a future can get a reference - ";
+    tests++;
+    int& ref=atp.submit(answer_ref).get();
+    if(&ref!=&the_answer){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+
+    std::cout << "test 12 - a task thrown away unrun breaks its future - ";
+    tests++;
+    bool broken=false;
+    {
+	std::shared_ptr<pool_future_state<int> > state=
+	    std::make_shared<pool_future_state<int> >();
+	pool_future<int> never(state);
+	{
+	    pool_task dropped(pool_future_runner<int(*)(),int>(six_times_seven,state));
+	    pool_task moved(std::move(dropped));
+	}
+	try{
+	    never.get();
+	}catch(const pool_broken_promise&){
+	    broken=true;
+	}
+    }
+    if(!broken){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+    std::cout << tests << " tests, passed: " << passed << ", failed: " << failed << '\n';
+
+    return 0;
+}
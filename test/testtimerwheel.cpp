@@ -0,0 +1,83 @@
+#include "../timerwheel.h"
+#include <iostream>
+#include <atomic>
+#include <time.h>
+#include <unistd.h>
+
+std::atomic<int> fired;
+unsigned long long fired_at[4];
+
+unsigned long long
+now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec*1000ULL+ts.tv_nsec/1000000;
+}
+
+void
+note(void *arg)
+{
+    fired_at[reinterpret_cast<long>(arg)]=now_ms();
+    fired++;
+}
+
+int
+main()
+{
+    size_t tests=0,passed=0,failed=0;
+    // 1ms ticks, so 300ms is past the first level and has to cascade
+    timerWheel wheel(1);
+    wheel_timer a(note,reinterpret_cast<void*>(0));
+    wheel_timer b(note,reinterpret_cast<void*>(1));
+    wheel_timer c(note,reinterpret_cast<void*>(2));
+    wheel_timer d(note,reinterpret_cast<void*>(3));
+    unsigned long long start=now_ms();
+    wheel.arm(a,50);
+    wheel.arm(b,300);
+    wheel.arm(c,100);
+    wheel.arm(d,1000);
+    wheel.cancel(c);
+    wheel.arm(d,150);	    // re-arming moves it
+    usleep(500000);
+
+    std::cout << "test 1 - first level timer fires on time - ";
+    tests++;
+    if(fired_at[0]<start+50 || fired_at[0]>start+100){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+    std::cout << "test 2 - second level timer cascades and fires on time - ";
+    tests++;
+    if(fired_at[1]<start+300 || fired_at[1]>start+350){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+    std::cout << "test 3 - cancelled timer doesn't fire - ";
+    tests++;
+    if(fired_at[2]!=0 || a.armed() || c.armed()){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+    std::cout << "test 4 - re-armed timer fires once at the new time - ";
+    tests++;
+    if(fired_at[3]<start+150 || fired_at[3]>start+200 || fired!=3){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+    std::cout << tests << " tests, passed: " << passed << ", failed: " << failed << '\n';
+
+    return 0;
+}
@@ -0,0 +1,112 @@
+#include "../topology.h"
+#include <iostream>
+#include <string>
+#include <vector>
+
+// does parse_cpulist(list) come out as the count CPUs in want?
+static bool
+parses_to(const std::string& list,const int *want,size_t count)
+{
+    std::vector<int> cpus;
+    parse_cpulist(list,cpus);
+    return cpus==std::vector<int>(want,want+count);
+}
+
+int
+main()
+{
+    size_t tests=0,passed=0,failed=0;
+
+    std::cout << "test 1 - ranges and single CPUs, newline and all - ";
+    tests++;
+    {
+	const int want[]={ 0,1,2,3,8,9,10,11,14 };
+	if(!parses_to("0-3,8-11,14\n",want,9)){
+	    std::cout << "failed\n";
+	    failed++;
+	}else{
+	    std::cout << "passed\n";
+	    passed++;
+	}
+    }
+
+    std::cout << "test 2 - an empty list, a memory only node's, is no CPUs - ";
+    tests++;
+    {
+	if(!parses_to("",0,0) || !parses_to("\n",0,0)){
+	    std::cout << "failed\n";
+	    failed++;
+	}else{
+	    std::cout << "passed\n";
+	    passed++;
+	}
+    }
+
+    std::cout << "test 3 - CPUs past CPU_SETSIZE are left out - ";
+    tests++;
+    {
+	std::vector<int> cpus;
+	std::string list="5,";
+	list+=std::to_string(CPU_SETSIZE-2)+"-"+std::to_string(CPU_SETSIZE+5);
+	parse_cpulist(list,cpus);
+	const int want[]={ 5,CPU_SETSIZE-2,CPU_SETSIZE-1 };
+	if(cpus!=std::vector<int>(want,want+3)){
+	    std::cout << "failed\n";
+	    failed++;
+	}else{
+	    std::cout << "passed\n";
+	    passed++;
+	}
+    }
+
+    std::cout << "test 4 - it stops at garbage and keeps what came before - ";
+    tests++;
+    {
+	const int want[]={ 2,3 };
+	if(!parses_to("2-3,x,7",want,2) || !parses_to("-1",0,0)
+		|| !parses_to("4-2",0,0)){
+	    std::cout << "failed\n";
+	    failed++;
+	}else{
+	    std::cout << "passed\n";
+	    passed++;
+	}
+    }
+
+    std::cout << "test 5 - it adds to what's already there - ";
+    tests++;
+    {
+	std::vector<int> cpus(1,7);
+	parse_cpulist("0",cpus);
+	if(cpus.size()!=2 || cpus[0]!=7 || cpus[1]!=0){
+	    std::cout << "failed\n";
+	    failed++;
+	}else{
+	    std::cout << "passed\n";
+	    passed++;
+	}
+    }
+
+    std::cout << "test 6 - the topology we're on covers every CPU it lists - ";
+    tests++;
+    {
+	cpuTopology topology;
+	bool good=topology.size()>0 && topology.num_cpus()>0;
+	for(size_t idx=0;good && idx<topology.size();idx++){
+	    for(size_t ctr=0;ctr<topology.node(idx).cpulist.size();ctr++){
+		good=good && topology.node_of_cpu(topology.node(idx).cpulist[ctr])
+		    ==static_cast<int>(idx);
+	    }
+	}
+	if(!good || topology.node_of_cpu(-1)!=-1){
+	    std::cout << "failed\n";
+	    failed++;
+	}else{
+	    std::cout << "passed\n";
+	    passed++;
+	}
+    }
+    std::cout << tests << " tests, passed: " << passed << ", failed: " << failed << '\n';
+
+    return 0;
+}
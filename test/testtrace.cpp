@@ -0,0 +1,96 @@
+#include "../trace.h"
+#include <iostream>
+#include <sstream>
+#include <string>
+
+// how many times what shows up in s
+static size_t
+count(const std::string& s,const std::string& what)
+{
+    size_t n=0;
+    for(size_t at=s.find(what);at!=std::string::npos;at=s.find(what,at+1)){
+	n++;
+    }
+    return n;
+}
+
+static void
+one_request(bool keep,const char *detail)
+{
+    trace_scope scope("request");
+    {
+	trace_span span("inner");
+    }
+    scope.set_detail(detail);
+    if(keep){
+	scope.keep();
+    }
+}
+
+int
+main()
+{
+    size_t tests=0,passed=0,failed=0;
+
+    std::cout << "test 1 - nothing's kept while tracing's off - ";
+    tests++;
+    one_request(true,"/off");
+    std::ostringstream off;
+    if(requestTrace::enabled() || requestTrace::dump(off)!=0){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+
+    std::cout << "test 2 - a fast request's only kept if it's asked to be - ";
+    tests++;
+    requestTrace::configure(60000,0);
+    one_request(false,"/dropped");
+    one_request(true,"/kept");
+    std::ostringstream kept;
+    size_t written=requestTrace::dump(kept);
+    if(written!=2 || count(kept.str(),"/dropped")!=0
+	    || count(kept.str(),"\"name\":\"inner\"")!=1){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+
+    std::cout << "test 3 - sampling keeps one in every n - ";
+    tests++;
+    requestTrace::configure(0,2);
+    for(size_t ctr=0;ctr<4;ctr++){
+	one_request(false,"/sampled");
+    }
+    std::ostringstream sampled;
+    requestTrace::dump(sampled);
+    if(count(sampled.str(),"/sampled")!=2){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+
+    std::cout << "test 4 - long details keep their end and get escaped - ";
+    tests++;
+    one_request(true,"/a/very/long/path/that/will/not/fit/\"quoted\".html");
+    std::ostringstream escaped;
+    requestTrace::dump(escaped);
+    if(count(escaped.str(),"...")!=1
+	    || count(escaped.str(),"\\\"quoted\\\".html\"")!=1){
+	std::cout << "failed\n";
+	failed++;
+    }else{
+	std::cout << "passed\n";
+	passed++;
+    }
+
+    std::cout << tests << " tests, passed: " << passed << ", failed: " << failed << '\n';
+
+    return 0;
+}
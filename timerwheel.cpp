@@ -0,0 +1,149 @@
+// copyright Patrick Horgan
+// source is open, feel free to use it as you wish with no restrictions
+// except that this copyright notice must be preserved intact
+#include "timerwheel.h"
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <time.h>
+
+// Sleep a tick, then fire everything that's come due.  If we overslept we
+// catch up a tick at a time so nothing gets skipped.
+void *
+timerwheel_ticker(void *voidwheel)
+{
+    timerWheel *wheel=static_cast<timerWheel*>(voidwheel);
+    struct timespec ts;
+    ts.tv_sec=wheel->tick/1000;
+    ts.tv_nsec=(wheel->tick%1000)*1000000L;
+    while(true){
+	nanosleep(&ts,NULL);
+	pthread_mutex_lock(&wheel->lock);
+	wheel->advance_to(wheel->now_ticks());
+	pthread_mutex_unlock(&wheel->lock);
+    }
+    return 0;
+}
+
+timerWheel::timerWheel(unsigned tick_ms):tick(tick_ms?tick_ms:1),running(false)
+{
+    for(size_t ctr=0;ctr<L0_SLOTS;ctr++){
+	level0[ctr].next=level0[ctr].prev=&level0[ctr];
+    }
+    for(size_t ctr=0;ctr<L1_SLOTS;ctr++){
+	level1[ctr].next=level1[ctr].prev=&level1[ctr];
+    }
+    current=now_ticks();
+    pthread_mutex_init(&lock,NULL);
+    int err;
+    if((err=pthread_create(&ticker,NULL,timerwheel_ticker,this))!=0){
+	// timers will never fire, but arming them still works
+	std::cerr << "timerWheel: pthread_create - " << strerror(err) << '\n';
+    }else{
+	running=true;
+    }
+}
+
+timerWheel::~timerWheel()
+{
+    if(running){
+	pthread_cancel(ticker);
+	pthread_join(ticker,NULL);
+    }
+}
+
+unsigned long long
+timerWheel::now_ticks() const
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (ts.tv_sec*1000ULL+ts.tv_nsec/1000000)/tick;
+}
+
+// called with the lock held.  t.expires has to be at least current.
+void
+timerWheel::link(wheel_timer& t)
+{
+    wheel_timer *head;
+    if(t.expires-current<L0_SLOTS){
+	head=&level0[t.expires&(L0_SLOTS-1)];
+    }else{
+	// a span number more than L1_SLOTS-1 ahead would land in the slot
+	// we're about to spread out, so the furthest we go is the one before
+	unsigned long long span=t.expires>>L0_BITS;
+	if(span-(current>>L0_BITS)>=L1_SLOTS){
+	    span=(current>>L0_BITS)+L1_SLOTS-1;
+	    t.expires=span<<L0_BITS;
+	}
+	head=&level1[span&(L1_SLOTS-1)];
+    }
+    t.prev=head->prev;
+    t.next=head;
+    head->prev->next=&t;
+    head->prev=&t;
+}
+
+// called with the lock held
+void
+timerWheel::unlink(wheel_timer& t)
+{
+    t.prev->next=t.next;
+    t.next->prev=t.prev;
+    t.next=t.prev=0;
+}
+
+void
+timerWheel::arm(wheel_timer& t,unsigned ms)
+{
+    pthread_mutex_lock(&lock);
+    if(t.armed()){
+	unlink(t);
+    }
+    // We're somewhere inside the tick now_ticks() says, and it fires at the
+    // start of a tick, so it's one more than the rounded up count to be
+    // sure it's never early.  And never into a tick that's gone by.
+    unsigned long long base=now_ticks();
+    if(base<current){
+	base=current;
+    }
+    t.expires=base+1+(ms+tick-1)/tick;
+    link(t);
+    pthread_mutex_unlock(&lock);
+}
+
+void
+timerWheel::cancel(wheel_timer& t)
+{
+    pthread_mutex_lock(&lock);
+    if(t.armed()){
+	unlink(t);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+// called with the lock held
+void
+timerWheel::advance_to(unsigned long long target)
+{
+    while(current<=target){
+	if((current&(L0_SLOTS-1))==0){
+	    // the first level's come around, so everything in the next
+	    // span drops down into it
+	    wheel_timer *head=&level1[(current>>L0_BITS)&(L1_SLOTS-1)];
+	    while(head->next!=head){
+		wheel_timer *t=head->next;
+		unlink(*t);
+		link(*t);
+	    }
+	}
+	wheel_timer *head=&level0[current&(L0_SLOTS-1)];
+	while(head->next!=head){
+	    wheel_timer *t=head->next;
+	    unlink(*t);
+	    if(t->fire){
+		t->fire(t->arg);
+	    }
+	}
+	current++;
+    }
+}
@@ -0,0 +1,64 @@
+// copyright Patrick Horgan
+// source is open, feel free to use it as you wish with no restrictions
+// except that this copyright notice must be preserved intact
+#ifndef timerwheel_guard
+#define timerwheel_guard
+#include <pthread.h>
+
+// One of these lives in whatever wants a deadline, a sockfdwrapper say.
+// The wheel links them into its slots, so arming or cancelling one is a
+// couple of pointer swaps and never a syscall or an allocation.
+struct wheel_timer
+{
+    wheel_timer():next(0),prev(0),expires(0),fire(0),arg(0){};
+    wheel_timer(void (*fire)(void*),void *arg):
+	next(0),prev(0),expires(0),fire(fire),arg(arg){};
+    bool armed() const { return next!=0; };
+    wheel_timer *next,*prev;
+    unsigned long long expires;	    // in ticks
+    void (*fire)(void *);
+    void *arg;
+};
+
+// A two level hierarchical timing wheel.  The first level has a slot for
+// each of the next 256 ticks, the second a slot for each of the 63 spans of
+// 256 ticks after that, and when the first level comes around again the
+// next second level slot gets spread out over it.  With the default 100ms
+// tick that's deadlines out to about 27 minutes; anything longer is cut
+// back to that.  A thread of its own moves the wheel along, so everybody
+// that arms timers shares the one sleep.
+//
+// fire is called with the wheel's lock held, so it has to be quick and must
+// not arm or cancel anything itself.  The upside is that once cancel()
+// returns the timer's fire isn't running and won't be, so it's safe to
+// throw away whatever arg points at.
+class timerWheel
+{
+public:
+    friend void* timerwheel_ticker(void *);
+    timerWheel(unsigned tick_ms=100);
+    ~timerWheel();
+    // (re)arm t to fire in ms milliseconds, or up to a tick later
+    void arm(wheel_timer& t,unsigned ms);
+    void cancel(wheel_timer& t);
+    unsigned tick_ms() const { return tick; };
+private:
+    timerWheel(const timerWheel&);
+    const timerWheel& operator=(const timerWheel&);
+    static const unsigned long long L0_BITS=8;
+    static const unsigned long long L0_SLOTS=1<<L0_BITS;
+    static const unsigned long long L1_SLOTS=64;
+    unsigned long long now_ticks() const;
+    void link(wheel_timer& t);
+    void unlink(wheel_timer& t);
+    void advance_to(unsigned long long target);
+    // each slot is the head of a circular list
+    wheel_timer level0[L0_SLOTS];
+    wheel_timer level1[L1_SLOTS];
+    unsigned long long current;	    // every tick before this has fired
+    unsigned tick;
+    pthread_mutex_t lock;
+    pthread_t ticker;
+    bool running;
+};
+#endif
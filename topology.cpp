@@ -0,0 +1,177 @@
+// copyright Patrick Horgan
+// source is open, feel free to use it as you wish with no restrictions
+// except that this copyright notice must be preserved intact
+#include "topology.h"
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <algorithm>
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+const char NODE_DIR[]="/sys/devices/system/node";
+
+void
+parse_cpulist(const std::string& list,std::vector<int>& cpus)
+{
+    const char *ptr=list.c_str();
+    while(*ptr){
+	char *endptr;
+	long first=strtol(ptr,&endptr,10),last;
+	if(endptr==ptr || first<0){
+	    break;
+	}
+	last=first;
+	ptr=endptr;
+	if(*ptr=='-'){
+	    last=strtol(ptr+1,&endptr,10);
+	    ptr=endptr;
+	}
+	for(long cpu=first;cpu<=last && cpu<CPU_SETSIZE;cpu++){
+	    cpus.push_back(static_cast<int>(cpu));
+	}
+	while(*ptr==',' || *ptr=='\n'){
+	    ptr++;
+	}
+    }
+}
+
+cpuTopology::cpuTopology()
+{
+    if(!read_sysfs()){
+	// no NUMA information, so it's all one node
+	cpu_set_t allowed;
+	numa_node node;
+	node.id=-1;
+	CPU_ZERO(&node.cpus);
+	CPU_ZERO(&allowed);
+	if(sched_getaffinity(0,sizeof allowed,&allowed)==-1){
+	    CPU_SET(0,&allowed);
+	}
+	for(int cpu=0;cpu<CPU_SETSIZE;cpu++){
+	    if(CPU_ISSET(cpu,&allowed)){
+		CPU_SET(cpu,&node.cpus);
+		node.cpulist.push_back(cpu);
+	    }
+	}
+	nodes.clear();
+	nodes.push_back(node);
+    }
+    for(size_t idx=0;idx<nodes.size();idx++){
+	for(size_t ctr=0;ctr<nodes[idx].cpulist.size();ctr++){
+	    size_t cpu=nodes[idx].cpulist[ctr];
+	    if(cpu>=cpu_to_node.size()){
+		cpu_to_node.resize(cpu+1,-1);
+	    }
+	    cpu_to_node[cpu]=static_cast<int>(idx);
+	}
+    }
+}
+
+static bool
+node_order(const numa_node& a,const numa_node& b)
+{
+    return a.id<b.id;
+}
+
+bool
+cpuTopology::read_sysfs()
+{
+    DIR *dir;
+    struct dirent *ent;
+    cpu_set_t allowed;
+
+    CPU_ZERO(&allowed);
+    if(sched_getaffinity(0,sizeof allowed,&allowed)==-1){
+	return false;
+    }
+    if((dir=opendir(NODE_DIR))==NULL){
+	return false;
+    }
+    while((ent=readdir(dir))!=NULL){
+	char *endptr;
+	if(strncmp(ent->d_name,"node",4)!=0){
+	    continue;
+	}
+	long id=strtol(ent->d_name+4,&endptr,10);
+	if(endptr==ent->d_name+4 || *endptr){
+	    continue;
+	}
+	std::ifstream in((std::string(NODE_DIR)+"/"+ent->d_name+"/cpulist").c_str());
+	std::string list;
+	std::vector<int> cpus;
+	if(!std::getline(in,list)){
+	    continue;
+	}
+	parse_cpulist(list,cpus);
+	numa_node node;
+	node.id=static_cast<int>(id);
+	CPU_ZERO(&node.cpus);
+	for(size_t ctr=0;ctr<cpus.size();ctr++){
+	    if(CPU_ISSET(cpus[ctr],&allowed)){
+		CPU_SET(cpus[ctr],&node.cpus);
+		node.cpulist.push_back(cpus[ctr]);
+	    }
+	}
+	if(!node.cpulist.empty()){
+	    nodes.push_back(node);
+	}
+    }
+    closedir(dir);
+    std::sort(nodes.begin(),nodes.end(),node_order);
+    return !nodes.empty();
+}
+
+int
+cpuTopology::node_of_cpu(int cpu) const
+{
+    if(cpu<0 || static_cast<size_t>(cpu)>=cpu_to_node.size()){
+	return -1;
+    }
+    return cpu_to_node[cpu];
+}
+
+size_t
+cpuTopology::num_cpus() const
+{
+    size_t count=0;
+    for(size_t idx=0;idx<nodes.size();idx++){
+	count+=nodes[idx].cpulist.size();
+    }
+    return count;
+}
+
+// mmap rather than malloc so the pages are ours alone, and mbind says
+// where they come from when they're first touched.  MPOL_PREFERRED rather
+// than MPOL_BIND so a full node means remote memory, not no memory.  It's
+// a raw syscall so we don't need libnuma for this one thing.
+void *
+node_alloc(size_t size,int node)
+{
+    void *ptr=mmap(NULL,size,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+    if(ptr==MAP_FAILED){
+	return 0;
+    }
+    if(node>=0 && node<static_cast<int>(sizeof(unsigned long)*8)){
+	unsigned long mask=1UL<<node;
+	if(syscall(SYS_mbind,ptr,size,MPOL_PREFERRED,&mask,sizeof(mask)*8,0)==-1){
+	    // still good memory, just maybe not local
+	    std::cerr << "node_alloc: mbind - " << strerror(errno) << '\n';
+	}
+    }
+    return ptr;
+}
+
+void
+node_free(void *ptr,size_t size)
+{
+    if(ptr){
+	munmap(ptr,size);
+    }
+}
@@ -0,0 +1,46 @@
+// copyright Patrick Horgan
+// source is open, feel free to use it as you wish with no restrictions
+// except that this copyright notice must be preserved intact
+#ifndef topology_guard
+#define topology_guard
+#include <sched.h>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+struct numa_node
+{
+    int id;			// the N in /sys/devices/system/node/nodeN
+    cpu_set_t cpus;		// the ones we're allowed to run on
+    std::vector<int> cpulist;	// same thing, as a list
+};
+
+// Which CPUs are on which NUMA node, from /sys/devices/system/node, leaving
+// out CPUs our affinity mask won't let us use and nodes that only have
+// memory.  If there's no sysfs to read it's one node with every CPU we can
+// use on it.
+class cpuTopology
+{
+public:
+    cpuTopology();
+    size_t size() const { return nodes.size(); };
+    const numa_node& node(size_t idx) const { return nodes[idx]; };
+    // index of the node cpu's on, or -1 if it's not one of ours
+    int node_of_cpu(int cpu) const;
+    size_t num_cpus() const;
+private:
+    bool read_sysfs();
+    std::vector<numa_node> nodes;
+    std::vector<int> cpu_to_node;
+};
+
+// "0-3,8-11" to 0 1 2 3 8 9 10 11, appended to cpus, the way sysfs writes
+// a node's cpulist.  CPUs past CPU_SETSIZE are left out.
+void parse_cpulist(const std::string& list,std::vector<int>& cpus);
+
+// Page granular memory whose pages come from NUMA node node (its id, not
+// its index) if at all possible.  node<0 means wherever.  Returns 0 if
+// there's no memory.  Give it back with node_free() and the same size.
+void *node_alloc(size_t size,int node);
+void node_free(void *ptr,size_t size);
+#endif
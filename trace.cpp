@@ -0,0 +1,268 @@
+// copyright Patrick Horgan
+// source is open, feel free to use it as you wish with no restrictions
+// except that this copyright notice must be preserved intact
+#include "trace.h"
+#include <pthread.h>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+// Everything one thread has.  They're never freed, when a thread exits
+// the next new one takes over its ring, so there are only ever as many as
+// there have been threads at once.
+struct trace_thread
+{
+    pthread_mutex_t lock;	    // for the ring, dump() reads it
+    trace_event spans[requestTrace::MAX_SPANS];
+    size_t nspans;
+    trace_event *ring;
+    size_t next;		    // where the next one goes in ring
+    size_t count;		    // how many are in ring
+    int tid;
+    unsigned long long queued_ns,dequeued_ns;
+    bool in_use;
+    trace_thread *link;		    // every one there is, for dump()
+};
+
+__thread trace_thread *trace_active=0;
+static __thread trace_thread *owned=0;
+
+static std::atomic<unsigned> slow_after_ms(0);
+static std::atomic<unsigned> every(0);
+static std::atomic<unsigned long long> seen(0);
+static pthread_mutex_t threads_lock=PTHREAD_MUTEX_INITIALIZER;
+static trace_thread *threads=0;
+static pthread_key_t owned_key;
+static pthread_once_t owned_once=PTHREAD_ONCE_INIT;
+
+static void
+let_go(void *voidtt)
+{
+    pthread_mutex_lock(&threads_lock);
+    static_cast<trace_thread*>(voidtt)->in_use=false;
+    pthread_mutex_unlock(&threads_lock);
+}
+
+static void
+make_key()
+{
+    pthread_key_create(&owned_key,let_go);
+}
+
+// If it's too long it's the end that tells you which it was, so that's
+// what we keep.
+static void
+copy_detail(char *to,const char *from)
+{
+    const size_t room=sizeof(trace_event::detail)-1;
+    size_t len=from?strlen(from):0;
+    if(len>room){
+	memcpy(to,"...",3);
+	memcpy(to+3,from+len-(room-3),room-3);
+	to[room]='\0';
+    }else if(from){
+	memcpy(to,from,len+1);
+    }else{
+	to[0]='\0';
+    }
+}
+
+// this thread's, one someone's done with if there is one
+static trace_thread *
+my_thread()
+{
+    if(owned){
+	return owned;
+    }
+    pthread_once(&owned_once,make_key);
+    pthread_mutex_lock(&threads_lock);
+    for(trace_thread *tt=threads;tt;tt=tt->link){
+	if(!tt->in_use){
+	    owned=tt;
+	    break;
+	}
+    }
+    if(owned==0){
+	owned=new trace_thread;
+	pthread_mutex_init(&owned->lock,0);
+	owned->ring=new trace_event[requestTrace::RING_SIZE];
+	owned->next=owned->count=0;
+	owned->link=threads;
+	threads=owned;
+    }
+    owned->in_use=true;
+    owned->nspans=0;
+    owned->queued_ns=owned->dequeued_ns=0;
+    owned->tid=static_cast<int>(syscall(SYS_gettid));
+    pthread_mutex_unlock(&threads_lock);
+    pthread_setspecific(owned_key,owned);
+    return owned;
+}
+
+static void
+add_span(trace_thread *tt,const char *name,unsigned long long begin,
+	unsigned long long end,const char *detail)
+{
+    if(tt->nspans==requestTrace::MAX_SPANS){
+	return;
+    }
+    trace_event& ev=tt->spans[tt->nspans++];
+    ev.name=name;
+    ev.begin_ns=begin;
+    ev.dur_ns=end>begin?end-begin:0;
+    ev.tid=tt->tid;
+    copy_detail(ev.detail,detail);
+}
+
+unsigned long long
+requestTrace::now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec*1000000000ULL+ts.tv_nsec;
+}
+
+void
+requestTrace::configure(unsigned slow_ms,unsigned sample_every)
+{
+    slow_after_ms=slow_ms;
+    every=sample_every;
+}
+
+bool
+requestTrace::enabled()
+{
+    return slow_after_ms!=0 || every!=0;
+}
+
+void
+requestTrace::queued(unsigned long long when_ns)
+{
+    if(!enabled()){
+	return;
+    }
+    trace_thread *tt=my_thread();
+    tt->queued_ns=when_ns;
+    tt->dequeued_ns=now();
+}
+
+// JSON strings can't have quotes, backslashes or control characters in
+// them as is
+static void
+json_string(std::ostream& out,const char *s)
+{
+    static const char hex[]="0123456789abcdef";
+    out << '"';
+    for(;*s;s++){
+	unsigned char c=static_cast<unsigned char>(*s);
+	if(c=='"' || c=='\\'){
+	    out << '\\' << *s;
+	}else if(c<0x20){
+	    out << "\\u00" << hex[c>>4] << hex[c&0xf];
+	}else{
+	    out << *s;
+	}
+    }
+    out << '"';
+}
+
+// trace-event timestamps are microseconds
+static void
+json_us(std::ostream& out,unsigned long long ns)
+{
+    char buf[32];
+    snprintf(buf,sizeof buf,"%llu.%03llu",ns/1000,ns%1000);
+    out << buf;
+}
+
+size_t
+requestTrace::dump(std::ostream& out)
+{
+    size_t written=0;
+    int pid=getpid();
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    pthread_mutex_lock(&threads_lock);
+    for(trace_thread *tt=threads;tt;tt=tt->link){
+	pthread_mutex_lock(&tt->lock);
+	size_t first=(tt->next+RING_SIZE-tt->count)%RING_SIZE;
+	for(size_t ctr=0;ctr<tt->count;ctr++){
+	    const trace_event& ev=tt->ring[(first+ctr)%RING_SIZE];
+	    out << (written++?",\n":"\n") << "{\"name\":";
+	    json_string(out,ev.name);
+	    out << ",\"cat\":\"httpserver\",\"ph\":\"X\",\"ts\":";
+	    json_us(out,ev.begin_ns);
+	    out << ",\"dur\":";
+	    json_us(out,ev.dur_ns);
+	    out << ",\"pid\":" << pid << ",\"tid\":" << ev.tid;
+	    if(ev.detail[0]){
+		out << ",\"args\":{\"detail\":";
+		json_string(out,ev.detail);
+		out << '}';
+	    }
+	    out << '}';
+	}
+	pthread_mutex_unlock(&tt->lock);
+    }
+    pthread_mutex_unlock(&threads_lock);
+    out << "\n]}\n";
+    return written;
+}
+
+trace_scope::trace_scope(const char *name):
+    mine(0),name(name),begin(0),kept(false)
+{
+    detail[0]='\0';
+    if(!requestTrace::enabled()){
+	return;
+    }
+    mine=my_thread();
+    mine->nspans=0;
+    begin=requestTrace::now();
+    if(mine->queued_ns){
+	// only the first request off the queue waited in it
+	add_span(mine,"queue wait",mine->queued_ns,mine->dequeued_ns,0);
+	mine->queued_ns=0;
+    }
+    trace_active=mine;
+}
+
+void
+trace_scope::set_detail(const char *detail)
+{
+    copy_detail(this->detail,detail);
+}
+
+trace_scope::~trace_scope()
+{
+    if(mine==0){
+	return;
+    }
+    trace_active=0;
+    unsigned long long end=requestTrace::now();
+    unsigned slow_ms=slow_after_ms,sample_every=every;
+    if(!kept && !(slow_ms && end-begin>=slow_ms*1000000ULL)
+	    && !(sample_every && ++seen%sample_every==0)){
+	mine->nspans=0;
+	return;
+    }
+    add_span(mine,name,begin,end,detail);
+    pthread_mutex_lock(&mine->lock);
+    for(size_t ctr=0;ctr<mine->nspans;ctr++){
+	mine->ring[mine->next]=mine->spans[ctr];
+	mine->next=(mine->next+1)%requestTrace::RING_SIZE;
+	if(mine->count<requestTrace::RING_SIZE){
+	    mine->count++;
+	}
+    }
+    pthread_mutex_unlock(&mine->lock);
+    mine->nspans=0;
+}
+
+void
+trace_span::record()
+{
+    add_span(trace_active,name,begin,requestTrace::now(),detail);
+}
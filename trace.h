@@ -0,0 +1,95 @@
+// copyright Patrick Horgan
+// source is open, feel free to use it as you wish with no restrictions
+// except that this copyright notice must be preserved intact
+#ifndef trace_guard
+#define trace_guard
+#include <cstddef>
+#include <ostream>
+
+// One finished span.  name has to be something that's around forever,
+// like a string literal, detail's copied and cut off if it's long.
+struct trace_event
+{
+    const char *name;
+    unsigned long long begin_ns;    // CLOCK_MONOTONIC
+    unsigned long long dur_ns;
+    int tid;
+    char detail[36];
+};
+
+struct trace_thread;
+// the thread's, only while it's on a request that's being traced
+extern __thread trace_thread *trace_active;
+
+// Where a request's time went, for the requests worth a look: the ones
+// slower than slow_ms, one in every sample_every, and any whoever's
+// answering it says to keep.  Each thread collects its spans for the
+// request it's on, and if the request's kept they go in the thread's ring
+// of its last RING_SIZE.  dump() writes every thread's ring as Chrome
+// trace-event JSON, which chrome://tracing and Perfetto show as a
+// timeline for each thread.  It's all off until configure() says
+// otherwise, and then a span's two clock reads.
+class requestTrace
+{
+public:
+    static const size_t MAX_SPANS=256;	    // for one request
+    static const size_t RING_SIZE=4096;	    // for one thread
+    // 0 turns off either trigger, both 0 turns off tracing
+    static void configure(unsigned slow_ms,unsigned sample_every);
+    static bool enabled();
+    // When the job this thread's about to run was queued.  The wait goes
+    // in the next request it traces.
+    static void queued(unsigned long long when_ns);
+    // returns how many events it wrote
+    static size_t dump(std::ostream& out);
+    static unsigned long long now();
+private:
+    requestTrace();
+};
+
+// Collects the spans of one request, itself included, while it's around
+// and decides if they're kept when it goes.
+class trace_scope
+{
+public:
+    trace_scope(const char *name);
+    ~trace_scope();
+    // keep it whatever the triggers say
+    void keep() { kept=true; };
+    // what shows up with the request's own span, like its path
+    void set_detail(const char *detail);
+private:
+    trace_scope(const trace_scope&);
+    const trace_scope& operator=(const trace_scope&);
+    trace_thread *mine;
+    const char *name;
+    unsigned long long begin;
+    bool kept;
+    char detail[36];
+};
+
+// One stage of a request, from when it's made till it goes.  Costs a
+// test of trace_active when the request isn't being traced.
+class trace_span
+{
+public:
+    trace_span(const char *name,const char *detail=0):
+	name(name),detail(detail),begin(trace_active?requestTrace::now():0){};
+    ~trace_span() { finish(); };
+    // ends it early, if it's not to go till the end of its scope
+    void finish()
+    {
+	if(begin && trace_active){
+	    record();
+	}
+	begin=0;
+    };
+private:
+    trace_span(const trace_span&);
+    const trace_span& operator=(const trace_span&);
+    void record();
+    const char *name;
+    const char *detail;
+    unsigned long long begin;
+};
+#endif